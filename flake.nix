@@ -44,6 +44,9 @@
           rustToolchain
           pkgs.qemu_kvm
           pkgs.tmux # needed for integration test
+          # used by `vmsh coredump --compress`
+          pkgs.zstd
+          pkgs.lz4
           (pkgs.python3.withPackages (ps: [
             ps.pytest
             ps.pytest-xdist
@@ -7,6 +7,8 @@
     pkgs.devmem2
     # for debugging
     pkgs.strace
+    # tests/bench_blkdev.py
+    pkgs.fio
   ];
 
   environment.pathsToLink = [ "/lib/modules" ];
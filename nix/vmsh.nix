@@ -9,6 +9,11 @@ rustPlatform.buildRustPackage {
   name = "vmsh";
   src = pkgSrc;
   buildInputs = [ bcc ];
+  nativeBuildInputs = [ pkgs.makeWrapper ];
   KERNELDIR = "${kernel.dev}/lib/modules/${kernel.modDirVersion}/build";
   cargoSha256 = "sha256-CEuXsOPZ23g8ZSRVqarAqOd+stKeSAV/mH7HWPg3Y3c=";
+  # `coredump --compress` runs these
+  postInstall = ''
+    wrapProgram $out/bin/vmsh --prefix PATH : ${pkgs.lib.makeBinPath [ pkgs.zstd pkgs.lz4 ]}
+  '';
 }
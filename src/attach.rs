@@ -1,34 +1,72 @@
-use log::{error, info};
+use log::{error, info, warn};
 use nix::unistd::Pid;
 use simple_error::try_with;
+use std::fs::OpenOptions;
 use std::path::PathBuf;
 use std::sync::mpsc::sync_channel;
 use std::sync::Arc;
+use std::time::Instant;
 
-use crate::devices::DeviceSet;
+use crate::devices::{BlockOptions, DeviceSet};
 use crate::result::Result;
+use crate::sessions::{Sessions, SESSIONS_ENV};
 use crate::stage1::spawn_stage1;
-use crate::{kvm, signal_handler};
+use crate::{fstype, kvm, signal_handler, timings};
 
 pub struct AttachOptions {
     pub pid: Pid,
     pub ssh_args: String,
     pub command: Vec<String>,
-    pub backing: PathBuf,
+    pub block: BlockOptions,
+    /// further consoles connected to these files, e.g. ptys of other terminals
+    pub consoles: Vec<PathBuf>,
+    /// number of shells kept available in the VM for as long as vmsh stays attached
+    pub sessions: usize,
+    /// filesystem of the root image, detected from the backing file if None
+    pub fstype: Option<String>,
+    /// serve metrics of the devices and mmio exits in the Prometheus text format on this socket
+    pub metrics_socket: Option<PathBuf>,
+    /// on detach remove memory, memslots and ioeventfds with a single stop of the hypervisor
+    /// right after the devices were reset
+    pub fast_detach: bool,
+    /// print how long each phase of the attach took
+    pub timings: bool,
+    /// also write the timings as json to this file
+    pub timings_json: Option<PathBuf>,
+}
+
+fn root_fstype(opts: &AttachOptions) -> Option<String> {
+    if opts.fstype.is_some() {
+        return opts.fstype.clone();
+    }
+    // remote images are only fetched by the guest
+    if opts.block.backing_url.is_some() {
+        return None;
+    }
+    match fstype::detect(&opts.block.backing) {
+        Ok(fstype) => fstype.map(String::from),
+        Err(e) => {
+            warn!("cannot detect filesystem of the backing file: {}", e);
+            None
+        }
+    }
 }
 
 pub fn attach(opts: &AttachOptions) -> Result<()> {
     info!("attaching");
+    if opts.timings || opts.timings_json.is_some() {
+        timings::enable(opts.timings_json.clone());
+    }
 
     let vm = Arc::new(try_with!(
-        kvm::hypervisor::get_hypervisor(opts.pid),
+        timings::measure("hypervisor", || kvm::hypervisor::get_hypervisor(opts.pid)),
         "cannot get vms for process {}",
         opts.pid
     ));
-    vm.stop()?;
+    timings::measure("stop", || vm.stop())?;
 
     let mut allocator = try_with!(
-        kvm::PhysMemAllocator::new(Arc::clone(&vm)),
+        timings::measure("allocator", || kvm::PhysMemAllocator::new(Arc::clone(&vm))),
         "cannot create allocator"
     );
 
@@ -36,36 +74,87 @@ pub fn attach(opts: &AttachOptions) -> Result<()> {
 
     signal_handler::setup(&sender)?;
 
+    // consoles are numbered in this order, our own one comes after them
+    let mut consoles = vec![];
+    for path in &opts.consoles {
+        consoles.push(try_with!(
+            OpenOptions::new().read(true).write(true).open(path),
+            "cannot open console {}",
+            path.display()
+        ));
+    }
+    let sessions = Sessions::new(opts.pid, opts.sessions)?;
+    consoles.append(&mut sessions.consoles()?);
+    let mut stage2_env = vec![];
+    if !sessions.is_empty() {
+        stage2_env.push(format!("{}={}", SESSIONS_ENV, sessions.len()));
+    }
+    if let Some(fstype) = root_fstype(opts) {
+        info!("root filesystem: {}", fstype);
+        if fstype::is_compressed(&fstype) {
+            stage2_env.push(format!(
+                "{}={}",
+                fstype::READ_AHEAD_ENV,
+                fstype::COMPRESSED_READ_AHEAD_KB
+            ));
+        }
+        stage2_env.push(format!("{}={}", fstype::FSTYPE_ENV, fstype));
+    }
+
     let devices = try_with!(
-        DeviceSet::new(&vm, &mut allocator, &opts.backing),
+        timings::measure("devices", || DeviceSet::new(
+            &vm,
+            &mut allocator,
+            &opts.block,
+            consoles
+        )),
         "cannot create devices"
     );
 
+    let mmio_addrs = devices.mmio_addrs()?;
     let stage1 = try_with!(
-        spawn_stage1(
+        timings::measure("stage1 setup", || spawn_stage1(
             opts.ssh_args.as_str(),
             &opts.command,
-            devices.mmio_addrs()?,
+            &stage2_env,
+            mmio_addrs,
             allocator,
             &sender
-        ),
+        )),
         "stage1 failed"
     );
-    let threads = try_with!(devices.start(&vm, &sender), "failed to start devices");
+    let threads = try_with!(
+        timings::measure("start devices", || {
+            devices.start(
+                &vm,
+                &sender,
+                opts.metrics_socket.as_deref(),
+                opts.fast_detach,
+            )
+        }),
+        "failed to start devices"
+    );
 
     info!("blkdev queue ready.");
     drop(sender);
 
     // termination wait or vmsh_stop()
     let _ = receiver.recv();
+    let detach = Instant::now();
     stage1.shutdown();
-    let virt_memory = match stage1.join() {
+    let mut virt_memory = match stage1.join() {
         Ok(mut v) => v.virt_mem.take(),
         Err(e) => {
             error!("stage1 failed: {}", e);
             None
         }
     };
+    if opts.fast_detach {
+        // stage1 is unloaded, its memory is removed by the mmio exit handler thread in the same
+        // batch as the device resources
+        vm.defer_cleanup()?;
+        drop(virt_memory.take());
+    }
     threads.iter().for_each(|t| t.shutdown());
     for t in threads {
         if let Err(e) = t.join() {
@@ -74,11 +163,20 @@ pub fn attach(opts: &AttachOptions) -> Result<()> {
     }
 
     // MMIO exit handler thread took over pthread control
-    // We need ptrace the process again before we can finish.
-    vm.finish_thread_transfer()?;
+    // We need ptrace the process again before we can finish, unless it already let go.
+    if opts.fast_detach {
+        vm.finish_fast_detach()?;
+    } else {
+        vm.finish_thread_transfer()?;
+    }
     // now that we got the tracer back, we can cleanup pysical memory
     drop(virt_memory);
     vm.resume()?;
+    drop(sessions);
+    info!(
+        "detached in {:.3}ms",
+        detach.elapsed().as_secs_f64() * 1000.0
+    );
 
     Ok(())
 }
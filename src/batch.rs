@@ -0,0 +1,174 @@
+//! Inspect or dump many VMs of a host at once.
+//!
+//! The memslots of all hypervisors are probed with one bpf program up front and cached, so the
+//! VMs processed afterwards do not compile it again. Copy threads, buffered memory and read
+//! bandwidth are budgets for the whole batch and split between the VMs in progress.
+
+use log::{error, info, warn};
+use nix::unistd::Pid;
+use simple_error::{bail, try_with};
+use std::cmp::{max, min};
+use std::fs;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::thread;
+
+use crate::coredump::{self, Bandwidth, Compression, CoredumpOptions};
+use crate::guest_mem::GuestMem;
+use crate::inspect::kernel_summary;
+use crate::kvm::hypervisor::{get_hypervisor, Hypervisor};
+use crate::kvm::memslots::{self, MemslotProbe};
+use crate::page_math::{page_align, page_size};
+use crate::result::Result;
+
+pub struct BatchOptions {
+    pub pids: Vec<Pid>,
+    /// per VM `kernel.<pid>` and, with `coredump`, `core.<pid>` are written here
+    pub dir: PathBuf,
+    /// VMs processed at the same time
+    pub jobs: usize,
+    pub coredump: bool,
+    /// threads reading guest memory, for all VMs together
+    pub threads: usize,
+    /// upper bound for the chunk size of each core
+    pub chunk_size: usize,
+    pub compression: Compression,
+    pub sparse: bool,
+    /// bytes per second read from guest memory, for all VMs together
+    pub bandwidth: Option<u64>,
+    /// guest memory buffered at once in bytes, for all VMs together
+    pub memory: Option<usize>,
+}
+
+/// Fill the memslot cache of every hypervisor with a single compiled probe. Hypervisors that
+/// fail here are probed on their own later. KVM offers no cheap way to check a cached layout,
+/// so only what this run probed is used.
+fn cache_memslots(pids: &[Pid]) {
+    for pid in pids {
+        memslots::invalidate_cache(*pid);
+    }
+    let mut probe = match MemslotProbe::new(None) {
+        Ok(probe) => probe,
+        Err(e) => {
+            warn!("cannot share memslot probe: {}", e);
+            return;
+        }
+    };
+    for pid in pids {
+        let res = get_hypervisor(*pid).and_then(|vm| {
+            vm.stop()?;
+            let res = vm.cache_memslots(&mut probe);
+            vm.resume()?;
+            res
+        });
+        if let Err(e) = res {
+            warn!("cannot probe memslots of {}: {}", pid, e);
+        }
+    }
+}
+
+fn collect_from(vm: &Hypervisor, opts: &BatchOptions, core: &CoredumpOptions) -> Result<()> {
+    vm.stop()?;
+    let summary = match GuestMem::new(vm).and_then(|mem| kernel_summary(&mem, vm)) {
+        Ok(summary) => summary,
+        Err(e) => format!("could not find kernel: {}", e),
+    };
+    let path = opts.dir.join(format!("kernel.{}", core.pid));
+    try_with!(
+        fs::write(&path, format!("{}\n", summary)),
+        "cannot write {}",
+        path.display()
+    );
+    if opts.coredump {
+        coredump::generate_coredump_of(vm, core)?;
+    }
+    Ok(())
+}
+
+fn collect(opts: &BatchOptions, core: &CoredumpOptions) -> Result<()> {
+    let vm = try_with!(
+        get_hypervisor(core.pid),
+        "cannot get vms for process {}",
+        core.pid
+    );
+    vm.use_memslot_cache()?;
+    let res = collect_from(&vm, opts, core);
+    vm.resume()?;
+    res
+}
+
+pub fn run(opts: BatchOptions) -> Result<()> {
+    try_with!(
+        fs::create_dir_all(&opts.dir),
+        "cannot create {}",
+        opts.dir.display()
+    );
+    cache_memslots(&opts.pids);
+
+    let jobs = max(min(opts.jobs, opts.pids.len()), 1);
+    let threads = max(opts.threads / jobs, 1);
+    let mut chunk_size = opts.chunk_size;
+    if let Some(memory) = opts.memory {
+        // copy_chunks keeps up to two chunks per thread in flight
+        chunk_size = min(chunk_size, memory / (jobs * threads * 2));
+    }
+    let chunk_size = page_align(max(chunk_size, page_size()));
+    info!(
+        "collect {} VMs, {} at a time with {} threads and {} KiB chunks each",
+        opts.pids.len(),
+        jobs,
+        threads,
+        chunk_size >> 10
+    );
+
+    let bandwidth = opts.bandwidth.map(|b| Arc::new(Bandwidth::new(b)));
+    let opts = Arc::new(opts);
+    let next = Arc::new(AtomicUsize::new(0));
+    let workers = (0..jobs)
+        .map(|_| {
+            let (opts, next, bandwidth) = (opts.clone(), next.clone(), bandwidth.clone());
+            thread::spawn(move || {
+                let mut failed = 0;
+                loop {
+                    let idx = next.fetch_add(1, Ordering::Relaxed);
+                    let pid = match opts.pids.get(idx) {
+                        Some(pid) => *pid,
+                        None => return failed,
+                    };
+                    let core = CoredumpOptions {
+                        pid,
+                        path: opts.dir.join(format!("core.{}", pid)),
+                        threads,
+                        chunk_size,
+                        compression: opts.compression,
+                        sparse: opts.sparse,
+                        dirty_log: false,
+                        parent: None,
+                        live: false,
+                        bandwidth: bandwidth.clone(),
+                    };
+                    match collect(&opts, &core) {
+                        Ok(()) => info!("collected {}", pid),
+                        Err(e) => {
+                            error!("cannot collect {}: {}", pid, e);
+                            failed += 1;
+                        }
+                    }
+                }
+            })
+        })
+        .collect::<Vec<_>>();
+
+    let mut failed = 0;
+    for worker in workers {
+        match worker.join() {
+            Ok(n) => failed += n,
+            Err(_) => bail!("batch worker panicked"),
+        }
+    }
+    if failed > 0 {
+        bail!("{} of {} VMs failed", failed, opts.pids.len());
+    }
+    Ok(())
+}
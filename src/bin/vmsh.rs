@@ -1,5 +1,6 @@
 use log::*;
 use std::path::PathBuf;
+use std::time::Duration;
 
 use clap::{
     crate_authors, crate_version, value_t, value_t_or_exit, values_t, App, AppSettings, Arg,
@@ -8,9 +9,11 @@ use clap::{
 use nix::unistd::Pid;
 
 use vmsh::attach::{self, AttachOptions};
-use vmsh::coredump::CoredumpOptions;
+use vmsh::batch::{self, BatchOptions};
+use vmsh::coredump::{Compression, CoredumpOptions};
+use vmsh::devices::{BlockBackend, BlockOptions, Coalescing, MAX_BLK_QUEUES};
 use vmsh::inspect::InspectOptions;
-use vmsh::{coredump, inspect};
+use vmsh::{coredump, inspect, sessions};
 
 fn pid_arg(index: u64) -> Arg<'static, 'static> {
     Arg::with_name("pid")
@@ -27,10 +30,32 @@ fn command_args(index: u64) -> Arg<'static, 'static> {
         .index(index)
 }
 
+fn paths_arg(args: &ArgMatches, name: &str) -> Vec<PathBuf> {
+    args.values_of(name)
+        .map(|v| v.map(PathBuf::from).collect())
+        .unwrap_or_default()
+}
+
 fn parse_pid_arg(args: &ArgMatches) -> Pid {
     Pid::from_raw(value_t_or_exit!(args, "pid", i32))
 }
 
+fn coalesce_arg(args: &ArgMatches) -> Coalescing {
+    let coalesce = Coalescing {
+        max_pending: value_t_or_exit!(args, "blk-coalesce-requests", u32),
+        max_delay: Duration::from_micros(value_t_or_exit!(args, "blk-coalesce-us", u64)),
+    };
+    // either limit alone would silently disable coalescing
+    if coalesce != Coalescing::default() && !coalesce.enabled() {
+        clap::Error::with_description(
+            "--blk-coalesce-requests (at least 2) and --blk-coalesce-us (at least 1) must be set together",
+            clap::ErrorKind::MissingRequiredArgument,
+        )
+        .exit();
+    }
+    coalesce
+}
+
 fn inspect(args: &ArgMatches) {
     let opts = InspectOptions {
         pid: parse_pid_arg(args),
@@ -47,7 +72,30 @@ fn attach(args: &ArgMatches) {
         pid: parse_pid_arg(args),
         ssh_args: value_t_or_exit!(args, "ssh-args", String),
         command: values_t!(args, "command", String).unwrap_or_else(|_| vec![]),
-        backing: PathBuf::from(value_t!(args, "backing-file", String).unwrap_or_else(|e| e.exit())),
+        block: BlockOptions {
+            backing: PathBuf::from(
+                value_t!(args, "backing-file", String).unwrap_or_else(|e| e.exit()),
+            ),
+            overlay: args.value_of("overlay").map(PathBuf::from),
+            overlay_replace: args.is_present("overlay-replace"),
+            backing_url: args.value_of("backing-url").map(String::from),
+            cache_dir: PathBuf::from(value_t_or_exit!(args, "cache-dir", String)),
+            shared_cache_mb: value_t_or_exit!(args, "shared-cache", u64),
+            coalesce: coalesce_arg(args),
+            queues: value_t_or_exit!(args, "blk-queues", usize),
+            backend: match args.value_of("block-backend") {
+                Some("io_uring") => BlockBackend::IoUring,
+                _ => BlockBackend::Std,
+            },
+            extra_disks: paths_arg(args, "disk"),
+        },
+        consoles: paths_arg(args, "console"),
+        sessions: value_t_or_exit!(args, "sessions", usize),
+        fstype: args.value_of("fstype").map(String::from),
+        metrics_socket: args.value_of("metrics-socket").map(PathBuf::from),
+        fast_detach: args.is_present("fast-detach"),
+        timings: args.is_present("timings"),
+        timings_json: args.value_of("timings-json").map(PathBuf::from),
     };
 
     if let Err(err) = attach::attach(&opts) {
@@ -56,12 +104,37 @@ fn attach(args: &ArgMatches) {
     };
 }
 
+fn session(args: &ArgMatches) {
+    let pid = parse_pid_arg(args);
+    let idx = value_t_or_exit!(args, "INDEX", usize);
+
+    if let Err(err) = sessions::connect(pid, idx) {
+        error!("{}", err);
+        std::process::exit(1);
+    };
+}
+
 fn coredump(args: &ArgMatches) {
     let pid = parse_pid_arg(args);
     let path =
         value_t!(args, "PATH", PathBuf).unwrap_or_else(|_| PathBuf::from(format!("core.{}", pid)));
 
-    let opts = CoredumpOptions { pid, path };
+    let threads = value_t!(args, "threads", usize).unwrap_or_else(|e| e.exit());
+    let chunk_size = value_t!(args, "chunk-size", usize).unwrap_or_else(|e| e.exit());
+    let compression = value_t!(args, "compress", Compression).unwrap_or_else(|e| e.exit());
+
+    let opts = CoredumpOptions {
+        pid,
+        path,
+        threads,
+        chunk_size: chunk_size << 20,
+        compression,
+        sparse: args.is_present("sparse"),
+        dirty_log: args.is_present("dirty-log"),
+        parent: args.value_of("parent").map(PathBuf::from),
+        live: args.is_present("live"),
+        bandwidth: None,
+    };
 
     if let Err(err) = coredump::generate_coredump(&opts) {
         error!("{}", err);
@@ -69,6 +142,32 @@ fn coredump(args: &ArgMatches) {
     };
 }
 
+fn batch(args: &ArgMatches) {
+    let pids = values_t!(args, "pid", i32).unwrap_or_else(|e| e.exit());
+    let mib = |name: &str| {
+        args.value_of(name)
+            .map(|_| value_t!(args, name, u64).unwrap_or_else(|e| e.exit()) << 20)
+    };
+
+    let opts = BatchOptions {
+        pids: pids.into_iter().map(Pid::from_raw).collect(),
+        dir: value_t!(args, "output-dir", PathBuf).unwrap_or_else(|e| e.exit()),
+        jobs: value_t!(args, "jobs", usize).unwrap_or_else(|e| e.exit()),
+        coredump: args.is_present("coredump"),
+        threads: value_t!(args, "threads", usize).unwrap_or_else(|e| e.exit()),
+        chunk_size: value_t!(args, "chunk-size", usize).unwrap_or_else(|e| e.exit()) << 20,
+        compression: value_t!(args, "compress", Compression).unwrap_or_else(|e| e.exit()),
+        sparse: args.is_present("sparse"),
+        bandwidth: mib("max-bandwidth"),
+        memory: mib("max-memory").map(|m| m as usize),
+    };
+
+    if let Err(err) = batch::run(opts) {
+        error!("{}", err);
+        std::process::exit(1);
+    };
+}
+
 fn setup_logging(matches: &clap::ArgMatches) {
     if matches.is_present("verbose") {
         env_logger::Builder::new().parse_filters("debug").init();
@@ -111,8 +210,149 @@ fn main() {
                 .takes_value(true)
                 .default_value("/dev/null")
                 .help("File which shall be served as a block device."),
+        )
+        .arg(
+            Arg::with_name("overlay")
+                .long("overlay")
+                .takes_value(true)
+                .help("Serve the backing file read-only and store writes in this sparse file. The file must not exist yet, see --overlay-replace."),
+        )
+        .arg(
+            Arg::with_name("overlay-replace")
+                .long("overlay-replace")
+                .requires("overlay")
+                .help("Truncate the --overlay file if it exists. It still must not be the backing file."),
+        )
+        .arg(
+            Arg::with_name("backing-url")
+                .long("backing-url")
+                .takes_value(true)
+                .conflicts_with("backing-file")
+                .help("Fetch the image on demand from this http:// url (needs range requests) instead of a backing file. Read-only unless --overlay is given."),
+        )
+        .arg(
+            Arg::with_name("cache-dir")
+                .long("cache-dir")
+                .takes_value(true)
+                .default_value("/var/cache/vmsh")
+                .help("Directory where chunks fetched from --backing-url are cached across attaches."),
+        )
+        .arg(
+            Arg::with_name("shared-cache")
+                .long("shared-cache")
+                .takes_value(true)
+                .default_value("0")
+                .validator(|v| v.parse::<u64>().map(|_| ()).map_err(|e| e.to_string()))
+                .help("MiB of shared memory (in /dev/shm) to cache blocks of a backing file served read-only (i.e. with --overlay). The cache is shared by all vmsh processes serving the same file. 0 disables it."),
+        )
+        .arg(
+            Arg::with_name("blk-queues")
+                .long("blk-queues")
+                .takes_value(true)
+                .default_value("1")
+                .validator(|v| match v.parse::<usize>() {
+                    Ok(n) if n > 0 && n <= MAX_BLK_QUEUES => Ok(()),
+                    _ => Err(format!("must be between 1 and {}", MAX_BLK_QUEUES)),
+                })
+                .help("Number of block device queues, each handled by its own thread. At most 256, and no more than the VM has vcpus, since the guest leaves further queues unused."),
+        )
+        .arg(
+            Arg::with_name("block-backend")
+                .long("block-backend")
+                .takes_value(true)
+                .possible_values(&["std", "io_uring"])
+                .default_value("std")
+                .help("How block requests are executed: one after the other (std) or batched with io_uring."),
+        )
+        .arg(
+            Arg::with_name("blk-coalesce-requests")
+                .long("blk-coalesce-requests")
+                .takes_value(true)
+                .default_value("0")
+                .validator(|v| v.parse::<u32>().map(|_| ()).map_err(|e| e.to_string()))
+                .help("Interrupt the guest once this many block requests completed, or after --blk-coalesce-us. Needs --blk-coalesce-us as well. 0 notifies after every drained queue."),
+        )
+        .arg(
+            Arg::with_name("blk-coalesce-us")
+                .long("blk-coalesce-us")
+                .takes_value(true)
+                .default_value("0")
+                .validator(|v| v.parse::<u64>().map(|_| ()).map_err(|e| e.to_string()))
+                .help("Maximum time in microseconds a completed block request waits for its interrupt when coalescing. Needs --blk-coalesce-requests as well."),
+        )
+        .arg(
+            Arg::with_name("disk")
+                .long("disk")
+                .takes_value(true)
+                .multiple(true)
+                .number_of_values(1)
+                .value_name("FILE")
+                .help("Serve FILE read-write as an additional block device. Can be given multiple times; the guest finds them by serial (vmsh1, vmsh2, ...)."),
+        )
+        .arg(
+            Arg::with_name("console")
+                .long("console")
+                .takes_value(true)
+                .multiple(true)
+                .number_of_values(1)
+                .value_name("FILE")
+                .help("Add a console connected to FILE, e.g. a pty. Can be given multiple times."),
+        )
+        .arg(
+            Arg::with_name("fstype")
+                .long("fstype")
+                .takes_value(true)
+                .help("Filesystem of the backing file as passed to mount(2). Detected from the backing file by default; without it the guest tries every filesystem it supports."),
+        )
+        .arg(
+            Arg::with_name("sessions")
+                .long("sessions")
+                .takes_value(true)
+                .default_value("0")
+                .validator(|v| v.parse::<usize>().map(|_| ()).map_err(|e| e.to_string()))
+                .help("Keep this many shells available in the VM while vmsh stays attached. Connect to them with `vmsh session`."),
+        )
+        .arg(
+            Arg::with_name("fast-detach")
+                .long("fast-detach")
+                .help("On detach remove memory, memslots and ioeventfds of vmsh with a single stop of the hypervisor as soon as the devices are reset, instead of a stop per syscall after moving ptrace back to the main thread."),
+        )
+        .arg(
+            Arg::with_name("metrics-socket")
+                .long("metrics-socket")
+                .takes_value(true)
+                .value_name("PATH")
+                .help("Serve counters and latency histograms of the devices and mmio exits in the Prometheus text format to every client connecting to the unix socket PATH, e.g. `socat - UNIX-CONNECT:PATH`."),
+        )
+        .arg(
+            Arg::with_name("timings")
+                .long("timings")
+                .help("Print wall time, injected syscalls and bytes copied per attach phase once the guest driver is loaded."),
+        )
+        .arg(
+            Arg::with_name("timings-json")
+                .long("timings-json")
+                .takes_value(true)
+                .value_name("FILE")
+                .help("Write the attach timings as json to FILE."),
+        );
+
+    let session_command = SubCommand::with_name("session")
+        .about("Open a shell of a running attach started with --sessions.")
+        .version(crate_version!())
+        .author(crate_authors!("\n"))
+        .arg(pid_arg(1))
+        .arg(
+            Arg::with_name("INDEX")
+                .help("session to connect to")
+                .default_value("0")
+                .index(2),
         );
 
+    let default_threads = std::thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .to_string();
     let coredump_command = SubCommand::with_name("coredump")
         .about("Get a coredump of a virtual machine.")
         .version(crate_version!())
@@ -120,8 +360,125 @@ fn main() {
         .arg(pid_arg(1))
         .arg(
             Arg::with_name("PATH")
-                .help("path to coredump. Defaults to core.${pid}")
+                .help("path to coredump. Defaults to core.${pid}, - writes to stdout")
                 .index(2),
+        )
+        .arg(
+            Arg::with_name("threads")
+                .long("threads")
+                .takes_value(true)
+                .default_value(&default_threads)
+                .help("Number of threads reading guest memory."),
+        )
+        .arg(
+            Arg::with_name("chunk-size")
+                .long("chunk-size")
+                .takes_value(true)
+                .default_value("64")
+                .help("Guest memory is read and compressed in chunks of this many MiB."),
+        )
+        .arg(
+            Arg::with_name("sparse")
+                .long("sparse")
+                .help("Do not read memory the hypervisor never touched and write zero pages as holes."),
+        )
+        .arg(
+            Arg::with_name("dirty-log")
+                .long("dirty-log")
+                .help("Make KVM track pages the guest writes, so later cores can use --parent. vmsh refuses memslots the hypervisor already logs itself, i.e. during live migration."),
+        )
+        .arg(
+            Arg::with_name("parent")
+                .long("parent")
+                .takes_value(true)
+                .value_name("CORE")
+                .help("Only dump memory written since CORE (taken with --dirty-log or --parent) was dumped. KVM does not log writes of the hypervisor itself (device emulation, vhost), so pages changed that way may be stale."),
+        )
+        .arg(
+            Arg::with_name("live")
+                .long("live")
+                .conflicts_with_all(&["parent", "compress"])
+                .help("Copy memory while the guest runs. The guest is stopped only briefly for the vcpu state and the pages written during the copy. KVM does not log writes of the hypervisor itself (device emulation, vhost), so pages changed that way during the copy may be stale."),
+        )
+        .arg(
+            Arg::with_name("compress")
+                .long("compress")
+                .takes_value(true)
+                .possible_values(&["none", "zstd", "lz4"])
+                .default_value("none")
+                .help("Compress each chunk with zstd or lz4 (the command line tool must be installed). The core ends with a seek table in the zstd seekable format."),
+        );
+
+    let batch_command = SubCommand::with_name("batch")
+        .about("Find the kernel of and optionally dump many virtual machines at once.")
+        .version(crate_version!())
+        .author(crate_authors!("\n"))
+        .arg(
+            Arg::with_name("pid")
+                .help("Pids of the hypervisors")
+                .required(true)
+                .multiple(true),
+        )
+        .arg(
+            Arg::with_name("output-dir")
+                .long("output-dir")
+                .takes_value(true)
+                .value_name("DIR")
+                .default_value(".")
+                .help("Write kernel.${pid} and core.${pid} of each VM to DIR."),
+        )
+        .arg(
+            Arg::with_name("coredump")
+                .long("coredump")
+                .help("Also write a coredump of each VM."),
+        )
+        .arg(
+            Arg::with_name("jobs")
+                .long("jobs")
+                .takes_value(true)
+                .default_value("4")
+                .help("Number of VMs processed at the same time."),
+        )
+        .arg(
+            Arg::with_name("threads")
+                .long("threads")
+                .takes_value(true)
+                .default_value(&default_threads)
+                .help("Number of threads reading guest memory, split between the VMs in progress."),
+        )
+        .arg(
+            Arg::with_name("chunk-size")
+                .long("chunk-size")
+                .takes_value(true)
+                .default_value("64")
+                .help("Guest memory is read and compressed in chunks of at most this many MiB."),
+        )
+        .arg(
+            Arg::with_name("max-memory")
+                .long("max-memory")
+                .takes_value(true)
+                .value_name("MIB")
+                .help("Buffer at most this much guest memory at once, for all VMs together. Lowers the chunk size."),
+        )
+        .arg(
+            Arg::with_name("max-bandwidth")
+                .long("max-bandwidth")
+                .takes_value(true)
+                .value_name("MIB")
+                .help("Read at most this many MiB of guest memory per second, for all VMs together."),
+        )
+        .arg(
+            Arg::with_name("sparse")
+                .long("sparse")
+                .help("Do not read memory the hypervisor never touched and write zero pages as holes."),
+        )
+        .arg(
+            Arg::with_name("compress")
+                .long("compress")
+                .takes_value(true)
+                .possible_values(&["none", "zstd", "lz4"])
+                .default_value("none")
+                .help("Compress each chunk with zstd or lz4 (the command line tool must be installed)."),
         );
 
     let main_app = App::new("vmsh")
@@ -139,14 +496,18 @@ fn main() {
              .help("Finegrained verbosity control. See docs.rs/env_logger. Examples: [error, warn, info, debug, trace]"))
         .subcommand(inspect_command)
         .subcommand(attach_command)
-        .subcommand(coredump_command);
+        .subcommand(session_command)
+        .subcommand(coredump_command)
+        .subcommand(batch_command);
 
     let matches = main_app.get_matches();
     setup_logging(&matches);
     match matches.subcommand() {
         ("inspect", Some(sub_matches)) => inspect(sub_matches),
         ("attach", Some(sub_matches)) => attach(sub_matches),
+        ("session", Some(sub_matches)) => session(sub_matches),
         ("coredump", Some(sub_matches)) => coredump(sub_matches),
+        ("batch", Some(sub_matches)) => batch(sub_matches),
         ("", None) => unreachable!(), // beause of AppSettings::SubCommandRequiredElseHelp
         _ => unreachable!(),
     }
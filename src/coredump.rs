@@ -1,16 +1,30 @@
 use crate::kvm::hypervisor::VCPU;
 use kvm_bindings as kvmb;
-use libc::{c_void, off_t, timeval, PT_LOAD, PT_NOTE};
+use libc::{timeval, PT_LOAD, PT_NOTE};
+use log::{info, warn};
 use nix::sys::{
-    mman::{mmap, MapFlags, ProtFlags},
+    mman::{MapFlags, ProtFlags},
     uio::{process_vm_readv, IoVec, RemoteIoVec},
 };
 use nix::unistd::Pid;
-use simple_error::try_with;
+use simple_error::{bail, require_with, try_with};
+use std::cmp::{max, min};
+use std::collections::BTreeMap;
+use std::convert::TryFrom;
 use std::fs::OpenOptions;
-use std::path::PathBuf;
-use std::{fs::File, io::Write, ptr, slice::from_raw_parts_mut};
-use std::{mem::size_of, os::unix::prelude::AsRawFd};
+use std::io::{self, BufWriter, Read};
+use std::mem::size_of;
+use std::ops::Range;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::process::{Command, Stdio};
+use std::str::FromStr;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{mpsc, Arc, Condvar, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+use std::{fs::File, io::Write, ptr};
 
 use crate::cpu::{FpuRegs, Regs};
 use crate::elf::{
@@ -19,13 +33,91 @@ use crate::elf::{
     ET_CORE, EV_CURRENT, NT_PRPSINFO, NT_PRSTATUS, NT_PRXREG, PF_W, PF_X, SHN_UNDEF,
 };
 use crate::kvm::hypervisor::Hypervisor;
+use crate::kvm::memslots::{memslot_mappings, MemSlot};
 use crate::page_math::{page_align, page_size};
 use crate::result::Result;
 use crate::{kvm, tracer::proc::Mapping};
 
+/// Compression of the chunks of the core file.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Compression {
+    None,
+    Zstd,
+    Lz4,
+}
+
+impl FromStr for Compression {
+    type Err = String;
+
+    fn from_str(s: &str) -> std::result::Result<Self, Self::Err> {
+        match s {
+            "none" => Ok(Compression::None),
+            "zstd" => Ok(Compression::Zstd),
+            "lz4" => Ok(Compression::Lz4),
+            _ => Err(format!("unknown compression: {}", s)),
+        }
+    }
+}
+
 pub struct CoredumpOptions {
     pub pid: Pid,
+    /// `-` writes the core to stdout
     pub path: PathBuf,
+    /// number of threads reading guest memory
+    pub threads: usize,
+    /// guest memory is read, compressed and written in chunks of this size
+    pub chunk_size: usize,
+    pub compression: Compression,
+    /// Skip memory that the hypervisor never touched and leave holes for zero pages in the
+    /// core file. Without a regular uncompressed core file, zero pages are still written.
+    pub sparse: bool,
+    /// Enable KVM dirty logging on all memslots, so later cores can be deltas to this one.
+    pub dirty_log: bool,
+    /// Only dump memory written since `parent` was dumped. The core references `parent` in a
+    /// NT_VMSH_PARENT note.
+    pub parent: Option<PathBuf>,
+    /// Copy memory while the guest runs and stop it only for the vcpu state and the pages it
+    /// wrote during the copy.
+    pub live: bool,
+    /// Caps how fast guest memory is read, shared by all cores written at the same time.
+    pub bandwidth: Option<Arc<Bandwidth>>,
+}
+
+/// Paces reads of guest memory to `bytes_per_sec`.
+pub struct Bandwidth {
+    bytes_per_sec: u64,
+    /// when the bandwidth is free again
+    next: Mutex<Option<Instant>>,
+}
+
+impl Bandwidth {
+    pub fn new(bytes_per_sec: u64) -> Bandwidth {
+        Bandwidth {
+            bytes_per_sec: max(bytes_per_sec, 1),
+            next: Mutex::new(None),
+        }
+    }
+
+    /// Start of a read of `bytes` issued at `now`. Unused bandwidth is not saved up.
+    fn reserve(&self, bytes: usize, now: Instant) -> Instant {
+        let mut next = self.next.lock().unwrap();
+        let start = match *next {
+            Some(next) if next > now => next,
+            _ => now,
+        };
+        let nanos = bytes as u128 * 1_000_000_000 / self.bytes_per_sec as u128;
+        *next = Some(start + Duration::from_nanos(nanos as u64));
+        start
+    }
+
+    /// Block until `bytes` may be read.
+    pub fn take(&self, bytes: usize) {
+        let now = Instant::now();
+        let start = self.reserve(bytes, now);
+        if start > now {
+            thread::sleep(start - now);
+        }
+    }
 }
 
 #[repr(C)]
@@ -58,43 +150,6 @@ unsafe fn any_as_bytes<T: Sized>(p: &T) -> &[u8] {
     std::slice::from_raw_parts((p as *const T) as *const u8, size_of::<T>())
 }
 
-fn dump_mappings(
-    pid: Pid,
-    core_file: &mut File,
-    core_size: off_t,
-    file_offset: off_t,
-    maps: &[Mapping],
-) -> Result<()> {
-    let buf_size = core_size - file_offset;
-    let res = unsafe {
-        mmap(
-            ptr::null_mut::<c_void>(),
-            buf_size as usize,
-            ProtFlags::PROT_WRITE,
-            MapFlags::MAP_SHARED,
-            core_file.as_raw_fd(),
-            file_offset,
-        )
-    };
-    let raw_buf = try_with!(res, "cannot mmap core file");
-    let buf = unsafe { from_raw_parts_mut(raw_buf as *mut u8, buf_size as usize) };
-
-    let dst_iovs = vec![IoVec::from_mut_slice(buf)];
-    let src_iovs = maps
-        .iter()
-        .map(|m| RemoteIoVec {
-            base: m.start,
-            len: m.size(),
-        })
-        .collect::<Vec<_>>();
-
-    try_with!(
-        process_vm_readv(pid, dst_iovs.as_slice(), src_iovs.as_slice()),
-        "cannot read hypervisor memory"
-    );
-    Ok(())
-}
-
 fn elf_header(phnum: Elf_Half) -> Ehdr {
     Ehdr {
         e_ident: [
@@ -142,7 +197,11 @@ fn pt_load_header(m: &Mapping, offset: Elf_Off) -> Phdr {
     }
 }
 
-fn write_note_section<T: Sized>(core_file: &mut File, ntype: Elf_Word, payload: &T) -> Result<()> {
+fn write_note_section<T: Sized>(
+    core_file: &mut Vec<u8>,
+    ntype: Elf_Word,
+    payload: &T,
+) -> Result<()> {
     let hdr = &Nhdr {
         n_namesz: 5,
         n_descsz: size_of::<T>() as Elf_Word,
@@ -164,7 +223,7 @@ fn write_note_section<T: Sized>(core_file: &mut File, ntype: Elf_Word, payload:
 }
 
 #[cfg(target_arch = "x86_64")]
-fn write_fpu_registers(core_file: &mut File, regs: &FpuRegs) -> Result<()> {
+fn write_fpu_registers(core_file: &mut Vec<u8>, regs: &FpuRegs) -> Result<()> {
     use crate::elf::NT_PRXFPREG;
     let hdr = &Nhdr {
         n_namesz: 5,
@@ -187,7 +246,7 @@ fn write_fpu_registers(core_file: &mut File, regs: &FpuRegs) -> Result<()> {
 }
 
 #[cfg(not(target_arch = "x86_64"))]
-fn write_fpu_registers(core_file: &mut File, regs: &FpuRegs) -> Result<()> {
+fn write_fpu_registers(core_file: &mut Vec<u8>, regs: &FpuRegs) -> Result<()> {
     use crate::elf::NT_PRFPREG;
     try_with!(
         write_note_section(
@@ -200,7 +259,7 @@ fn write_fpu_registers(core_file: &mut File, regs: &FpuRegs) -> Result<()> {
     Ok(())
 }
 
-fn write_note_sections(core_file: &mut File, vcpus: &[VcpuState]) -> Result<()> {
+fn write_note_sections(core_file: &mut Vec<u8>, vcpus: &[VcpuState]) -> Result<()> {
     try_with!(
         write_note_section(
             core_file,
@@ -282,56 +341,697 @@ pub fn note_size<T>() -> usize {
     size_of::<Nhdr>() + name_size + size_of::<T>()
 }
 
-fn write_corefile(
+/// First `len` bytes of a `PT_LOAD` segment at `offset` in the core file.
+#[derive(Clone, Debug, PartialEq)]
+struct Chunk {
+    addr: usize,
+    len: usize,
+    offset: u64,
+    /// Private anonymous memory: pages that were never faulted in are zero.
+    anonymous: bool,
+}
+
+/// Split the memory of `maps` into chunks of at most `chunk_size` bytes, beginning at `offset`.
+fn split_chunks(maps: &[Mapping], mut offset: u64, chunk_size: usize) -> Vec<Chunk> {
+    let mut chunks = vec![];
+    for m in maps {
+        let anonymous = m.inode == 0 && m.map_flags.contains(MapFlags::MAP_PRIVATE);
+        let mut addr = m.start;
+        while addr < m.end {
+            let len = min(chunk_size, m.end - addr);
+            chunks.push(Chunk {
+                addr,
+                len,
+                offset,
+                anonymous,
+            });
+            addr += len;
+            offset += len as u64;
+        }
+    }
+    chunks
+}
+
+fn read_memory(pid: Pid, buf: &mut [u8], addr: usize) -> Result<()> {
+    let mut done = 0;
+    while done < buf.len() {
+        let len = buf.len() - done;
+        let dst_iovs = [IoVec::from_mut_slice(&mut buf[done..])];
+        let src_iovs = [RemoteIoVec {
+            base: addr + done,
+            len,
+        }];
+        let read = try_with!(
+            process_vm_readv(pid, &dst_iovs, &src_iovs),
+            "cannot read hypervisor memory at {:#x}",
+            addr + done
+        );
+        if read == 0 {
+            bail!("hypervisor memory at {:#x} is gone", addr + done);
+        }
+        done += read;
+    }
+    Ok(())
+}
+
+const PAGEMAP_PRESENT: u64 = 1 << 63;
+const PAGEMAP_SWAPPED: u64 = 1 << 62;
+
+/// Which pages of `chunk` are in memory or swapped out according to /proc/pid/pagemap.
+fn resident_pages(pagemap: &File, chunk: &Chunk) -> Result<Vec<bool>> {
+    let page = page_size();
+    let mut entries = vec![0u8; chunk.len / page * 8];
+    try_with!(
+        pagemap.read_exact_at(&mut entries, (chunk.addr / page * 8) as u64),
+        "cannot read pagemap"
+    );
+    Ok(entries
+        .chunks_exact(8)
+        .map(|e| {
+            let mut entry = [0u8; 8];
+            entry.copy_from_slice(e);
+            u64::from_ne_bytes(entry) & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED) != 0
+        })
+        .collect())
+}
+
+/// Scans 16 bytes at a time, which the compiler turns into vector instructions.
+fn is_zero(buf: &[u8]) -> bool {
+    let (prefix, words, suffix) = unsafe { buf.align_to::<u128>() };
+    prefix.iter().all(|b| *b == 0)
+        && words.iter().fold(0, |acc, w| acc | w) == 0
+        && suffix.iter().all(|b| *b == 0)
+}
+
+/// Runs of consecutive pages of `len` bytes for which `f(page index)` is true, as byte ranges.
+fn page_runs(len: usize, mut f: impl FnMut(usize) -> bool) -> Vec<Range<usize>> {
+    let page = page_size();
+    let mut runs: Vec<Range<usize>> = vec![];
+    for (i, start) in (0..len).step_by(page).enumerate() {
+        if !f(i) {
+            continue;
+        }
+        let end = min(start + page, len);
+        match runs.last_mut() {
+            Some(run) if run.end == start => run.end = end,
+            _ => runs.push(start..end),
+        }
+    }
+    runs
+}
+
+/// Bytes of guest memory that were not copied into the core file.
+#[derive(Default)]
+struct SkipStats {
+    not_resident: AtomicU64,
+    zero: AtomicU64,
+}
+
+/// Read `chunk`. With `pagemap`, pages of anonymous memory that were never touched are not read
+/// and stay zero in the returned buffer.
+fn read_chunk(
     pid: Pid,
-    core_file: &mut File,
+    chunk: &Chunk,
+    pagemap: Option<&File>,
+    stats: &SkipStats,
+) -> Result<Vec<u8>> {
+    let mut buf = vec![0u8; chunk.len];
+    let resident = match pagemap {
+        Some(pagemap) if chunk.anonymous => resident_pages(pagemap, chunk)?,
+        _ => {
+            read_memory(pid, &mut buf, chunk.addr)?;
+            return Ok(buf);
+        }
+    };
+    let runs = page_runs(chunk.len, |i| resident[i]);
+    let read: usize = runs.iter().map(|r| r.len()).sum();
+    stats
+        .not_resident
+        .fetch_add((chunk.len - read) as u64, Ordering::Relaxed);
+    for run in runs {
+        read_memory(pid, &mut buf[run.clone()], chunk.addr + run.start)?;
+    }
+    Ok(buf)
+}
+
+/// Write `data` of `chunk` to `file`, leaving holes for zero pages if `sparse`.
+fn write_chunk(
+    file: &File,
+    chunk: &Chunk,
+    data: &[u8],
+    sparse: bool,
+    stats: &SkipStats,
+) -> Result<()> {
+    let runs = if sparse {
+        let page = page_size();
+        page_runs(data.len(), |i| {
+            !is_zero(&data[i * page..min((i + 1) * page, data.len())])
+        })
+    } else {
+        vec![0..data.len()]
+    };
+    let written: usize = runs.iter().map(|r| r.len()).sum();
+    stats
+        .zero
+        .fetch_add((data.len() - written) as u64, Ordering::Relaxed);
+    for run in runs {
+        try_with!(
+            file.write_all_at(&data[run.clone()], chunk.offset + run.start as u64),
+            "cannot write core file"
+        );
+    }
+    Ok(())
+}
+
+/// Compress `data` as one independent frame with the command line tool of the compression, so
+/// every chunk can be decompressed on its own.
+fn compress(compression: Compression, data: Vec<u8>) -> Result<Vec<u8>> {
+    let (program, args): (&str, &[&str]) = match compression {
+        Compression::None => return Ok(data),
+        Compression::Zstd => ("zstd", &["-q", "-c", "-T1"]),
+        Compression::Lz4 => ("lz4", &["-q", "-c"]),
+    };
+    let mut child = try_with!(
+        Command::new(program)
+            .args(args)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .spawn(),
+        "cannot run {}",
+        program
+    );
+    let mut stdin = require_with!(child.stdin.take(), "no stdin for {}", program);
+    let mut stdout = require_with!(child.stdout.take(), "no stdout for {}", program);
+    // feed the input from another thread, so neither pipe can fill up
+    let writer = thread::spawn(move || stdin.write_all(&data));
+    let mut out = vec![];
+    try_with!(stdout.read_to_end(&mut out), "cannot read from {}", program);
+    match writer.join() {
+        Ok(res) => try_with!(res, "cannot write to {}", program),
+        Err(_) => bail!("writer thread for {} panicked", program),
+    }
+    let status = try_with!(child.wait(), "cannot wait for {}", program);
+    if !status.success() {
+        bail!("{} failed: {}", program, status);
+    }
+    Ok(out)
+}
+
+const SKIPPABLE_MAGIC: u32 = 0x184d2a5e;
+const SEEKABLE_MAGIC: u32 = 0x8f92eab1;
+
+/// Skippable frame with the seek table of the zstd seekable format, which lists the compressed and
+/// decompressed size of each frame. zstd and lz4 both ignore skippable frames when decompressing
+/// the whole file.
+fn seek_table(frames: &[(u32, u32)]) -> Vec<u8> {
+    let mut table = vec![];
+    table.extend_from_slice(&SKIPPABLE_MAGIC.to_le_bytes());
+    table.extend_from_slice(&((frames.len() * 8 + 9) as u32).to_le_bytes());
+    for (compressed, decompressed) in frames {
+        table.extend_from_slice(&compressed.to_le_bytes());
+        table.extend_from_slice(&decompressed.to_le_bytes());
+    }
+    table.extend_from_slice(&(frames.len() as u32).to_le_bytes());
+    // descriptor: no checksums
+    table.push(0);
+    table.extend_from_slice(&SEEKABLE_MAGIC.to_le_bytes());
+    table
+}
+
+/// Where the core file goes. If it is a regular file and not compressed, threads write their
+/// chunks directly at their offset, otherwise chunks are written in order.
+enum Output {
+    File(Arc<File>),
+    Stream(Box<dyn Write>),
+}
+
+/// Chunks in order, compressed or not, with their seek table entries if compressed.
+struct StreamWriter {
+    out: Box<dyn Write>,
+    compression: Compression,
+    frames: Vec<(u32, u32)>,
+}
+
+impl StreamWriter {
+    fn write(&mut self, data: &[u8], decompressed: usize) -> Result<()> {
+        try_with!(self.out.write_all(data), "cannot write core file");
+        if self.compression != Compression::None {
+            let compressed = try_with!(u32::try_from(data.len()), "compressed chunk too big");
+            let decompressed = try_with!(u32::try_from(decompressed), "chunk too big");
+            self.frames.push((compressed, decompressed));
+        }
+        Ok(())
+    }
+
+    fn finish(mut self) -> Result<()> {
+        if self.compression != Compression::None {
+            let table = seek_table(&self.frames);
+            try_with!(self.out.write_all(&table), "cannot write seek table");
+        }
+        try_with!(self.out.flush(), "cannot flush core file");
+        Ok(())
+    }
+}
+
+/// Limits how far workers may run ahead of the writer, so that out-of-order chunks waiting to
+/// be written do not pile up in memory.
+struct Window {
+    written: Mutex<usize>,
+    cond: Condvar,
+    size: usize,
+}
+
+impl Window {
+    fn wait(&self, idx: usize, failed: &AtomicBool) {
+        let mut written = self.written.lock().unwrap();
+        while idx >= *written + self.size && !failed.load(Ordering::Relaxed) {
+            written = self.cond.wait(written).unwrap();
+        }
+    }
+
+    fn advance(&self, written: usize) {
+        *self.written.lock().unwrap() = written;
+        self.cond.notify_all();
+    }
+}
+
+fn report_progress(done: u64, total: u64, started: Instant) {
+    let mib = (1 << 20) as f64;
+    info!(
+        "{:.0}/{:.0} MiB ({:.0}%), {:.0} MiB/s",
+        done as f64 / mib,
+        total as f64 / mib,
+        done as f64 * 100.0 / total as f64,
+        done as f64 / mib / started.elapsed().as_secs_f64().max(1e-3)
+    );
+}
+
+/// Name of notes that vmsh adds to core files.
+const VMSH_NOTE_NAME: &[u8; 8] = b"VMSH\0\0\0\0";
+/// Path of the core file that a delta core is based on.
+pub const NT_VMSH_PARENT: Elf_Word = 1;
+
+fn parent_note(parent: &Path) -> Vec<u8> {
+    let mut desc = parent.as_os_str().as_bytes().to_vec();
+    desc.push(0);
+    desc.resize((desc.len() + 3) / 4 * 4, 0);
+    let hdr = Nhdr {
+        n_namesz: 5,
+        n_descsz: desc.len() as Elf_Word,
+        n_type: NT_VMSH_PARENT,
+    };
+    let mut note = unsafe { any_as_bytes(&hdr) }.to_vec();
+    note.extend_from_slice(VMSH_NOTE_NAME);
+    note.extend_from_slice(&desc);
+    note
+}
+
+/// e_phnum is 16 bit and one program header is the PT_NOTE.
+const MAX_SEGMENTS: usize = 0xfff0;
+
+/// Page ranges of set bits in `bitmap`. Ranges at most `max_gap` clean pages apart are merged.
+fn dirty_runs(bitmap: &[u64], npages: usize, max_gap: usize) -> Vec<Range<usize>> {
+    let mut runs: Vec<Range<usize>> = vec![];
+    for (i, word) in bitmap.iter().enumerate() {
+        if *word == 0 {
+            continue;
+        }
+        for bit in 0..64 {
+            let page = i * 64 + bit;
+            if page >= npages || word & (1 << bit) == 0 {
+                continue;
+            }
+            match runs.last_mut() {
+                Some(run) if page - run.end <= max_gap => run.end = page + 1,
+                _ => runs.push(page..page + 1),
+            }
+        }
+    }
+    runs
+}
+
+/// Parts of `maps` the guest wrote to since the last core, according to the dirty log of the
+/// corresponding `slots`. Fetching the log resets it. Writes of the hypervisor from userspace
+/// are not logged, so pages changed by device emulation or vhost can be missing.
+fn dirty_maps(vm: &Hypervisor, slots: &[MemSlot], maps: &[Mapping]) -> Result<Vec<Mapping>> {
+    let page = page_size();
+    let mut bitmaps = vec![];
+    for slot in slots {
+        if slot.flags() & kvmb::KVM_MEM_LOG_DIRTY_PAGES == 0 {
+            bail!(
+                "dirty logging is not enabled for memslot {}, take a core with --dirty-log first",
+                slot
+            );
+        }
+        bitmaps.push(vm.get_dirty_log(slot)?);
+    }
+    // merge close segments until there are few enough program headers
+    let mut max_gap = 0;
+    loop {
+        let mut segments = vec![];
+        for (map, bitmap) in maps.iter().zip(&bitmaps) {
+            for run in dirty_runs(bitmap, map.size() / page, max_gap) {
+                let mut segment = map.clone();
+                segment.start = map.start + run.start * page;
+                segment.end = map.start + run.end * page;
+                segment.phys_addr = map.phys_addr + run.start * page;
+                segments.push(segment);
+            }
+        }
+        if segments.len() <= MAX_SEGMENTS {
+            return Ok(segments);
+        }
+        max_gap = max_gap * 2 + 1;
+    }
+}
+
+/// Placement of the headers, notes and memory of `maps` in a core file.
+struct CoreLayout {
+    ehdr: Ehdr,
+    section_headers: Vec<Phdr>,
+    data_offset: usize,
+    core_size: usize,
+}
+
+impl CoreLayout {
+    fn new(maps: &[Mapping], nvcpus: usize, notes_len: usize) -> CoreLayout {
+        // +1 == PT_NOTE section
+        let ehdr = elf_header((maps.len() + 1) as Elf_Half);
+
+        let metadata_size = size_of::<Ehdr>() + (size_of::<Phdr>() * ehdr.e_phnum as usize);
+        let mut core_size = metadata_size;
+
+        let pt_note_size = note_size::<elf_prpsinfo>()
+            + nvcpus
+                * (note_size::<core_user>() + note_size::<elf_prstatus>() + note_size::<FpuRegs>())
+            + notes_len;
+        let mut section_headers = vec![pt_note_header(core_size as Elf_Off, pt_note_size as u64)];
+        core_size += pt_note_size;
+        core_size = page_align(core_size);
+        let data_offset = core_size;
+
+        for m in maps {
+            let phdr = pt_load_header(m, core_size as Elf_Off);
+            core_size += m.size();
+            section_headers.push(phdr);
+        }
+        CoreLayout {
+            ehdr,
+            section_headers,
+            data_offset,
+            core_size,
+        }
+    }
+
+    /// Everything before the memory.
+    fn header(&self, vcpus: &[VcpuState], notes: &[u8]) -> Result<Vec<u8>> {
+        let mut header = vec![];
+        header.extend_from_slice(unsafe { any_as_bytes(&self.ehdr) });
+        for section_header in &self.section_headers {
+            header.extend_from_slice(unsafe { any_as_bytes(section_header) });
+        }
+        write_note_sections(&mut header, vcpus)?;
+        header.extend_from_slice(notes);
+        header.resize(self.data_offset, 0);
+        Ok(header)
+    }
+}
+
+/// Copy `chunks` from the hypervisor with `opts.threads` threads, either directly into `file`
+/// or in order into `stream`. If `sparse`, zero pages are left out of `file`.
+fn copy_chunks(
+    opts: &CoredumpOptions,
+    chunks: Arc<Vec<Chunk>>,
+    file: Option<Arc<File>>,
+    mut stream: Option<&mut StreamWriter>,
+    sparse: bool,
+) -> Result<()> {
+    let total: u64 = chunks.iter().map(|c| c.len as u64).sum();
+    let pagemap = if opts.sparse {
+        let path = format!("/proc/{}/pagemap", opts.pid);
+        Some(Arc::new(try_with!(
+            File::open(&path),
+            "cannot open {}",
+            path
+        )))
+    } else {
+        None
+    };
+    let stats = Arc::new(SkipStats::default());
+
+    let threads = max(opts.threads, 1);
+    let next = Arc::new(AtomicUsize::new(0));
+    let failed = Arc::new(AtomicBool::new(false));
+    let window = Arc::new(Window {
+        written: Mutex::new(0),
+        cond: Condvar::new(),
+        size: 2 * threads,
+    });
+    let (sender, receiver) = mpsc::channel();
+    let workers = (0..threads)
+        .map(|_| {
+            let (chunks, next, failed, window) =
+                (chunks.clone(), next.clone(), failed.clone(), window.clone());
+            let (file, sender) = (file.clone(), sender.clone());
+            let (pagemap, stats) = (pagemap.clone(), stats.clone());
+            let (pid, compression) = (opts.pid, opts.compression);
+            let bandwidth = opts.bandwidth.clone();
+            thread::spawn(move || loop {
+                let idx = next.fetch_add(1, Ordering::Relaxed);
+                if idx >= chunks.len() || failed.load(Ordering::Relaxed) {
+                    break;
+                }
+                let chunk = &chunks[idx];
+                if file.is_none() {
+                    window.wait(idx, &failed);
+                }
+                if let Some(ref bandwidth) = bandwidth {
+                    bandwidth.take(chunk.len);
+                }
+                let res =
+                    read_chunk(pid, chunk, pagemap.as_deref(), &stats).and_then(
+                        |data| match file {
+                            Some(ref file) => {
+                                write_chunk(file, chunk, &data, sparse, &stats)?;
+                                Ok(vec![])
+                            }
+                            None => compress(compression, data),
+                        },
+                    );
+                if sender.send((idx, res)).is_err() {
+                    break;
+                }
+            })
+        })
+        .collect::<Vec<_>>();
+    drop(sender);
+
+    let res = (|| -> Result<()> {
+        let started = Instant::now();
+        let mut last_report = started;
+        let mut done = 0;
+        let mut pending: BTreeMap<usize, Vec<u8>> = BTreeMap::new();
+        let mut next_write = 0;
+        for _ in 0..chunks.len() {
+            let (idx, data) = try_with!(receiver.recv(), "coredump worker died");
+            let data = data?;
+            done += chunks[idx].len as u64;
+            if let Some(ref mut stream) = stream {
+                pending.insert(idx, data);
+                while let Some(data) = pending.remove(&next_write) {
+                    stream.write(&data, chunks[next_write].len)?;
+                    next_write += 1;
+                }
+                window.advance(next_write);
+            }
+            if last_report.elapsed() >= Duration::from_secs(1) {
+                report_progress(done, total, started);
+                last_report = Instant::now();
+            }
+        }
+        report_progress(done, total, started);
+        Ok(())
+    })();
+    if res.is_err() {
+        failed.store(true, Ordering::Relaxed);
+        window.advance(0);
+    }
+    // workers still running stop at their next send
+    drop(receiver);
+    for worker in workers {
+        if worker.join().is_err() {
+            bail!("coredump worker panicked");
+        }
+    }
+    res?;
+    if opts.sparse {
+        let mib = (1 << 20) as f64;
+        info!(
+            "skipped {:.0} MiB of memory that was never used and {:.0} MiB of zero pages",
+            stats.not_resident.load(Ordering::Relaxed) as f64 / mib,
+            stats.zero.load(Ordering::Relaxed) as f64 / mib
+        );
+    }
+
+    Ok(())
+}
+
+fn write_corefile(
+    opts: &CoredumpOptions,
+    output: Output,
     maps: &[Mapping],
     vcpus: &[VcpuState],
+    notes: &[u8],
 ) -> Result<()> {
-    // +1 == PT_NOTE section
-    let ehdr = elf_header((maps.len() + 1) as Elf_Half);
+    let layout = CoreLayout::new(maps, vcpus.len(), notes.len());
+    let header = layout.header(vcpus, notes)?;
 
-    let metadata_size = size_of::<Ehdr>() + (size_of::<Phdr>() * ehdr.e_phnum as usize);
-    let mut core_size = metadata_size;
+    let chunk_size = page_align(max(opts.chunk_size, page_size()));
+    let chunks = Arc::new(split_chunks(maps, layout.data_offset as u64, chunk_size));
+    match output {
+        Output::File(file) => {
+            try_with!(file.set_len(0), "cannot truncate core file");
+            try_with!(file.write_all_at(&header, 0), "cannot write elf header");
+            copy_chunks(opts, chunks, Some(file.clone()), None, opts.sparse)?;
+            // trailing zero pages are a hole
+            try_with!(
+                file.set_len(layout.core_size as u64),
+                "cannot resize core file"
+            );
+            Ok(())
+        }
+        Output::Stream(out) => {
+            let mut stream = StreamWriter {
+                out,
+                compression: opts.compression,
+                frames: vec![],
+            };
+            let len = header.len();
+            stream.write(&compress(opts.compression, header)?, len)?;
+            copy_chunks(opts, chunks, None, Some(&mut stream), false)?;
+            stream.finish()
+        }
+    }
+}
 
-    let pt_note_size = note_size::<elf_prpsinfo>()
-        + vcpus.len()
-            * (note_size::<core_user>() + note_size::<elf_prstatus>() + note_size::<FpuRegs>());
-    let mut section_headers = vec![pt_note_header(core_size as Elf_Off, pt_note_size as u64)];
-    core_size += pt_note_size;
-    core_size = page_align(core_size);
+/// Stop copying dirty memory while the guest runs once less than this is left.
+const LIVE_FINAL_BYTES: u64 = 64 << 20;
+const LIVE_MAX_ROUNDS: usize = 8;
 
-    for m in maps {
-        let phdr = pt_load_header(m, core_size as Elf_Off);
-        core_size += m.size();
-        section_headers.push(phdr);
+/// Chunks of the pages of `maps` written since the last call, according to the dirty log of
+/// `slots`.
+fn dirty_chunks(
+    vm: &Hypervisor,
+    slots: &[MemSlot],
+    maps: &[Mapping],
+    layout: &CoreLayout,
+    chunk_size: usize,
+) -> Result<Vec<Chunk>> {
+    let page = page_size();
+    let mut chunks = vec![];
+    // section_headers[0] is the PT_NOTE section
+    for ((slot, map), phdr) in slots.iter().zip(maps).zip(&layout.section_headers[1..]) {
+        let bitmap = vm.get_dirty_log(slot)?;
+        for run in dirty_runs(&bitmap, map.size() / page, 0) {
+            let mut segment = map.clone();
+            segment.start = map.start + run.start * page;
+            segment.end = map.start + run.end * page;
+            chunks.extend(split_chunks(
+                &[segment],
+                phdr.p_offset + (run.start * page) as u64,
+                chunk_size,
+            ));
+        }
     }
+    Ok(chunks)
+}
 
-    try_with!(
-        core_file.set_len(core_size as u64),
-        "cannot truncate core file"
-    );
-    try_with!(
-        core_file.write_all(unsafe { any_as_bytes(&ehdr) }),
-        "cannot write elf header"
-    );
-    for header in section_headers {
+/// Copy memory while the guest keeps running and track its writes with KVM's dirty log. Pages
+/// written meanwhile are copied again, until few enough are left to copy them together with the
+/// vcpu state in one short stop. The vm must be stopped when calling this.
+///
+/// KVM only logs writes of the guest. Pages the hypervisor writes from userspace meanwhile, i.e.
+/// virtio buffers filled by QEMU or vhost, are not copied again and may be stale in the core.
+fn write_live_corefile(opts: &CoredumpOptions, vm: &Hypervisor, file: Arc<File>) -> Result<()> {
+    let slots = vm.get_memslots()?;
+    let maps = memslot_mappings(opts.pid, &slots)?;
+    let layout = CoreLayout::new(&maps, vm.vcpus.len(), 0);
+    let chunk_size = page_align(max(opts.chunk_size, page_size()));
+    // slots vmsh enabled dirty logging for
+    let mut enabled = vec![];
+
+    let res = (|| -> Result<()> {
+        for slot in &slots {
+            if vm.enable_dirty_log(slot)? {
+                enabled.push(slot);
+            }
+            // only writes from now on matter
+            vm.get_dirty_log(slot)?;
+        }
+        try_with!(file.set_len(0), "cannot truncate core file");
+        let mut chunks = split_chunks(&maps, layout.data_offset as u64, chunk_size);
+        let mut sparse = opts.sparse;
+        let mut last_size = u64::MAX;
+        let mut round = 0;
+        let stopped = loop {
+            round += 1;
+            vm.resume()?;
+            // pages copied before may be zero now, so only the first round can leave holes
+            copy_chunks(opts, Arc::new(chunks), Some(file.clone()), None, sparse)?;
+            sparse = false;
+            vm.stop()?;
+            let stopped = Instant::now();
+            chunks = dirty_chunks(vm, &slots, &maps, &layout, chunk_size)?;
+            let size: u64 = chunks.iter().map(|c| c.len as u64).sum();
+            info!(
+                "round {}: {} MiB written by the guest meanwhile",
+                round,
+                size >> 20
+            );
+            if size <= LIVE_FINAL_BYTES || size >= last_size || round == LIVE_MAX_ROUNDS {
+                break stopped;
+            }
+            last_size = size;
+        };
+
+        let res = vm
+            .vcpus
+            .iter()
+            .map(|vcpu| VcpuState::new(vcpu, vm))
+            .collect::<Result<Vec<VcpuState>>>();
+        let vcpu_states = try_with!(res, "fail to dump vcpu registers");
+        copy_chunks(opts, Arc::new(chunks), Some(file.clone()), None, false)?;
         try_with!(
-            core_file.write_all(unsafe { any_as_bytes(&header) }),
+            file.write_all_at(&layout.header(&vcpu_states, &[])?, 0),
             "cannot write elf header"
         );
-    }
-    write_note_sections(core_file, vcpus)?;
-
-    try_with!(core_file.flush(), "cannot flush core file");
+        try_with!(
+            file.set_len(layout.core_size as u64),
+            "cannot resize core file"
+        );
+        info!(
+            "guest was stopped for {:.1}ms for the final copy",
+            stopped.elapsed().as_secs_f64() * 1000.0
+        );
+        Ok(())
+    })();
 
-    dump_mappings(
-        pid,
-        core_file,
-        core_size as off_t,
-        page_align(metadata_size + pt_note_size) as off_t,
-        maps,
-    )
+    // dirty logging slows down the guest
+    if !opts.dirty_log && !enabled.is_empty() {
+        // the copy stops the guest at its end, but may have failed while it was running
+        let stopped = if res.is_ok() { Ok(()) } else { vm.stop() };
+        match stopped {
+            Ok(()) => {
+                for slot in enabled {
+                    if let Err(e) = vm.disable_dirty_log(slot) {
+                        warn!("{}", e);
+                    }
+                }
+            }
+            Err(e) => warn!("cannot disable dirty logging again: {}", e),
+        }
+    }
+    res
 }
 
 const MSR_EFER: u32 = 0xc0000080;
@@ -366,32 +1066,185 @@ impl VcpuState {
 }
 
 pub fn generate_coredump(opts: &CoredumpOptions) -> Result<()> {
-    println!("Write {}", opts.path.display());
-    let mut core_file = try_with!(
-        OpenOptions::new()
-            .read(true)
-            .write(true)
-            .create(true)
-            .open(&opts.path),
-        "cannot open core_file: {}",
-        opts.path.display()
-    );
     let vm = try_with!(
         kvm::hypervisor::get_hypervisor(opts.pid),
         "cannot get vms for process {}",
         opts.pid
     );
+    generate_coredump_of(&vm, opts)
+}
+
+/// Like `generate_coredump` for a hypervisor that was already looked up. `vm` stays stopped.
+pub fn generate_coredump_of(vm: &Hypervisor, opts: &CoredumpOptions) -> Result<()> {
+    // the seek table stores frame sizes as u32
+    if opts.compression != Compression::None && page_align(opts.chunk_size) > u32::MAX as usize {
+        bail!(
+            "compressed chunks must be smaller than 4 GiB, got {} MiB",
+            opts.chunk_size >> 20
+        );
+    }
+    let output = if opts.path == Path::new("-") {
+        Output::Stream(Box::new(BufWriter::new(io::stdout())))
+    } else {
+        info!("Write {}", opts.path.display());
+        let core_file = try_with!(
+            OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .open(&opts.path),
+            "cannot open core_file: {}",
+            opts.path.display()
+        );
+        let meta = try_with!(core_file.metadata(), "cannot stat core file");
+        if meta.is_file() && opts.compression == Compression::None {
+            Output::File(Arc::new(core_file))
+        } else {
+            if meta.is_file() {
+                try_with!(core_file.set_len(0), "cannot truncate core file");
+            }
+            Output::Stream(Box::new(BufWriter::new(core_file)))
+        }
+    };
     vm.stop()?;
-    let maps = vm.get_maps()?;
+    if opts.live {
+        let file = match output {
+            Output::File(file) if opts.parent.is_none() => file,
+            _ => bail!("live coredumps need an uncompressed, regular file and no parent"),
+        };
+        return try_with!(
+            write_live_corefile(opts, vm, file),
+            "cannot write core file"
+        );
+    }
+    let (maps, notes) = if opts.dirty_log || opts.parent.is_some() {
+        let slots = vm.get_memslots()?;
+        let maps = memslot_mappings(opts.pid, &slots)?;
+        let (maps, notes) = match opts.parent {
+            Some(ref parent) => {
+                let parent = try_with!(
+                    parent.canonicalize(),
+                    "cannot find parent core {}",
+                    parent.display()
+                );
+                let maps = dirty_maps(vm, &slots, &maps)?;
+                let size: usize = maps.iter().map(|m| m.size()).sum();
+                info!(
+                    "{} MiB in {} segments changed since {}",
+                    size >> 20,
+                    maps.len(),
+                    parent.display()
+                );
+                (maps, parent_note(&parent))
+            }
+            None => (maps, vec![]),
+        };
+        for slot in &slots {
+            vm.enable_dirty_log(slot)?;
+        }
+        (maps, notes)
+    } else {
+        (vm.get_maps()?, vec![])
+    };
     let res = vm
         .vcpus
         .iter()
-        .map(|vcpu| VcpuState::new(vcpu, &vm))
+        .map(|vcpu| VcpuState::new(vcpu, vm))
         .collect::<Result<Vec<VcpuState>>>();
     let vcpu_states = try_with!(res, "fail to dump vcpu registers");
     try_with!(
-        write_corefile(opts.pid, &mut core_file, &maps, vcpu_states.as_slice()),
+        write_corefile(opts, output, &maps, vcpu_states.as_slice(), &notes),
         "cannot write core file"
     );
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_split_chunks() {
+        let mut map = Mapping {
+            start: 0x1000,
+            end: 0x6000,
+            prot_flags: ProtFlags::PROT_READ,
+            map_flags: MapFlags::MAP_SHARED,
+            offset: 0,
+            major_dev: 0,
+            minor_dev: 0,
+            inode: 0,
+            pathname: String::new(),
+            phys_addr: 0,
+        };
+        let maps = vec![map.clone(), {
+            map.start = 0x10000;
+            map.end = 0x11000;
+            map
+        }];
+        let chunks = split_chunks(&maps, 0x1000, 0x2000);
+        let chunk = |addr, len, offset| Chunk {
+            addr,
+            len,
+            offset,
+            anonymous: false,
+        };
+        assert_eq!(
+            chunks,
+            vec![
+                chunk(0x1000, 0x2000, 0x1000),
+                chunk(0x3000, 0x2000, 0x3000),
+                chunk(0x5000, 0x1000, 0x5000),
+                chunk(0x10000, 0x1000, 0x6000),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_zero_pages() {
+        let page = page_size();
+        let mut data = vec![0u8; 4 * page + 10];
+        assert!(is_zero(&data));
+        data[page + 17] = 1;
+        data[4 * page + 3] = 1;
+        assert!(!is_zero(&data[1..]));
+        let runs = page_runs(data.len(), |i| {
+            !is_zero(&data[i * page..min((i + 1) * page, data.len())])
+        });
+        assert_eq!(runs, vec![page..2 * page, 4 * page..4 * page + 10]);
+    }
+
+    #[test]
+    fn test_dirty_runs() {
+        let bitmap = [0b1011_0001, 0, 1 << 1 | 1 << 63];
+        assert_eq!(
+            dirty_runs(&bitmap, 190, 0),
+            vec![0..1, 4..6, 7..8, 129..130]
+        );
+        assert_eq!(dirty_runs(&bitmap, 190, 2), vec![0..1, 4..8, 129..130]);
+        assert_eq!(dirty_runs(&bitmap, 192, 3), vec![0..8, 129..130, 191..192]);
+    }
+
+    #[test]
+    fn test_bandwidth() {
+        let bandwidth = Bandwidth::new(1000);
+        let now = Instant::now();
+        assert_eq!(bandwidth.reserve(100, now), now);
+        assert_eq!(
+            bandwidth.reserve(100, now),
+            now + Duration::from_millis(100)
+        );
+        let later = now + Duration::from_secs(1);
+        assert_eq!(bandwidth.reserve(100, later), later);
+    }
+
+    #[test]
+    fn test_seek_table() {
+        let table = seek_table(&[(10, 20), (30, 40)]);
+        assert_eq!(table.len(), 8 + 2 * 8 + 9);
+        assert_eq!(table[..4], SKIPPABLE_MAGIC.to_le_bytes());
+        assert_eq!(table[4..8], 25u32.to_le_bytes());
+        assert_eq!(table[table.len() - 9..table.len() - 5], 2u32.to_le_bytes());
+        assert_eq!(table[table.len() - 4..], SEEKABLE_MAGIC.to_le_bytes());
+    }
+}
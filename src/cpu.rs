@@ -123,6 +123,17 @@ mod arch {
             self.rax
         }
 
+        /// Registers to run `SYSCALL_BATCH_TEXT` at `ip` on `count` entries at `entries`.
+        pub fn prepare_syscall_batch(&self, ip: u64, entries: u64, count: u64) -> Regs {
+            let mut copy = *self;
+            copy.rip = ip;
+            copy.rbx = entries;
+            copy.r12 = count;
+            // do not let the kernel restart a syscall we interrupted when attaching
+            copy.orig_rax = u64::MAX;
+            copy
+        }
+
         /// To be used during wrap_syscall.
         /// return (syscall_nr, arg1, ..., arg6)
         pub fn get_syscall_params(&self) -> (u64, u64, u64, u64, u64, u64, u64) {
@@ -147,6 +158,22 @@ mod arch {
     // $ rasm2  -a x86 -b 64 'syscall'
     pub const SYSCALL_TEXT: u64 = 0x050F;
     pub const SYSCALL_SIZE: u64 = 2;
+
+    /// Runs the syscalls of `r12` entries at `rbx`, each 8 words: number, 6 arguments and the
+    /// return value, which gets written back. Stops with int3 afterwards.
+    ///
+    /// loop: test r12, r12; jz done
+    ///       mov rax, [rbx]; mov rdi, [rbx+8]; mov rsi, [rbx+16]; mov rdx, [rbx+24]
+    ///       mov r10, [rbx+32]; mov r8, [rbx+40]; mov r9, [rbx+48]
+    ///       syscall; mov [rbx+56], rax
+    ///       add rbx, 64; dec r12; jmp loop
+    /// done: int3
+    pub const SYSCALL_BATCH_TEXT: &[u8] = &[
+        0x4d, 0x85, 0xe4, 0x74, 0x2a, 0x48, 0x8b, 0x03, 0x48, 0x8b, 0x7b, 0x08, 0x48, 0x8b, 0x73,
+        0x10, 0x48, 0x8b, 0x53, 0x18, 0x4c, 0x8b, 0x53, 0x20, 0x4c, 0x8b, 0x43, 0x28, 0x4c, 0x8b,
+        0x4b, 0x30, 0x0f, 0x05, 0x48, 0x89, 0x43, 0x38, 0x48, 0x83, 0xc3, 0x40, 0x49, 0xff, 0xcc,
+        0xeb, 0xd1, 0xcc,
+    ];
 }
 
 pub use arch::*;
@@ -21,6 +21,10 @@ const MMIO_VERSION: u32 = 2;
 // like the standard doesn't say anything regarding an actual VENDOR_ID value for MMIO devices.
 const VENDOR_ID: u32 = 0;
 
+// Offset of the device status register. Writes to it may activate or reset a device, which
+// requires syscall injection into the hypervisor.
+const MMIO_STATUS_OFFSET: u64 = 0x70;
+
 type MmioPirateBus<D> = Bus<MmioAddress, D>;
 
 /// Replacement for vm_device::device_manager::IoManager.
@@ -51,7 +55,18 @@ impl IoPirate {
     //    Ok(())
     //}
 
-    pub fn handle_mmio_rw(&mut self, mmio_rw: &mut MmioRw) -> Result<()> {
+    /// True if the access writes the status register of one of our devices.
+    pub fn is_status_write(&self, mmio_rw: &MmioRw) -> bool {
+        if !mmio_rw.is_write {
+            return false;
+        }
+        match self.mmio_device(MmioAddress(mmio_rw.addr)) {
+            Some((range, _)) => mmio_rw.addr - range.base().0 == MMIO_STATUS_OFFSET,
+            None => false,
+        }
+    }
+
+    pub fn handle_mmio_rw(&self, mmio_rw: &mut MmioRw) -> Result<()> {
         if mmio_rw.is_write {
             map_err_with!(
                 self.mmio_write(MmioAddress(mmio_rw.addr), mmio_rw.data()),
@@ -1,27 +1,33 @@
 pub mod mmio;
 mod threads;
+mod vcpu_workers;
 mod virtio;
 
 use crate::devices::mmio::IoPirate;
 use crate::devices::threads::SubscriberEventManager;
 use crate::devices::virtio::block::{self, BlockArgs};
-use crate::devices::virtio::console::{self, ConsoleArgs};
-use crate::devices::virtio::{CommonArgs, MmioConfig};
+use crate::devices::virtio::console::{self, ConsoleArgs, ConsoleStats};
+use crate::devices::virtio::direct_io::DirectIo;
+use crate::devices::virtio::{CommonArgs, DeviceStats, MmioConfig, SubscriberEndpoint};
 use crate::kvm::hypervisor::Hypervisor;
 use crate::kvm::PhysMemAllocator;
+use crate::metrics::Exposition;
 use crate::result::Result;
 use crate::tracer::proc::Mapping;
 use libc::pid_t;
+use log::info;
 use simple_error::{bail, try_with};
-use std::path::Path;
-use std::sync::{Arc, Mutex};
-use vm_device::device_manager::MmioManager;
+use std::fs::File;
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex, RwLock, RwLockWriteGuard};
 use vm_memory::guest_memory::GuestAddress;
 use vm_memory::mmap::MmapRegion;
 use vm_memory::GuestMemoryRegion;
 use vm_memory::{GuestMemoryMmap, GuestRegionMmap};
 
 pub use self::threads::DeviceSet;
+pub use self::virtio::block::BlockBackend;
+pub use self::virtio::Coalescing;
 
 pub type Block = block::Block<Arc<GuestMemoryMmap>>;
 pub type Console = console::Console<Arc<GuestMemoryMmap>>;
@@ -61,10 +67,66 @@ fn convert(pid: pid_t, mappings: &[Mapping]) -> Result<GuestMemoryMmap> {
     ))
 }
 
+/// All devices share one interrupt line: virtio-mmio requests it as shared and checks the
+/// interrupt status of its device before handling it.
+const DEVICE_GSI: u32 = 5;
+
+/// Upper limit of `BlockOptions::queues`. Each queue costs a thread and an event manager in vmsh
+/// and an ioeventfd in the hypervisor, while the guest driver uses no more queues than it has
+/// cpus.
+pub const MAX_BLK_QUEUES: usize = 256;
+
+/// How the block device is set up.
+pub struct BlockOptions {
+    /// file served as block device
+    pub backing: PathBuf,
+    /// serve `backing` read-only and store writes in this (sparse) file instead
+    pub overlay: Option<PathBuf>,
+    /// discard the content of an existing `overlay` instead of failing
+    pub overlay_replace: bool,
+    /// fetch the image from this http url on demand instead of serving `backing`
+    pub backing_url: Option<String>,
+    /// chunks fetched from `backing_url` are kept here and shared by all attaches
+    pub cache_dir: PathBuf,
+    /// MiB of shared memory for a block cache used by all vmsh processes serving the same
+    /// read-only file, 0 to disable it
+    pub shared_cache_mb: u64,
+    /// number of queues, each one handled by a thread of its own. At most `MAX_BLK_QUEUES`, and
+    /// no more than the vm has vcpus are used.
+    pub queues: usize,
+    /// how requests are executed
+    pub backend: BlockBackend,
+    /// how many completed requests are batched into one interrupt
+    pub coalesce: Coalescing,
+    /// further files served read-write as block devices `vmsh1`, `vmsh2`, ...
+    pub extra_disks: Vec<PathBuf>,
+}
+
+#[derive(Default)]
+pub struct DeviceMetrics {
+    blkdevs: Vec<Arc<DeviceStats>>,
+    consoles: Vec<(Arc<DeviceStats>, Arc<ConsoleStats>)>,
+}
+
+impl DeviceMetrics {
+    pub fn write(&self, exp: &mut Exposition) {
+        for (i, stats) in self.blkdevs.iter().enumerate() {
+            stats.write_metrics(exp, &format!("device=\"vmsh{}\"", i));
+        }
+        for (i, (stats, io_stats)) in self.consoles.iter().enumerate() {
+            let labels = format!("device=\"console{}\"", i);
+            stats.write_metrics(exp, &labels);
+            io_stats.write_metrics(exp, &labels);
+        }
+    }
+}
+
 pub struct DeviceContext {
-    pub blkdev: Arc<Mutex<Block>>,
-    pub console: Arc<Mutex<Console>>,
-    pub mmio_mgr: Arc<Mutex<IoPirate>>,
+    /// the first one is the root device of stage2
+    pub blkdevs: Vec<Arc<Mutex<Block>>>,
+    /// the last one is connected to vmsh itself and used by stage2
+    pub consoles: Vec<Arc<Mutex<Console>>>,
+    pub mmio_mgr: Arc<RwLock<IoPirate>>,
     /// start address of mmio space
     pub first_mmio_addr: u64,
     /// start address of mmio space
@@ -73,91 +135,156 @@ pub struct DeviceContext {
 
 impl DeviceContext {
     pub fn mmio_addrs(&self) -> Result<Vec<u64>> {
-        Ok(vec![
-            try_with!(self.blkdev.lock(), "cannot lock block device")
-                .mmio_cfg
-                .range
-                .base()
-                .0,
-            try_with!(self.console.lock(), "cannot lock console device")
-                .mmio_cfg
-                .range
-                .base()
-                .0,
-        ])
+        let mut addrs = vec![];
+        for blkdev in &self.blkdevs {
+            let blkdev = try_with!(blkdev.lock(), "cannot lock block device");
+            addrs.push(blkdev.mmio_cfg.range.base().0);
+        }
+        // the guest numbers consoles in the order they are registered
+        for console in &self.consoles {
+            let console = try_with!(console.lock(), "cannot lock console device");
+            addrs.push(console.mmio_cfg.range.base().0);
+        }
+        Ok(addrs)
     }
+    /// Counters of all devices to be exported while the devices run.
+    pub fn metrics(&self) -> Result<DeviceMetrics> {
+        let mut metrics = DeviceMetrics::default();
+        for blkdev in &self.blkdevs {
+            let blkdev = try_with!(blkdev.lock(), "cannot lock block device");
+            metrics.blkdevs.push(blkdev.stats.clone());
+        }
+        for console in &self.consoles {
+            let console = try_with!(console.lock(), "cannot lock console device");
+            metrics
+                .consoles
+                .push((console.stats.clone(), console.io_stats.clone()));
+        }
+        Ok(metrics)
+    }
+
+    /// Report how often each device trapped, see `DeviceStats`.
+    pub fn log_stats(&self) -> Result<()> {
+        for (i, blkdev) in self.blkdevs.iter().enumerate() {
+            let blkdev = try_with!(blkdev.lock(), "cannot lock block device");
+            info!("block device vmsh{}: {}", i, blkdev.stats);
+            if let Some(cache) = blkdev.shared_cache() {
+                info!("block cache: {}", cache);
+            }
+        }
+        for (i, console) in self.consoles.iter().enumerate() {
+            let console = try_with!(console.lock(), "cannot lock console device");
+            info!("console device {}: {}", i, console.stats);
+            info!("console io {}: {}", i, console.io_stats);
+        }
+        Ok(())
+    }
+
     pub fn new(
         vmm: &Arc<Hypervisor>,
         allocator: &mut PhysMemAllocator,
         event_mgr: &mut SubscriberEventManager,
-        backing: &Path,
+        blk_opts: &BlockOptions,
+        blk_queue_endpoints: Vec<SubscriberEndpoint>,
+        consoles: Vec<File>,
     ) -> Result<DeviceContext> {
         let guest_memory = try_with!(vmm.get_maps(), "cannot get guests memory");
         let mem = Arc::new(try_with!(
             convert(vmm.pid.as_raw(), &guest_memory),
             "cannot convert Mapping to GuestMemoryMmap"
         ));
+        let direct_io = Arc::new(try_with!(
+            DirectIo::new(vmm.pid, &guest_memory),
+            "cannot prepare direct io to guest memory"
+        ));
 
-        let block_mmio_cfg = MmioConfig {
-            range: allocator.alloc_mmio_range(0x1000)?,
-            gsi: 5,
-        };
-
-        let console_mmio_cfg = MmioConfig {
-            range: allocator.alloc_mmio_range(0x1000)?,
-            gsi: 5,
-        };
-
-        let first_mmio_addr = console_mmio_cfg.range.base().0;
-        let last_mmio_addr = block_mmio_cfg.range.last().0;
+        // the root device, the extra disks, the extra consoles and our own console
+        let num_devices = 1 + blk_opts.extra_disks.len() + consoles.len() + 1;
+        let ranges = allocator.alloc_mmio_ranges(num_devices, 0x1000)?;
+        let first_mmio_addr = ranges[0].base().0;
+        let last_mmio_addr = ranges[num_devices - 1].last().0;
+        let mut mmio_cfgs = ranges.into_iter().map(|range| MmioConfig {
+            range,
+            gsi: DEVICE_GSI,
+        });
 
         // IoManager replacement:
-        let device_manager = Arc::new(Mutex::new(IoPirate::default()));
-        let blkdev = {
-            let guard = device_manager.lock().unwrap();
-            guard.mmio_device(block_mmio_cfg.range.base());
+        let device_manager = Arc::new(RwLock::new(IoPirate::default()));
 
-            let common = CommonArgs {
+        let mut blkdevs = vec![];
+        let root = BlockArgs {
+            common: CommonArgs {
                 mem: Arc::clone(&mem),
                 vmm: vmm.clone(),
                 event_mgr,
-                mmio_mgr: guard,
-                mmio_cfg: block_mmio_cfg,
-            };
+                mmio_mgr: device_manager.write().unwrap(),
+                mmio_cfg: mmio_cfgs.next().unwrap(),
+            },
+            file_path: blk_opts.backing.clone(),
+            // without an overlay, remote images can only be read
+            read_only: blk_opts.backing_url.is_some() && blk_opts.overlay.is_none(),
+            root_device: true,
+            index: 0,
+            advertise_flush: true,
+            overlay: blk_opts.overlay.clone(),
+            overlay_replace: blk_opts.overlay_replace,
+            backing_url: blk_opts.backing_url.clone(),
+            cache_dir: blk_opts.cache_dir.clone(),
+            shared_cache_mb: blk_opts.shared_cache_mb,
+            queue_endpoints: blk_queue_endpoints,
+            backend: blk_opts.backend,
+            coalesce: blk_opts.coalesce,
+            direct_io: direct_io.clone(),
+        };
+        blkdevs.push(new_block(root)?);
+        for (i, disk) in blk_opts.extra_disks.iter().enumerate() {
             let args = BlockArgs {
-                common,
-                file_path: backing.to_path_buf(),
+                common: CommonArgs {
+                    mem: Arc::clone(&mem),
+                    vmm: vmm.clone(),
+                    event_mgr,
+                    mmio_mgr: device_manager.write().unwrap(),
+                    mmio_cfg: mmio_cfgs.next().unwrap(),
+                },
+                file_path: disk.clone(),
                 read_only: false,
-                root_device: true,
+                root_device: false,
+                index: i + 1,
                 advertise_flush: true,
+                overlay: None,
+                overlay_replace: false,
+                backing_url: None,
+                cache_dir: blk_opts.cache_dir.clone(),
+                shared_cache_mb: 0,
+                queue_endpoints: vec![],
+                backend: blk_opts.backend,
+                coalesce: blk_opts.coalesce,
+                direct_io: direct_io.clone(),
             };
-            match Block::new(args) {
-                Ok(v) => v,
-                Err(e) => bail!("cannot create block device: {:?}", e),
-            }
-        };
-        let console = {
-            let guard = device_manager.lock().unwrap();
-            guard.mmio_device(console_mmio_cfg.range.base());
+            blkdevs.push(new_block(args)?);
+        }
 
-            let common = CommonArgs {
-                mem,
-                vmm: vmm.clone(),
-                event_mgr,
-                mmio_mgr: guard,
-                mmio_cfg: console_mmio_cfg,
+        // Our console comes last and therefore gets the highest hvc number.
+        let files = consoles.into_iter().map(Some).chain(Some(None));
+        let mut consoles = vec![];
+        for file in files {
+            let args = ConsoleArgs {
+                common: CommonArgs {
+                    mem: Arc::clone(&mem),
+                    vmm: vmm.clone(),
+                    event_mgr,
+                    mmio_mgr: device_manager.write().unwrap(),
+                    mmio_cfg: mmio_cfgs.next().unwrap(),
+                },
+                direct_io: direct_io.clone(),
+                file,
             };
-            let args = ConsoleArgs { common };
-
-            match Console::new(args) {
-                Ok(v) => v,
-                Err(e) => bail!("cannot create console device: {:?}", e),
-            }
-        };
+            consoles.push(new_console(args)?);
+        }
 
         let device = DeviceContext {
-            blkdev,
-            console,
+            blkdevs,
+            consoles,
             mmio_mgr: device_manager,
             first_mmio_addr,
             last_mmio_addr,
@@ -166,3 +293,23 @@ impl DeviceContext {
         Ok(device)
     }
 }
+
+type DeviceManagerGuard<'a> = RwLockWriteGuard<'a, IoPirate>;
+
+fn new_block(
+    args: BlockArgs<Arc<GuestMemoryMmap>, DeviceManagerGuard>,
+) -> Result<Arc<Mutex<Block>>> {
+    match Block::new(args) {
+        Ok(v) => Ok(v),
+        Err(e) => bail!("cannot create block device: {:?}", e),
+    }
+}
+
+fn new_console(
+    args: ConsoleArgs<Arc<GuestMemoryMmap>, DeviceManagerGuard>,
+) -> Result<Arc<Mutex<Console>>> {
+    match Console::new(args) {
+        Ok(v) => Ok(v),
+        Err(e) => bail!("cannot create console device: {:?}", e),
+    }
+}
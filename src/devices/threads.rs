@@ -1,22 +1,34 @@
 use event_manager::EventManager;
 use event_manager::MutEventSubscriber;
-use log::{debug, info, log_enabled, trace, Level};
+use log::{debug, info, trace, warn};
 use simple_error::{require_with, try_with};
+use std::cmp::{max, min};
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::os::unix::net::UnixListener;
 use std::path::Path;
 use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::mpsc::SyncSender;
 use std::sync::Arc;
 use std::sync::{Condvar, Mutex};
+use std::time::{Duration, Instant};
 use virtio_device::{VirtioDevice, WithDriverSelect};
 
-use crate::devices::DeviceContext;
+use crate::devices::vcpu_workers::VcpuWorkers;
+use crate::devices::{BlockOptions, DeviceContext, DeviceMetrics};
 use crate::interrutable_thread::InterrutableThread;
 use crate::kvm::hypervisor::Hypervisor;
 use crate::kvm::PhysMemAllocator;
+use crate::metrics::{self, Exposition};
 use crate::result::Result;
 use crate::tracer::wrap_syscall::KvmRunWrapper;
 
-const EVENT_LOOP_TIMEOUT_MS: i32 = 1;
+/// Event threads only wake up on their own to check whether they should stop, everything else
+/// (including irq ack timeouts) is driven by events.
+const EVENT_LOOP_TIMEOUT_MS: i32 = 100;
+
+/// How long to wait for answers of the vcpu workers before looking for new mmio exits again.
+const VCPU_WORKER_POLL_TIMEOUT: Duration = Duration::from_micros(50);
 
 // Arc<Mutex<>> because the same device (a dyn DevicePio/DeviceMmio from IoManager's
 // perspective, and a dyn MutEventSubscriber from EventManager's) is managed by the 2 entities,
@@ -59,99 +71,72 @@ impl DeviceReady {
 }
 
 fn event_thread(
+    name: &str,
     mut event_mgr: SubscriberEventManager,
-    device_space: &DeviceContext,
     err_sender: &SyncSender<()>,
 ) -> Result<InterrutableThread<()>> {
-    let blkdev = device_space.blkdev.clone();
-    let ack_handler = {
-        let blkdev = try_with!(blkdev.lock(), "cannot unlock thread");
-        blkdev.irq_ack_handler.clone()
-    };
-
-    let res = InterrutableThread::spawn(
-        "event-manager",
-        err_sender,
-        move |should_stop: Arc<AtomicBool>| {
-            loop {
-                match event_mgr.run_with_timeout(EVENT_LOOP_TIMEOUT_MS) {
-                    Ok(nr) => {
-                        if nr != 0 {
-                            trace!("EventManager: processed {} events", nr)
-                        }
+    let res = InterrutableThread::spawn(name, err_sender, move |should_stop: Arc<AtomicBool>| {
+        loop {
+            match event_mgr.run_with_timeout(EVENT_LOOP_TIMEOUT_MS) {
+                Ok(nr) => {
+                    if nr != 0 {
+                        trace!("EventManager: processed {} events", nr)
                     }
-                    Err(e) => log::warn!("Failed to handle events: {:?}", e),
-                }
-                {
-                    let mut ack_handler = try_with!(ack_handler.lock(), "failed to lock");
-                    ack_handler.handle_timeouts();
-                }
-                if should_stop.load(Ordering::Relaxed) {
-                    break;
                 }
+                Err(e) => log::warn!("Failed to handle events: {:?}", e),
             }
-            Ok(())
-        },
-    );
-    Ok(try_with!(res, "failed to spawn event-manager thread"))
+            if should_stop.load(Ordering::Relaxed) {
+                break;
+            }
+        }
+        Ok(())
+    });
+    Ok(try_with!(res, "failed to spawn {} thread", name))
 }
 
-/// Periodically print block device state
-fn blkdev_monitor_thread(
-    device: &DeviceContext,
+/// Serve the metrics in the Prometheus text format to every client connecting to `path`.
+fn metrics_thread(
+    path: &Path,
+    metrics: DeviceMetrics,
+    vcpus: usize,
     err_sender: &SyncSender<()>,
 ) -> Result<InterrutableThread<()>> {
-    let blkdev = device.blkdev.clone();
+    // left over from a vmsh that did not exit cleanly
+    let _ = fs::remove_file(path);
+    let listener = try_with!(UnixListener::bind(path), "cannot bind {}", path.display());
+    try_with!(
+        listener.set_nonblocking(true),
+        "cannot make metrics socket non-blocking"
+    );
+    info!("serving metrics on {}", path.display());
+    let path = path.to_path_buf();
     let res = InterrutableThread::spawn(
-        "blkdev-monitor",
+        "metrics",
         err_sender,
         move |should_stop: Arc<AtomicBool>| {
-            //std::thread::sleep(std::time::Duration::from_millis(10000));
-            loop {
-                {
-                    let blkdev = try_with!(blkdev.lock(), "cannot unlock thread");
-                    // debug!("");
-                    // debug!("dev type {}", blkdev.device_type());
-                    // debug!("dev features b{:b}", blkdev.device_features());
-                    // debug!(
-                    //     "dev interrupt stat b{:b}",
-                    //     blkdev.interrupt_status().load(Ordering::Relaxed)
-                    // );
-                    // debug!("dev status b{:b}", blkdev.device_status());
-                    // debug!("dev config gen {}", blkdev.config_generation());
-                    // debug!(
-                    //     "dev queue {}: max size: {}, ready: {}, is valid: {}",
-                    //     //blkdev.selected_queue().map(Queue::max_size).unwrap()
-                    //     blkdev.queue_select(),
-                    //     blkdev.selected_queue().unwrap().max_size(),
-                    //     blkdev.selected_queue().unwrap().ready,
-                    //     blkdev.selected_queue().unwrap().is_valid() // crashes before activate()
-                    // );
-                    // debug!(
-                    //     "dev queue {}: avail idx {}, next avail idx {}",
-                    //     blkdev.queue_select(),
-                    //     blkdev.selected_queue().unwrap().avail_idx(Ordering::Relaxed).unwrap(),
-                    //     blkdev.selected_queue().unwrap().next_avail(),
-                    //     );
-                    debug!(
-                        "dev queue {}: irq status b{:b}",
-                        blkdev.queue_select(),
-                        blkdev.interrupt_status().load(Ordering::SeqCst),
-                    );
-
-                    //debug!("occasional irqfd << 1");
-                    //blkdev.irqfd.write(1).unwrap();
-                }
-
-                if should_stop.load(Ordering::Relaxed) {
-                    return Ok(());
+            let exits = metrics::vcpu_exits(vcpus);
+            while !should_stop.load(Ordering::Relaxed) {
+                match listener.accept() {
+                    Ok((mut stream, _)) => {
+                        let mut exp = Exposition::default();
+                        exp.vcpu_exits(&exits);
+                        metrics.write(&mut exp);
+                        if let Err(e) = stream.write_all(exp.finish().as_bytes()) {
+                            debug!("cannot send metrics: {}", e);
+                        }
+                    }
+                    Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                        std::thread::sleep(Duration::from_millis(EVENT_LOOP_TIMEOUT_MS as u64))
+                    }
+                    Err(e) => warn!("cannot accept metrics connection: {}", e),
                 }
-                std::thread::sleep(std::time::Duration::from_millis(10000));
             }
+            let _ = fs::remove_file(&path);
+            Ok(())
         },
     );
 
-    Ok(try_with!(res, "failed to spawn blkdev-monitor"))
+    Ok(try_with!(res, "failed to spawn metrics thread"))
 }
 
 /// Traps KVM_MMIO_EXITs with ptrace and forward them as needed to out block and console device driver
@@ -160,45 +145,112 @@ fn handle_mmio_exits(
     should_stop: &Arc<AtomicBool>,
     ctx: &DeviceContext,
     device_ready: &Arc<DeviceReady>,
+    vcpus: usize,
 ) -> Result<()> {
-    let mut mmio_mgr = try_with!(ctx.mmio_mgr.lock(), "cannot lock mmio manager");
     device_ready.notify()?;
 
-    loop {
-        let mut kvm_exit;
-        {
-            let mut wrapper_go = try_with!(wrapper_mo.lock(), "cannot obtain wrapper mutex");
-            let wrapper_g = require_with!(wrapper_go.as_mut(), "KvmRunWrapper not initialized");
-            kvm_exit = try_with!(
-                wrapper_g.wait_for_ioctl(),
-                "failed to wait for vmm exit_mmio"
-            )
-        };
-
-        if let Some(mmio_rw) = &mut kvm_exit {
-            if ctx.first_mmio_addr <= mmio_rw.addr && mmio_rw.addr < ctx.last_mmio_addr {
-                // intercept op
-                trace!("mmio access: 0x{:x}", mmio_rw.addr);
-                try_with!(mmio_mgr.handle_mmio_rw(mmio_rw), "failed to handle MmioRw");
-            } else {
-                // do nothing, just continue to ignore and pass to hv
-                trace!("ignore addr: 0x{:x}", mmio_rw.addr)
+    // With a single vcpu there is nothing to parallelize, so we answer exits in this thread.
+    let mut workers = if vcpus > 1 {
+        Some(VcpuWorkers::new(vcpus, &ctx.mmio_mgr)?)
+    } else {
+        None
+    };
+
+    let res = loop {
+        // errors must not skip the quiesce below
+        let step = (|| -> Result<()> {
+            let kvm_exit;
+            let mut dispatch = false;
+            {
+                let mut wrapper_go = try_with!(wrapper_mo.lock(), "cannot obtain wrapper mutex");
+                let wrapper_g = require_with!(wrapper_go.as_mut(), "KvmRunWrapper not initialized");
+                let busy = match &mut workers {
+                    Some(w) => {
+                        for tid in w.finished()? {
+                            wrapper_g.release(tid);
+                        }
+                        w.busy()
+                    }
+                    None => false,
+                };
+                // do not block in waitpid while workers may want their threads to be resumed
+                let res = if busy {
+                    wrapper_g.try_wait_for_ioctl()
+                } else {
+                    wrapper_g.wait_for_ioctl()
+                };
+                kvm_exit = try_with!(res, "failed to wait for vmm exit_mmio");
+
+                if let Some(mmio_rw) = &kvm_exit {
+                    let in_range =
+                        ctx.first_mmio_addr <= mmio_rw.addr && mmio_rw.addr < ctx.last_mmio_addr;
+                    if in_range {
+                        wrapper_g.intercepted(mmio_rw.tid());
+                    }
+                    if workers.is_some() {
+                        let mmio_mgr = try_with!(ctx.mmio_mgr.read(), "cannot lock mmio manager");
+                        // status writes may (de)activate devices, which needs the KvmRunWrapper.
+                        if in_range && !mmio_mgr.is_status_write(mmio_rw) {
+                            wrapper_g.hold(mmio_rw.tid())?;
+                            dispatch = true;
+                        }
+                    }
+                }
+            };
+
+            match (kvm_exit, &mut workers) {
+                (Some(mmio_rw), Some(w)) if dispatch => {
+                    trace!("mmio access: 0x{:x} (vcpu {})", mmio_rw.addr, mmio_rw.vcpu);
+                    w.dispatch(mmio_rw)?;
+                }
+                (Some(mut mmio_rw), workers) => {
+                    if ctx.first_mmio_addr <= mmio_rw.addr && mmio_rw.addr < ctx.last_mmio_addr {
+                        // intercept op
+                        trace!("mmio access: 0x{:x}", mmio_rw.addr);
+                        if let Some(w) = workers {
+                            w.quiesce()?;
+                        }
+                        let mmio_mgr = try_with!(ctx.mmio_mgr.read(), "cannot lock mmio manager");
+                        try_with!(
+                            mmio_mgr.handle_mmio_rw(&mut mmio_rw),
+                            "failed to handle MmioRw"
+                        );
+                    } else {
+                        // do nothing, just continue to ignore and pass to hv
+                        trace!("ignore addr: 0x{:x}", mmio_rw.addr)
+                    }
+                }
+                (None, Some(w)) => w.wait(VCPU_WORKER_POLL_TIMEOUT)?,
+                (None, None) => {}
             }
+
+            Ok(())
+        })();
+        if let Err(e) = step {
+            break Err(e);
         }
 
         if should_stop.load(Ordering::Relaxed) {
-            break;
+            break Ok(());
         }
+    };
+
+    // all answers must be written before the hypervisor threads are resumed
+    match &mut workers {
+        Some(w) => res.and(w.quiesce()),
+        None => res,
     }
-    Ok(())
 }
 
-/// see handle_mmio_exits
+/// see handle_mmio_exits. With `fast_detach` the thread removes the resources of the devices
+/// together with those queued by the main thread and releases ptrace itself once it is asked to
+/// stop, see `Hypervisor::fast_detach`.
 fn mmio_exit_handler_thread(
     vm: &Arc<Hypervisor>,
     device: DeviceContext,
     err_sender: &SyncSender<()>,
     device_ready: &Arc<DeviceReady>,
+    fast_detach: bool,
 ) -> Result<InterrutableThread<()>> {
     let device_ready = Arc::clone(device_ready);
     let vm = Arc::clone(vm);
@@ -214,13 +266,37 @@ fn mmio_exit_handler_thread(
 
             info!("mmio dev attached");
 
+            let mut stopping = None;
             let res = vm.kvmrun_wrapped(|wrapper_mo: &Mutex<Option<KvmRunWrapper>>| {
                 // Signal that our blockdevice driver is ready now
-                handle_mmio_exits(wrapper_mo, &should_stop, &device, &device_ready)?;
-
-                Ok(())
+                let res = handle_mmio_exits(
+                    wrapper_mo,
+                    &should_stop,
+                    &device,
+                    &device_ready,
+                    vm.vcpu_maps.len(),
+                );
+                stopping = Some(Instant::now());
+                res
             });
 
+            if fast_detach {
+                // devices are reset and drained already, their remote resources are queued
+                drop(device);
+                vm.fast_detach()?;
+                if let Some(stopping) = stopping {
+                    info!(
+                        "released hypervisor {:.3}ms after stopping the exit handler",
+                        stopping.elapsed().as_secs_f64() * 1000.0
+                    );
+                }
+                return res;
+            }
+
+            if let Err(e) = device.log_stats() {
+                log::warn!("{}", e);
+            }
+            metrics::log_vcpu_exits(vm.vcpu_maps.len());
             // drop remote resources like ioeventfd before disowning traced process.
             drop(device);
 
@@ -236,6 +312,8 @@ fn mmio_exit_handler_thread(
 pub struct DeviceSet {
     context: DeviceContext,
     event_manager: SubscriberEventManager,
+    /// event managers of the block device queues beyond the first one
+    blk_queue_managers: Vec<SubscriberEventManager>,
 }
 
 impl DeviceSet {
@@ -246,37 +324,85 @@ impl DeviceSet {
     pub fn new(
         vm: &Arc<Hypervisor>,
         allocator: &mut PhysMemAllocator,
-        backing_file: &Path,
+        blk_opts: &BlockOptions,
+        consoles: Vec<File>,
     ) -> Result<DeviceSet> {
         let mut event_manager =
             try_with!(SubscriberEventManager::new(), "cannot create event manager");
+        // the guest would leave queues beyond one per vcpu unused
+        let queues = min(blk_opts.queues, max(vm.vcpus.len(), 1));
+        if queues < blk_opts.queues {
+            info!(
+                "use {} instead of {} block queues, one per vcpu",
+                queues, blk_opts.queues
+            );
+        }
+        // every further block queue is handled by an event manager in a thread of its own
+        let mut blk_queue_managers = vec![];
+        for _ in 1..queues {
+            blk_queue_managers.push(try_with!(
+                SubscriberEventManager::new(),
+                "cannot create event manager for block queue"
+            ));
+        }
+        let blk_queue_endpoints = blk_queue_managers
+            .iter()
+            .map(|mgr| mgr.remote_endpoint())
+            .collect();
         // instantiate blkdev
         let context = try_with!(
-            DeviceContext::new(vm, allocator, &mut event_manager, backing_file),
+            DeviceContext::new(
+                vm,
+                allocator,
+                &mut event_manager,
+                blk_opts,
+                blk_queue_endpoints,
+                consoles
+            ),
             "cannot create vm"
         );
         Ok(DeviceSet {
             context,
             event_manager,
+            blk_queue_managers,
         })
     }
 
+    /// Starts the device threads and, if `metrics_socket` is given, a thread serving metrics on
+    /// it. See `mmio_exit_handler_thread` for `fast_detach`.
     pub fn start(
         self,
         vm: &Arc<Hypervisor>,
         err_sender: &SyncSender<()>,
+        metrics_socket: Option<&Path>,
+        fast_detach: bool,
     ) -> Result<Vec<InterrutableThread<()>>> {
         let device_ready = Arc::new(DeviceReady::new());
-        let mut threads = vec![event_thread(self.event_manager, &self.context, err_sender)?];
+        let mut threads = vec![event_thread(
+            "event-manager",
+            self.event_manager,
+            err_sender,
+        )?];
+        for (idx, event_mgr) in self.blk_queue_managers.into_iter().enumerate() {
+            let name = format!("blk-queue-{}", idx + 1);
+            threads.push(event_thread(&name, event_mgr, err_sender)?);
+        }
 
-        if log_enabled!(Level::Debug) {
-            threads.push(blkdev_monitor_thread(&self.context, err_sender)?);
+        if let Some(path) = metrics_socket {
+            let metrics = self.context.metrics()?;
+            threads.push(metrics_thread(
+                path,
+                metrics,
+                vm.vcpu_maps.len(),
+                err_sender,
+            )?);
         }
         threads.push(mmio_exit_handler_thread(
             vm,
             self.context,
             err_sender,
             &device_ready,
+            fast_detach,
         )?);
 
         device_ready.wait()?;
@@ -0,0 +1,146 @@
+use log::warn;
+use nix::unistd::Pid;
+use simple_error::{bail, simple_error, try_with};
+use std::sync::mpsc::{channel, Receiver, RecvTimeoutError, Sender};
+use std::sync::{Arc, RwLock};
+use std::thread::{Builder, JoinHandle};
+use std::time::Duration;
+
+use crate::devices::mmio::IoPirate;
+use crate::interrutable_thread::DEFAULT_THREAD_STACKSIZE;
+use crate::result::Result;
+use crate::tracer::wrap_syscall::MmioRw;
+
+struct Worker {
+    sender: Sender<MmioRw>,
+    handle: JoinHandle<()>,
+}
+
+/// Answers mmio exits of each vcpu in a thread of its own, so that exits of different vcpus are
+/// handled in parallel and only serialize on the device they access.
+///
+/// ptrace only allows the thread owning the KvmRunWrapper to wait for and resume hypervisor
+/// threads. The owner therefore keeps a thread stopped (`KvmRunWrapper::hold()`) while its exit
+/// is dispatched and resumes it once the exit appears in `finished()`.
+pub struct VcpuWorkers {
+    workers: Vec<Worker>,
+    done: Receiver<(Pid, Result<()>)>,
+    /// exits dispatched but not yet reported back by `finished()`/`wait()`
+    in_flight: usize,
+    /// threads whose exits were answered and that can be resumed
+    finished: Vec<Pid>,
+}
+
+fn worker_loop(
+    mmio_mgr: Arc<RwLock<IoPirate>>,
+    exits: Receiver<MmioRw>,
+    done: Sender<(Pid, Result<()>)>,
+) {
+    for mut mmio_rw in exits {
+        let res = match mmio_mgr.read() {
+            Ok(mmio_mgr) => mmio_mgr.handle_mmio_rw(&mut mmio_rw),
+            Err(e) => Err(simple_error!("cannot lock mmio manager: {}", e)),
+        };
+        if done.send((mmio_rw.tid(), res)).is_err() {
+            // VcpuWorkers was dropped, nobody is waiting for us anymore.
+            return;
+        }
+    }
+}
+
+impl VcpuWorkers {
+    pub fn new(vcpus: usize, mmio_mgr: &Arc<RwLock<IoPirate>>) -> Result<VcpuWorkers> {
+        let (done_sender, done) = channel();
+        let mut workers = Vec::with_capacity(vcpus);
+        for idx in 0..vcpus {
+            let (sender, exits) = channel();
+            let mmio_mgr = Arc::clone(mmio_mgr);
+            let done_sender = done_sender.clone();
+            let handle = try_with!(
+                Builder::new()
+                    .name(format!("mmio-vcpu-{}", idx))
+                    .stack_size(DEFAULT_THREAD_STACKSIZE)
+                    .spawn(move || worker_loop(mmio_mgr, exits, done_sender)),
+                "cannot spawn mmio worker for vcpu {}",
+                idx
+            );
+            workers.push(Worker { sender, handle });
+        }
+        Ok(VcpuWorkers {
+            workers,
+            done,
+            in_flight: 0,
+            finished: vec![],
+        })
+    }
+
+    /// True if some dispatched exits have not been answered yet.
+    pub fn busy(&self) -> bool {
+        self.in_flight != 0
+    }
+
+    /// Hand an mmio exit to the worker of its vcpu.
+    pub fn dispatch(&mut self, mmio_rw: MmioRw) -> Result<()> {
+        let worker = match self.workers.get(mmio_rw.vcpu) {
+            Some(w) => w,
+            None => bail!("no mmio worker for vcpu {}", mmio_rw.vcpu),
+        };
+        if worker.sender.send(mmio_rw).is_err() {
+            bail!("mmio worker has stopped");
+        }
+        self.in_flight += 1;
+        Ok(())
+    }
+
+    fn completed(&mut self, res: (Pid, Result<()>)) -> Result<()> {
+        let (tid, res) = res;
+        self.in_flight -= 1;
+        self.finished.push(tid);
+        try_with!(res, "failed to handle MmioRw of thread {}", tid);
+        Ok(())
+    }
+
+    /// Wait up to `timeout` for the next answered exit.
+    pub fn wait(&mut self, timeout: Duration) -> Result<()> {
+        if !self.busy() {
+            return Ok(());
+        }
+        match self.done.recv_timeout(timeout) {
+            Ok(res) => self.completed(res),
+            Err(RecvTimeoutError::Timeout) => Ok(()),
+            Err(RecvTimeoutError::Disconnected) => bail!("all mmio workers have stopped"),
+        }
+    }
+
+    /// Block until all dispatched exits are answered. Must be called before the KvmRunWrapper
+    /// is converted into a different tracer, since that resumes all its threads.
+    pub fn quiesce(&mut self) -> Result<()> {
+        while self.busy() {
+            match self.done.recv() {
+                Ok(res) => self.completed(res)?,
+                Err(_) => bail!("all mmio workers have stopped"),
+            }
+        }
+        Ok(())
+    }
+
+    /// Threads whose exits have been answered since the last call.
+    pub fn finished(&mut self) -> Result<Vec<Pid>> {
+        while let Ok(res) = self.done.try_recv() {
+            self.completed(res)?;
+        }
+        Ok(self.finished.split_off(0))
+    }
+}
+
+impl Drop for VcpuWorkers {
+    fn drop(&mut self) {
+        for worker in self.workers.drain(..) {
+            // closing the channel stops the worker
+            drop(worker.sender);
+            if worker.handle.join().is_err() {
+                warn!("mmio worker panicked");
+            }
+        }
+    }
+}
@@ -3,14 +3,11 @@
 // SPDX-License-Identifier: Apache-2.0 OR BSD-3-Clause
 
 use std::borrow::{Borrow, BorrowMut};
-use std::fs::OpenOptions;
 use std::ops::DerefMut;
-use std::path::PathBuf;
 use std::sync::{Arc, Mutex};
 use virtio_device::{VirtioDevice, VirtioDeviceType};
 
-use event_manager::{MutEventSubscriber, RemoteEndpoint, Result as EvmgrResult, SubscriberId};
-use virtio_blk::stdio_executor::StdIoBackend;
+use event_manager::{MutEventSubscriber, Result as EvmgrResult, SubscriberId};
 use virtio_device::{VirtioConfig, VirtioDeviceActions, VirtioMmioDevice};
 use virtio_queue::Queue;
 use vm_device::bus::MmioAddress;
@@ -19,16 +16,27 @@ use vm_device::{DeviceMmio, MutDeviceMmio};
 use vm_memory::GuestAddressSpace;
 use vmm_sys_util::eventfd::EventFd;
 
-use crate::devices::virtio::block::{BLOCK_DEVICE_ID, VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_RO};
+use crate::devices::virtio::block::{
+    BlockBackend, BLOCK_DEVICE_ID, VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_MQ, VIRTIO_BLK_F_RO,
+};
+use crate::devices::virtio::direct_io::DirectIo;
 use crate::devices::virtio::features::{
     VIRTIO_F_IN_ORDER, VIRTIO_F_RING_EVENT_IDX, VIRTIO_F_VERSION_1,
 };
-use crate::devices::virtio::{IrqAckHandler, MmioConfig, SingleFdSignalQueue, QUEUE_MAX_SIZE};
-use crate::kvm::hypervisor::Hypervisor;
+use crate::devices::virtio::{
+    kick_queue, mmio_written, Coalescing, DeviceStats, IrqAckHandler, MmioConfig, NotifyCoalescer,
+    SingleFdSignalQueue, SubscriberEndpoint, QUEUE_MAX_SIZE,
+};
+use crate::kvm::hypervisor::{Hypervisor, IoEventFd};
 
-use super::super::register_ioeventfd;
+use super::super::register_ioeventfds;
+use super::executor::{device_id, SyncExecutor, VIRTIO_BLK_ID_BYTES};
+use super::image::{DiskImage, Overlay};
 use super::inorder_handler::InOrderQueueHandler;
+use super::io_uring_handler::IoUringQueueHandler;
 use super::queue_handler::QueueHandler;
+use super::remote::RemoteImage;
+use super::shared_cache::SharedCache;
 use super::{build_config_space, BlockArgs, Error, Result};
 
 // This Block device can only use the MMIO transport for now, but we plan to reuse large parts of
@@ -37,17 +45,25 @@ use super::{build_config_space, BlockArgs, Error, Result};
 pub struct Block<M: GuestAddressSpace> {
     virtio_cfg: VirtioConfig<M>,
     pub mmio_cfg: MmioConfig,
-    endpoint: RemoteEndpoint<Arc<Mutex<dyn MutEventSubscriber + Send>>>,
+    // One event manager per queue: queue handlers of different queues run in different threads.
+    endpoints: Vec<SubscriberEndpoint>,
     pub irq_ack_handler: Arc<Mutex<IrqAckHandler>>,
     vmm: Arc<Hypervisor>,
     irqfd: Arc<EventFd>,
-    file_path: PathBuf,
     read_only: bool,
-    sub_id: Option<SubscriberId>,
+    device_id: [u8; VIRTIO_BLK_ID_BYTES],
+    image: Arc<DiskImage>,
+    backend: BlockBackend,
+    coalesce: Coalescing,
+    mem: M,
+    direct_io: Arc<DirectIo>,
+    // Subscribers of the active queues as (queue index, subscriber id).
+    sub_ids: Vec<(usize, SubscriberId)>,
+    pub stats: Arc<DeviceStats>,
+    // Duplicates of the queue ioeventfds (indexed by queue) to forward queue notifications that
+    // trapped anyway.
+    queue_kicks: Vec<Option<EventFd>>,
 
-    // Before resetting we return the handler to the mmio thread for cleanup
-    #[allow(dead_code)]
-    handler: Option<Arc<Mutex<dyn MutEventSubscriber + Send>>>,
     // We'll prob need to remember this for state save/restore unless we pass the info from
     // the outside.
     _root_device: bool,
@@ -64,10 +80,13 @@ where
         B: DerefMut,
         B::Target: MmioManager<D = Arc<dyn DeviceMmio + Send + Sync>>,
     {
-        // The queue handling logic for this device uses the buffers in order, so we enable the
-        // corresponding feature as well.
-        let mut device_features =
-            1 << VIRTIO_F_VERSION_1 | 1 << VIRTIO_F_IN_ORDER | 1 << VIRTIO_F_RING_EVENT_IDX;
+        let mut device_features = 1 << VIRTIO_F_VERSION_1 | 1 << VIRTIO_F_RING_EVENT_IDX;
+
+        // The std queue handling logic for this device uses the buffers in order, so we enable
+        // the corresponding feature as well. io_uring completes requests out of order.
+        if args.backend == BlockBackend::Std {
+            device_features |= 1 << VIRTIO_F_IN_ORDER;
+        }
 
         if args.read_only {
             device_features |= 1 << VIRTIO_BLK_F_RO;
@@ -77,9 +96,41 @@ where
             device_features |= 1 << VIRTIO_BLK_F_FLUSH;
         }
 
-        // A block device has a single queue.
-        let queues = vec![Queue::new(args.common.mem, QUEUE_MAX_SIZE)];
-        let config_space = build_config_space(&args.file_path)?;
+        let mut endpoints = vec![args.common.event_mgr.remote_endpoint()];
+        endpoints.append(&mut args.queue_endpoints);
+        let num_queues = endpoints.len();
+        if num_queues > 1 {
+            device_features |= 1 << VIRTIO_BLK_F_MQ;
+        }
+
+        let queues = vec![Queue::new(args.common.mem.clone(), QUEUE_MAX_SIZE); num_queues];
+        let base = match &args.backing_url {
+            Some(url) => {
+                DiskImage::Remote(RemoteImage::new(url, &args.cache_dir).map_err(Error::Simple)?)
+            }
+            None => DiskImage::raw(&args.file_path, args.read_only || args.overlay.is_some())?,
+        };
+        // The cache must never see writes, so it only sits in front of images nobody writes to.
+        let cache = match base.raw_file() {
+            Some(file)
+                if args.shared_cache_mb > 0 && (args.read_only || args.overlay.is_some()) =>
+            {
+                Some(SharedCache::for_file(file, args.shared_cache_mb).map_err(Error::Simple)?)
+            }
+            _ => None,
+        };
+        let base = match cache {
+            Some(cache) => DiskImage::Cached {
+                image: Box::new(base),
+                cache,
+            },
+            None => base,
+        };
+        let image = Arc::new(match &args.overlay {
+            Some(delta) => DiskImage::Overlay(Overlay::new(base, delta, args.overlay_replace)?),
+            None => base,
+        });
+        let config_space = build_config_space(image.size(), num_queues as u16);
         let virtio_cfg = VirtioConfig::new(device_features, queues, config_space);
 
         // Used to send notifications to the driver.
@@ -94,22 +145,32 @@ where
 
         let mmio_cfg = args.common.mmio_cfg;
 
-        let irq_ack_handler = Arc::new(Mutex::new(IrqAckHandler::new(
+        let stats = Arc::new(DeviceStats::default());
+        let irq_ack_handler = IrqAckHandler::subscribe(
+            args.common.event_mgr,
             virtio_cfg.interrupt_status.clone(),
             irqfd.clone(),
-        )));
+            stats.clone(),
+        )
+        .map_err(Error::Simple)?;
 
         let block = Arc::new(Mutex::new(Block {
             virtio_cfg,
             mmio_cfg,
-            endpoint: args.common.event_mgr.remote_endpoint(),
+            endpoints,
             irq_ack_handler,
             vmm: args.common.vmm.clone(),
             irqfd,
-            file_path: args.file_path,
             read_only: args.read_only,
-            sub_id: None,
-            handler: None,
+            device_id: device_id(args.index),
+            image,
+            backend: args.backend,
+            coalesce: args.coalesce,
+            mem: args.common.mem,
+            direct_io: args.direct_io,
+            sub_ids: vec![],
+            stats,
+            queue_kicks: vec![],
             _root_device: args.root_device,
         }));
 
@@ -122,54 +183,64 @@ where
         Ok(block)
     }
 
-    fn _activate(&mut self) -> Result<()> {
-        if self.virtio_cfg.device_activated {
-            return Err(Error::AlreadyActivated);
-        }
-
-        // We do not support legacy drivers.
-        if self.virtio_cfg.driver_features & (1 << VIRTIO_F_VERSION_1) == 0 {
-            return Err(Error::BadFeatures(self.virtio_cfg.driver_features));
-        }
-
-        let ioeventfd = register_ioeventfd(&self.vmm, &self.mmio_cfg, 0).map_err(Error::Simple)?;
-
-        let file = OpenOptions::new()
-            .read(true)
-            .write(!self.read_only)
-            .open(&self.file_path)
-            .map_err(Error::OpenFile)?;
-
-        let mut features = self.virtio_cfg.driver_features;
-        if self.read_only {
-            // Not sure if the driver is expected to explicitly acknowledge the `RO` feature,
-            // so adding it explicitly here when present just in case.
-            features |= 1 << VIRTIO_BLK_F_RO;
-        }
+    /// The host-wide block cache used by this device, if any.
+    pub fn shared_cache(&self) -> Option<&SharedCache> {
+        self.image.shared_cache()
+    }
 
-        // TODO: Create the backend earlier (as part of `Block::new`)?
-        let disk = StdIoBackend::new(file, features)
-            .map_err(Error::Backend)?
-            .with_device_id(*b"vmsh0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0");
+    /// Connects queue `idx` to `ioeventfd` and registers its handler with the event manager
+    /// of the queue.
+    fn activate_queue(&mut self, idx: usize, ioeventfd: IoEventFd) -> Result<()> {
+        self.queue_kicks[idx] = Some(ioeventfd.try_clone().map_err(Error::EventFd)?);
 
         let driver_notify = SingleFdSignalQueue {
             irqfd: self.irqfd.clone(),
             interrupt_status: self.virtio_cfg.interrupt_status.clone(),
             ack_handler: self.irq_ack_handler.clone(),
         };
-
-        let inner = InOrderQueueHandler {
-            driver_notify,
-            queue: self.virtio_cfg.queues[0].clone(),
-            disk,
+        let queue = self.virtio_cfg.queues[idx].clone();
+        let stats = self.stats.clone();
+        let executor = SyncExecutor {
+            image: self.image.clone(),
+            direct_io: self.direct_io.clone(),
+            read_only: self.read_only,
+            device_id: self.device_id,
+        };
+        let coalescer = NotifyCoalescer::new(self.coalesce).map_err(Error::Simple)?;
+
+        let handler: Arc<Mutex<dyn MutEventSubscriber + Send>> = match self.backend {
+            BlockBackend::Std => {
+                let inner = InOrderQueueHandler {
+                    driver_notify,
+                    queue,
+                    executor,
+                    coalescer,
+                    stats: stats.clone(),
+                };
+
+                Arc::new(Mutex::new(QueueHandler {
+                    inner,
+                    ioeventfd,
+                    stats,
+                }))
+            }
+            BlockBackend::IoUring => Arc::new(Mutex::new(
+                IoUringQueueHandler::new(
+                    driver_notify,
+                    queue,
+                    self.mem.clone(),
+                    ioeventfd,
+                    stats,
+                    executor,
+                    coalescer,
+                )
+                .map_err(Error::IoUring)?,
+            )),
         };
-
-        let handler = Arc::new(Mutex::new(QueueHandler { inner, ioeventfd }));
 
         // Register the queue handler with the `EventManager`. We record the `sub_id`
         // (and/or keep a handler clone) to remove the subscriber when resetting the device
-        let sub_id = self
-            .endpoint
+        let sub_id = self.endpoints[idx]
             .call_blocking(move |mgr| -> EvmgrResult<SubscriberId> {
                 Ok(mgr.add_subscriber(handler))
             })
@@ -177,7 +248,49 @@ where
                 log::warn!("{}", e);
                 Error::Endpoint(e)
             })?;
-        self.sub_id = Some(sub_id);
+        self.sub_ids.push((idx, sub_id));
+        Ok(())
+    }
+
+    fn _activate(&mut self) -> Result<()> {
+        if self.virtio_cfg.device_activated {
+            return Err(Error::AlreadyActivated);
+        }
+
+        // We do not support legacy drivers.
+        if self.virtio_cfg.driver_features & (1 << VIRTIO_F_VERSION_1) == 0 {
+            return Err(Error::BadFeatures(self.virtio_cfg.driver_features));
+        }
+
+        let mut features = self.virtio_cfg.driver_features;
+        if self.read_only {
+            // Not sure if the driver is expected to explicitly acknowledge the `RO` feature,
+            // so adding it explicitly here when present just in case.
+            features |= 1 << VIRTIO_BLK_F_RO;
+        }
+
+        // Without VIRTIO_BLK_F_MQ the driver only uses the first queue. With it, the driver may
+        // still leave queues unused (i.e. if the guest has less cpus than we offer queues).
+        let num_queues = if features & (1 << VIRTIO_BLK_F_MQ) != 0 {
+            self.virtio_cfg.queues.len()
+        } else {
+            1
+        };
+        self.queue_kicks = (0..num_queues).map(|_| None).collect();
+
+        let mut ready = vec![];
+        for idx in 0..num_queues {
+            if !self.virtio_cfg.queues[idx].ready {
+                log::debug!("block queue {} is not used by the driver", idx);
+                continue;
+            }
+            ready.push(idx as u64);
+        }
+        let ioeventfds =
+            register_ioeventfds(&self.vmm, &self.mmio_cfg, &ready).map_err(Error::Simple)?;
+        for (idx, ioeventfd) in ready.into_iter().zip(ioeventfds) {
+            self.activate_queue(idx as usize, ioeventfd)?;
+        }
 
         log::debug!("activating device: ok");
         self.virtio_cfg.device_activated = true;
@@ -185,17 +298,18 @@ where
         Ok(())
     }
     fn _reset(&mut self) -> Result<()> {
-        // we remove the handler here, since we need to free up the ioeventfd resources
-        // in the mmio thread rather the eventmanager thread.
-        if let Some(sub_id) = self.sub_id.take() {
-            let handler = self
-                .endpoint
+        self.queue_kicks.clear();
+        // we remove the handlers here, since we need to free up the ioeventfd resources
+        // in the mmio thread rather the eventmanager threads. Dropping a handler unregisters
+        // its ioeventfd, so the next activation can register the queue again.
+        for (idx, sub_id) in self.sub_ids.split_off(0) {
+            let handler = self.endpoints[idx]
                 .call_blocking(move |mgr| mgr.remove_subscriber(sub_id))
                 .map_err(|e| {
                     log::warn!("{}", e);
                     Error::Endpoint(e)
                 })?;
-            self.handler = Some(handler);
+            drop(handler);
         }
         Ok(())
     }
@@ -241,14 +355,22 @@ impl<M: GuestAddressSpace + Clone + Send + 'static> VirtioDeviceActions for Bloc
     }
 }
 
-impl<M: GuestAddressSpace + Clone + Send + 'static> VirtioMmioDevice<M> for Block<M> {}
+impl<M: GuestAddressSpace + Clone + Send + 'static> VirtioMmioDevice<M> for Block<M> {
+    fn queue_notify(&mut self, val: u32) {
+        let kick = self.queue_kicks.get(val as usize).and_then(Option::as_ref);
+        kick_queue(kick, val);
+    }
+}
 
 impl<M: GuestAddressSpace + Clone + Send + 'static> MutDeviceMmio for Block<M> {
     fn mmio_read(&mut self, _base: MmioAddress, offset: u64, data: &mut [u8]) {
+        self.stats.mmio_exit(self.device_status(), offset);
         self.read(offset, data);
     }
 
     fn mmio_write(&mut self, _base: MmioAddress, offset: u64, data: &[u8]) {
+        self.stats.mmio_exit(self.device_status(), offset);
         self.write(offset, data);
+        mmio_written(&self.irq_ack_handler, offset);
     }
 }
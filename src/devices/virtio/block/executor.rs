@@ -0,0 +1,99 @@
+use std::cmp::min;
+use std::fmt::Debug;
+use std::sync::Arc;
+
+use log::warn;
+use virtio_blk::request::{Request, RequestType};
+use vm_memory::{Bytes, GuestAddress};
+
+use crate::devices::virtio::block::image::DiskImage;
+use crate::devices::virtio::block::request_range;
+use crate::devices::virtio::direct_io::DirectIo;
+
+// Status values as defined by the standard.
+pub const VIRTIO_BLK_S_OK: u8 = 0;
+pub const VIRTIO_BLK_S_IOERR: u8 = 1;
+pub const VIRTIO_BLK_S_UNSUPP: u8 = 2;
+
+// Length of the device id returned for GET_ID requests.
+pub const VIRTIO_BLK_ID_BYTES: usize = 20;
+
+/// The id of the `index`th block device of an attach: `vmsh<index>`. stage2 mounts `vmsh0`.
+pub fn device_id(index: usize) -> [u8; VIRTIO_BLK_ID_BYTES] {
+    let mut id = [0; VIRTIO_BLK_ID_BYTES];
+    let name = format!("vmsh{}", index);
+    let len = min(name.len(), VIRTIO_BLK_ID_BYTES);
+    id[..len].copy_from_slice(&name.as_bytes()[..len]);
+    id
+}
+
+/// Executes block requests one at a time against a `DiskImage`. Request data is moved between
+/// the image and guest memory with `DirectIo`.
+pub struct SyncExecutor {
+    pub image: Arc<DiskImage>,
+    pub direct_io: Arc<DirectIo>,
+    pub read_only: bool,
+    pub device_id: [u8; VIRTIO_BLK_ID_BYTES],
+}
+
+impl SyncExecutor {
+    /// Returns the status to report to the driver and the number of bytes written to guest
+    /// memory, including the status byte. The status byte itself is not written yet.
+    pub fn execute<B>(&self, mem: &B, request: &Request) -> (u8, u32)
+    where
+        B: Bytes<GuestAddress>,
+        B::E: Debug,
+    {
+        let res = match request.request_type() {
+            RequestType::In => request_range(request, self.image.size()).and_then(|offset| {
+                self.image
+                    .read(&self.direct_io, offset, request.data())
+                    .map(|len| len as u32)
+            }),
+            RequestType::Out if self.read_only => {
+                warn!("write to read-only block device");
+                return (VIRTIO_BLK_S_IOERR, 1);
+            }
+            RequestType::Out => request_range(request, self.image.size()).and_then(|offset| {
+                self.image
+                    .write(&self.direct_io, offset, request.data())
+                    .map(|_| 0)
+            }),
+            RequestType::Flush => self.image.flush().map(|_| 0),
+            RequestType::GetDeviceID => {
+                let (addr, len) = match request.data().first() {
+                    Some(segment) => *segment,
+                    None => return (VIRTIO_BLK_S_OK, 1),
+                };
+                let len = min(len as usize, VIRTIO_BLK_ID_BYTES);
+                if let Err(e) = mem.write_slice(&self.device_id[..len], addr) {
+                    warn!("cannot write block device id: {:?}", e);
+                    return (VIRTIO_BLK_S_IOERR, 1);
+                }
+                Ok(len as u32)
+            }
+            t => {
+                warn!("unsupported block request: {:?}", t);
+                return (VIRTIO_BLK_S_UNSUPP, 1);
+            }
+        };
+        match res {
+            Ok(len) => (VIRTIO_BLK_S_OK, len.saturating_add(1)),
+            Err(e) => {
+                warn!("failed to execute block request: {}", e);
+                (VIRTIO_BLK_S_IOERR, 1)
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_device_id() {
+        assert_eq!(&device_id(0), b"vmsh0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0");
+        assert_eq!(&device_id(12)[..7], b"vmsh12\0");
+    }
+}
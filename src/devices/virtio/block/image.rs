@@ -0,0 +1,355 @@
+use std::cmp::min;
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Mutex, MutexGuard};
+
+use simple_error::SimpleError;
+use vm_memory::GuestAddress;
+
+use crate::devices::virtio::direct_io::{segments_len, sub_segments, DirectIo};
+
+use super::remote::RemoteImage;
+use super::shared_cache::SharedCache;
+use super::{disk_size, Error, Result};
+
+/// Granularity of the overlay: writes smaller than this copy the rest of the block from the base.
+const OVERLAY_BLOCK_SIZE: u64 = 4096;
+/// Blocks share this many locks, see `Overlay::lock_fresh`.
+const OVERLAY_LOCKS: u64 = 64;
+
+/// Storage behind the block device.
+pub enum DiskImage {
+    /// Reads and writes go to the backing file.
+    Raw { file: File, size: u64 },
+    /// The base image is shared and only read, see `Overlay`.
+    Overlay(Overlay),
+    /// Fetched on demand from a server, read-only.
+    Remote(RemoteImage),
+    /// Read-only image whose blocks are cached in memory shared with other vmsh processes.
+    Cached {
+        image: Box<DiskImage>,
+        cache: SharedCache,
+    },
+}
+
+impl DiskImage {
+    pub fn raw(path: &Path, read_only: bool) -> Result<DiskImage> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(!read_only)
+            .open(path)
+            .map_err(Error::OpenFile)?;
+        let size = disk_size(&file)?;
+        Ok(DiskImage::Raw { file, size })
+    }
+
+    /// Size of the disk in bytes.
+    pub fn size(&self) -> u64 {
+        match self {
+            DiskImage::Raw { size, .. } => *size,
+            DiskImage::Overlay(o) => o.size,
+            DiskImage::Remote(r) => r.size(),
+            DiskImage::Cached { image, .. } => image.size(),
+        }
+    }
+
+    /// The file requests can be submitted to directly, if there is one.
+    pub fn raw_file(&self) -> Option<&File> {
+        match self {
+            DiskImage::Raw { file, .. } => Some(file),
+            _ => None,
+        }
+    }
+
+    /// The local file the image reads from, if any.
+    fn backing_file(&self) -> Option<&File> {
+        match self {
+            DiskImage::Raw { file, .. } => Some(file),
+            DiskImage::Cached { image, .. } => image.backing_file(),
+            DiskImage::Overlay(o) => o.base.backing_file(),
+            DiskImage::Remote(_) => None,
+        }
+    }
+
+    /// The shared cache in front of the image, if any.
+    pub fn shared_cache(&self) -> Option<&SharedCache> {
+        match self {
+            DiskImage::Cached { cache, .. } => Some(cache),
+            DiskImage::Overlay(o) => o.base.shared_cache(),
+            _ => None,
+        }
+    }
+
+    /// Fill `buf` from `offset`, for reads that do not go to the guest.
+    pub fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        match self {
+            DiskImage::Raw { file, .. } => file.read_exact_at(buf, offset),
+            DiskImage::Remote(r) => r.read_at(buf, offset),
+            DiskImage::Cached { image, cache } => cache.read_at(image, buf, offset),
+            DiskImage::Overlay(_) => Err(io::Error::new(
+                io::ErrorKind::Other,
+                "overlays cannot be stacked",
+            )),
+        }
+    }
+
+    /// Read from `offset` into the guest buffers. The range must be within `size()`.
+    pub fn read(
+        &self,
+        direct_io: &DirectIo,
+        offset: u64,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<usize> {
+        match self {
+            DiskImage::Raw { file, .. } => direct_io.read_file(file, offset, segments),
+            DiskImage::Overlay(o) => o.read(direct_io, offset, segments),
+            DiskImage::Remote(_) | DiskImage::Cached { .. } => {
+                let mut buf = vec![0; segments_len(segments)];
+                self.read_at(&mut buf, offset)?;
+                direct_io.write_guest(&buf, segments)?;
+                Ok(buf.len())
+            }
+        }
+    }
+
+    /// Write the guest buffers to `offset`. The range must be within `size()`.
+    pub fn write(
+        &self,
+        direct_io: &DirectIo,
+        offset: u64,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<usize> {
+        match self {
+            DiskImage::Raw { file, .. } => direct_io.write_file(file, offset, segments),
+            DiskImage::Overlay(o) => o.write(direct_io, offset, segments),
+            DiskImage::Remote(_) | DiskImage::Cached { .. } => Err(io::Error::new(
+                io::ErrorKind::PermissionDenied,
+                "image is read-only",
+            )),
+        }
+    }
+
+    pub fn flush(&self) -> io::Result<()> {
+        match self {
+            DiskImage::Raw { file, .. } => file.sync_data(),
+            DiskImage::Overlay(o) => o.delta.sync_data(),
+            DiskImage::Remote(_) | DiskImage::Cached { .. } => Ok(()),
+        }
+    }
+}
+
+/// Copy-on-write view of a read-only base image. Writes go to a sparse delta file of the same
+/// size, and a bitmap records which blocks have been written to the delta since attaching.
+/// Neither attaching nor the bitmap (one bit per 4KiB) need to touch the base image, so many
+/// sessions can share one base without copying it.
+pub struct Overlay {
+    base: Box<DiskImage>,
+    delta: File,
+    size: u64,
+    written: Vec<AtomicU64>,
+    // serializes copying blocks from the base to the delta with writes to the same blocks,
+    // block `b` is protected by `locks[b % OVERLAY_LOCKS]`
+    locks: Vec<Mutex<()>>,
+}
+
+impl Overlay {
+    /// Stacks on `base`, which should be opened read-only, and creates `delta`. An existing
+    /// `delta` is only reused with `replace`, its content is discarded since the bitmap does not
+    /// outlive the session. `delta` must never be the file of `base`.
+    pub fn new(base: DiskImage, delta_path: &Path, replace: bool) -> Result<Overlay> {
+        let size = base.size();
+        let mut options = OpenOptions::new();
+        options.read(true).write(true);
+        if replace {
+            options.create(true);
+        } else {
+            options.create_new(true);
+        }
+        // not truncated before we know it is not the base
+        let delta = options.open(delta_path).map_err(Error::OpenFile)?;
+        if let Some(file) = base.backing_file() {
+            let (a, b) = (
+                file.metadata().map_err(Error::OpenFile)?,
+                delta.metadata().map_err(Error::OpenFile)?,
+            );
+            if (a.dev(), a.ino()) == (b.dev(), b.ino()) {
+                return Err(Error::Simple(SimpleError::new(format!(
+                    "overlay {} is the backing file",
+                    delta_path.display()
+                ))));
+            }
+        }
+        delta.set_len(0).map_err(Error::OpenFile)?;
+        // sparse: no disk space is used until the guest writes
+        delta.set_len(size).map_err(Error::OpenFile)?;
+
+        let blocks = (size + OVERLAY_BLOCK_SIZE - 1) / OVERLAY_BLOCK_SIZE;
+        let written = (0..(blocks + 63) / 64).map(|_| AtomicU64::new(0)).collect();
+        Ok(Overlay {
+            base: Box::new(base),
+            delta,
+            size,
+            written,
+            locks: (0..OVERLAY_LOCKS).map(|_| Mutex::new(())).collect(),
+        })
+    }
+
+    fn is_written(&self, block: u64) -> bool {
+        let word = self.written[(block / 64) as usize].load(Ordering::Acquire);
+        word & (1 << (block % 64)) != 0
+    }
+
+    fn set_written(&self, block: u64) {
+        self.written[(block / 64) as usize].fetch_or(1 << (block % 64), Ordering::Release);
+    }
+
+    /// Lock the blocks `first..=last` that are not in the delta yet. Blocks in the delta stay
+    /// there, so writes to them need no lock.
+    fn lock_fresh(&self, first: u64, last: u64) -> io::Result<Vec<MutexGuard<()>>> {
+        let mut locks = (first..=last)
+            .filter(|block| !self.is_written(*block))
+            .map(|block| (block % OVERLAY_LOCKS) as usize)
+            .collect::<Vec<_>>();
+        // always lock in the same order
+        locks.sort_unstable();
+        locks.dedup();
+        locks
+            .into_iter()
+            .map(|idx| {
+                self.locks[idx]
+                    .lock()
+                    .map_err(|_| io::Error::new(io::ErrorKind::Other, "overlay lock poisoned"))
+            })
+            .collect()
+    }
+
+    /// Copy `block` from the base to the delta unless it is already there. The caller holds the
+    /// lock of the block.
+    fn copy_up(&self, block: u64) -> io::Result<()> {
+        if self.is_written(block) {
+            return Ok(());
+        }
+        let start = block * OVERLAY_BLOCK_SIZE;
+        let mut buf = vec![0; min(OVERLAY_BLOCK_SIZE, self.size - start) as usize];
+        self.base.read_at(&mut buf, start)?;
+        self.delta.write_all_at(&buf, start)?;
+        self.set_written(block);
+        Ok(())
+    }
+
+    fn read(
+        &self,
+        direct_io: &DirectIo,
+        offset: u64,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<usize> {
+        let len = segments_len(segments) as u64;
+        let mut pos = 0;
+        // read runs of blocks that are all in the base or all in the delta at once
+        while pos < len {
+            let in_delta = self.is_written((offset + pos) / OVERLAY_BLOCK_SIZE);
+            let mut end = pos;
+            while end < len && self.is_written((offset + end) / OVERLAY_BLOCK_SIZE) == in_delta {
+                let next_block = ((offset + end) / OVERLAY_BLOCK_SIZE + 1) * OVERLAY_BLOCK_SIZE;
+                end = min(len, next_block - offset);
+            }
+            let run = sub_segments(segments, pos as usize, (end - pos) as usize);
+            if in_delta {
+                direct_io.read_file(&self.delta, offset + pos, &run)?;
+            } else {
+                self.base.read(direct_io, offset + pos, &run)?;
+            }
+            pos = end;
+        }
+        Ok(len as usize)
+    }
+
+    fn write(
+        &self,
+        direct_io: &DirectIo,
+        offset: u64,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<usize> {
+        let len = segments_len(segments) as u64;
+        if len == 0 {
+            return Ok(0);
+        }
+        let first = offset / OVERLAY_BLOCK_SIZE;
+        let last = (offset + len - 1) / OVERLAY_BLOCK_SIZE;
+        // Otherwise a concurrent partial write could copy up one of the blocks after our write
+        // and replace it with data of the base.
+        let _locks = self.lock_fresh(first, last)?;
+        // only the first and the last block can be partially overwritten
+        if offset % OVERLAY_BLOCK_SIZE != 0 {
+            self.copy_up(first)?;
+        }
+        let end = offset + len;
+        if end % OVERLAY_BLOCK_SIZE != 0 && end != self.size {
+            self.copy_up(last)?;
+        }
+        let written = direct_io.write_file(&self.delta, offset, segments)?;
+        for block in first..=last {
+            self.set_written(block);
+        }
+        Ok(written)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::Write;
+    use vmm_sys_util::tempfile::TempFile;
+
+    use super::*;
+
+    fn segment(buf: &mut [u8]) -> [(GuestAddress, u32); 1] {
+        [(GuestAddress(buf.as_mut_ptr() as u64), buf.len() as u32)]
+    }
+
+    #[test]
+    fn test_overlay() {
+        let block = OVERLAY_BLOCK_SIZE as usize;
+        let base = TempFile::new().unwrap();
+        for i in 1..=3u8 {
+            base.as_file().write_all(&vec![i; block]).unwrap();
+        }
+        let delta = TempFile::new().unwrap();
+        let open = |path: &Path, replace| {
+            Overlay::new(DiskImage::raw(base.as_path(), true).unwrap(), path, replace)
+        };
+        // neither the base nor an existing file without replace is (re-)used
+        assert!(open(base.as_path(), true).is_err());
+        assert_eq!(base.as_file().metadata().unwrap().len(), 3 * block as u64);
+        assert!(open(delta.as_path(), false).is_err());
+        let overlay = open(delta.as_path(), true).unwrap();
+        let direct_io = DirectIo::identity();
+
+        // partial write in the middle block
+        let mut data = vec![0xffu8; 512];
+        let offset = (block + 512) as u64;
+        assert_eq!(
+            overlay
+                .write(&direct_io, offset, &segment(&mut data))
+                .unwrap(),
+            512
+        );
+
+        let mut disk = vec![0u8; 3 * block];
+        overlay.read(&direct_io, 0, &segment(&mut disk)).unwrap();
+        assert!(disk[..block].iter().all(|b| *b == 1));
+        assert!(disk[block..block + 512].iter().all(|b| *b == 2));
+        assert!(disk[block + 512..block + 1024].iter().all(|b| *b == 0xff));
+        assert!(disk[block + 1024..2 * block].iter().all(|b| *b == 2));
+        assert!(disk[2 * block..].iter().all(|b| *b == 3));
+
+        // the base stays untouched
+        let mut base_block = vec![0u8; block];
+        base.as_file()
+            .read_exact_at(&mut base_block, block as u64)
+            .unwrap();
+        assert!(base_block.iter().all(|b| *b == 2));
+    }
+}
@@ -2,16 +2,17 @@
 // Author of further modifications: Peter Okelmann
 // SPDX-License-Identifier: Apache-2.0 OR BSD-3-Clause
 
-use std::fs::File;
 use std::result;
+use std::sync::Arc;
 
 use log::warn;
 use virtio_blk::request::Request;
-use virtio_blk::stdio_executor::{self, StdIoBackend};
 use virtio_queue::{DescriptorChain, Queue};
 use vm_memory::{self, Bytes, GuestAddressSpace};
 
-use crate::devices::virtio::SignalUsedQueue;
+use crate::devices::virtio::block::executor::SyncExecutor;
+use crate::devices::virtio::direct_io::segments_len;
+use crate::devices::virtio::{DeviceStats, NotifyCoalescer, SignalUsedQueue};
 
 #[derive(Debug)]
 pub enum Error {
@@ -32,14 +33,16 @@ impl From<virtio_queue::Error> for Error {
 }
 
 // This object is used to process the queue of a block device without making any assumptions
-// about the notification mechanism. We're using a specific backend for now (the `StdIoBackend`
-// object), but the aim is to have a way of working with generic backends and turn this into
-// a more flexible building block. The name comes from processing and returning descriptor
-// chains back to the device in the same order they are received.
+// about the notification mechanism. Requests are executed one after the other by a
+// `SyncExecutor`. The name comes from processing and returning descriptor chains back to the
+// device in the same order they are received. The driver is notified once per drained queue,
+// or less often as permitted by `coalescer`.
 pub struct InOrderQueueHandler<M: GuestAddressSpace, S: SignalUsedQueue> {
     pub driver_notify: S,
     pub queue: Queue<M>,
-    pub disk: StdIoBackend<File>,
+    pub executor: SyncExecutor,
+    pub coalescer: NotifyCoalescer,
+    pub stats: Arc<DeviceStats>,
 }
 
 impl<M, S> InOrderQueueHandler<M, S>
@@ -54,31 +57,11 @@ where
         match Request::parse(&mut chain) {
             Ok(request) => {
                 log::trace!("request: {:?}", request);
-                let status = match self.disk.execute(chain.memory(), &request) {
-                    Ok(l) => {
-                        // TODO: Using `saturating_add` until we consume the recent changes
-                        // proposed for the executor upstream.
-                        len = l.saturating_add(1);
-                        // VIRTIO_BLK_S_OK defined as 0 in the standard.
-                        0
-                    }
-                    Err(e) => {
-                        warn!("failed to execute block request: {:?}", e);
-                        len = 1;
-                        // TODO: add `status` or similar method to executor error.
-                        if let stdio_executor::Error::Unsupported(_) = e {
-                            // UNSUPP
-                            2
-                        } else {
-                            // IOERR
-                            1
-                        }
-                    }
-                };
-
-                chain
-                    .memory()
-                    .write_obj(status as u8, request.status_addr())?;
+                self.stats.request(segments_len(request.data()));
+                let (status, l) = self.executor.execute(chain.memory(), &request);
+                len = l;
+
+                chain.memory().write_obj(status, request.status_addr())?;
             }
             Err(e) => {
                 len = 0;
@@ -88,18 +71,12 @@ where
 
         self.queue.add_used(chain.head_index(), len)?;
 
-        if self.queue.needs_notification()? {
-            log::trace!("notification needed: yes");
-            self.driver_notify.signal_used_queue(0);
-        } else {
-            log::trace!("notification needed: no");
-        }
-
         log::trace!("process_chain done");
         Ok(())
     }
 
     pub fn process_queue(&mut self) -> result::Result<(), Error> {
+        let mut completed = 0;
         // To see why this is done in a loop, please look at the `Queue::enable_notification`
         // comments in `vm_virtio`.
         loop {
@@ -107,6 +84,7 @@ where
 
             while let Some(chain) = self.queue.iter()?.next() {
                 self.process_chain(chain)?;
+                completed += 1;
             }
 
             if !self.queue.enable_notification()? {
@@ -114,9 +92,33 @@ where
             }
         }
 
+        if completed > 0 {
+            self.stats.queue_depth.record(completed as u64);
+        }
+        if completed > 0 && self.coalescer.completed(completed) {
+            self.notify_driver()?;
+        }
+        Ok(())
+    }
+
+    /// The coalescing timer fired.
+    pub fn coalescing_expired(&mut self) -> result::Result<(), Error> {
+        if self.coalescer.expired() {
+            self.notify_driver()?;
+        }
+        Ok(())
+    }
+
+    fn notify_driver(&mut self) -> result::Result<(), Error> {
+        self.coalescer.notified();
+        if self.queue.needs_notification()? {
+            log::trace!("notification needed: yes");
+            self.driver_notify.signal_used_queue(0);
+        } else {
+            log::trace!("notification needed: no");
+        }
         Ok(())
     }
 }
 
-// TODO: Figure out which unit tests make sense to add after implementing a generic backend
-// abstraction for `InOrderHandler`.
+// TODO: Figure out which unit tests make sense to add for `InOrderHandler`.
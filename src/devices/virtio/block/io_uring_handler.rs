@@ -0,0 +1,454 @@
+use std::collections::HashMap;
+use std::io;
+use std::os::unix::io::AsRawFd;
+use std::result;
+use std::sync::Arc;
+
+use event_manager::{EventOps, EventSet, Events, MutEventSubscriber};
+use libc::iovec;
+use log::{error, warn};
+use virtio_blk::request::{Request, RequestType};
+use virtio_queue::{DescriptorChain, Queue};
+use vm_memory::{self, Bytes, GuestAddress, GuestAddressSpace};
+use vmm_sys_util::eventfd::{EventFd, EFD_NONBLOCK};
+
+use crate::devices::virtio::block::executor::{SyncExecutor, VIRTIO_BLK_S_IOERR, VIRTIO_BLK_S_OK};
+use crate::devices::virtio::block::request_range;
+use crate::devices::virtio::block::uring::{Entry, Ring};
+use crate::devices::virtio::direct_io::segments_len;
+use crate::devices::virtio::{DeviceStats, NotifyCoalescer, SignalUsedQueue, QUEUE_MAX_SIZE};
+use crate::kvm::hypervisor::IoEventFd;
+
+const IOEVENT_DATA: u32 = 0;
+const COMPLETION_DATA: u32 = 1;
+const COALESCING_DATA: u32 = 2;
+
+#[derive(Debug)]
+pub enum Error {
+    GuestMemory(vm_memory::GuestMemoryError),
+    Queue(virtio_queue::Error),
+    Io(io::Error),
+}
+
+impl From<vm_memory::GuestMemoryError> for Error {
+    fn from(e: vm_memory::GuestMemoryError) -> Self {
+        Error::GuestMemory(e)
+    }
+}
+
+impl From<virtio_queue::Error> for Error {
+    fn from(e: virtio_queue::Error) -> Self {
+        Error::Queue(e)
+    }
+}
+
+impl From<io::Error> for Error {
+    fn from(e: io::Error) -> Self {
+        Error::Io(e)
+    }
+}
+
+/// A request submitted to the ring but not completed yet.
+struct InFlight {
+    head_index: u16,
+    request_type: RequestType,
+    status_addr: GuestAddress,
+    data: Vec<(GuestAddress, u32)>,
+    /// bytes to be transferred
+    len: usize,
+    // Either iovecs pointing into guest memory we share with the hypervisor, or a bounce
+    // buffer that is copied from/to the guest with one syscall. Must not be freed before the
+    // request completed.
+    iovecs: Vec<iovec>,
+    buf: Vec<u8>,
+}
+
+// The iovecs point either into `buf` or into guest memory mapped by `DirectIo`.
+unsafe impl Send for InFlight {}
+
+/// Executes the requests of a block queue with io_uring. All chains found in the queue are
+/// submitted as one batch and completed in whatever order the kernel finishes them, so the
+/// device must not offer VIRTIO_F_IN_ORDER when using this handler. Requests that do not need
+/// the disk, and all requests to images that are not a single file the ring could operate on
+/// (overlays, remote images), are executed synchronously by `executor`.
+pub(crate) struct IoUringQueueHandler<M: GuestAddressSpace, S: SignalUsedQueue> {
+    pub driver_notify: S,
+    pub queue: Queue<M>,
+    pub mem: M,
+    pub ioeventfd: IoEventFd,
+    pub stats: Arc<DeviceStats>,
+    executor: SyncExecutor,
+    coalescer: NotifyCoalescer,
+    ring: Ring,
+    // Signalled by the kernel whenever a completion is posted to the ring.
+    completion_fd: EventFd,
+    in_flight: HashMap<u64, InFlight>,
+    next_user_data: u64,
+}
+
+impl<M, S> IoUringQueueHandler<M, S>
+where
+    M: GuestAddressSpace,
+    S: SignalUsedQueue,
+{
+    pub fn new(
+        driver_notify: S,
+        queue: Queue<M>,
+        mem: M,
+        ioeventfd: IoEventFd,
+        stats: Arc<DeviceStats>,
+        executor: SyncExecutor,
+        coalescer: NotifyCoalescer,
+    ) -> result::Result<Self, Error> {
+        // The queue cannot hold more chains than this, so submissions never overflow the ring.
+        let ring = Ring::new(QUEUE_MAX_SIZE as u32)?;
+        let completion_fd = EventFd::new(EFD_NONBLOCK)?;
+        ring.register_eventfd(completion_fd.as_raw_fd())?;
+
+        Ok(IoUringQueueHandler {
+            driver_notify,
+            queue,
+            mem,
+            ioeventfd,
+            stats,
+            executor,
+            coalescer,
+            ring,
+            completion_fd,
+            in_flight: HashMap::new(),
+            next_user_data: 0,
+        })
+    }
+
+    /// Answer a request right away, i.e. if it does not need the disk.
+    fn complete_now(&mut self, head_index: u16, status_addr: GuestAddress, status: u8, len: u32) {
+        let mem = self.mem.memory();
+        if let Err(e) = mem.write_obj(status, status_addr) {
+            warn!("cannot write block request status: {:?}", e);
+        }
+        if let Err(e) = self.queue.add_used(head_index, len) {
+            warn!("cannot add used block request: {:?}", e);
+        }
+    }
+
+    /// Execute a request without the ring.
+    fn execute_sync(&mut self, head_index: u16, request: &Request) {
+        let (status, len) = self.executor.execute(&*self.mem.memory(), request);
+        self.complete_now(head_index, request.status_addr(), status, len);
+    }
+
+    /// Turn a descriptor chain into a submission entry or answer it directly.
+    fn submit_chain(&mut self, mut chain: DescriptorChain<M>) -> result::Result<(), Error> {
+        let head_index = chain.head_index();
+        let request = match Request::parse(&mut chain) {
+            Ok(r) => r,
+            Err(e) => {
+                warn!("block request parse error: {:?}", e);
+                self.queue.add_used(head_index, 0)?;
+                return Ok(());
+            }
+        };
+        log::trace!("request: {:?}", request);
+
+        let len = segments_len(request.data());
+        self.stats.request(len);
+        let mut iovecs = vec![];
+        let mut buf = vec![];
+
+        let fd = match self.executor.image.raw_file() {
+            Some(file) => file.as_raw_fd(),
+            None => {
+                self.execute_sync(head_index, &request);
+                return Ok(());
+            }
+        };
+        let entry = match request.request_type() {
+            RequestType::In | RequestType::Out => {
+                let write = matches!(request.request_type(), RequestType::Out);
+                if write && self.executor.read_only {
+                    warn!("write to read-only block device");
+                    self.complete_now(head_index, request.status_addr(), VIRTIO_BLK_S_IOERR, 1);
+                    return Ok(());
+                }
+                let offset = match request_range(&request, self.executor.image.size()) {
+                    Ok(offset) => offset,
+                    Err(e) => {
+                        warn!("{}", e);
+                        self.complete_now(head_index, request.status_addr(), VIRTIO_BLK_S_IOERR, 1);
+                        return Ok(());
+                    }
+                };
+                match self.executor.direct_io.local_iovecs(request.data()) {
+                    Some(local) => iovecs = local,
+                    None => {
+                        buf.resize(len, 0);
+                        if write {
+                            if let Err(e) =
+                                self.executor.direct_io.read_guest(&mut buf, request.data())
+                            {
+                                warn!("cannot read block request data: {}", e);
+                                self.complete_now(
+                                    head_index,
+                                    request.status_addr(),
+                                    VIRTIO_BLK_S_IOERR,
+                                    1,
+                                );
+                                return Ok(());
+                            }
+                        }
+                        iovecs.push(iovec {
+                            iov_base: buf.as_mut_ptr() as *mut libc::c_void,
+                            iov_len: buf.len(),
+                        });
+                    }
+                }
+                if write {
+                    Entry::writev(fd, iovecs.as_ptr(), iovecs.len() as u32, offset)
+                } else {
+                    Entry::readv(fd, iovecs.as_ptr(), iovecs.len() as u32, offset)
+                }
+            }
+            RequestType::Flush => Entry::fsync(fd),
+            _ => {
+                self.execute_sync(head_index, &request);
+                return Ok(());
+            }
+        };
+
+        let user_data = self.next_user_data;
+        self.next_user_data = self.next_user_data.wrapping_add(1);
+        let entry = entry.user_data(user_data);
+        // Safe because iovecs and buffer are kept alive in `in_flight` until the request
+        // completed.
+        if !unsafe { self.ring.push(&entry) } {
+            // cannot happen as long as the ring is as large as the queue, but be safe.
+            self.ring.submit()?;
+            if !unsafe { self.ring.push(&entry) } {
+                error!("io_uring submission queue is full");
+                self.complete_now(head_index, request.status_addr(), VIRTIO_BLK_S_IOERR, 1);
+                return Ok(());
+            }
+        }
+        self.in_flight.insert(
+            user_data,
+            InFlight {
+                head_index,
+                request_type: request.request_type(),
+                status_addr: request.status_addr(),
+                data: request.data().to_vec(),
+                len,
+                iovecs,
+                buf,
+            },
+        );
+        Ok(())
+    }
+
+    /// Submit all chains currently available in the queue.
+    pub fn process_queue(&mut self) -> result::Result<(), Error> {
+        let submitted_before = self.in_flight.len();
+        let mut answered = 0;
+        let mut found = 0;
+        // To see why this is done in a loop, please look at the `Queue::enable_notification`
+        // comments in `vm_virtio`.
+        loop {
+            self.queue.disable_notification()?;
+
+            while let Some(chain) = self.queue.iter()?.next() {
+                found += 1;
+                let in_flight = self.in_flight.len();
+                self.submit_chain(chain)?;
+                if self.in_flight.len() == in_flight {
+                    answered += 1;
+                }
+            }
+
+            if !self.queue.enable_notification()? {
+                break;
+            }
+        }
+        if found > 0 {
+            self.stats.queue_depth.record(found);
+        }
+        if self.in_flight.len() != submitted_before {
+            self.ring.submit()?;
+        }
+        if answered > 0 && self.coalescer.completed(answered) {
+            self.notify_driver()?;
+        }
+        Ok(())
+    }
+
+    /// Write back the results of all requests the kernel has completed so far.
+    pub fn process_completions(&mut self) -> result::Result<(), Error> {
+        let completions = self.ring.completions();
+        if completions.is_empty() {
+            return Ok(());
+        }
+
+        let completed = completions.len() as u32;
+        let mem = self.mem.memory();
+        // the completions are gone from the ring, so answer all of them before failing
+        let mut first_err = None;
+        for (user_data, res) in completions {
+            let req = match self.in_flight.remove(&user_data) {
+                Some(req) => req,
+                None => {
+                    warn!("io_uring completion for unknown request {}", user_data);
+                    continue;
+                }
+            };
+            let mut len = 1;
+            let status = if res < 0 {
+                warn!(
+                    "failed to execute block request: {}",
+                    io::Error::from_raw_os_error(-res)
+                );
+                VIRTIO_BLK_S_IOERR
+            } else if matches!(req.request_type, RequestType::Flush) {
+                VIRTIO_BLK_S_OK
+            } else if req.len != res as usize {
+                warn!("short block request: {} of {} bytes", res, req.len);
+                VIRTIO_BLK_S_IOERR
+            } else if let RequestType::In = req.request_type {
+                // with a bounce buffer, the data still needs to reach the guest
+                match if req.buf.is_empty() {
+                    Ok(())
+                } else {
+                    self.executor.direct_io.write_guest(&req.buf, &req.data)
+                } {
+                    Ok(()) => {
+                        len += req.len as u32;
+                        VIRTIO_BLK_S_OK
+                    }
+                    Err(e) => {
+                        warn!("cannot write block request data: {}", e);
+                        VIRTIO_BLK_S_IOERR
+                    }
+                }
+            } else {
+                VIRTIO_BLK_S_OK
+            };
+            let written = mem.write_obj(status, req.status_addr).map_err(Error::from);
+            let used = self
+                .queue
+                .add_used(req.head_index, len)
+                .map_err(Error::from);
+            if let Err(e) = written.and(used) {
+                first_err.get_or_insert(e);
+            }
+        }
+        drop(mem);
+        if self.coalescer.completed(completed) {
+            self.notify_driver()?;
+        }
+        match first_err {
+            Some(e) => Err(e),
+            None => Ok(()),
+        }
+    }
+
+    fn notify_driver(&mut self) -> result::Result<(), Error> {
+        self.coalescer.notified();
+        if self.queue.needs_notification()? {
+            log::trace!("notification needed: yes");
+            self.driver_notify.signal_used_queue(0);
+        } else {
+            log::trace!("notification needed: no");
+        }
+        Ok(())
+    }
+}
+
+impl<M, S> Drop for IoUringQueueHandler<M, S>
+where
+    M: GuestAddressSpace,
+    S: SignalUsedQueue,
+{
+    fn drop(&mut self) {
+        // The kernel may still write into our bounce buffers.
+        while !self.in_flight.is_empty() {
+            if let Err(e) = self.ring.submit_and_wait(1) {
+                error!("cannot wait for io_uring requests: {}", e);
+                // leak the buffers instead of handing freed memory to the kernel
+                std::mem::forget(std::mem::take(&mut self.in_flight));
+                return;
+            }
+            for (user_data, _) in self.ring.completions() {
+                self.in_flight.remove(&user_data);
+            }
+        }
+    }
+}
+
+impl<M, S> MutEventSubscriber for IoUringQueueHandler<M, S>
+where
+    M: GuestAddressSpace,
+    S: SignalUsedQueue,
+{
+    fn process(&mut self, events: Events, ops: &mut EventOps) {
+        let res = if events.event_set() != EventSet::IN {
+            error!("unexpected event_set");
+            Err(())
+        } else {
+            match events.data() {
+                IOEVENT_DATA => match self.ioeventfd.read() {
+                    Ok(_) => {
+                        self.stats.ioeventfd_notify();
+                        self.process_queue().map_err(|e| {
+                            error!("error processing block queue {:?}", e);
+                        })
+                    }
+                    Err(e) => {
+                        error!("ioeventfd read error: {}", e);
+                        Err(())
+                    }
+                },
+                COMPLETION_DATA => {
+                    // the counter only wakes us up, completions are read from the ring.
+                    let _ = self.completion_fd.read();
+                    self.process_completions().map_err(|e| {
+                        error!("error completing block requests {:?}", e);
+                    })
+                }
+                COALESCING_DATA => {
+                    if self.coalescer.expired() {
+                        self.notify_driver().map_err(|e| {
+                            error!("error notifying block queue {:?}", e);
+                        })
+                    } else {
+                        Ok(())
+                    }
+                }
+                data => {
+                    error!("unexpected events data {}", data);
+                    Err(())
+                }
+            }
+        };
+
+        if res.is_err() {
+            ops.remove(events)
+                .expect("Failed to remove fd from event handling loop");
+        }
+    }
+
+    fn init(&mut self, ops: &mut EventOps) {
+        ops.add(Events::with_data(
+            &self.ioeventfd,
+            IOEVENT_DATA,
+            EventSet::IN,
+        ))
+        .expect("Failed to init block queue handler");
+        ops.add(Events::with_data(
+            &self.completion_fd,
+            COMPLETION_DATA,
+            EventSet::IN,
+        ))
+        .expect("Failed to register io_uring completions for block queue handler");
+        if let Some(timer) = self.coalescer.timer() {
+            ops.add(Events::with_data(timer, COALESCING_DATA, EventSet::IN))
+                .expect("Failed to register coalescing timer for block queue handler");
+        }
+    }
+}
@@ -3,19 +3,27 @@
 // SPDX-License-Identifier: Apache-2.0 OR BSD-3-Clause
 
 mod device;
+mod executor;
+mod image;
 mod inorder_handler;
+mod io_uring_handler;
 mod queue_handler;
+mod remote;
+mod shared_cache;
+mod uring;
 
 use std::fs::File;
 use std::io::{self, Seek, SeekFrom};
-use std::path::{Path, PathBuf};
+use std::path::PathBuf;
+use std::sync::Arc;
 
 use event_manager::Error as EvmgrError;
-use virtio_blk::stdio_executor;
+use virtio_blk::request::Request;
 use vm_device::bus;
 use vmm_sys_util::errno;
 
-use crate::devices::virtio::CommonArgs;
+use crate::devices::virtio::direct_io::{segments_len, DirectIo};
+use crate::devices::virtio::{Coalescing, CommonArgs, SubscriberEndpoint};
 use simple_error::SimpleError;
 
 pub use device::Block;
@@ -29,6 +37,11 @@ pub const BLOCK_DEVICE_ID: u32 = 2;
 pub const VIRTIO_BLK_F_RO: u64 = 5;
 // Block device FLUSH feature.
 pub const VIRTIO_BLK_F_FLUSH: u64 = 9;
+// Block device multi-queue feature.
+pub const VIRTIO_BLK_F_MQ: u64 = 12;
+
+// Offset of `num_queues` in `struct virtio_blk_config`.
+const CONFIG_NUM_QUEUES_OFFSET: usize = 34;
 
 // The sector size is 512 bytes (1 << 9).
 const SECTOR_SHIFT: u8 = 9;
@@ -36,11 +49,11 @@ const SECTOR_SHIFT: u8 = 9;
 #[derive(Debug)]
 pub enum Error {
     AlreadyActivated,
-    Backend(stdio_executor::Error),
     BadFeatures(u64),
     Bus(bus::Error),
     Endpoint(EvmgrError),
     EventFd(io::Error),
+    IoUring(io_uring_handler::Error),
     OpenFile(io::Error),
     #[allow(dead_code)] // FIXME
     QueuesNotValid,
@@ -56,19 +69,55 @@ pub type Result<T> = std::result::Result<T, Error>;
 
 // TODO: Add a helper abstraction to rust-vmm for building the device configuration space.
 // The one we build below for the block device contains the minimally required `capacity` member,
-// but other fields can be present as well depending on the negotiated features.
-fn build_config_space<P: AsRef<Path>>(path: P) -> Result<Vec<u8>> {
-    // TODO: right now, the file size is computed by the StdioBackend as well. Maybe we should
-    // create the backend as early as possible, and get the size information from there.
-    let file_size = File::open(path)
-        .map_err(Error::OpenFile)?
-        .seek(SeekFrom::End(0))
-        .map_err(Error::Seek)?;
+// and `num_queues` if the device has more than one queue (VIRTIO_BLK_F_MQ). The fields in
+// between belong to features we do not offer and are left zeroed.
+fn build_config_space(disk_size: u64, num_queues: u16) -> Vec<u8> {
+    let num_sectors = disk_size >> SECTOR_SHIFT;
+    // This has to be in little endian btw.
+    let mut config_space = num_sectors.to_le_bytes().to_vec();
+    if num_queues > 1 {
+        config_space.resize(CONFIG_NUM_QUEUES_OFFSET, 0);
+        config_space.extend_from_slice(&num_queues.to_le_bytes());
+    }
+    config_space
+}
+
+/// How the block device executes guest requests.
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum BlockBackend {
+    /// Synchronous reads and writes, one request after the other.
+    Std,
+    /// Batched submission and out-of-order completion with io_uring.
+    IoUring,
+}
+
+/// Usable size of a backing file (or block device) in bytes.
+fn disk_size(file: &File) -> Result<u64> {
+    let mut file = file;
+    let file_size = file.seek(SeekFrom::End(0)).map_err(Error::Seek)?;
     // If the file size is actually not a multiple of sector size, then data at the very end
     // will be ignored.
-    let num_sectors = file_size >> SECTOR_SHIFT;
-    // This has to be in little endian btw.
-    Ok(num_sectors.to_le_bytes().to_vec())
+    Ok(file_size >> SECTOR_SHIFT << SECTOR_SHIFT)
+}
+
+/// Returns the file offset of a read or write request after checking that it does not go
+/// beyond the end of the disk.
+fn request_range(request: &Request, disk_size: u64) -> io::Result<u64> {
+    let len = segments_len(request.data()) as u64;
+    request
+        .sector()
+        .checked_mul(1 << SECTOR_SHIFT)
+        .filter(|offset| {
+            offset
+                .checked_add(len)
+                .map_or(false, |end| end <= disk_size)
+        })
+        .ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "block request beyond the end of the disk",
+            )
+        })
 }
 
 // Arguments required when building a block device.
@@ -77,7 +126,27 @@ pub struct BlockArgs<'a, M, B> {
     pub file_path: PathBuf,
     pub read_only: bool,
     pub root_device: bool,
+    // Reported as serial `vmsh<index>` to the guest.
+    pub index: usize,
     pub advertise_flush: bool,
+    // Serve `file_path` read-only and redirect writes to this (sparse) file.
+    pub overlay: Option<PathBuf>,
+    // Reuse an existing `overlay` file instead of failing.
+    pub overlay_replace: bool,
+    // Fetch the image on demand from this url instead of reading `file_path`.
+    pub backing_url: Option<String>,
+    // Where chunks of `backing_url` are cached.
+    pub cache_dir: PathBuf,
+    // Size of the host-wide cache for read-only backing files in MiB, 0 to disable it.
+    pub shared_cache_mb: u64,
+    pub backend: BlockBackend,
+    // How long queue handlers may delay notifying the driver about completed requests.
+    pub coalesce: Coalescing,
+    // Used to move request data between the backing file and guest memory.
+    pub direct_io: Arc<DirectIo>,
+    // Event managers for the queues beyond the first one, each one run by a thread of its own.
+    // The device offers 1 + `queue_endpoints.len()` queues; queue 0 uses `common.event_mgr`.
+    pub queue_endpoints: Vec<SubscriberEndpoint>,
 }
 
 #[cfg(test)]
@@ -101,7 +170,7 @@ mod tests {
         }
 
         {
-            let config_space = build_config_space(tmp.as_path()).unwrap();
+            let config_space = build_config_space(disk_size(tmp.as_file()).unwrap(), 1);
 
             // The config space is only populated with the `capacity` field for now.
             assert_eq!(config_space.len(), size_of::<u64>());
@@ -113,9 +182,23 @@ mod tests {
         tmp.as_file().write_all(&[1u8, 2, 3]).unwrap();
 
         {
-            let config_space = build_config_space(tmp.as_path()).unwrap();
+            let config_space = build_config_space(disk_size(tmp.as_file()).unwrap(), 1);
             // We should get the same value of capacity, as the extra bytes are ignored.
             assert_eq!(config_space[..8], num_sectors.to_le_bytes());
         }
+
+        {
+            let config_space = build_config_space(disk_size(tmp.as_file()).unwrap(), 4);
+            // With multiple queues, `num_queues` follows the (zeroed) optional fields.
+            assert_eq!(
+                config_space.len(),
+                CONFIG_NUM_QUEUES_OFFSET + size_of::<u16>()
+            );
+            assert_eq!(config_space[..8], num_sectors.to_le_bytes());
+            assert!(config_space[8..CONFIG_NUM_QUEUES_OFFSET]
+                .iter()
+                .all(|b| *b == 0));
+            assert_eq!(config_space[CONFIG_NUM_QUEUES_OFFSET..], 4u16.to_le_bytes());
+        }
     }
 }
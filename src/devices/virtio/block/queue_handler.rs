@@ -4,14 +4,16 @@
 
 use event_manager::{EventOps, Events, MutEventSubscriber};
 use log::error;
+use std::sync::Arc;
 use vm_memory::GuestAddressSpace;
 use vmm_sys_util::epoll::EventSet;
 
 use crate::devices::virtio::block::inorder_handler::InOrderQueueHandler;
-use crate::devices::virtio::SingleFdSignalQueue;
+use crate::devices::virtio::{DeviceStats, SingleFdSignalQueue};
 use crate::kvm::hypervisor::IoEventFd;
 
 const IOEVENT_DATA: u32 = 0;
+const COALESCING_DATA: u32 = 1;
 
 // This object simply combines the more generic `InOrderQueueHandler` with a concrete queue
 // signalling implementation based on `EventFd`s, and then also implements `MutEventSubscriber`
@@ -20,6 +22,7 @@ const IOEVENT_DATA: u32 = 0;
 pub(crate) struct QueueHandler<M: GuestAddressSpace> {
     pub inner: InOrderQueueHandler<M, SingleFdSignalQueue>,
     pub ioeventfd: IoEventFd,
+    pub stats: Arc<DeviceStats>,
 }
 
 impl<M: GuestAddressSpace> MutEventSubscriber for QueueHandler<M> {
@@ -30,14 +33,23 @@ impl<M: GuestAddressSpace> MutEventSubscriber for QueueHandler<M> {
         // just to be sure.
         if events.event_set() != EventSet::IN {
             error!("unexpected event_set");
+        } else if events.data() == COALESCING_DATA {
+            if let Err(e) = self.inner.coalescing_expired() {
+                error!("error notifying block queue {:?}", e);
+            } else {
+                error = false;
+            }
         } else if events.data() != IOEVENT_DATA {
             error!("unexpected events data {}", events.data());
         } else if self.ioeventfd.read().is_err() {
             error!("ioeventfd read error")
-        } else if let Err(e) = self.inner.process_queue() {
-            error!("error processing block queue {:?}", e);
         } else {
-            error = false;
+            self.stats.ioeventfd_notify();
+            if let Err(e) = self.inner.process_queue() {
+                error!("error processing block queue {:?}", e);
+            } else {
+                error = false;
+            }
         }
 
         if error {
@@ -53,6 +65,10 @@ impl<M: GuestAddressSpace> MutEventSubscriber for QueueHandler<M> {
             EventSet::IN,
         ))
         .expect("Failed to init block queue handler");
+        if let Some(timer) = self.inner.coalescer.timer() {
+            ops.add(Events::with_data(timer, COALESCING_DATA, EventSet::IN))
+                .expect("Failed to register coalescing timer for block queue handler");
+        }
     }
 }
 
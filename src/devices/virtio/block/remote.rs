@@ -0,0 +1,577 @@
+use std::cmp::min;
+use std::collections::HashSet;
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::net::TcpStream;
+use std::os::unix::fs::FileExt;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{channel, Sender};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::Duration;
+
+use log::{debug, warn};
+use simple_error::{bail, require_with, try_with};
+
+use crate::result::Result;
+
+/// Images are fetched and cached in chunks of this size.
+const CHUNK_SIZE: u64 = 1 << 20;
+/// Number of chunks fetched ahead once the guest reads sequentially.
+const PREFETCH_CHUNKS: u64 = 8;
+const TIMEOUT: Duration = Duration::from_secs(30);
+
+/// Makes the names of partially written chunks unique within the process.
+static TMP_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// 64-bit FNV-1a. Unlike `DefaultHasher` it is the same in every build, so it can name cache
+/// directories that outlive vmsh.
+pub(super) fn fnv1a(parts: &[&[u8]]) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325u64;
+    for part in parts {
+        // the length keeps ("ab", "c") and ("a", "bc") apart
+        for b in (part.len() as u64).to_le_bytes().iter().chain(part.iter()) {
+            hash ^= *b as u64;
+            hash = hash.wrapping_mul(0x0100_0000_01b3);
+        }
+    }
+    hash
+}
+
+/// Location of an image on a plain HTTP server (or an S3-compatible endpoint).
+#[derive(Debug, PartialEq)]
+struct Url {
+    host: String,
+    port: u16,
+    path: String,
+}
+
+fn parse_url(url: &str) -> Result<Url> {
+    let rest = match url.strip_prefix("http://") {
+        Some(rest) => rest,
+        None => bail!("unsupported url {}: only http:// is supported", url),
+    };
+    let (authority, path) = match rest.find('/') {
+        Some(idx) => (&rest[..idx], &rest[idx..]),
+        None => (rest, "/"),
+    };
+    let (host, port) = match authority.rfind(':') {
+        Some(idx) => (
+            &authority[..idx],
+            try_with!(
+                authority[idx + 1..].parse::<u16>(),
+                "invalid port in url {}",
+                url
+            ),
+        ),
+        None => (authority, 80),
+    };
+    if host.is_empty() {
+        bail!("no host in url {}", url);
+    }
+    Ok(Url {
+        host: host.to_string(),
+        port,
+        path: path.to_string(),
+    })
+}
+
+impl Url {
+    /// Sends a request and returns status, headers (with lowercase names) and the body. With
+    /// `if_range`, the server sends the whole image instead of `range` if its validator changed.
+    fn request(
+        &self,
+        method: &str,
+        range: Option<(u64, u64)>,
+        if_range: Option<&str>,
+    ) -> io::Result<Response> {
+        let stream = TcpStream::connect((self.host.as_str(), self.port))?;
+        stream.set_read_timeout(Some(TIMEOUT))?;
+        stream.set_write_timeout(Some(TIMEOUT))?;
+        let mut req = format!(
+            "{} {} HTTP/1.1\r\nHost: {}\r\nConnection: close\r\n",
+            method, self.path, self.host
+        );
+        if let Some((start, end)) = range {
+            req.push_str(&format!("Range: bytes={}-{}\r\n", start, end - 1));
+            if let Some(validator) = if_range {
+                req.push_str(&format!("If-Range: {}\r\n", validator));
+            }
+        }
+        req.push_str("\r\n");
+        (&stream).write_all(req.as_bytes())?;
+
+        let mut reader = BufReader::new(stream);
+        let mut line = String::new();
+        reader.read_line(&mut line)?;
+        let status = line
+            .split_whitespace()
+            .nth(1)
+            .and_then(|s| s.parse::<u16>().ok())
+            .ok_or_else(|| http_err(&format!("invalid status line: {:?}", line.trim_end())))?;
+        let mut headers = vec![];
+        loop {
+            line.clear();
+            if reader.read_line(&mut line)? == 0 {
+                return Err(http_err("connection closed in headers"));
+            }
+            let header = line.trim_end();
+            if header.is_empty() {
+                break;
+            }
+            if let Some(idx) = header.find(':') {
+                headers.push((
+                    header[..idx].to_ascii_lowercase(),
+                    header[idx + 1..].trim().to_string(),
+                ));
+            }
+        }
+        let mut res = Response {
+            status,
+            headers,
+            body: vec![],
+        };
+        if method != "HEAD" {
+            if let Some(encoding) = res.header("transfer-encoding") {
+                if encoding.eq_ignore_ascii_case("chunked") {
+                    res.body = read_chunked(&mut reader)?;
+                    return Ok(res);
+                }
+                return Err(http_err(&format!(
+                    "unsupported transfer encoding {}",
+                    encoding
+                )));
+            }
+            match res.content_length() {
+                Some(len) => {
+                    res.body.resize(len as usize, 0);
+                    reader.read_exact(&mut res.body)?;
+                }
+                None => {
+                    reader.read_to_end(&mut res.body)?;
+                }
+            }
+        }
+        Ok(res)
+    }
+}
+
+/// Decode a body with `Transfer-Encoding: chunked`. Trailers are skipped.
+fn read_chunked(reader: &mut impl BufRead) -> io::Result<Vec<u8>> {
+    let mut body = vec![];
+    let mut line = String::new();
+    loop {
+        line.clear();
+        if reader.read_line(&mut line)? == 0 {
+            return Err(http_err("connection closed in chunked body"));
+        }
+        // chunk extensions follow a ';'
+        let size = line.trim_end().split(';').next().unwrap_or("");
+        let size = usize::from_str_radix(size.trim(), 16)
+            .map_err(|_| http_err(&format!("invalid chunk size: {:?}", line.trim_end())))?;
+        if size == 0 {
+            break;
+        }
+        let start = body.len();
+        body.resize(start + size, 0);
+        reader.read_exact(&mut body[start..])?;
+        line.clear();
+        reader.read_line(&mut line)?;
+        if !line.trim_end().is_empty() {
+            return Err(http_err("missing line break after chunk"));
+        }
+    }
+    loop {
+        line.clear();
+        if reader.read_line(&mut line)? == 0 || line.trim_end().is_empty() {
+            return Ok(body);
+        }
+    }
+}
+
+struct Response {
+    status: u16,
+    headers: Vec<(String, String)>,
+    body: Vec<u8>,
+}
+
+impl Response {
+    fn header(&self, name: &str) -> Option<&str> {
+        self.headers
+            .iter()
+            .find(|(n, _)| n == name)
+            .map(|(_, v)| v.as_str())
+    }
+
+    fn content_length(&self) -> Option<u64> {
+        self.header("content-length").and_then(|l| l.parse().ok())
+    }
+}
+
+fn http_err(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, msg)
+}
+
+struct Inner {
+    url: Url,
+    size: u64,
+    /// strong ETag or Last-Modified of the image, sent as If-Range
+    validator: Option<String>,
+    /// one file per fetched chunk, named after the chunk index
+    cache_dir: PathBuf,
+    /// chunks queued for or being prefetched
+    pending: Mutex<HashSet<u64>>,
+}
+
+impl Inner {
+    fn chunk_path(&self, idx: u64) -> PathBuf {
+        self.cache_dir.join(idx.to_string())
+    }
+
+    fn chunk_len(&self, idx: u64) -> u64 {
+        min(CHUNK_SIZE, self.size - idx * CHUNK_SIZE)
+    }
+
+    /// Downloads a chunk into the cache unless it is there already. Chunks become visible
+    /// with a rename from a name unique to the writer, so concurrent fetches of the same chunk,
+    /// by this or another attach, never see partial chunks.
+    fn fetch(&self, idx: u64) -> io::Result<File> {
+        let path = self.chunk_path(idx);
+        if let Ok(file) = File::open(&path) {
+            return Ok(file);
+        }
+        let start = idx * CHUNK_SIZE;
+        let end = start + self.chunk_len(idx);
+        debug!(
+            "fetch chunk {} ({}-{}) of {}",
+            idx, start, end, self.url.path
+        );
+        let res = self
+            .url
+            .request("GET", Some((start, end)), self.validator.as_deref())?;
+        if res.status == 200 && self.validator.is_some() {
+            return Err(http_err(&format!(
+                "{} changed on the server since it was attached",
+                self.url.path
+            )));
+        }
+        if res.status != 206 || res.body.len() as u64 != end - start {
+            return Err(http_err(&format!(
+                "range request for chunk {} failed: status {}, {} bytes",
+                idx,
+                res.status,
+                res.body.len()
+            )));
+        }
+        let tmp = self.cache_dir.join(format!(
+            ".{}.{}.{}",
+            idx,
+            std::process::id(),
+            TMP_COUNTER.fetch_add(1, Ordering::Relaxed)
+        ));
+        let res = fs::write(&tmp, &res.body).and_then(|_| fs::rename(&tmp, &path));
+        if let Err(e) = res {
+            let _ = fs::remove_file(&tmp);
+            // someone else was faster
+            if let Ok(file) = File::open(&path) {
+                return Ok(file);
+            }
+            return Err(e);
+        }
+        File::open(&path)
+    }
+}
+
+/// Read-only image that is fetched lazily with HTTP range requests. Only chunks the guest
+/// actually reads are downloaded. They are kept in `cache_dir`, keyed by the url and the
+/// identity (strong ETag or Last-Modified, size) of the image, so later attaches of the same
+/// image start warm. Servers that send neither get a cache that is removed again with the image,
+/// since nothing would tell a changed image apart.
+pub struct RemoteImage {
+    inner: Arc<Inner>,
+    /// whether the chunks stay in the cache for later attaches
+    persistent: bool,
+    /// end of the last read, to detect sequential reads
+    last_end: AtomicU64,
+    prefetch: Mutex<Sender<u64>>,
+}
+
+impl RemoteImage {
+    pub fn new(url: &str, cache_dir: &std::path::Path) -> Result<RemoteImage> {
+        let parsed = parse_url(url)?;
+        let res = try_with!(parsed.request("HEAD", None, None), "cannot reach {}", url);
+        if res.status != 200 {
+            bail!("HEAD {} failed with status {}", url, res.status);
+        }
+        if res.header("accept-ranges") == Some("none") {
+            bail!("{} does not support range requests", url);
+        }
+        let size = require_with!(res.content_length(), "no content length for {}", url);
+        // same as for local files: a partial sector at the end is ignored.
+        let size = size >> super::SECTOR_SHIFT << super::SECTOR_SHIFT;
+
+        // weak ETags are not allowed in If-Range
+        let validator = res
+            .header("etag")
+            .filter(|etag| !etag.starts_with("W/"))
+            .or_else(|| res.header("last-modified"))
+            .map(String::from);
+        let cache_dir = match &validator {
+            Some(validator) => {
+                let key = fnv1a(&[url.as_bytes(), validator.as_bytes(), &size.to_le_bytes()]);
+                cache_dir.join(format!("{:016x}", key))
+            }
+            None => {
+                warn!(
+                    "{} has neither ETag nor Last-Modified, its chunks are not kept after detach",
+                    url
+                );
+                cache_dir.join(format!(
+                    ".private-{}.{}",
+                    std::process::id(),
+                    TMP_COUNTER.fetch_add(1, Ordering::Relaxed)
+                ))
+            }
+        };
+        try_with!(
+            fs::create_dir_all(&cache_dir),
+            "cannot create cache directory {}",
+            cache_dir.display()
+        );
+        debug!(
+            "serving {} ({} bytes) from cache {}",
+            url,
+            size,
+            cache_dir.display()
+        );
+
+        let persistent = validator.is_some();
+        let inner = Arc::new(Inner {
+            url: parsed,
+            size,
+            validator,
+            cache_dir,
+            pending: Mutex::new(HashSet::new()),
+        });
+        let (sender, receiver) = channel::<u64>();
+        let prefetch_inner = inner.clone();
+        // exits once the image and with it the sender is dropped
+        try_with!(
+            thread::Builder::new()
+                .name(String::from("blk-prefetch"))
+                .spawn(move || {
+                    for idx in receiver {
+                        if let Err(e) = prefetch_inner.fetch(idx) {
+                            warn!("cannot prefetch chunk {}: {}", idx, e);
+                        }
+                        if let Ok(mut pending) = prefetch_inner.pending.lock() {
+                            pending.remove(&idx);
+                        }
+                    }
+                }),
+            "cannot start prefetch thread"
+        );
+
+        Ok(RemoteImage {
+            inner,
+            persistent,
+            last_end: AtomicU64::new(u64::MAX),
+            prefetch: Mutex::new(sender),
+        })
+    }
+
+    pub fn size(&self) -> u64 {
+        self.inner.size
+    }
+
+    /// Fill `buf` from `offset`. The range must be within `size()`.
+    pub fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        let end = offset + buf.len() as u64;
+        let mut pos = offset;
+        while pos < end {
+            let idx = pos / CHUNK_SIZE;
+            let chunk_end = min(end, (idx + 1) * CHUNK_SIZE);
+            let part = &mut buf[(pos - offset) as usize..(chunk_end - offset) as usize];
+            self.inner
+                .fetch(idx)?
+                .read_exact_at(part, pos - idx * CHUNK_SIZE)?;
+            pos = chunk_end;
+        }
+        if self.last_end.swap(end, Ordering::Relaxed) == offset {
+            self.prefetch_after(end);
+        }
+        Ok(())
+    }
+
+    /// Queue the chunks following `offset` that are neither cached nor queued already.
+    fn prefetch_after(&self, offset: u64) {
+        let first = (offset + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        let chunks = (self.inner.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        let (sender, mut pending) = match (self.prefetch.lock(), self.inner.pending.lock()) {
+            (Ok(s), Ok(p)) => (s, p),
+            _ => return,
+        };
+        for idx in first..min(chunks, first + PREFETCH_CHUNKS) {
+            if pending.contains(&idx) || self.inner.chunk_path(idx).exists() {
+                continue;
+            }
+            if sender.send(idx).is_ok() {
+                pending.insert(idx);
+            }
+        }
+    }
+}
+
+impl Drop for RemoteImage {
+    fn drop(&mut self) {
+        if !self.persistent {
+            if let Err(e) = fs::remove_dir_all(&self.inner.cache_dir) {
+                warn!(
+                    "cannot remove cache {}: {}",
+                    self.inner.cache_dir.display(),
+                    e
+                );
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::TcpListener;
+    use vmm_sys_util::tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn test_parse_url() {
+        assert_eq!(
+            parse_url("http://example.com:8080/images/tools.img").unwrap(),
+            Url {
+                host: String::from("example.com"),
+                port: 8080,
+                path: String::from("/images/tools.img"),
+            }
+        );
+        assert_eq!(parse_url("http://example.com").unwrap().port, 80);
+        assert_eq!(parse_url("http://example.com").unwrap().path, "/");
+        assert!(parse_url("https://example.com/tools.img").is_err());
+        assert!(parse_url("http://:80/tools.img").is_err());
+    }
+
+    #[test]
+    fn test_fnv1a() {
+        // no input leaves the offset basis
+        assert_eq!(fnv1a(&[]), 0xcbf2_9ce4_8422_2325);
+        assert_ne!(fnv1a(&[b"ab", b"c"]), fnv1a(&[b"a", b"bc"]));
+        assert_eq!(fnv1a(&[b"tools"]), fnv1a(&[b"tools"]));
+    }
+
+    #[test]
+    fn test_read_chunked() {
+        let body = b"4\r\nvmsh\r\n6;ext=1\r\n rocks\r\n0\r\nX-Trailer: 1\r\n\r\n";
+        assert_eq!(read_chunked(&mut &body[..]).unwrap(), b"vmsh rocks");
+        assert!(read_chunked(&mut &b"4\r\nvm"[..]).is_err());
+        assert!(read_chunked(&mut &b"zz\r\n"[..]).is_err());
+    }
+
+    /// Serves `image` to one connection per entry of `etags`, answering HEAD and range
+    /// requests. Each entry is the ETag of the image while answering that connection.
+    fn serve(image: Vec<u8>, etags: Vec<Option<&'static str>>) -> u16 {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let port = listener.local_addr().unwrap().port();
+        thread::spawn(move || {
+            for (stream, etag) in listener.incoming().zip(etags) {
+                let stream = stream.unwrap();
+                let mut reader = BufReader::new(&stream);
+                let mut request = String::new();
+                let mut range = None;
+                let mut if_range = None;
+                reader.read_line(&mut request).unwrap();
+                loop {
+                    let mut line = String::new();
+                    reader.read_line(&mut line).unwrap();
+                    if line.trim_end().is_empty() {
+                        break;
+                    }
+                    if let Some(r) = line.trim_end().strip_prefix("Range: bytes=") {
+                        let mut bounds = r.split('-').map(|b| b.parse::<usize>().unwrap());
+                        range = Some((bounds.next().unwrap(), bounds.next().unwrap() + 1));
+                    }
+                    if let Some(v) = line.trim_end().strip_prefix("If-Range: ") {
+                        if_range = Some(v.to_string());
+                    }
+                }
+                let mut stream = &stream;
+                if if_range.is_some() && if_range.as_deref() != etag {
+                    range = None;
+                }
+                let etag = etag.map_or(String::new(), |e| format!("ETag: {}\r\n", e));
+                match range {
+                    None => write!(
+                        stream,
+                        "HTTP/1.1 200 OK\r\nContent-Length: {}\r\n{}\r\n",
+                        image.len(),
+                        etag
+                    )
+                    .unwrap(),
+                    Some((start, end)) => {
+                        write!(
+                            stream,
+                            "HTTP/1.1 206 Partial Content\r\nContent-Length: {}\r\n\r\n",
+                            end - start
+                        )
+                        .unwrap();
+                        stream.write_all(&image[start..end]).unwrap();
+                    }
+                }
+            }
+        });
+        port
+    }
+
+    #[test]
+    fn test_remote_read() {
+        let image = (0..2 * CHUNK_SIZE + 512)
+            .map(|i| (i / 512) as u8)
+            .collect::<Vec<_>>();
+        // HEAD and the two chunks read by the first image, HEAD by the second one. The server
+        // is gone afterwards, so the second image can only read from the cache.
+        let port = serve(image.clone(), vec![Some("\"1\""); 4]);
+        let url = format!("http://127.0.0.1:{}/tools.img", port);
+        let cache = TempDir::new().unwrap();
+        // crosses the boundary of the first two chunks
+        let offset = CHUNK_SIZE - 512;
+        let expected = &image[offset as usize..offset as usize + 1024];
+
+        for _ in 0..2 {
+            let remote = RemoteImage::new(&url, cache.as_path()).unwrap();
+            assert_eq!(remote.size(), image.len() as u64);
+            let mut buf = vec![0u8; 1024];
+            remote.read_at(&mut buf, offset).unwrap();
+            assert_eq!(buf[..], expected[..]);
+        }
+    }
+
+    #[test]
+    fn test_remote_validators() {
+        let image = vec![1u8; CHUNK_SIZE as usize];
+        let cache = TempDir::new().unwrap();
+        let mut buf = vec![0u8; 512];
+
+        // without a validator, chunks do not survive the image
+        let port = serve(image.clone(), vec![None; 2]);
+        let url = format!("http://127.0.0.1:{}/tools.img", port);
+        let remote = RemoteImage::new(&url, cache.as_path()).unwrap();
+        remote.read_at(&mut buf, 0).unwrap();
+        drop(remote);
+        assert_eq!(fs::read_dir(cache.as_path()).unwrap().count(), 0);
+
+        // the image changes between HEAD and the first range request
+        let port = serve(image, vec![Some("\"1\""), Some("\"2\"")]);
+        let url = format!("http://127.0.0.1:{}/tools.img", port);
+        let remote = RemoteImage::new(&url, cache.as_path()).unwrap();
+        assert!(remote.read_at(&mut buf, 0).is_err());
+    }
+}
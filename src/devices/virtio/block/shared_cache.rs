@@ -0,0 +1,493 @@
+use std::cmp::min;
+use std::fmt;
+use std::fs::{self, DirBuilder, File, Metadata, OpenOptions};
+use std::io;
+use std::os::unix::fs::{DirBuilderExt, FileExt, MetadataExt, OpenOptionsExt};
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::ptr;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+
+use log::{debug, warn};
+use nix::errno::Errno;
+use nix::sys::mman::{self, MapFlags, ProtFlags};
+use nix::sys::signal::kill;
+use nix::unistd::{geteuid, Pid};
+use simple_error::{bail, try_with};
+
+use super::image::DiskImage;
+use super::remote::fnv1a;
+use crate::result::Result;
+
+/// Blocks are cached at this granularity.
+pub const CACHE_BLOCK_SIZE: u64 = 4096;
+/// Changes with the layout of the file, the second version added `Slot::owner`.
+const MAGIC: u64 = u64::from_le_bytes(*b"vmshcac2");
+
+/// Caches of all images, only accessible by the user running vmsh.
+const CACHE_DIR: &str = "/dev/shm/vmsh";
+
+static TMP_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// Other users must not be able to replace or read cached blocks, which would let them change
+/// or see the image served to the guest.
+fn check_private(meta: &Metadata, path: &Path) -> Result<()> {
+    if meta.uid() != geteuid().as_raw() || meta.mode() & 0o077 != 0 {
+        bail!(
+            "{} must be owned by uid {} and not be accessible by others (owner {}, mode {:o})",
+            path.display(),
+            geteuid(),
+            meta.uid(),
+            meta.mode() & 0o7777
+        );
+    }
+    Ok(())
+}
+
+fn process_alive(pid: u64) -> bool {
+    !matches!(kill(Pid::from_raw(pid as i32), None), Err(Errno::ESRCH))
+}
+
+/// First page of the cache file.
+#[repr(C)]
+struct Header {
+    magic: AtomicU64,
+    slots: AtomicU64,
+    /// counters of all processes using the cache
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+/// Index entry of a slot. `seq` is a sequence lock: it is odd while a process fills the
+/// slot, and readers count the block as a miss if it changed while they copied the data.
+#[repr(C)]
+struct Slot {
+    seq: AtomicU64,
+    /// block number + 1, 0 if empty
+    key: AtomicU64,
+    /// pid of the process filling the slot, 0 if none. Writers take the slot by setting it.
+    owner: AtomicU64,
+}
+
+/// Block cache for read-only images in a shared memory file, named after the identity of the
+/// image. All vmsh processes of the host that serve the same image use the same cache, so
+/// only the first attach has to read a block from disk.
+///
+/// The cache is direct-mapped (each block has exactly one slot) and lock-free: readers never
+/// block, and a writer skips filling a slot that another process is filling right now. Slots
+/// of writers that crashed are released when the cache is opened again.
+pub struct SharedCache {
+    path: PathBuf,
+    ptr: *mut u8,
+    len: usize,
+    slots: u64,
+    /// counters of this process
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+// All shared state is accessed with atomics or guarded by the sequence locks.
+unsafe impl Send for SharedCache {}
+unsafe impl Sync for SharedCache {}
+
+fn layout(slots: u64) -> (usize, usize) {
+    let index_start = CACHE_BLOCK_SIZE as usize;
+    let index_len = slots as usize * std::mem::size_of::<Slot>();
+    let data_start = (index_start + index_len + CACHE_BLOCK_SIZE as usize - 1)
+        / CACHE_BLOCK_SIZE as usize
+        * CACHE_BLOCK_SIZE as usize;
+    (data_start, data_start + (slots * CACHE_BLOCK_SIZE) as usize)
+}
+
+impl SharedCache {
+    /// Cache for `file` in `CACHE_DIR` keyed by device, inode, size and modification time of the
+    /// file, so a changed image gets a new cache.
+    pub fn for_file(file: &File, size_mb: u64) -> Result<SharedCache> {
+        let meta = try_with!(file.metadata(), "cannot stat backing file");
+        let dir = Path::new(CACHE_DIR);
+        if let Err(e) = DirBuilder::new().mode(0o700).create(dir) {
+            if e.kind() != io::ErrorKind::AlreadyExists {
+                bail!("cannot create {}: {}", dir.display(), e);
+            }
+        }
+        let dir_meta = try_with!(fs::symlink_metadata(dir), "cannot stat {}", dir.display());
+        if !dir_meta.is_dir() {
+            bail!("{} is not a directory", dir.display());
+        }
+        check_private(&dir_meta, dir)?;
+        let key = fnv1a(&[
+            &meta.dev().to_le_bytes(),
+            &meta.ino().to_le_bytes(),
+            &meta.size().to_le_bytes(),
+            &meta.mtime().to_le_bytes(),
+            &meta.mtime_nsec().to_le_bytes(),
+        ]);
+        let path = dir.join(format!("cache-{:016x}", key));
+        SharedCache::open(&path, size_mb * (1 << 20) / CACHE_BLOCK_SIZE)
+    }
+
+    /// Opens or creates the cache at `path`. If another process created it already, its number
+    /// of slots is used instead of `slots`.
+    pub fn open(path: &Path, slots: u64) -> Result<SharedCache> {
+        if slots == 0 {
+            bail!("shared cache needs at least one slot");
+        }
+        loop {
+            let file = match OpenOptions::new()
+                .read(true)
+                .write(true)
+                .custom_flags(libc::O_NOFOLLOW)
+                .open(path)
+            {
+                Ok(file) => file,
+                Err(e) if e.kind() == io::ErrorKind::NotFound => {
+                    SharedCache::create(path, slots, false)?;
+                    continue;
+                }
+                Err(e) => bail!("cannot open shared cache {}: {}", path.display(), e),
+            };
+            match SharedCache::map(&file, path)? {
+                Some(cache) => {
+                    cache.recover();
+                    return Ok(cache);
+                }
+                None => {
+                    warn!("replace invalid shared cache {}", path.display());
+                    SharedCache::create(path, slots, true)?;
+                }
+            }
+        }
+    }
+
+    /// Initialize a cache file under a temporary name and move it to `path`, so other processes
+    /// never see a partially initialized cache. Unless `replace` is set, a file another process
+    /// created at `path` meanwhile is kept.
+    fn create(path: &Path, slots: u64, replace: bool) -> Result<()> {
+        let tmp = PathBuf::from(format!(
+            "{}.{}.{}",
+            path.display(),
+            std::process::id(),
+            TMP_COUNTER.fetch_add(1, Ordering::Relaxed)
+        ));
+        let res = (|| -> Result<()> {
+            let file = try_with!(
+                OpenOptions::new()
+                    .read(true)
+                    .write(true)
+                    .create_new(true)
+                    .mode(0o600)
+                    .open(&tmp),
+                "cannot create {}",
+                tmp.display()
+            );
+            let (_, len) = layout(slots);
+            // sparse, filled as blocks are cached
+            try_with!(file.set_len(len as u64), "cannot resize shared cache");
+            let mut header = [0u8; 16];
+            header[..8].copy_from_slice(&MAGIC.to_ne_bytes());
+            header[8..].copy_from_slice(&slots.to_ne_bytes());
+            try_with!(
+                file.write_all_at(&header, 0),
+                "cannot write shared cache header"
+            );
+            if replace {
+                try_with!(
+                    fs::rename(&tmp, path),
+                    "cannot move shared cache into place"
+                );
+                return Ok(());
+            }
+            match fs::hard_link(&tmp, path) {
+                Ok(()) => Ok(()),
+                Err(e) if e.kind() == io::ErrorKind::AlreadyExists => Ok(()),
+                Err(e) => bail!("cannot move shared cache into place: {}", e),
+            }
+        })();
+        if let Err(e) = fs::remove_file(&tmp) {
+            if e.kind() != io::ErrorKind::NotFound {
+                warn!("cannot remove {}: {}", tmp.display(), e);
+            }
+        }
+        res
+    }
+
+    /// Map an initialized cache file, `None` if it is not a cache of this vmsh version.
+    fn map(file: &File, path: &Path) -> Result<Option<SharedCache>> {
+        let meta = try_with!(file.metadata(), "cannot stat shared cache");
+        check_private(&meta, path)?;
+        let file_len = meta.len();
+        let mut header = [0u8; 16];
+        if file_len < header.len() as u64 {
+            return Ok(None);
+        }
+        try_with!(
+            file.read_exact_at(&mut header, 0),
+            "cannot read shared cache header"
+        );
+        let mut word = [0u8; 8];
+        word.copy_from_slice(&header[..8]);
+        if u64::from_ne_bytes(word) != MAGIC {
+            return Ok(None);
+        }
+        word.copy_from_slice(&header[8..]);
+        let slots = u64::from_ne_bytes(word);
+        let (_, len) = layout(slots);
+        if slots == 0 || file_len < len as u64 {
+            return Ok(None);
+        }
+        let ptr = try_with!(
+            unsafe {
+                mman::mmap(
+                    ptr::null_mut(),
+                    len,
+                    ProtFlags::PROT_READ | ProtFlags::PROT_WRITE,
+                    MapFlags::MAP_SHARED,
+                    file.as_raw_fd(),
+                    0,
+                )
+            },
+            "cannot mmap shared cache"
+        ) as *mut u8;
+        debug!("shared block cache {} with {} slots", path.display(), slots);
+        Ok(Some(SharedCache {
+            path: path.to_path_buf(),
+            ptr,
+            len,
+            slots,
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }))
+    }
+
+    /// Release slots whose writer died while filling them. Readers would skip them forever
+    /// and no other writer could fill them again.
+    fn recover(&self) {
+        let me = std::process::id() as u64;
+        let mut recovered = 0;
+        for idx in 0..self.slots {
+            let (slot, _) = self.slot(idx);
+            let owner = slot.owner.load(Ordering::Relaxed);
+            // other caches of this process may be writing right now
+            if owner == 0 || owner == me || process_alive(owner) {
+                continue;
+            }
+            if slot
+                .owner
+                .compare_exchange(owner, me, Ordering::Acquire, Ordering::Relaxed)
+                .is_err()
+            {
+                continue;
+            }
+            let seq = slot.seq.load(Ordering::Relaxed);
+            if seq % 2 == 1 {
+                slot.key.store(0, Ordering::Relaxed);
+                slot.seq.store(seq + 1, Ordering::Release);
+            }
+            slot.owner.store(0, Ordering::Release);
+            recovered += 1;
+        }
+        if recovered > 0 {
+            warn!(
+                "recovered {} slots of shared cache {} left by crashed processes",
+                recovered,
+                self.path.display()
+            );
+        }
+    }
+
+    fn header(&self) -> &Header {
+        unsafe { &*(self.ptr as *const Header) }
+    }
+
+    fn slot(&self, block: u64) -> (&Slot, *mut u8) {
+        let idx = block % self.slots;
+        let (data_start, _) = layout(self.slots);
+        unsafe {
+            let slot = &*(self.ptr.add(CACHE_BLOCK_SIZE as usize) as *const Slot).add(idx as usize);
+            let data = self.ptr.add(data_start + (idx * CACHE_BLOCK_SIZE) as usize);
+            (slot, data)
+        }
+    }
+
+    /// Copy `block` into `buf` (at most one block) if it is cached.
+    fn lookup(&self, block: u64, buf: &mut [u8]) -> bool {
+        let (slot, data) = self.slot(block);
+        let seq = slot.seq.load(Ordering::Acquire);
+        if seq % 2 == 1 || slot.key.load(Ordering::Relaxed) != block + 1 {
+            return false;
+        }
+        unsafe { ptr::copy_nonoverlapping(data, buf.as_mut_ptr(), buf.len()) };
+        fence(Ordering::Acquire);
+        slot.seq.load(Ordering::Relaxed) == seq
+    }
+
+    /// Store `buf` (at most one block) as `block`, unless another process is writing the slot.
+    fn insert(&self, block: u64, buf: &[u8]) {
+        let (slot, data) = self.slot(block);
+        let me = std::process::id() as u64;
+        if slot
+            .owner
+            .compare_exchange(0, me, Ordering::Acquire, Ordering::Relaxed)
+            .is_err()
+        {
+            return;
+        }
+        let seq = slot.seq.load(Ordering::Relaxed);
+        slot.seq.store(seq + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        slot.key.store(block + 1, Ordering::Relaxed);
+        unsafe { ptr::copy_nonoverlapping(buf.as_ptr(), data, buf.len()) };
+        slot.seq.store(seq + 2, Ordering::Release);
+        slot.owner.store(0, Ordering::Release);
+    }
+
+    /// Fill `buf` from `offset` of `image`, reading only blocks from `image` that are not
+    /// cached. The range must be within `image.size()`.
+    pub fn read_at(&self, image: &DiskImage, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        let bs = CACHE_BLOCK_SIZE;
+        let end = offset + buf.len() as u64;
+        let first = offset / bs;
+        let last = (end + bs - 1) / bs;
+        let mut blocks = vec![0u8; (min(last * bs, image.size()) - first * bs) as usize];
+        let total = blocks.len();
+        let block_range = |b: u64| {
+            let start = ((b - first) * bs) as usize;
+            start..min(start + bs as usize, total)
+        };
+
+        let mut hits = 0;
+        let mut block = first;
+        while block < last {
+            if self.lookup(block, &mut blocks[block_range(block)]) {
+                hits += 1;
+                block += 1;
+                continue;
+            }
+            // read consecutive misses at once
+            let mut miss_end = block + 1;
+            while miss_end < last && !self.lookup(miss_end, &mut blocks[block_range(miss_end)]) {
+                miss_end += 1;
+            }
+            let run = block_range(block).start..block_range(miss_end - 1).end;
+            image.read_at(&mut blocks[run.clone()], block * bs)?;
+            for b in block..miss_end {
+                self.insert(b, &blocks[block_range(b)]);
+            }
+            // the block that ended the run was a hit
+            if miss_end < last {
+                hits += 1;
+                miss_end += 1;
+            }
+            block = miss_end;
+        }
+        let misses = last - first - hits;
+        self.hits.fetch_add(hits, Ordering::Relaxed);
+        self.misses.fetch_add(misses, Ordering::Relaxed);
+        self.header().hits.fetch_add(hits, Ordering::Relaxed);
+        self.header().misses.fetch_add(misses, Ordering::Relaxed);
+
+        let skip = (offset - first * bs) as usize;
+        buf.copy_from_slice(&blocks[skip..skip + buf.len()]);
+        Ok(())
+    }
+}
+
+impl Drop for SharedCache {
+    fn drop(&mut self) {
+        if let Err(e) = unsafe { mman::munmap(self.ptr as *mut libc::c_void, self.len) } {
+            warn!("cannot unmap shared cache: {}", e);
+        }
+    }
+}
+
+impl fmt::Display for SharedCache {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(
+            f,
+            "{}: hits: {}, misses: {} (all processes: hits: {}, misses: {})",
+            self.path.display(),
+            self.hits.load(Ordering::Relaxed),
+            self.misses.load(Ordering::Relaxed),
+            self.header().hits.load(Ordering::Relaxed),
+            self.header().misses.load(Ordering::Relaxed),
+        )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::Write;
+    use vmm_sys_util::tempfile::TempFile;
+
+    use super::*;
+
+    #[test]
+    fn test_shared_cache() {
+        let bs = CACHE_BLOCK_SIZE as usize;
+        let base = TempFile::new().unwrap();
+        for i in 0..8u8 {
+            base.as_file().write_all(&vec![i; bs]).unwrap();
+        }
+        let image = DiskImage::raw(base.as_path(), true).unwrap();
+        let path = TempFile::new().unwrap();
+        std::fs::remove_file(path.as_path()).unwrap();
+
+        let cache = SharedCache::open(path.as_path(), 4).unwrap();
+        let mut buf = vec![0u8; 2 * bs];
+        cache.read_at(&image, &mut buf, 512).unwrap();
+        assert!(buf[..bs - 512].iter().all(|b| *b == 0));
+        assert!(buf[bs - 512..2 * bs - 512].iter().all(|b| *b == 1));
+        assert!(buf[2 * bs - 512..].iter().all(|b| *b == 2));
+        assert_eq!(cache.misses.load(Ordering::Relaxed), 3);
+
+        // another process opening the cache finds the blocks
+        let other = SharedCache::open(path.as_path(), 16).unwrap();
+        assert_eq!(other.slots, 4);
+        let mut buf = vec![0u8; bs];
+        other.read_at(&image, &mut buf, bs as u64).unwrap();
+        assert!(buf.iter().all(|b| *b == 1));
+        assert_eq!(other.hits.load(Ordering::Relaxed), 1);
+        assert_eq!(other.header().hits.load(Ordering::Relaxed), 1);
+
+        // block 5 evicts block 1, which shares its slot
+        other.read_at(&image, &mut buf, 5 * bs as u64).unwrap();
+        assert!(buf.iter().all(|b| *b == 5));
+        cache.read_at(&image, &mut buf, bs as u64).unwrap();
+        assert!(buf.iter().all(|b| *b == 1));
+        assert_eq!(cache.misses.load(Ordering::Relaxed), 4);
+        std::fs::remove_file(path.as_path()).unwrap();
+    }
+
+    #[test]
+    fn test_shared_cache_recovery() {
+        let bs = CACHE_BLOCK_SIZE as usize;
+        let base = TempFile::new().unwrap();
+        base.as_file().write_all(&vec![1u8; bs]).unwrap();
+        let image = DiskImage::raw(base.as_path(), true).unwrap();
+        let path = TempFile::new().unwrap();
+
+        // a file that is not a cache gets replaced
+        std::fs::write(path.as_path(), b"garbage").unwrap();
+        let cache = SharedCache::open(path.as_path(), 1).unwrap();
+
+        // a writer that died while filling the slot
+        let mut child = std::process::Command::new("true").spawn().unwrap();
+        let dead = child.id() as u64;
+        child.wait().unwrap();
+        let (slot, _) = cache.slot(0);
+        slot.owner.store(dead, Ordering::Relaxed);
+        slot.seq.store(1, Ordering::Relaxed);
+        let mut buf = vec![0u8; bs];
+        cache.read_at(&image, &mut buf, 0).unwrap();
+        cache.read_at(&image, &mut buf, 0).unwrap();
+        assert_eq!(cache.hits.load(Ordering::Relaxed), 0);
+
+        let other = SharedCache::open(path.as_path(), 1).unwrap();
+        assert_eq!(slot.owner.load(Ordering::Relaxed), 0);
+        other.read_at(&image, &mut buf, 0).unwrap();
+        cache.read_at(&image, &mut buf, 0).unwrap();
+        assert!(buf.iter().all(|b| *b == 1));
+        assert_eq!(cache.hits.load(Ordering::Relaxed), 1);
+        std::fs::remove_file(path.as_path()).unwrap();
+    }
+}
@@ -0,0 +1,385 @@
+//! Just enough io_uring for `IoUringQueueHandler`: vectored reads and writes, fsync and an
+//! eventfd for completions, on top of the raw syscalls.
+//!
+//! This is not the io-uring crate because every new crate needs a Cargo.lock entry and a new
+//! cargoSha256 for the vendored dependencies in nix/vmsh.nix, and the handler needs only three
+//! opcodes of it. Replace this module once the crate is pinned there.
+
+use libc::{c_long, c_uint, c_void, iovec};
+use std::io;
+use std::os::unix::io::RawFd;
+use std::ptr;
+use std::sync::atomic::{AtomicU32, Ordering};
+
+const IORING_OFF_SQ_RING: libc::off_t = 0;
+const IORING_OFF_CQ_RING: libc::off_t = 0x800_0000;
+const IORING_OFF_SQES: libc::off_t = 0x1000_0000;
+
+const IORING_ENTER_GETEVENTS: c_uint = 1;
+const IORING_REGISTER_EVENTFD: c_uint = 4;
+
+const IORING_OP_READV: u8 = 1;
+const IORING_OP_WRITEV: u8 = 2;
+const IORING_OP_FSYNC: u8 = 3;
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    resv2: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    resv2: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+/// A submission queue entry, `struct io_uring_sqe`.
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct Entry {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    rw_flags: u32,
+    user_data: u64,
+    pad: [u64; 3],
+}
+
+impl Entry {
+    fn rw(opcode: u8, fd: RawFd, iovecs: *const iovec, len: u32, offset: u64) -> Entry {
+        Entry {
+            opcode,
+            fd,
+            off: offset,
+            addr: iovecs as u64,
+            len,
+            ..Default::default()
+        }
+    }
+
+    pub fn readv(fd: RawFd, iovecs: *const iovec, len: u32, offset: u64) -> Entry {
+        Entry::rw(IORING_OP_READV, fd, iovecs, len, offset)
+    }
+
+    pub fn writev(fd: RawFd, iovecs: *const iovec, len: u32, offset: u64) -> Entry {
+        Entry::rw(IORING_OP_WRITEV, fd, iovecs, len, offset)
+    }
+
+    pub fn fsync(fd: RawFd) -> Entry {
+        Entry {
+            opcode: IORING_OP_FSYNC,
+            fd,
+            ..Default::default()
+        }
+    }
+
+    pub fn user_data(mut self, user_data: u64) -> Entry {
+        self.user_data = user_data;
+        self
+    }
+}
+
+/// A completion queue entry, `struct io_uring_cqe`.
+#[repr(C)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+struct Mmap {
+    ptr: *mut c_void,
+    len: usize,
+}
+
+impl Mmap {
+    fn new(fd: RawFd, len: usize, offset: libc::off_t) -> io::Result<Mmap> {
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                offset,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Mmap { ptr, len })
+    }
+
+    /// # Safety
+    ///
+    /// offset must be within the mapping and aligned for T.
+    unsafe fn at<T>(&self, offset: u32) -> *mut T {
+        (self.ptr as *mut u8).add(offset as usize) as *mut T
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr, self.len) };
+    }
+}
+
+/// An io_uring instance. Entries pushed are handed to the kernel by the next `submit`.
+pub struct Ring {
+    // only kept to be unmapped, the pointers below point into them
+    _sq: Mmap,
+    _cq: Mmap,
+    sqes: Mmap,
+    fd: RawFd,
+    sq_head: *const AtomicU32,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_entries: u32,
+    sq_array: *mut u32,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const Cqe,
+    /// pushed but not yet submitted
+    pending: u32,
+}
+
+// The pointers point into mappings owned by the ring.
+unsafe impl Send for Ring {}
+
+fn check(res: c_long) -> io::Result<c_long> {
+    if res < 0 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(res)
+    }
+}
+
+impl Ring {
+    pub fn new(entries: u32) -> io::Result<Ring> {
+        let mut params = Params::default();
+        let fd = check(unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_setup,
+                entries,
+                &mut params as *mut Params,
+            )
+        })? as RawFd;
+        let maps = (|| {
+            let sq_len = params.sq_off.array as usize + params.sq_entries as usize * 4;
+            let cq_len = params.cq_off.cqes as usize
+                + params.cq_entries as usize * std::mem::size_of::<Cqe>();
+            let sqes_len = params.sq_entries as usize * std::mem::size_of::<Entry>();
+            Ok((
+                Mmap::new(fd, sq_len, IORING_OFF_SQ_RING)?,
+                Mmap::new(fd, cq_len, IORING_OFF_CQ_RING)?,
+                Mmap::new(fd, sqes_len, IORING_OFF_SQES)?,
+            ))
+        })();
+        let (sq, cq, sqes) = match maps {
+            Ok(maps) => maps,
+            Err(e) => {
+                unsafe { libc::close(fd) };
+                return Err(e);
+            }
+        };
+        // Safe because the kernel told us these offsets into the mappings.
+        unsafe {
+            Ok(Ring {
+                sq_head: sq.at(params.sq_off.head),
+                sq_tail: sq.at(params.sq_off.tail),
+                sq_mask: *sq.at::<u32>(params.sq_off.ring_mask),
+                sq_entries: *sq.at::<u32>(params.sq_off.ring_entries),
+                sq_array: sq.at(params.sq_off.array),
+                cq_head: cq.at(params.cq_off.head),
+                cq_tail: cq.at(params.cq_off.tail),
+                cq_mask: *cq.at::<u32>(params.cq_off.ring_mask),
+                cqes: cq.at(params.cq_off.cqes),
+                _sq: sq,
+                _cq: cq,
+                sqes,
+                fd,
+                pending: 0,
+            })
+        }
+    }
+
+    /// Let the kernel signal `eventfd` for every completion.
+    pub fn register_eventfd(&self, eventfd: RawFd) -> io::Result<()> {
+        check(unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_register,
+                self.fd,
+                IORING_REGISTER_EVENTFD,
+                &eventfd as *const RawFd,
+                1,
+            )
+        })
+        .map(drop)
+    }
+
+    /// Queue `entry`, false if the submission queue is full.
+    ///
+    /// # Safety
+    ///
+    /// Buffers and iovecs of the entry must stay valid until its completion was read.
+    pub unsafe fn push(&mut self, entry: &Entry) -> bool {
+        // only the kernel moves the head
+        let head = (*self.sq_head).load(Ordering::Acquire);
+        let tail = (*self.sq_tail).load(Ordering::Relaxed);
+        if tail.wrapping_sub(head) >= self.sq_entries {
+            return false;
+        }
+        let idx = tail & self.sq_mask;
+        ptr::write(self.sqes.at::<Entry>(0).add(idx as usize), *entry);
+        *self.sq_array.add(idx as usize) = idx;
+        (*self.sq_tail).store(tail.wrapping_add(1), Ordering::Release);
+        self.pending += 1;
+        true
+    }
+
+    fn enter(&mut self, min_complete: u32) -> io::Result<usize> {
+        let flags = if min_complete > 0 {
+            IORING_ENTER_GETEVENTS
+        } else {
+            0
+        };
+        let submitted = check(unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_enter,
+                self.fd,
+                self.pending,
+                min_complete,
+                flags,
+                ptr::null::<libc::sigset_t>(),
+                0,
+            )
+        })? as u32;
+        self.pending -= submitted.min(self.pending);
+        Ok(submitted as usize)
+    }
+
+    /// Hand pushed entries to the kernel.
+    pub fn submit(&mut self) -> io::Result<usize> {
+        self.enter(0)
+    }
+
+    /// Like `submit`, then wait until at least `want` completions are available.
+    pub fn submit_and_wait(&mut self, want: u32) -> io::Result<usize> {
+        self.enter(want)
+    }
+
+    /// Take all available completions as `(user_data, result)`, where errors are -errno.
+    pub fn completions(&mut self) -> Vec<(u64, i32)> {
+        let mut completions = vec![];
+        unsafe {
+            // only we move the head
+            let mut head = (*self.cq_head).load(Ordering::Relaxed);
+            let tail = (*self.cq_tail).load(Ordering::Acquire);
+            while head != tail {
+                let cqe = &*self.cqes.add((head & self.cq_mask) as usize);
+                completions.push((cqe.user_data, cqe.res));
+                head = head.wrapping_add(1);
+            }
+            (*self.cq_head).store(head, Ordering::Release);
+        }
+        completions
+    }
+}
+
+impl Drop for Ring {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.fd) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs::File;
+    use std::io::Write;
+    use std::os::unix::io::AsRawFd;
+    use tempfile::tempfile;
+
+    #[test]
+    fn test_ring() {
+        let mut ring = match Ring::new(4) {
+            Ok(ring) => ring,
+            // e.g. disabled by kernel.io_uring_disabled
+            Err(e) => return eprintln!("skip, no io_uring: {}", e),
+        };
+        let mut file: File = tempfile().unwrap();
+        file.write_all(&[0u8; 8]).unwrap();
+        let mut data = *b"abcdefgh";
+        let mut out = [0u8; 4];
+        let write = [iovec {
+            iov_base: data.as_mut_ptr() as *mut c_void,
+            iov_len: 4,
+        }];
+        let read = [iovec {
+            iov_base: out.as_mut_ptr() as *mut c_void,
+            iov_len: 4,
+        }];
+        let fd = file.as_raw_fd();
+        let eventfd = unsafe { libc::eventfd(0, 0) };
+        assert!(eventfd >= 0);
+        ring.register_eventfd(eventfd).unwrap();
+        unsafe {
+            assert!(ring.push(&Entry::writev(fd, write.as_ptr(), 1, 2).user_data(1)));
+            assert!(ring.push(&Entry::fsync(fd).user_data(2)));
+        }
+        assert_eq!(ring.submit().unwrap(), 2);
+        let mut done = vec![];
+        while done.len() < 2 {
+            ring.submit_and_wait(1).unwrap();
+            done.extend(ring.completions());
+        }
+        done.sort_unstable();
+        assert_eq!(done, vec![(1, 4), (2, 0)]);
+        let mut count = 0u64;
+        let n = unsafe { libc::read(eventfd, &mut count as *mut u64 as *mut c_void, 8) };
+        assert_eq!((n, count), (8, 2));
+        unsafe { libc::close(eventfd) };
+
+        unsafe { assert!(ring.push(&Entry::readv(fd, read.as_ptr(), 1, 1).user_data(3))) };
+        ring.submit_and_wait(1).unwrap();
+        assert_eq!(ring.completions(), vec![(3, 4)]);
+        assert_eq!(&out, b"\0abc");
+    }
+}
@@ -3,7 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0 OR BSD-3-Clause
 
 use std::borrow::{Borrow, BorrowMut};
-use std::fs::OpenOptions;
+use std::fs::{File, OpenOptions};
 use std::ops::DerefMut;
 use std::sync::{Arc, Mutex};
 use virtio_device::{VirtioDevice, VirtioDeviceType};
@@ -17,13 +17,15 @@ use vm_device::{DeviceMmio, MutDeviceMmio};
 use vm_memory::GuestAddressSpace;
 use vmm_sys_util::eventfd::EventFd;
 
-use crate::devices::virtio::console::log_handler::LogQueueHandler;
-use crate::devices::virtio::console::VIRTIO_CONSOLE_F_SIZE;
+use crate::devices::virtio::console::log_handler::{bytes_available, LogQueueHandler};
+use crate::devices::virtio::console::{ConsoleStats, VIRTIO_CONSOLE_F_SIZE};
+use crate::devices::virtio::direct_io::DirectIo;
 use crate::devices::virtio::features::{
     VIRTIO_F_IN_ORDER, VIRTIO_F_RING_EVENT_IDX, VIRTIO_F_VERSION_1,
 };
 use crate::devices::virtio::{
-    register_ioeventfd, IrqAckHandler, MmioConfig, SingleFdSignalQueue, QUEUE_MAX_SIZE,
+    kick_queue, mmio_written, register_ioeventfds, DeviceStats, IrqAckHandler, MmioConfig,
+    SingleFdSignalQueue, QUEUE_MAX_SIZE,
 };
 use crate::kvm::hypervisor::Hypervisor;
 
@@ -39,6 +41,13 @@ pub struct Console<M: GuestAddressSpace> {
     vmm: Arc<Hypervisor>,
     irqfd: Arc<EventFd>,
     sub_id: Option<SubscriberId>,
+    pub stats: Arc<DeviceStats>,
+    pub io_stats: Arc<ConsoleStats>,
+    direct_io: Arc<DirectIo>,
+    file: Option<File>,
+    // Duplicates of the queue ioeventfds to forward queue notifications that trapped anyway.
+    rx_kick: Option<EventFd>,
+    tx_kick: Option<EventFd>,
 
     // Before resetting we return the handler to the mmio thread for cleanup
     #[allow(dead_code)]
@@ -80,10 +89,14 @@ where
 
         let mmio_cfg = args.common.mmio_cfg;
 
-        let irq_ack_handler = Arc::new(Mutex::new(IrqAckHandler::new(
+        let stats = Arc::new(DeviceStats::default());
+        let irq_ack_handler = IrqAckHandler::subscribe(
+            args.common.event_mgr,
             virtio_cfg.interrupt_status.clone(),
             Arc::clone(&irqfd),
-        )));
+            stats.clone(),
+        )
+        .map_err(Error::Simple)?;
 
         let console = Arc::new(Mutex::new(Console {
             virtio_cfg,
@@ -93,6 +106,12 @@ where
             vmm: args.common.vmm.clone(),
             irqfd,
             sub_id: None,
+            stats,
+            io_stats: Arc::new(ConsoleStats::default()),
+            direct_io: args.direct_io,
+            file: args.file,
+            rx_kick: None,
+            tx_kick: None,
             handler: None,
         }));
 
@@ -121,25 +140,43 @@ where
             ack_handler: self.irq_ack_handler.clone(),
         };
 
-        // FIXME replace with actual console
-        let console = map_err_with!(
-            OpenOptions::new()
-                .read(true)
-                .write(true)
-                .open("/proc/self/fd/0"),
-            "could not open console"
-        )
+        let console = match &self.file {
+            Some(file) => map_err_with!(file.try_clone(), "could not duplicate console file"),
+            None => map_err_with!(
+                OpenOptions::new()
+                    .read(true)
+                    .write(true)
+                    .open("/proc/self/fd/0"),
+                "could not open console"
+            ),
+        }
         .map_err(Error::Simple)?;
 
-        //let rx_fd = register_ioeventfd(&self.vmm, &self.mmio_cfg, 0).map_err(Error::Simple)?;
-        let tx_fd = register_ioeventfd(&self.vmm, &self.mmio_cfg, 1).map_err(Error::Simple)?;
+        // input is only forwarded from ttys, pipes and sockets which tell us how much they have
+        let rx = bytes_available(&console).is_some();
+        if !rx {
+            log::info!("console input is not forwarded to the guest");
+        }
+
+        let mut ioeventfds =
+            register_ioeventfds(&self.vmm, &self.mmio_cfg, &[0, 1]).map_err(Error::Simple)?;
+        let tx_fd = ioeventfds.pop().unwrap();
+        let rx_fd = ioeventfds.pop().unwrap();
+        self.rx_kick = Some(rx_fd.try_clone().map_err(Error::EventFd)?);
+        self.tx_kick = Some(tx_fd.try_clone().map_err(Error::EventFd)?);
 
         let handler = Arc::new(Mutex::new(LogQueueHandler {
             driver_notify,
             tx_fd,
+            rx_fd,
             rxq: self.virtio_cfg.queues[0].clone(),
             txq: self.virtio_cfg.queues[1].clone(),
             console,
+            direct_io: self.direct_io.clone(),
+            rx,
+            input_watched: false,
+            stats: self.stats.clone(),
+            io_stats: self.io_stats.clone(),
         }));
 
         // Register the queue handler with the `EventManager`. We record the `sub_id`
@@ -161,6 +198,8 @@ where
         Ok(())
     }
     fn _reset(&mut self) -> Result<()> {
+        self.rx_kick = None;
+        self.tx_kick = None;
         // we remove the handler here, since we need to free up the ioeventfd resources
         // in the mmio thread rather the eventmanager thread.
         if let Some(sub_id) = self.sub_id.take() {
@@ -217,14 +256,26 @@ impl<M: GuestAddressSpace + Clone + Send + 'static> VirtioDeviceActions for Cons
     }
 }
 
-impl<M: GuestAddressSpace + Clone + Send + 'static> VirtioMmioDevice<M> for Console<M> {}
+impl<M: GuestAddressSpace + Clone + Send + 'static> VirtioMmioDevice<M> for Console<M> {
+    fn queue_notify(&mut self, val: u32) {
+        let kick = match val {
+            0 => self.rx_kick.as_ref(),
+            1 => self.tx_kick.as_ref(),
+            _ => None,
+        };
+        kick_queue(kick, val);
+    }
+}
 
 impl<M: GuestAddressSpace + Clone + Send + 'static> MutDeviceMmio for Console<M> {
     fn mmio_read(&mut self, _base: MmioAddress, offset: u64, data: &mut [u8]) {
+        self.stats.mmio_exit(self.device_status(), offset);
         self.read(offset, data);
     }
 
     fn mmio_write(&mut self, _base: MmioAddress, offset: u64, data: &[u8]) {
+        self.stats.mmio_exit(self.device_status(), offset);
         self.write(offset, data);
+        mmio_written(&self.irq_ack_handler, offset);
     }
 }
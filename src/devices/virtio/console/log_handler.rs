@@ -2,19 +2,24 @@
 // Author of further modifications: Peter Okelmann
 // SPDX-License-Identifier: Apache-2.0 OR BSD-3-Clause
 
+use std::cmp::min;
 use std::fs::File;
+use std::io;
+use std::os::unix::io::AsRawFd;
 use std::result;
+use std::sync::Arc;
 
 use event_manager::EventOps;
 use event_manager::EventSet;
 use event_manager::Events;
 use event_manager::MutEventSubscriber;
-use log::error;
+use log::{debug, error, warn};
 use virtio_queue::{DescriptorChain, Queue};
-use vm_memory::Bytes;
-use vm_memory::{self, GuestAddressSpace};
+use vm_memory::{self, GuestAddress, GuestAddressSpace};
 
-use crate::devices::virtio::SignalUsedQueue;
+use crate::devices::virtio::console::ConsoleStats;
+use crate::devices::virtio::direct_io::{segments_len, sub_segments, DirectIo};
+use crate::devices::virtio::{DeviceStats, SignalUsedQueue};
 use crate::kvm::hypervisor::IoEventFd;
 
 #[derive(Debug)]
@@ -35,15 +40,51 @@ impl From<virtio_queue::Error> for Error {
     }
 }
 
+const RX_IOEVENT_DATA: u32 = 0;
 const TX_IOEVENT_DATA: u32 = 1;
+const INPUT_DATA: u32 = 2;
 
+/// Number of bytes that can be read from `file` without blocking, if it is a tty, pipe or
+/// socket.
+pub fn bytes_available(file: &File) -> Option<usize> {
+    let mut avail: libc::c_int = 0;
+    if unsafe { libc::ioctl(file.as_raw_fd(), libc::FIONREAD, &mut avail) } < 0 {
+        return None;
+    }
+    Some(avail as usize)
+}
+
+/// Buffers of `chain` the device may read from (`write_only == false`) or write to.
+fn chain_segments<M: GuestAddressSpace>(
+    chain: &mut DescriptorChain<M>,
+    write_only: bool,
+) -> Vec<(GuestAddress, u32)> {
+    let mut segments = vec![];
+    for desc in chain {
+        if desc.is_write_only() == write_only {
+            segments.push((desc.addr(), desc.len()));
+        }
+    }
+    segments
+}
+
+/// Copies guest output (tx) to `console` and input from `console` (rx, if enabled) into buffers
+/// the guest posted. All chains available at once are moved with one writev/readv, straight
+/// from/to guest memory if `direct_io` has it mapped.
 pub(crate) struct LogQueueHandler<M: GuestAddressSpace, S: SignalUsedQueue> {
     pub tx_fd: IoEventFd,
+    pub rx_fd: IoEventFd,
     pub driver_notify: S,
-    #[allow(unused)]
     pub rxq: Queue<M>,
     pub txq: Queue<M>,
     pub console: File,
+    pub direct_io: Arc<DirectIo>,
+    /// whether to forward input from `console` to the guest
+    pub rx: bool,
+    /// whether `console` is registered for input, which we only want while there are rx buffers
+    pub input_watched: bool,
+    pub stats: Arc<DeviceStats>,
+    pub io_stats: Arc<ConsoleStats>,
 }
 
 impl<M, S> LogQueueHandler<M, S>
@@ -57,49 +98,143 @@ where
             .expect("Failed to remove tx ioevent");
     }
 
-    fn process_chain(&mut self, mut chain: DescriptorChain<M>) -> result::Result<(), Error> {
-        log::trace!("process_chain");
-
-        let mut i = 0;
-        while let Some(desc) = chain.next() {
-            let mem = chain.memory();
-            if let Err(e) = mem.write_to(desc.addr(), &mut self.console, desc.len() as usize) {
-                error!("error logging console: {}", e)
-            }
-            i += 1;
-        }
-        self.txq.add_used(chain.head_index(), i as u32)?;
-
-        if self.txq.needs_notification()? {
-            log::trace!("notification needed: yes");
-            self.driver_notify.signal_used_queue(0);
-        } else {
-            log::trace!("notification needed: no");
-        }
-
-        Ok(())
-    }
-
     pub fn process_txq(&mut self) -> result::Result<(), Error> {
+        let mut completed = false;
         // To see why this is done in a loop, please look at the `Queue::enable_notification`
         // comments in `vm_virtio`.
         loop {
             self.txq.disable_notification()?;
 
-            while let Some(chain) = self.txq.iter()?.next() {
-                self.process_chain(chain)?;
+            let mut heads = vec![];
+            let mut segments = vec![];
+            while let Some(mut chain) = self.txq.iter()?.next() {
+                segments.append(&mut chain_segments(&mut chain, false));
+                heads.push(chain.head_index());
+            }
+            if !heads.is_empty() {
+                match self.direct_io.write_stream(&self.console, &segments) {
+                    Ok(syscalls) => {
+                        self.io_stats
+                            .add_tx(segments_len(&segments), heads.len(), syscalls)
+                    }
+                    // nobody reads the pty of a session
+                    Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                        debug!("console output dropped")
+                    }
+                    Err(e) => error!("error logging console: {}", e),
+                }
+                for head in heads {
+                    self.txq.add_used(head, 0)?;
+                }
+                completed = true;
             }
 
             if !self.txq.enable_notification()? {
                 break;
             }
         }
+
+        // one notification for all chains of this round
+        if completed {
+            self.notify_driver(false)?;
+        }
         Ok(())
     }
+
+    /// Move pending input into as many rx buffers as needed. Returns false if there is no rx
+    /// buffer left, so the input should not be watched until the driver posts more.
+    pub fn process_input(&mut self) -> result::Result<bool, Error> {
+        let avail = match bytes_available(&self.console) {
+            Some(avail) if avail > 0 => avail,
+            // hangup or end of file
+            _ => {
+                self.rx = false;
+                return Ok(false);
+            }
+        };
+
+        let mut heads = vec![];
+        let mut segments = vec![];
+        let mut capacity = 0;
+        while capacity < avail {
+            let mut chain = match self.rxq.iter()?.next() {
+                Some(chain) => chain,
+                None => break,
+            };
+            let mut chain_segs = chain_segments(&mut chain, true);
+            let len = segments_len(&chain_segs);
+            capacity += len;
+            heads.push((chain.head_index(), len));
+            segments.append(&mut chain_segs);
+        }
+        if heads.is_empty() {
+            return Ok(false);
+        }
+
+        let segments = sub_segments(&segments, 0, min(avail, capacity));
+        let mut read = match self.direct_io.read_stream(&self.console, &segments) {
+            Ok((read, syscalls)) => {
+                self.io_stats.add_rx(read, heads.len(), syscalls);
+                read
+            }
+            Err(e) => {
+                warn!("cannot read console input: {}", e);
+                0
+            }
+        };
+        // chains are filled one after the other
+        for (head, len) in heads {
+            let used = min(read, len);
+            read -= used;
+            self.rxq.add_used(head, used as u32)?;
+        }
+        self.notify_driver(true)?;
+        Ok(capacity >= avail)
+    }
+
+    fn notify_driver(&mut self, rx: bool) -> result::Result<(), Error> {
+        let queue = if rx { &mut self.rxq } else { &mut self.txq };
+        if queue.needs_notification()? {
+            log::trace!("notification needed: yes");
+            self.driver_notify.signal_used_queue(0);
+        } else {
+            log::trace!("notification needed: no");
+        }
+        Ok(())
+    }
+
+    fn watch_input(&mut self, ops: &mut EventOps, watch: bool) {
+        let watch = watch && self.rx;
+        if watch == self.input_watched {
+            return;
+        }
+        let res = if watch {
+            ops.add(Events::with_data(&self.console, INPUT_DATA, EventSet::IN))
+        } else {
+            ops.remove(Events::empty(&self.console))
+        };
+        match res {
+            Ok(()) => self.input_watched = watch,
+            Err(e) => error!("cannot update console input events: {:?}", e),
+        }
+    }
 }
 
 impl<M: GuestAddressSpace, S: SignalUsedQueue> MutEventSubscriber for LogQueueHandler<M, S> {
     fn process(&mut self, events: Events, ops: &mut EventOps) {
+        // input may come with EventSet::HUP, which `process_input` notices
+        if INPUT_DATA == events.data() {
+            match self.process_input() {
+                Ok(more) => self.watch_input(ops, more),
+                Err(e) => {
+                    error!("Process rx error {:?}", e);
+                    self.rx = false;
+                    self.watch_input(ops, false);
+                }
+            }
+            return;
+        }
+
         if events.event_set() != EventSet::IN {
             self.handle_error("Unexpected event_set", ops);
             return;
@@ -109,9 +244,17 @@ impl<M: GuestAddressSpace, S: SignalUsedQueue> MutEventSubscriber for LogQueueHa
             if self.tx_fd.read().is_err() {
                 self.handle_error("Tx ioevent read", ops);
             }
+            self.stats.ioeventfd_notify();
             if let Err(e) = self.process_txq() {
                 self.handle_error(format!("Process tx error {:?}", e), ops);
             }
+        } else if RX_IOEVENT_DATA == events.data() {
+            if let Err(e) = self.rx_fd.read() {
+                error!("Rx ioevent read: {}", e);
+            }
+            self.stats.ioeventfd_notify();
+            // the driver posted new rx buffers
+            self.watch_input(ops, true);
         } else {
             self.handle_error("Unexpected data", ops)
         }
@@ -124,5 +267,12 @@ impl<M: GuestAddressSpace, S: SignalUsedQueue> MutEventSubscriber for LogQueueHa
             EventSet::IN,
         ))
         .expect("Failed to register tx ioeventfd for console queue handler");
+        ops.add(Events::with_data(
+            &self.rx_fd,
+            RX_IOEVENT_DATA,
+            EventSet::IN,
+        ))
+        .expect("Failed to register rx ioeventfd for console queue handler");
+        self.watch_input(ops, true);
     }
 }
@@ -3,13 +3,20 @@ mod device;
 //mod queue_handler;
 mod log_handler;
 
+use std::fmt;
+use std::fs::File;
 use std::io;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Instant;
 
 use event_manager::Error as EvmgrError;
 use vm_device::bus;
 use vmm_sys_util::errno;
 
+use crate::devices::virtio::direct_io::DirectIo;
 use crate::devices::virtio::CommonArgs;
+use crate::metrics::Exposition;
 use simple_error::SimpleError;
 
 pub use device::Console;
@@ -97,7 +104,121 @@ fn build_config_space() -> Vec<u8> {
     unsafe { any_as_u8_slice(&config) }.to_vec()
 }
 
+/// Throughput of the console since the device was created.
+pub struct ConsoleStats {
+    started: Instant,
+    tx_bytes: AtomicU64,
+    tx_chains: AtomicU64,
+    tx_syscalls: AtomicU64,
+    rx_bytes: AtomicU64,
+    rx_chains: AtomicU64,
+    rx_syscalls: AtomicU64,
+}
+
+impl Default for ConsoleStats {
+    fn default() -> Self {
+        ConsoleStats {
+            started: Instant::now(),
+            tx_bytes: AtomicU64::new(0),
+            tx_chains: AtomicU64::new(0),
+            tx_syscalls: AtomicU64::new(0),
+            rx_bytes: AtomicU64::new(0),
+            rx_chains: AtomicU64::new(0),
+            rx_syscalls: AtomicU64::new(0),
+        }
+    }
+}
+
+impl ConsoleStats {
+    pub fn add_tx(&self, bytes: usize, chains: usize, syscalls: usize) {
+        self.tx_bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+        self.tx_chains.fetch_add(chains as u64, Ordering::Relaxed);
+        self.tx_syscalls
+            .fetch_add(syscalls as u64, Ordering::Relaxed);
+    }
+
+    pub fn write_metrics(&self, exp: &mut Exposition, labels: &str) {
+        for (direction, bytes, chains, syscalls) in &[
+            ("tx", &self.tx_bytes, &self.tx_chains, &self.tx_syscalls),
+            ("rx", &self.rx_bytes, &self.rx_chains, &self.rx_syscalls),
+        ] {
+            let labels = format!("{},direction=\"{}\"", labels, direction);
+            exp.counter(
+                "vmsh_console_bytes_total",
+                &labels,
+                bytes.load(Ordering::Relaxed),
+            );
+            exp.counter(
+                "vmsh_console_chains_total",
+                &labels,
+                chains.load(Ordering::Relaxed),
+            );
+            exp.counter(
+                "vmsh_console_syscalls_total",
+                &labels,
+                syscalls.load(Ordering::Relaxed),
+            );
+        }
+    }
+
+    pub fn add_rx(&self, bytes: usize, chains: usize, syscalls: usize) {
+        self.rx_bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+        self.rx_chains.fetch_add(chains as u64, Ordering::Relaxed);
+        self.rx_syscalls
+            .fetch_add(syscalls as u64, Ordering::Relaxed);
+    }
+}
+
+fn write_direction(
+    f: &mut fmt::Formatter,
+    name: &str,
+    secs: f64,
+    bytes: &AtomicU64,
+    chains: &AtomicU64,
+    syscalls: &AtomicU64,
+) -> fmt::Result {
+    let bytes = bytes.load(Ordering::Relaxed);
+    let chains = chains.load(Ordering::Relaxed);
+    let syscalls = syscalls.load(Ordering::Relaxed);
+    write!(
+        f,
+        "{}: {} bytes ({:.0} bytes/s), {} chains, {:.2} syscalls/chain",
+        name,
+        bytes,
+        bytes as f64 / secs,
+        chains,
+        syscalls as f64 / (chains.max(1) as f64)
+    )
+}
+
+impl fmt::Display for ConsoleStats {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let secs = self.started.elapsed().as_secs_f64().max(1e-3);
+        write_direction(
+            f,
+            "tx",
+            secs,
+            &self.tx_bytes,
+            &self.tx_chains,
+            &self.tx_syscalls,
+        )?;
+        write!(f, "; ")?;
+        write_direction(
+            f,
+            "rx",
+            secs,
+            &self.rx_bytes,
+            &self.rx_chains,
+            &self.rx_syscalls,
+        )
+    }
+}
+
 // Arguments required when building a console device.
 pub struct ConsoleArgs<'a, M, B> {
     pub common: CommonArgs<'a, M, B>,
+    /// used to copy console data between guest memory and the host file
+    pub direct_io: Arc<DirectIo>,
+    /// file the console is connected to, stdin of vmsh if None
+    pub file: Option<File>,
 }
@@ -0,0 +1,474 @@
+use libc::{c_void, iovec};
+use log::{debug, warn};
+use nix::sys::mman::{self, MapFlags, ProtFlags};
+use nix::unistd::Pid;
+use simple_error::{require_with, try_with};
+use std::fs::{File, OpenOptions};
+use std::io::{self, Read};
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+use std::ptr;
+use vm_memory::GuestAddress;
+
+use crate::kvm::memslots::fetch_mappings;
+use crate::result::Result;
+use crate::tracer::proc::{find_mapping, pid_path, Mapping};
+
+/// Guest memory of a memslot that is also mapped into our process. Only possible if the
+/// hypervisor backs guest memory with a shared file mapping (i.e. memfd or hugetlbfs).
+struct LocalMapping {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl LocalMapping {
+    fn new(pid: Pid, slot: &Mapping, vmas: &[Mapping]) -> Result<LocalMapping> {
+        // `slot` is clipped to the memslot, the file in map_files is named after the whole vma.
+        let vma = require_with!(
+            find_mapping(vmas, slot.start),
+            "no mapping for memslot at 0x{:x}",
+            slot.start
+        );
+        let path = pid_path(pid)
+            .join("map_files")
+            .join(format!("{:x}-{:x}", vma.start, vma.end));
+        let file = try_with!(
+            OpenOptions::new().read(true).write(true).open(&path),
+            "cannot open {}",
+            path.display()
+        );
+        let offset = vma.offset + (slot.start - vma.start) as u64;
+        let ptr = try_with!(
+            unsafe {
+                mman::mmap(
+                    ptr::null_mut(),
+                    slot.size(),
+                    ProtFlags::PROT_READ | ProtFlags::PROT_WRITE,
+                    MapFlags::MAP_SHARED,
+                    file.as_raw_fd(),
+                    offset as libc::off_t,
+                )
+            },
+            "cannot mmap {}",
+            path.display()
+        );
+        Ok(LocalMapping {
+            ptr: ptr as *mut u8,
+            len: slot.size(),
+        })
+    }
+}
+
+impl Drop for LocalMapping {
+    fn drop(&mut self) {
+        if let Err(e) = unsafe { mman::munmap(self.ptr as *mut c_void, self.len) } {
+            warn!("cannot unmap guest memory: {}", e);
+        }
+    }
+}
+
+struct Region {
+    phys_start: u64,
+    phys_end: u64,
+    /// address of the memslot in the hypervisor
+    host_start: usize,
+    local: Option<LocalMapping>,
+}
+
+/// Part of a guest buffer that lies within a single memslot.
+struct Piece {
+    remote: usize,
+    local: Option<*mut u8>,
+    len: usize,
+}
+
+/// Moves data between files and guest buffers (as found in descriptor chains) with as few
+/// copies and syscalls as possible:
+///
+/// - If guest memory is a shared mapping, we map it as well and read/write the file straight
+///   into guest memory with preadv/pwritev.
+/// - Otherwise the data goes through a single buffer, which is copied to/from the hypervisor
+///   with one process_vm_readv/process_vm_writev per chain rather than one per descriptor.
+pub struct DirectIo {
+    pid: Pid,
+    regions: Vec<Region>,
+}
+
+// Local mappings are plain memory shared with the guest, which is free to modify it anytime.
+unsafe impl Send for DirectIo {}
+unsafe impl Sync for DirectIo {}
+
+fn io_err(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, msg)
+}
+
+impl DirectIo {
+    /// `mappings` are the memslots of the guest as returned by `Hypervisor::get_maps()`.
+    pub fn new(pid: Pid, mappings: &[Mapping]) -> Result<DirectIo> {
+        let vmas = fetch_mappings(pid)?;
+        let regions = mappings
+            .iter()
+            .map(|m| {
+                let local = if m.map_flags.contains(MapFlags::MAP_SHARED) {
+                    match LocalMapping::new(pid, m, &vmas) {
+                        Ok(l) => Some(l),
+                        Err(e) => {
+                            debug!("cannot share guest memory at 0x{:x}: {}", m.phys_addr, e);
+                            None
+                        }
+                    }
+                } else {
+                    None
+                };
+                Region {
+                    phys_start: m.phys_addr as u64,
+                    phys_end: m.phys_end() as u64,
+                    host_start: m.start,
+                    local,
+                }
+            })
+            .collect::<Vec<_>>();
+        let shared = regions.iter().filter(|r| r.local.is_some()).count();
+        debug!(
+            "{} of {} memslots are mapped for zero-copy io",
+            shared,
+            regions.len()
+        );
+        Ok(DirectIo { pid, regions })
+    }
+
+    fn pieces(&self, segments: &[(GuestAddress, u32)]) -> io::Result<Vec<Piece>> {
+        let mut pieces = Vec::with_capacity(segments.len());
+        for (addr, len) in segments {
+            let mut addr = addr.0;
+            let mut len = *len as u64;
+            // descriptors may cross the boundary of memslots
+            while len > 0 {
+                let region = self
+                    .regions
+                    .iter()
+                    .find(|r| r.phys_start <= addr && addr < r.phys_end)
+                    .ok_or_else(|| io_err("guest buffer is not backed by a memslot"))?;
+                let offset = (addr - region.phys_start) as usize;
+                let piece_len = std::cmp::min(len, region.phys_end - addr);
+                pieces.push(Piece {
+                    remote: region.host_start + offset,
+                    local: region.local.as_ref().map(|l| unsafe { l.ptr.add(offset) }),
+                    len: piece_len as usize,
+                });
+                addr += piece_len;
+                len -= piece_len;
+            }
+        }
+        Ok(pieces)
+    }
+
+    /// iovecs pointing straight into guest memory, if all of `segments` are mapped locally.
+    /// The iovecs stay valid as long as `self` is alive.
+    pub fn local_iovecs(&self, segments: &[(GuestAddress, u32)]) -> Option<Vec<iovec>> {
+        let pieces = self.pieces(segments).ok()?;
+        pieces
+            .iter()
+            .map(|p| {
+                p.local.map(|ptr| iovec {
+                    iov_base: ptr as *mut c_void,
+                    iov_len: p.len,
+                })
+            })
+            .collect()
+    }
+
+    fn remote_iovecs(&self, segments: &[(GuestAddress, u32)]) -> io::Result<Vec<iovec>> {
+        Ok(self
+            .pieces(segments)?
+            .iter()
+            .map(|p| iovec {
+                iov_base: p.remote as *mut c_void,
+                iov_len: p.len,
+            })
+            .collect())
+    }
+
+    /// Copy `segments` of guest memory into `buf` with a single syscall.
+    pub fn read_guest(&self, buf: &mut [u8], segments: &[(GuestAddress, u32)]) -> io::Result<()> {
+        let remote = self.remote_iovecs(segments)?;
+        let local = iovec {
+            iov_base: buf.as_mut_ptr() as *mut c_void,
+            iov_len: buf.len(),
+        };
+        let res = unsafe {
+            libc::process_vm_readv(
+                self.pid.as_raw(),
+                &local,
+                1,
+                remote.as_ptr(),
+                remote.len() as libc::c_ulong,
+                0,
+            )
+        };
+        check_len(res, buf.len())
+    }
+
+    /// Copy `buf` into `segments` of guest memory with a single syscall.
+    pub fn write_guest(&self, buf: &[u8], segments: &[(GuestAddress, u32)]) -> io::Result<()> {
+        let remote = self.remote_iovecs(segments)?;
+        let local = iovec {
+            iov_base: buf.as_ptr() as *mut c_void,
+            iov_len: buf.len(),
+        };
+        let res = unsafe {
+            libc::process_vm_writev(
+                self.pid.as_raw(),
+                &local,
+                1,
+                remote.as_ptr(),
+                remote.len() as libc::c_ulong,
+                0,
+            )
+        };
+        check_len(res, buf.len())
+    }
+
+    /// Read `file` at `offset` into the guest buffers. Returns the number of bytes read.
+    pub fn read_file(
+        &self,
+        file: &File,
+        offset: u64,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<usize> {
+        if let Some(iovecs) = self.local_iovecs(segments) {
+            let res = unsafe {
+                libc::preadv(
+                    file.as_raw_fd(),
+                    iovecs.as_ptr(),
+                    iovecs.len() as libc::c_int,
+                    offset as libc::off_t,
+                )
+            };
+            let len = segments_len(segments);
+            return check_len(res, len).map(|_| len);
+        }
+        let mut buf = vec![0; segments_len(segments)];
+        file.read_exact_at(&mut buf, offset)?;
+        self.write_guest(&buf, segments)?;
+        Ok(buf.len())
+    }
+
+    /// Write the guest buffers to `file` at `offset`. Returns the number of bytes written.
+    pub fn write_file(
+        &self,
+        file: &File,
+        offset: u64,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<usize> {
+        if let Some(iovecs) = self.local_iovecs(segments) {
+            let res = unsafe {
+                libc::pwritev(
+                    file.as_raw_fd(),
+                    iovecs.as_ptr(),
+                    iovecs.len() as libc::c_int,
+                    offset as libc::off_t,
+                )
+            };
+            let len = segments_len(segments);
+            return check_len(res, len).map(|_| len);
+        }
+        let mut buf = vec![0; segments_len(segments)];
+        self.read_guest(&mut buf, segments)?;
+        file.write_all_at(&buf, offset)?;
+        Ok(buf.len())
+    }
+
+    /// Write the guest buffers to a pipe, tty or socket, retrying on short writes. Returns the
+    /// number of syscalls that were needed.
+    pub fn write_stream(&self, file: &File, segments: &[(GuestAddress, u32)]) -> io::Result<usize> {
+        let mut bounce = vec![];
+        let mut iovecs = match self.local_iovecs(segments) {
+            Some(iovecs) => iovecs,
+            None => {
+                bounce.resize(segments_len(segments), 0);
+                self.read_guest(&mut bounce, segments)?;
+                vec![iovec {
+                    iov_base: bounce.as_mut_ptr() as *mut c_void,
+                    iov_len: bounce.len(),
+                }]
+            }
+        };
+        let mut syscalls = if bounce.is_empty() { 0 } else { 1 };
+        let mut remaining = &mut iovecs[..];
+        while !remaining.is_empty() {
+            let res = unsafe {
+                libc::writev(
+                    file.as_raw_fd(),
+                    remaining.as_ptr(),
+                    std::cmp::min(remaining.len(), IOV_MAX) as libc::c_int,
+                )
+            };
+            syscalls += 1;
+            if res < 0 {
+                let err = io::Error::last_os_error();
+                if err.kind() == io::ErrorKind::Interrupted {
+                    continue;
+                }
+                return Err(err);
+            }
+            advance(&mut remaining, res as usize);
+        }
+        Ok(syscalls)
+    }
+
+    /// Read from a pipe, tty or socket into the guest buffers with a single read. Returns the
+    /// number of bytes read and the number of syscalls needed.
+    pub fn read_stream(
+        &self,
+        file: &File,
+        segments: &[(GuestAddress, u32)],
+    ) -> io::Result<(usize, usize)> {
+        let segments = &segments[..std::cmp::min(segments.len(), IOV_MAX)];
+        if let Some(iovecs) = self.local_iovecs(segments) {
+            let res = unsafe {
+                libc::readv(
+                    file.as_raw_fd(),
+                    iovecs.as_ptr(),
+                    iovecs.len() as libc::c_int,
+                )
+            };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            return Ok((res as usize, 1));
+        }
+        let mut buf = vec![0; segments_len(segments)];
+        let len = (&*file).read(&mut buf)?;
+        if len == 0 {
+            return Ok((0, 1));
+        }
+        self.write_guest(&buf[..len], &sub_segments(segments, 0, len))?;
+        Ok((len, 2))
+    }
+}
+
+pub fn segments_len(segments: &[(GuestAddress, u32)]) -> usize {
+    segments.iter().map(|(_, len)| *len as usize).sum()
+}
+
+/// The part of `segments` that covers `len` bytes starting at byte `skip`.
+pub fn sub_segments(
+    segments: &[(GuestAddress, u32)],
+    mut skip: usize,
+    mut len: usize,
+) -> Vec<(GuestAddress, u32)> {
+    let mut res = vec![];
+    for (addr, seg_len) in segments {
+        let seg_len = *seg_len as usize;
+        if skip >= seg_len {
+            skip -= seg_len;
+            continue;
+        }
+        if len == 0 {
+            break;
+        }
+        let part = std::cmp::min(seg_len - skip, len);
+        res.push((GuestAddress(addr.0 + skip as u64), part as u32));
+        len -= part;
+        skip = 0;
+    }
+    res
+}
+
+/// Maximum number of iovecs per readv/writev.
+const IOV_MAX: usize = 1024;
+
+/// Drop the first `len` bytes from `iovecs`.
+fn advance(iovecs: &mut &mut [iovec], mut len: usize) {
+    while let Some(first) = iovecs.first_mut() {
+        if len < first.iov_len {
+            first.iov_base = unsafe { (first.iov_base as *mut u8).add(len) } as *mut c_void;
+            first.iov_len -= len;
+            return;
+        }
+        len -= first.iov_len;
+        let rest = std::mem::take(iovecs);
+        *iovecs = &mut rest[1..];
+    }
+}
+
+fn check_len(res: isize, expected: usize) -> io::Result<()> {
+    if res < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    if res as usize != expected {
+        return Err(io_err(&format!(
+            "short transfer: {} of {} bytes",
+            res, expected
+        )));
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+impl DirectIo {
+    /// Treats guest physical addresses as addresses of our own process.
+    pub fn identity() -> DirectIo {
+        DirectIo {
+            pid: nix::unistd::getpid(),
+            regions: vec![Region {
+                phys_start: 0,
+                phys_end: u64::MAX,
+                host_start: 0,
+                local: None,
+            }],
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_sub_segments() {
+        let segments = [
+            (GuestAddress(0x1000), 0x100),
+            (GuestAddress(0x3000), 0x200),
+            (GuestAddress(0x5000), 0x100),
+        ];
+        assert_eq!(sub_segments(&segments, 0, 0x400), segments.to_vec());
+        assert_eq!(
+            sub_segments(&segments, 0x80, 0x100),
+            vec![(GuestAddress(0x1080), 0x80), (GuestAddress(0x3000), 0x80)]
+        );
+        assert_eq!(
+            sub_segments(&segments, 0x300, 0x80),
+            vec![(GuestAddress(0x5000), 0x80)]
+        );
+        assert_eq!(sub_segments(&segments, 0x100, 0), vec![]);
+    }
+
+    #[test]
+    fn test_streams() {
+        let (read_end, write_end) = nix::unistd::pipe().unwrap();
+        let (reader, writer) = unsafe {
+            use std::os::unix::io::FromRawFd;
+            (File::from_raw_fd(read_end), File::from_raw_fd(write_end))
+        };
+        let direct_io = DirectIo::identity();
+        let mut first = *b"hello ";
+        let mut second = *b"world";
+        let segments = [
+            (GuestAddress(first.as_mut_ptr() as u64), first.len() as u32),
+            (
+                GuestAddress(second.as_mut_ptr() as u64),
+                second.len() as u32,
+            ),
+        ];
+        // one bounce buffer copy and one write
+        assert_eq!(direct_io.write_stream(&writer, &segments).unwrap(), 2);
+
+        let mut buf = [0u8; 16];
+        let (len, _) = direct_io
+            .read_stream(&reader, &[(GuestAddress(buf.as_mut_ptr() as u64), 16)])
+            .unwrap();
+        assert_eq!(&buf[..len], b"hello world");
+    }
+}
@@ -6,21 +6,27 @@
 
 pub mod block;
 pub mod console;
+pub mod direct_io;
 
-use std::sync::atomic::{AtomicU8, Ordering};
+use std::fmt;
+use std::os::unix::io::AsRawFd;
+use std::sync::atomic::{AtomicU64, AtomicU8, Ordering};
 use std::sync::{Arc, Mutex};
 use std::time::{Duration, Instant};
 
 use crate::kvm::hypervisor::{Hypervisor, IoEventFd};
+use crate::metrics::{Exposition, Histogram};
 use crate::result::Result;
 use crate::tracer::inject_syscall;
 use crate::tracer::wrap_syscall::KvmRunWrapper;
-use event_manager::{EventManager, MutEventSubscriber};
+use event_manager::{EventManager, EventOps, EventSet, Events, MutEventSubscriber, RemoteEndpoint};
 use log::error;
+use nix::fcntl::{fcntl, FcntlArg, OFlag};
 
 use simple_error::try_with;
 use vm_device::bus::MmioRange;
 use vmm_sys_util::eventfd::EventFd;
+use vmm_sys_util::timerfd::TimerFd;
 
 // TODO: Move virtio-related defines from the local modules to the `vm-virtio` crate upstream.
 
@@ -43,9 +49,20 @@ const VIRTIO_MMIO_INT_VRING: u8 = 0x01;
 // about available queue events.
 const VIRTIO_MMIO_QUEUE_NOTIFY_OFFSET: u64 = 0x50;
 
+// Registers the driver still accesses once the device is set up.
+const VIRTIO_MMIO_INTERRUPT_STATUS_OFFSET: u64 = 0x60;
+const VIRTIO_MMIO_INTERRUPT_ACK_OFFSET: u64 = 0x64;
+const VIRTIO_MMIO_CONFIG_OFFSET: u64 = 0x100;
+
+// Device status bit set by the driver once it has set up the device.
+const VIRTIO_STATUS_DRIVER_OK: u8 = 4;
+
 // TODO: Make configurable for each device maybe?
 const QUEUE_MAX_SIZE: u16 = 256;
 
+/// Handle to an event manager running in a different thread.
+pub type SubscriberEndpoint = RemoteEndpoint<Arc<Mutex<dyn MutEventSubscriber + Send>>>;
+
 #[derive(Copy, Clone)]
 pub struct MmioConfig {
     pub range: MmioRange,
@@ -74,6 +91,143 @@ pub struct CommonArgs<'a, M, B> {
     // limitation.
 }
 
+/// Counts how a device is driven by its driver. Once the driver has set DRIVER_OK, queues are
+/// supposed to be notified through ioeventfds only: `trapped_notifies` should stay 0 and the
+/// remaining steady state traps should only grow with interrupts and config space accesses.
+#[derive(Default)]
+pub struct DeviceStats {
+    /// mmio exits before DRIVER_OK
+    pub setup_traps: AtomicU64,
+    /// mmio exits to the interrupt status and ack registers after DRIVER_OK
+    pub irq_traps: AtomicU64,
+    /// mmio exits to the device config space after DRIVER_OK
+    pub config_traps: AtomicU64,
+    /// queue notifications that trapped after DRIVER_OK instead of hitting the ioeventfd
+    pub trapped_notifies: AtomicU64,
+    /// any other mmio exit after DRIVER_OK
+    pub other_traps: AtomicU64,
+    /// queue notifications received through ioeventfds
+    pub ioeventfd_notifies: AtomicU64,
+    /// interrupts sent to the driver
+    pub irqs_sent: AtomicU64,
+    /// interrupts sent again because the driver did not ack them in time
+    pub irqs_resent: AtomicU64,
+    /// requests taken from the queues
+    pub requests: AtomicU64,
+    /// data bytes of these requests
+    pub request_bytes: AtomicU64,
+    /// requests found per queue notification
+    pub queue_depth: Histogram,
+}
+
+impl DeviceStats {
+    /// Account an mmio exit of the driver to the register at `offset`.
+    pub fn mmio_exit(&self, device_status: u8, offset: u64) {
+        let counter = if device_status & VIRTIO_STATUS_DRIVER_OK == 0 {
+            &self.setup_traps
+        } else {
+            match offset {
+                VIRTIO_MMIO_INTERRUPT_STATUS_OFFSET | VIRTIO_MMIO_INTERRUPT_ACK_OFFSET => {
+                    &self.irq_traps
+                }
+                VIRTIO_MMIO_QUEUE_NOTIFY_OFFSET => &self.trapped_notifies,
+                o if o >= VIRTIO_MMIO_CONFIG_OFFSET => &self.config_traps,
+                _ => &self.other_traps,
+            }
+        };
+        counter.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn ioeventfd_notify(&self) {
+        self.ioeventfd_notifies.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn request(&self, bytes: usize) {
+        self.requests.fetch_add(1, Ordering::Relaxed);
+        self.request_bytes
+            .fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+
+    /// Export the counters for the device labeled by `labels`.
+    pub fn write_metrics(&self, exp: &mut Exposition, labels: &str) {
+        for (kind, counter) in &[
+            ("setup", &self.setup_traps),
+            ("irq", &self.irq_traps),
+            ("config", &self.config_traps),
+            ("queue_notify", &self.trapped_notifies),
+            ("other", &self.other_traps),
+        ] {
+            exp.counter(
+                "vmsh_device_traps_total",
+                &format!("{},kind=\"{}\"", labels, kind),
+                counter.load(Ordering::Relaxed),
+            );
+        }
+        for (name, counter) in &[
+            (
+                "vmsh_device_ioeventfd_notifies_total",
+                &self.ioeventfd_notifies,
+            ),
+            ("vmsh_device_irqs_sent_total", &self.irqs_sent),
+            ("vmsh_device_irqs_resent_total", &self.irqs_resent),
+            ("vmsh_device_requests_total", &self.requests),
+            ("vmsh_device_request_bytes_total", &self.request_bytes),
+        ] {
+            exp.counter(name, labels, counter.load(Ordering::Relaxed));
+        }
+        // a queue holds at most QUEUE_MAX_SIZE requests
+        exp.histogram(
+            "vmsh_device_queue_depth",
+            labels,
+            &self.queue_depth,
+            1,
+            9,
+            1.0,
+        );
+    }
+
+    /// All mmio exits since the driver set DRIVER_OK.
+    pub fn steady_state_traps(&self) -> u64 {
+        self.irq_traps.load(Ordering::Relaxed)
+            + self.config_traps.load(Ordering::Relaxed)
+            + self.trapped_notifies.load(Ordering::Relaxed)
+            + self.other_traps.load(Ordering::Relaxed)
+    }
+}
+
+impl fmt::Display for DeviceStats {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(
+            f,
+            "setup traps: {}, steady state traps: {} (irq: {}, config: {}, queue notify: {}, other: {}), ioeventfd notifies: {}, irqs sent: {} (re-sent: {})",
+            self.setup_traps.load(Ordering::Relaxed),
+            self.steady_state_traps(),
+            self.irq_traps.load(Ordering::Relaxed),
+            self.config_traps.load(Ordering::Relaxed),
+            self.trapped_notifies.load(Ordering::Relaxed),
+            self.other_traps.load(Ordering::Relaxed),
+            self.ioeventfd_notifies.load(Ordering::Relaxed),
+            self.irqs_sent.load(Ordering::Relaxed),
+            self.irqs_resent.load(Ordering::Relaxed),
+        )
+    }
+}
+
+/// Forward a queue notification that was trapped instead of being delivered by the ioeventfd,
+/// i.e. if KVM did not match the written queue index. The queue handler listens on `kick`, so
+/// the request does not get lost.
+pub fn kick_queue(kick: Option<&EventFd>, queue_idx: u32) {
+    log::warn!(
+        "queue {} notify was trapped rather than delivered via ioeventfd",
+        queue_idx
+    );
+    if let Some(kick) = kick {
+        if let Err(e) = kick.write(1) {
+            error!("cannot kick queue {}: {}", queue_idx, e);
+        }
+    }
+}
+
 /// Simple trait to model the operation of signalling the driver about used events
 /// for the specified queue.
 // TODO: Does this need renaming to be relevant for packed queues as well?
@@ -83,6 +237,113 @@ pub trait SignalUsedQueue {
     fn signal_used_queue(&self, index: u16);
 }
 
+/// Timers may be disarmed after epoll reported them readable, so reads must not block.
+fn nonblocking_timerfd() -> Result<TimerFd> {
+    let timer = try_with!(TimerFd::new(), "cannot create timerfd");
+    try_with!(
+        fcntl(timer.as_raw_fd(), FcntlArg::F_SETFL(OFlag::O_NONBLOCK)),
+        "cannot make timerfd non-blocking"
+    );
+    Ok(timer)
+}
+
+fn read_timer(timer: &mut TimerFd, name: &str) {
+    if let Err(e) = timer.wait() {
+        if e.errno() != libc::EAGAIN {
+            error!("cannot read {} timer: {}", name, e);
+        }
+    }
+}
+
+/// Limits for delaying used-ring notifications, so that the driver gets one interrupt for
+/// several completed requests. All zero disables coalescing.
+#[derive(Copy, Clone, Debug, Default, PartialEq)]
+pub struct Coalescing {
+    /// notify at the latest once this many requests completed
+    pub max_pending: u32,
+    /// notify at the latest this long after the first unnotified request completed
+    pub max_delay: Duration,
+}
+
+impl Coalescing {
+    pub fn enabled(&self) -> bool {
+        self.max_pending > 1 && self.max_delay > Duration::from_secs(0)
+    }
+}
+
+/// Decides when a queue handler notifies the driver about completed requests. Handlers must
+/// add `timer()` to their events, call `expired()` when it fires, and `notified()` whenever
+/// they notify the driver.
+pub struct NotifyCoalescer {
+    cfg: Coalescing,
+    pending: u32,
+    // only exists if coalescing is enabled
+    timer: Option<TimerFd>,
+    armed: bool,
+}
+
+impl NotifyCoalescer {
+    pub fn new(cfg: Coalescing) -> Result<NotifyCoalescer> {
+        let timer = if cfg.enabled() {
+            Some(nonblocking_timerfd()?)
+        } else {
+            None
+        };
+        Ok(NotifyCoalescer {
+            cfg,
+            pending: 0,
+            timer,
+            armed: false,
+        })
+    }
+
+    pub fn timer(&self) -> Option<&TimerFd> {
+        self.timer.as_ref()
+    }
+
+    /// Account `n` completed requests. Returns true if the driver should be notified now.
+    pub fn completed(&mut self, n: u32) -> bool {
+        self.pending += n;
+        let timer = match &mut self.timer {
+            Some(timer) => timer,
+            None => return true,
+        };
+        if self.pending >= self.cfg.max_pending {
+            return true;
+        }
+        if !self.armed {
+            match timer.reset(self.cfg.max_delay, None) {
+                Ok(()) => self.armed = true,
+                Err(e) => {
+                    error!("cannot arm coalescing timer: {}", e);
+                    return true;
+                }
+            }
+        }
+        false
+    }
+
+    /// The driver has been notified about all pending requests.
+    pub fn notified(&mut self) {
+        self.pending = 0;
+        if let (true, Some(timer)) = (self.armed, &mut self.timer) {
+            if let Err(e) = timer.clear() {
+                error!("cannot disarm coalescing timer: {}", e);
+            }
+            self.armed = false;
+        }
+    }
+
+    /// The timer fired. Returns true if the driver should be notified now.
+    pub fn expired(&mut self) -> bool {
+        if let Some(timer) = &mut self.timer {
+            read_timer(timer, "coalescing");
+        }
+        self.armed = false;
+        self.pending > 0
+    }
+}
+
 /// Uses a single irqfd as the basis of signalling any queue (useful for the MMIO transport,
 /// where a single interrupt is shared for everything).
 pub struct SingleFdSignalQueue {
@@ -107,62 +368,146 @@ impl SignalUsedQueue for SingleFdSignalQueue {
     }
 }
 
-/// Note: `device::threads::EVENT_LOOP_TIMEOUT_MS` typically determines how often the irq ack
-/// timeout is handled and thus is typically the lower bound.
+/// How long the driver has to ack an interrupt before we send it again.
 const INTERRUPT_ACK_TIMEOUT: Duration = Duration::from_millis(1);
 
+/// Re-sends interrupts the driver did not ack in time. A timerfd is armed when an interrupt is
+/// sent and disarmed once it is acked, so an idle device causes no wakeups. It has to be added
+/// as subscriber to an event manager.
 pub struct IrqAckHandler {
     last_sent: Instant,
     interrupt_status: Arc<AtomicU8>,
     irqfd: Arc<EventFd>,
-    total_sent: usize,
-    total_ack_timeouted: usize,
+    timer: TimerFd,
+    armed: bool,
+    stats: Arc<DeviceStats>,
 }
 
 impl IrqAckHandler {
-    pub fn new(interrupt_status: Arc<AtomicU8>, irqfd: Arc<EventFd>) -> Self {
-        IrqAckHandler {
+    pub fn new(
+        interrupt_status: Arc<AtomicU8>,
+        irqfd: Arc<EventFd>,
+        stats: Arc<DeviceStats>,
+    ) -> Result<Self> {
+        Ok(IrqAckHandler {
             last_sent: Instant::now(),
             interrupt_status,
             irqfd,
-            total_sent: 0,
-            total_ack_timeouted: 0,
+            timer: nonblocking_timerfd()?,
+            armed: false,
+            stats,
+        })
+    }
+
+    /// Creates a handler and adds it to `event_mgr`.
+    pub fn subscribe(
+        event_mgr: &mut EventManager<Arc<Mutex<dyn MutEventSubscriber + Send>>>,
+        interrupt_status: Arc<AtomicU8>,
+        irqfd: Arc<EventFd>,
+        stats: Arc<DeviceStats>,
+    ) -> Result<Arc<Mutex<Self>>> {
+        let handler = Arc::new(Mutex::new(IrqAckHandler::new(
+            interrupt_status,
+            irqfd,
+            stats,
+        )?));
+        event_mgr.add_subscriber(handler.clone());
+        Ok(handler)
+    }
+
+    fn arm(&mut self, timeout: Duration) {
+        match self.timer.reset(timeout, None) {
+            Ok(()) => self.armed = true,
+            Err(e) => error!("cannot arm irq ack timer: {}", e),
         }
     }
 
     /// Must be called whenever a new irq is sent for which an ack is expected.
     pub fn irq_sent(&mut self) {
-        self.total_sent += 1;
+        self.stats.irqs_sent.fetch_add(1, Ordering::Relaxed);
         self.last_sent = Instant::now();
+        // An armed timer fires early for this irq, `handle_timeout` then waits for the rest.
+        if !self.armed {
+            self.arm(INTERRUPT_ACK_TIMEOUT);
+        }
+    }
+
+    /// Must be called when the driver acked the interrupt.
+    pub fn irq_acked(&mut self) {
+        if !self.armed || self.interrupt_status.load(Ordering::Acquire) != 0 {
+            return;
+        }
+        match self.timer.clear() {
+            Ok(()) => self.armed = false,
+            Err(e) => error!("cannot disarm irq ack timer: {}", e),
+        }
     }
 
-    /// Must be called regularly to handle ack timeouts and re-send irqs.
-    pub fn handle_timeouts(&mut self) {
+    fn handle_timeout(&mut self) {
+        self.armed = false;
+        if self.interrupt_status.load(Ordering::Acquire) == 0 {
+            return;
+        }
         let passed = Instant::now().duration_since(self.last_sent);
-        let unacked = self.interrupt_status.load(Ordering::Acquire) != 0;
-        if passed >= INTERRUPT_ACK_TIMEOUT && unacked {
-            // interrupt timed out && has not been acked
-            if let Err(e) = self.irqfd.write(1) {
-                log::error!("Failed write to eventfd when signalling queue: {}", e);
-            } else {
-                self.total_ack_timeouted += 1;
-                log::debug!(
-                    "re-sending lost interrupt after {:.1}ms. Total lost {:.0}% ({}/{})",
-                    passed.as_micros() as f64 / 1000.0,
-                    100.0 * self.total_ack_timeouted as f64 / self.total_sent as f64,
-                    self.total_ack_timeouted,
-                    self.total_sent,
-                );
-            }
+        if passed < INTERRUPT_ACK_TIMEOUT {
+            self.arm(INTERRUPT_ACK_TIMEOUT - passed);
+            return;
+        }
+        // interrupt timed out && has not been acked
+        if let Err(e) = self.irqfd.write(1) {
+            log::error!("Failed write to eventfd when signalling queue: {}", e);
+        } else {
+            let resent = self.stats.irqs_resent.fetch_add(1, Ordering::Relaxed) + 1;
+            let sent = self.stats.irqs_sent.load(Ordering::Relaxed);
+            log::debug!(
+                "re-sending lost interrupt after {:.1}ms. Total lost {:.0}% ({}/{})",
+                passed.as_micros() as f64 / 1000.0,
+                100.0 * resent as f64 / sent as f64,
+                resent,
+                sent,
+            );
+        }
+        self.last_sent = Instant::now();
+        self.arm(INTERRUPT_ACK_TIMEOUT);
+    }
+}
+
+/// To be called after the driver wrote the mmio register at `offset`.
+pub fn mmio_written(handler: &Mutex<IrqAckHandler>, offset: u64) {
+    if offset != VIRTIO_MMIO_INTERRUPT_ACK_OFFSET {
+        return;
+    }
+    match handler.lock() {
+        Ok(mut handler) => handler.irq_acked(),
+        Err(e) => error!("Failed to lock IrqAckHandler: {}", e),
+    }
+}
+
+impl MutEventSubscriber for IrqAckHandler {
+    fn process(&mut self, events: Events, ops: &mut EventOps) {
+        if events.event_set() != EventSet::IN {
+            error!("unexpected event_set for irq ack timer");
+            ops.remove(events)
+                .expect("Failed to remove fd from event handling loop");
+            return;
         }
+        read_timer(&mut self.timer, "irq ack");
+        self.handle_timeout();
+    }
+
+    fn init(&mut self, ops: &mut EventOps) {
+        ops.add(Events::new(&self.timer, EventSet::IN))
+            .expect("Failed to init irq ack handler");
     }
 }
 
-pub fn register_ioeventfd(
+/// Register one ioeventfd for each of `queues`. All of them are set up in one go, so the
+/// hypervisor only stops a constant number of times.
+pub fn register_ioeventfds(
     vmm: &Arc<Hypervisor>,
     mmio_cfg: &MmioConfig,
-    queue_idx: u64,
-) -> Result<IoEventFd> {
+    queues: &[u64],
+) -> Result<Vec<IoEventFd>> {
     // Register the queue event fd. Something like this, but in a pirate fashion.
     // let ioeventfd = EventFd::new(EFD_NONBLOCK).map_err(Error::EventFd)?;
     // self.vm_fd
@@ -186,12 +531,13 @@ pub fn register_ioeventfd(
         try_with!(tracee.attach_to(injector), &err);
     }
 
-    // we need to drop tracee for ioeventfd_
-    let ioeventfd = vmm.ioeventfd_(
-        mmio_cfg.range.base().0 + VIRTIO_MMIO_QUEUE_NOTIFY_OFFSET,
-        4,
-        Some(queue_idx),
-    )?;
+    // we need to drop tracee for ioeventfds
+    let notify_addr = mmio_cfg.range.base().0 + VIRTIO_MMIO_QUEUE_NOTIFY_OFFSET;
+    let events = queues
+        .iter()
+        .map(|idx| (notify_addr, 4, Some(*idx)))
+        .collect::<Vec<_>>();
+    let ioeventfds = vmm.ioeventfds(&events)?;
 
     // injector -> wrapper
     {
@@ -200,9 +546,39 @@ pub fn register_ioeventfd(
         let injector = tracee.detach().unwrap();
         let wrapper = KvmRunWrapper::from_tracer(inject_syscall::into_tracer(
             injector,
-            vmm.vcpu_maps[0].clone(),
+            vmm.vcpu_maps.clone(),
         )?)?;
         let _ = wrapper_go.replace(wrapper);
     }
-    Ok(ioeventfd)
+    Ok(ioeventfds)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_notify_coalescer() {
+        let mut off = NotifyCoalescer::new(Coalescing::default()).unwrap();
+        assert!(off.timer().is_none());
+        assert!(off.completed(1));
+
+        let mut coalescer = NotifyCoalescer::new(Coalescing {
+            max_pending: 4,
+            max_delay: Duration::from_millis(1),
+        })
+        .unwrap();
+        assert!(!coalescer.completed(1));
+        assert!(!coalescer.completed(2));
+        assert!(coalescer.completed(1));
+        coalescer.notified();
+
+        // the timer flushes requests that stay below `max_pending`
+        assert!(!coalescer.completed(1));
+        std::thread::sleep(Duration::from_millis(2));
+        assert!(coalescer.expired());
+        coalescer.notified();
+        // a disarmed timer can be read without blocking
+        assert!(!coalescer.expired());
+    }
 }
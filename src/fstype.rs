@@ -0,0 +1,116 @@
+//! Tell the filesystem of an image from its superblock so stage2 does not have to try every
+//! filesystem the guest kernel supports.
+
+use simple_error::try_with;
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+
+use crate::result::Result;
+
+// ext2/3/4 superblock starts at 1024
+const EXT_MAGIC_OFFSET: usize = 1024 + 0x38;
+const EXT_MAGIC: u16 = 0xEF53;
+const EXT_COMPAT_OFFSET: usize = 1024 + 0x5C;
+const EXT_INCOMPAT_OFFSET: usize = 1024 + 0x60;
+const EXT_COMPAT_HAS_JOURNAL: u32 = 0x4;
+// extents, 64bit, flex_bg
+const EXT4_INCOMPAT: u32 = 0x40 | 0x80 | 0x200;
+
+const EROFS_MAGIC_OFFSET: usize = 1024;
+const EROFS_MAGIC: u32 = 0xE0F5E1E2;
+const SQUASHFS_MAGIC: &[u8] = b"hsqs";
+const XFS_MAGIC: &[u8] = b"XFSB";
+const BTRFS_MAGIC_OFFSET: usize = 0x10040;
+const BTRFS_MAGIC: &[u8] = b"_BHRfS_M";
+
+const PROBE_SIZE: usize = BTRFS_MAGIC_OFFSET + 8;
+
+/// Environment variable telling stage2 which filesystem to mount.
+pub const FSTYPE_ENV: &str = "VMSH_FSTYPE";
+/// Environment variable telling stage2 the read-ahead for the root block device in KiB.
+pub const READ_AHEAD_ENV: &str = "VMSH_READ_AHEAD_KB";
+/// Compressed images are read in whole compressed blocks, so fewer but larger requests pay off.
+pub const COMPRESSED_READ_AHEAD_KB: u32 = 1024;
+
+/// Read-only filesystems storing their data compressed.
+pub fn is_compressed(fstype: &str) -> bool {
+    fstype == "squashfs" || fstype == "erofs"
+}
+
+fn u16_at(buf: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes([buf[offset], buf[offset + 1]])
+}
+
+fn u32_at(buf: &[u8], offset: usize) -> u32 {
+    let mut bytes = [0; 4];
+    bytes.copy_from_slice(&buf[offset..offset + 4]);
+    u32::from_le_bytes(bytes)
+}
+
+fn from_superblock(buf: &[u8]) -> Option<&'static str> {
+    if buf.starts_with(SQUASHFS_MAGIC) {
+        return Some("squashfs");
+    }
+    if buf.starts_with(XFS_MAGIC) {
+        return Some("xfs");
+    }
+    if buf.len() >= EROFS_MAGIC_OFFSET + 4 && u32_at(buf, EROFS_MAGIC_OFFSET) == EROFS_MAGIC {
+        return Some("erofs");
+    }
+    if buf.len() >= EXT_INCOMPAT_OFFSET + 4 && u16_at(buf, EXT_MAGIC_OFFSET) == EXT_MAGIC {
+        return Some(if u32_at(buf, EXT_INCOMPAT_OFFSET) & EXT4_INCOMPAT != 0 {
+            "ext4"
+        } else if u32_at(buf, EXT_COMPAT_OFFSET) & EXT_COMPAT_HAS_JOURNAL != 0 {
+            "ext3"
+        } else {
+            "ext2"
+        });
+    }
+    if buf.len() >= PROBE_SIZE && &buf[BTRFS_MAGIC_OFFSET..PROBE_SIZE] == BTRFS_MAGIC {
+        return Some("btrfs");
+    }
+    None
+}
+
+/// Returns the filesystem type of the image at `path` as understood by mount(2), if known.
+pub fn detect(path: &Path) -> Result<Option<&'static str>> {
+    let file = try_with!(File::open(path), "cannot open {}", path.display());
+    let mut buf = vec![0; PROBE_SIZE];
+    let mut len = 0;
+    while len < buf.len() {
+        let n = try_with!(
+            file.read_at(&mut buf[len..], len as u64),
+            "cannot read {}",
+            path.display()
+        );
+        if n == 0 {
+            break;
+        }
+        len += n;
+    }
+    Ok(from_superblock(&buf[..len]))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_from_superblock() {
+        let mut buf = vec![0; PROBE_SIZE];
+        assert_eq!(from_superblock(&buf), None);
+        assert_eq!(from_superblock(b"hsqs"), Some("squashfs"));
+
+        buf[EXT_MAGIC_OFFSET..EXT_MAGIC_OFFSET + 2].copy_from_slice(&EXT_MAGIC.to_le_bytes());
+        assert_eq!(from_superblock(&buf), Some("ext2"));
+        buf[EXT_COMPAT_OFFSET] = EXT_COMPAT_HAS_JOURNAL as u8;
+        assert_eq!(from_superblock(&buf), Some("ext3"));
+        buf[EXT_INCOMPAT_OFFSET] = 0x40;
+        assert_eq!(from_superblock(&buf), Some("ext4"));
+
+        let mut buf = vec![0; PROBE_SIZE];
+        buf[EROFS_MAGIC_OFFSET..EROFS_MAGIC_OFFSET + 4].copy_from_slice(&EROFS_MAGIC.to_le_bytes());
+        assert_eq!(from_superblock(&buf), Some("erofs"));
+    }
+}
@@ -9,6 +9,7 @@ use nix::unistd::Pid;
 use simple_error::try_with;
 
 use crate::kvm;
+use crate::kvm::hypervisor::Hypervisor;
 
 pub struct InspectOptions {
     pub pid: Pid,
@@ -49,22 +50,26 @@ pub fn inspect(opts: &InspectOptions) -> Result<()> {
     }
 
     let mem = GuestMem::new(&vm)?;
-    match mem.find_kernel(&vm) {
-        Ok(maps) => {
-            let first = maps.first().unwrap();
-            let space_before = first.virt_start - LINUX_KERNEL_KASLR_RANGE_START;
-            let last = maps.last().unwrap();
-            let space_after = LINUX_KERNEL_KASLR_RANGE_END - last.virt_start - last.len;
-            info!(
-                "found kernel at 0x{:x}-0x{:x} (free space before: {} kib, free space after: {} kib)",
-                first.virt_start,
-                last.virt_start + last.len,
-                space_before / 1024,
-                space_after / 1024,
-            );
-        }
+    match kernel_summary(&mem, &vm) {
+        Ok(summary) => info!("{}", summary),
         Err(e) => info!("could not find kernel: {}", e),
     }
 
     Ok(())
 }
+
+/// Where the kernel is and how much of the KASLR range is left around it.
+pub fn kernel_summary(mem: &GuestMem, vm: &Hypervisor) -> Result<String> {
+    let maps = mem.find_kernel(vm)?;
+    let first = maps.first().unwrap();
+    let space_before = first.virt_start - LINUX_KERNEL_KASLR_RANGE_START;
+    let last = maps.last().unwrap();
+    let space_after = LINUX_KERNEL_KASLR_RANGE_END - last.virt_start - last.len;
+    Ok(format!(
+        "found kernel at 0x{:x}-0x{:x} (free space before: {} kib, free space after: {} kib)",
+        first.virt_start,
+        last.virt_start + last.len,
+        space_before / 1024,
+        space_after / 1024,
+    ))
+}
@@ -161,4 +161,18 @@ impl PhysMemAllocator {
             "failed to allocate mmio range"
         ))
     }
+
+    /// Allocates `num` adjacent mmio ranges of `size` bytes each, lowest address first.
+    pub fn alloc_mmio_ranges(&mut self, num: usize, size: usize) -> Result<Vec<MmioRange>> {
+        let len = require_with!(num.checked_mul(size), "too many mmio ranges");
+        let start = self.reserve_range(len)?;
+        (0..num)
+            .map(|i| {
+                Ok(try_with!(
+                    MmioRange::new(MmioAddress((start + i * size) as u64), size as u64),
+                    "failed to allocate mmio range"
+                ))
+            })
+            .collect()
+    }
 }
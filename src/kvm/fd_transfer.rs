@@ -130,15 +130,7 @@ impl Drop for HvSocket {
             }
             Ok(t) => t,
         };
-        let proc = match tracee.try_get_proc() {
-            Err(e) => {
-                warn!("cannot drop HvMem: {}", e);
-                return;
-            }
-            Ok(t) => t,
-        };
-
-        let ret = match proc.close(self.fd) {
+        let ret = match tracee.close(self.fd) {
             Err(e) => {
                 warn!(
                     "cannot execute close socket to drop HvMem (fd {}): {}",
@@ -1,10 +1,11 @@
 use crate::page_table::PhysAddr;
 use crate::tracer::inject_syscall;
 use kvm_bindings as kvmb;
-use libc::{c_int, c_void};
+use libc::{c_int, c_ulong, c_void};
 use log::*;
+use nix::sys::uio::{process_vm_readv, process_vm_writev, IoVec, RemoteIoVec};
 use nix::unistd::Pid;
-use simple_error::{bail, simple_error, try_with};
+use simple_error::{bail, require_with, simple_error, try_with};
 use std::ffi::OsStr;
 use std::marker::PhantomData;
 use std::mem::size_of;
@@ -17,31 +18,149 @@ use vmm_sys_util::eventfd::{EventFd, EFD_NONBLOCK};
 use crate::cpu;
 use crate::kvm::fd_transfer;
 use crate::kvm::ioctls;
+use crate::kvm::memslots::{self, MemSlot, MemslotProbe};
 use crate::kvm::tracee::{kvm_msrs, Tracee};
 use crate::page_math::{self, compute_host_offset};
 use crate::result::Result;
+use crate::timings;
 use crate::tracer::proc::{openpid, Mapping, PidHandle};
-use crate::tracer::wrap_syscall::KvmRunWrapper;
+use crate::tracer::wrap_syscall::{KvmRunWrapper, SharedKvmRun, VcpuMap};
 
 pub fn process_read<T: Sized + Copy>(pid: Pid, addr: *const c_void) -> Result<T> {
+    timings::count_copied(size_of::<T>());
     remote_mem::process_read(pid, addr).map_err(|e| simple_error!("{}", e))
 }
 
 pub fn process_write<T: Sized + Copy>(pid: Pid, addr: *mut c_void, val: &T) -> Result<()> {
+    timings::count_copied(size_of::<T>());
     remote_mem::process_write(pid, addr, val).map_err(|e| simple_error!("{}", e))
 }
 
+/// Allocation sizes served by `HvArena`, larger allocations get a mapping of their own.
+const ARENA_CLASSES: [usize; 4] = [64, 256, 1024, 4096];
+/// Size of the mapping `HvArena` carves its slots from.
+const ARENA_SIZE: usize = 256 * 1024;
+
+fn arena_class(size: usize) -> Option<usize> {
+    ARENA_CLASSES.iter().position(|class| size <= *class)
+}
+
+/// Small hypervisor allocations (i.e. ioctl arguments) are carved out of one mapping in the
+/// hypervisor and reused, so that they need no injected mmap/munmap each.
+#[derive(Debug)]
+struct HvArena {
+    /// start of the mapping, 0 if not mapped
+    base: libc::uintptr_t,
+    /// bytes of the mapping handed out so far
+    used: usize,
+    /// returned slots per size class
+    free: Vec<Vec<libc::uintptr_t>>,
+    /// slots currently in use
+    outstanding: usize,
+    tracee: Arc<RwLock<Tracee>>,
+}
+
+impl HvArena {
+    fn new(tracee: Arc<RwLock<Tracee>>) -> HvArena {
+        HvArena {
+            base: 0,
+            used: 0,
+            free: ARENA_CLASSES.iter().map(|_| vec![]).collect(),
+            outstanding: 0,
+            tracee,
+        }
+    }
+
+    /// A zeroed slot of at least `size` bytes or None if the arena does not serve this size.
+    fn alloc(&mut self, tracee: &Tracee, size: usize) -> Result<Option<libc::uintptr_t>> {
+        let class = match arena_class(size) {
+            Some(class) => class,
+            None => return Ok(None),
+        };
+        let len = ARENA_CLASSES[class];
+        if let Some(ptr) = self.free[class].pop() {
+            // like a fresh mapping
+            let zeros = vec![0u8; len];
+            let written = try_with!(
+                process_vm_writev(
+                    tracee.pid(),
+                    &[IoVec::from_slice(&zeros)],
+                    &[RemoteIoVec { base: ptr, len }]
+                ),
+                "cannot clear hypervisor memory"
+            );
+            timings::count_copied(written);
+            self.outstanding += 1;
+            return Ok(Some(ptr));
+        }
+        if self.base == 0 {
+            self.base = tracee.mmap(ARENA_SIZE)? as libc::uintptr_t;
+            self.used = 0;
+        }
+        if self.used + len > ARENA_SIZE {
+            return Ok(None);
+        }
+        let ptr = self.base + self.used;
+        self.used += len;
+        self.outstanding += 1;
+        Ok(Some(ptr))
+    }
+
+    fn free(&mut self, ptr: libc::uintptr_t, size: usize) {
+        if let Some(class) = arena_class(size) {
+            self.free[class].push(ptr);
+            self.outstanding -= 1;
+        }
+    }
+
+    /// Unmap the arena unless slots are still in use. Must happen while the tracee is attached.
+    fn release(&mut self, tracee: &Tracee) {
+        if self.base == 0 || self.outstanding != 0 {
+            return;
+        }
+        if let Err(e) = tracee.munmap(self.base as *mut c_void, ARENA_SIZE) {
+            warn!("failed to unmap memory arena from process: {}", e);
+        }
+        self.base = 0;
+        self.used = 0;
+        self.free.iter_mut().for_each(|f| f.clear());
+    }
+}
+
+impl Drop for HvArena {
+    fn drop(&mut self) {
+        if self.base == 0 {
+            return;
+        }
+        match self.tracee.clone().write() {
+            Ok(tracee) => self.release(&tracee),
+            Err(e) => warn!("Could not aquire lock to drop HvArena: {}", e),
+        }
+    }
+}
+
 /// Hypervisor Memory
 #[derive(Debug)]
 pub struct HvMem<T: Copy> {
     pub ptr: libc::uintptr_t,
+    /// mapped bytes, at least `size_of::<T>()`
+    size: usize,
     pid: Pid,
     tracee: Arc<RwLock<Tracee>>,
+    /// the arena the memory belongs to or None if it is a mapping of its own
+    arena: Option<Arc<Mutex<HvArena>>>,
     phantom: PhantomData<T>,
 }
 
 impl<T: Copy> Drop for HvMem<T> {
     fn drop(&mut self) {
+        if let Some(arena) = &self.arena {
+            match arena.lock() {
+                Ok(mut arena) => arena.free(self.ptr, self.size),
+                Err(e) => warn!("Could not aquire lock to drop HvMem: {}", e),
+            }
+            return;
+        }
         let tracee = match self.tracee.write() {
             Err(e) => {
                 warn!("Could not aquire lock to drop HvMem: {}", e);
@@ -49,7 +168,7 @@ impl<T: Copy> Drop for HvMem<T> {
             }
             Ok(t) => t,
         };
-        if let Err(e) = tracee.munmap(self.ptr as *mut c_void, size_of::<T>()) {
+        if let Err(e) = tracee.munmap(self.ptr as *mut c_void, self.size) {
             warn!("failed to unmap memory from process: {}", e);
         }
     }
@@ -62,6 +181,33 @@ impl<T: Copy> HvMem<T> {
     pub fn write(&self, val: &T) -> Result<()> {
         process_write(self.pid, self.ptr as *mut c_void, val)
     }
+    /// Read `buf.len()` bytes of the whole (padded) allocation.
+    pub fn read_bytes(&self, buf: &mut [u8]) -> Result<()> {
+        if buf.len() > self.size {
+            bail!(
+                "cannot read {}b from allocation of {}b",
+                buf.len(),
+                self.size
+            );
+        }
+        let len = buf.len();
+        let read = try_with!(
+            process_vm_readv(
+                self.pid,
+                &[IoVec::from_mut_slice(buf)],
+                &[RemoteIoVec {
+                    base: self.ptr,
+                    len
+                }]
+            ),
+            "cannot read hypervisor memory"
+        );
+        timings::count_copied(read);
+        if read != len {
+            bail!("short read from hypervisor memory: {}/{}b", read, len);
+        }
+        Ok(())
+    }
 }
 
 /// Physical Memory attached to a VM. Backed by `PhysMem.mem`.
@@ -110,6 +256,7 @@ impl<T: Copy> Drop for PhysMem<T> {
                 ret
             )
         }
+        tracee.update_memslot(MemSlot::from_region(&ioctl_arg));
     }
 }
 
@@ -125,10 +272,10 @@ pub struct Hypervisor {
     pub pid: Pid,
     pub vm_fd: RawFd,
     pub vcpus: Vec<VCPU>,
-    /// hypervisor memory where fd_num is mapped to.
-    /// sorted by vcpu nr. TODO what if there exist cpu [0, 1, 4]?
-    pub vcpu_maps: Vec<Mapping>,
+    /// hypervisor memory where the vcpu fds are mapped to. Sorted by vcpu nr.
+    pub vcpu_maps: Vec<VcpuMap>,
     tracee: Arc<RwLock<Tracee>>,
+    arena: Arc<Mutex<HvArena>>,
     pub wrapper: Mutex<Option<KvmRunWrapper>>,
 }
 
@@ -165,47 +312,63 @@ fn kvm_ioeventfd(
     }
 }
 impl IoEventFd {
-    fn new(
-        hv: &Hypervisor,
-        guest_addr: u64,
-        len: u32,
-        datamatch: Option<u64>,
-    ) -> Result<IoEventFd> {
-        let eventfd = try_with!(EventFd::new(EFD_NONBLOCK), "cannot create event fd");
-        info!(
-            "ioeventfd {}, guest phys addr 0x{:x}",
-            eventfd.as_raw_fd(),
-            guest_addr
-        );
-        let hv_eventfd = hv.transfer(vec![eventfd.as_raw_fd()].as_slice())?[0];
-        let ioeventfd = kvm_ioeventfd(hv_eventfd, guest_addr, len, datamatch);
-
-        let mem = hv.alloc_mem()?;
-        mem.write(&ioeventfd)?;
+    /// Register an eventfd for each `(guest_addr, len, datamatch)`. The eventfds are transferred
+    /// together and registered with one batch of ioctls.
+    fn register(hv: &Hypervisor, events: &[(u64, u32, Option<u64>)]) -> Result<Vec<IoEventFd>> {
+        let mut eventfds = Vec::with_capacity(events.len());
+        for (guest_addr, _, _) in events {
+            let eventfd = try_with!(EventFd::new(EFD_NONBLOCK), "cannot create event fd");
+            info!(
+                "ioeventfd {}, guest phys addr 0x{:x}",
+                eventfd.as_raw_fd(),
+                guest_addr
+            );
+            eventfds.push(eventfd);
+        }
+        let fds = eventfds.iter().map(|e| e.as_raw_fd()).collect::<Vec<_>>();
+        let hv_eventfds = hv.transfer(&fds)?;
+        let mems = hv.alloc_mems(events.len())?;
 
-        let ret = {
+        let mut calls = Vec::with_capacity(events.len());
+        for (((guest_addr, len, datamatch), hv_eventfd), mem) in
+            events.iter().zip(&hv_eventfds).zip(&mems)
+        {
+            mem.write(&kvm_ioeventfd(*hv_eventfd, *guest_addr, *len, *datamatch))?;
+            calls.push((ioctls::KVM_IOEVENTFD(), mem.ptr as c_ulong));
+        }
+        let rets = {
             let tracee = try_with!(
                 hv.tracee.read(),
                 "cannot obtain tracee read lock: poinsoned"
             );
             try_with!(
-                tracee.vm_ioctl_with_ref(ioctls::KVM_IOEVENTFD(), &mem),
+                tracee.vm_ioctls(&calls),
                 "kvm ioeventfd ioctl injection failed"
             )
         };
-        if ret != 0 {
+
+        // on error, dropping them unregisters the others
+        let ioeventfds = events
+            .iter()
+            .zip(hv_eventfds)
+            .zip(mems)
+            .zip(eventfds)
+            .map(
+                |((((guest_addr, len, datamatch), hv_eventfd), hv_mem), fd)| IoEventFd {
+                    guest_addr: *guest_addr,
+                    len: *len,
+                    datamatch: *datamatch,
+                    hv_eventfd,
+                    hv_mem,
+                    fd,
+                    tracee: hv.tracee.clone(),
+                },
+            )
+            .collect::<Vec<_>>();
+        if let Some(ret) = rets.iter().find(|ret| **ret != 0) {
             bail!("cannot register KVM_IOEVENTFD via ioctl: {:?}", ret);
         }
-
-        Ok(IoEventFd {
-            guest_addr,
-            len,
-            datamatch,
-            hv_eventfd,
-            hv_mem: mem,
-            fd: eventfd,
-            tracee: hv.tracee.clone(),
-        })
+        Ok(ioeventfds)
     }
 }
 
@@ -274,10 +437,58 @@ impl Hypervisor {
             self.tracee.write(),
             "cannot obtain tracee write lock: poinsoned"
         );
+        if tracee.try_get_proc().is_ok() {
+            try_with!(self.arena.lock(), "cannot lock memory arena").release(&tracee);
+        }
         let _ = tracee.detach();
         Ok(())
     }
 
+    /// Queue the syscalls of destructors from now on, see `Tracee::defer_cleanup`.
+    pub fn defer_cleanup(&self) -> Result<()> {
+        let tracee = try_with!(
+            self.tracee.read(),
+            "cannot obtain tracee read lock: poinsoned"
+        );
+        tracee.defer_cleanup()
+    }
+
+    /// Remove memory, memslots and ioeventfds dropped since `defer_cleanup` with a single stop
+    /// of the process and release ptrace. The syscall batch page stays mapped, it cannot unmap
+    /// itself from within the batch, and the next attach reuses it. Must be called from the
+    /// thread owning the tracee.
+    pub fn fast_detach(&self) -> Result<()> {
+        let mut tracee = try_with!(
+            self.tracee.write(),
+            "cannot obtain tracee write lock: poinsoned"
+        );
+        try_with!(self.arena.lock(), "cannot lock memory arena").release(&tracee);
+        let res = tracee.run_deferred();
+        if let Some(proc) = tracee.detach() {
+            proc.keep_batch_page();
+        }
+        res
+    }
+
+    /// Run what was queued after the mmio exit handler thread called `fast_detach`, i.e.
+    /// because it stopped before the main thread dropped the memory of stage1.
+    pub fn finish_fast_detach(&self) -> Result<()> {
+        let mut tracee = try_with!(
+            self.tracee.write(),
+            "cannot obtain tracee write lock: poinsoned"
+        );
+        if !tracee.has_deferred() {
+            // stops deferring
+            return tracee.run_deferred();
+        }
+        tracee.attach()?;
+        let res = tracee.run_deferred();
+        if let Some(proc) = tracee.detach() {
+            proc.keep_batch_page();
+        }
+        res
+    }
+
     pub fn stop(&self) -> Result<()> {
         let mut tracee = try_with!(
             self.tracee.write(),
@@ -313,7 +524,7 @@ impl Hypervisor {
                 Some(injector) => {
                     let wrapper = KvmRunWrapper::from_tracer(inject_syscall::into_tracer(
                         injector,
-                        self.vcpu_maps[0].clone(),
+                        self.vcpu_maps.clone(),
                     )?)?;
                     (true, wrapper)
                 }
@@ -372,6 +583,155 @@ impl Hypervisor {
         tracee.get_vcpu_maps()
     }
 
+    pub fn get_memslots(&self) -> Result<Vec<MemSlot>> {
+        let tracee = try_with!(
+            self.tracee.read(),
+            "cannot obtain tracee read lock: poinsoned"
+        );
+        tracee.get_memslots()
+    }
+
+    /// See `Tracee::use_memslot_cache`.
+    pub fn use_memslot_cache(&self) -> Result<()> {
+        let mut tracee = try_with!(
+            self.tracee.write(),
+            "cannot obtain tracee write lock: poinsoned"
+        );
+        tracee.use_memslot_cache();
+        Ok(())
+    }
+
+    /// Probe the memslots with a probe shared between hypervisors, so `get_memslots` finds them
+    /// cached.
+    pub fn cache_memslots(&self, probe: &mut MemslotProbe) -> Result<()> {
+        let tracee = try_with!(
+            self.tracee.read(),
+            "cannot obtain tracee read lock: poinsoned"
+        );
+        memslots::cache_memslots(&tracee, probe)
+    }
+
+    /// Make KVM track guest writes to `slot` (KVM_MEM_LOG_DIRTY_PAGES). Tracking stays enabled
+    /// after vmsh exits. Returns false if vmsh enabled it before. Slots the hypervisor logs itself
+    /// (i.e. while migrating) are refused, since fetching their log would hide pages from it.
+    ///
+    /// KVM only logs writes of the guest: pages the hypervisor writes from userspace (device
+    /// emulation, vhost) are not reported.
+    pub fn enable_dirty_log(&self, slot: &MemSlot) -> Result<bool> {
+        let mut owned = memslots::dirty_log_slots(self.pid)?;
+        if slot.flags() & kvmb::KVM_MEM_LOG_DIRTY_PAGES != 0 {
+            if owned.iter().any(|s| s.same_region(slot)) {
+                return Ok(false);
+            }
+            bail!(
+                "memslot {} already logs dirty pages for the hypervisor (i.e. for a migration)",
+                slot
+            );
+        }
+        self.set_memslot_flags(slot, slot.flags() | kvmb::KVM_MEM_LOG_DIRTY_PAGES)?;
+        owned.retain(|s| !s.same_region(slot));
+        owned.push(slot.clone());
+        memslots::set_dirty_log_slots(self.pid, &owned)?;
+        Ok(true)
+    }
+
+    /// Undo `enable_dirty_log`.
+    pub fn disable_dirty_log(&self, slot: &MemSlot) -> Result<()> {
+        self.require_dirty_log(slot)?;
+        self.set_memslot_flags(slot, slot.flags() & !kvmb::KVM_MEM_LOG_DIRTY_PAGES)?;
+        let mut owned = memslots::dirty_log_slots(self.pid)?;
+        owned.retain(|s| !s.same_region(slot));
+        memslots::set_dirty_log_slots(self.pid, &owned)
+    }
+
+    /// Fail unless vmsh enabled dirty logging of `slot`. The flags of `slot` may predate that.
+    fn require_dirty_log(&self, slot: &MemSlot) -> Result<()> {
+        let owned = memslots::dirty_log_slots(self.pid)?;
+        if !owned.iter().any(|s| s.same_region(slot)) {
+            bail!("vmsh did not enable dirty logging of memslot {}", slot);
+        }
+        Ok(())
+    }
+
+    /// Change the KVM_MEM_* flags of an existing memslot.
+    pub fn set_memslot_flags(&self, slot: &MemSlot, flags: u32) -> Result<()> {
+        let arg = kvmb::kvm_userspace_memory_region {
+            slot: slot.id(),
+            flags,
+            guest_phys_addr: slot.physical_start() as u64,
+            memory_size: slot.size() as u64,
+            userspace_addr: slot.start() as u64,
+        };
+        let arg_hv = self.alloc_mem()?;
+        arg_hv.write(&arg)?;
+
+        let tracee = try_with!(
+            self.tracee.read(),
+            "cannot obtain tracee read lock: poinsoned"
+        );
+        tracee.require_probed_memslots()?;
+        let ret = tracee.vm_ioctl_with_ref(ioctls::KVM_SET_USER_MEMORY_REGION(), &arg_hv)?;
+        if ret != 0 {
+            bail!("cannot set flags of memslot {}: {}", slot, ret)
+        }
+        tracee.update_memslot(MemSlot::from_region(&arg));
+        Ok(())
+    }
+
+    /// Bitmap of pages in `slot` the guest wrote to since the last call or since dirty logging
+    /// was enabled. The bitmap is cleared and the pages are write protected again, with
+    /// KVM_CLEAR_DIRTY_LOG where the hypervisor may have enabled manual protection. Only slots
+    /// vmsh enabled dirty logging for are read, to not steal the log of a migration.
+    pub fn get_dirty_log(&self, slot: &MemSlot) -> Result<Vec<u64>> {
+        self.require_dirty_log(slot)?;
+        let npages = slot.size() / page_math::page_size();
+        let mut bitmap = vec![0u8; (npages + 63) / 64 * 8];
+        let bitmap_hv = self.alloc_mem_padded::<u64>(page_math::page_align(bitmap.len()))?;
+        let arg = ioctls::kvm_dirty_log {
+            slot: slot.id(),
+            padding1: 0,
+            dirty_bitmap: bitmap_hv.ptr as u64,
+        };
+        let arg_hv = self.alloc_mem()?;
+        arg_hv.write(&arg)?;
+        // clears exactly the bits KVM_GET_DIRTY_LOG just wrote to the bitmap
+        let clear = ioctls::kvm_clear_dirty_log {
+            slot: slot.id(),
+            num_pages: npages as u32,
+            first_page: 0,
+            dirty_bitmap: bitmap_hv.ptr as u64,
+        };
+        let clear_hv = self.alloc_mem()?;
+        clear_hv.write(&clear)?;
+
+        let tracee = try_with!(
+            self.tracee.read(),
+            "cannot obtain tracee read lock: poinsoned"
+        );
+        let mut calls = vec![(ioctls::KVM_GET_DIRTY_LOG(), arg_hv.ptr as c_ulong)];
+        // Supported does not mean enabled, but clearing is correct either way.
+        if tracee.check_extension(ioctls::KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2)? > 0 {
+            calls.push((ioctls::KVM_CLEAR_DIRTY_LOG(), clear_hv.ptr as c_ulong));
+        }
+        let rets = tracee.vm_ioctls(&calls)?;
+        if rets[0] != 0 {
+            bail!("cannot get dirty log of memslot {}: {}", slot, rets[0])
+        }
+        if let Some(ret) = rets.get(1).filter(|ret| **ret != 0) {
+            bail!("cannot clear dirty log of memslot {}: {}", slot, ret)
+        }
+        drop(tracee);
+        bitmap_hv.read_bytes(&mut bitmap)?;
+        Ok(bitmap
+            .chunks_exact(8)
+            .map(|w| {
+                let mut word = [0u8; 8];
+                word.copy_from_slice(w);
+                u64::from_ne_bytes(word)
+            })
+            .collect())
+    }
+
     /// `readonly`: If true, a guest writing to it leads to KVM_EXIT_MMIO.
     ///
     /// Safety: This function is safe even for the guest because VmMem enforces, that only the
@@ -401,10 +761,13 @@ impl Hypervisor {
             self.tracee.read(),
             "cannot obtain tracee write lock: poinsoned"
         );
+        tracee.require_probed_memslots()?;
         let ret = tracee.vm_ioctl_with_ref(ioctls::KVM_SET_USER_MEMORY_REGION(), &arg_hv)?;
         if ret != 0 {
+            memslots::invalidate_cache(self.pid);
             bail!("ioctl_with_ref failed: {}", ret)
         }
+        tracee.update_memslot(MemSlot::from_region(&arg));
         let host_offset = compute_host_offset(hv_memslot.ptr, guest_addr as usize);
         Ok(PhysMem {
             mem: hv_memslot,
@@ -416,11 +779,55 @@ impl Hypervisor {
         })
     }
 
+    /// Allocate memory for T, usually from the memory arena, so no syscall gets injected.
     pub fn alloc_mem<T: Copy>(&self) -> Result<HvMem<T>> {
-        self.alloc_mem_padded::<T>(size_of::<T>())
+        let mut mems = self.alloc_mems(1)?;
+        Ok(mems.remove(0))
+    }
+
+    /// Like `alloc_mem` for `n` items. Items the arena has no space for are mapped with a single
+    /// stop of the hypervisor.
+    pub fn alloc_mems<T: Copy>(&self, n: usize) -> Result<Vec<HvMem<T>>> {
+        let size = size_of::<T>();
+        let tracee = try_with!(
+            self.tracee.write(),
+            "cannot obtain tracee write lock: poinsoned"
+        );
+        let mut mems = Vec::with_capacity(n);
+        {
+            let mut arena = try_with!(self.arena.lock(), "cannot lock memory arena");
+            while mems.len() < n {
+                let ptr = match arena.alloc(&tracee, size)? {
+                    Some(ptr) => ptr,
+                    None => break,
+                };
+                mems.push(HvMem {
+                    ptr,
+                    size,
+                    pid: self.pid,
+                    tracee: self.tracee.clone(),
+                    arena: Some(self.arena.clone()),
+                    phantom: PhantomData,
+                });
+            }
+        }
+        if mems.len() == n {
+            return Ok(mems);
+        }
+        let ptrs = tracee.mmaps(&vec![size; n - mems.len()])?;
+        mems.extend(ptrs.into_iter().map(|ptr| HvMem {
+            ptr: ptr as libc::uintptr_t,
+            size,
+            pid: self.pid,
+            tracee: self.tracee.clone(),
+            arena: None,
+            phantom: PhantomData,
+        }));
+        Ok(mems)
     }
 
     /// allocate memory for T. Allocate more than necessary to increase allocation size to `size`.
+    /// The memory is a mapping of its own and thus page aligned.
     pub fn alloc_mem_padded<T: Copy>(&self, size: usize) -> Result<HvMem<T>> {
         if size < size_of::<T>() {
             bail!(
@@ -438,8 +845,10 @@ impl Hypervisor {
         let ptr = tracee.mmap(size)?;
         Ok(HvMem {
             ptr: ptr as libc::uintptr_t,
+            size,
             pid: self.pid,
             tracee: self.tracee.clone(),
+            arena: None,
             phantom: PhantomData,
         })
     }
@@ -502,7 +911,14 @@ impl Hypervisor {
         len: u32,
         datamatch: Option<u64>,
     ) -> Result<IoEventFd> {
-        IoEventFd::new(self, guest_addr, len, datamatch)
+        let mut ioeventfds = self.ioeventfds(&[(guest_addr, len, datamatch)])?;
+        Ok(ioeventfds.remove(0))
+    }
+
+    /// Like `ioeventfd_` for each `(guest_addr, len, datamatch)`, but with a constant number of
+    /// hypervisor stops.
+    pub fn ioeventfds(&self, events: &[(u64, u32, Option<u64>)]) -> Result<Vec<IoEventFd>> {
+        IoEventFd::register(self, events)
     }
 
     /// param `gsi`: pin on the irqchip to be toggled by fd events
@@ -684,10 +1100,40 @@ fn find_vm_fd(handle: &PidHandle) -> Result<(Vec<RawFd>, Vec<VCPU>)> {
     Ok((vm_fds, vcpu_fds))
 }
 
+/// Pair each vcpu fd with the mapping of its `kvm_run` structure and map the latter into vmsh if
+/// possible.
+fn pair_vcpu_maps(pid: Pid, vcpus: &[VCPU], maps: Vec<Mapping>) -> Result<Vec<VcpuMap>> {
+    maps.into_iter()
+        .map(|mapping| {
+            let vcpu = vcpus.iter().find(|vcpu| {
+                mapping.pathname == format!("{}{}", VCPUFD_INODE_NAME_STARTS_WITH, vcpu.idx)
+            });
+            let vcpu = require_with!(vcpu, "no vcpu fd found for {}", mapping.pathname);
+            let mut vcpu_map = VcpuMap {
+                idx: vcpu.idx,
+                fd_num: vcpu.fd_num,
+                mapping,
+                kvm_run: None,
+            };
+            match SharedKvmRun::new(pid, &vcpu_map) {
+                Ok(kvm_run) => vcpu_map.kvm_run = Some(Arc::new(kvm_run)),
+                Err(e) => warn!(
+                    "cannot map kvm_run of vcpu {}, copy it on every exit instead: {}",
+                    vcpu.idx, e
+                ),
+            }
+            Ok(vcpu_map)
+        })
+        .collect()
+}
+
 pub fn get_hypervisor(pid: Pid) -> Result<Hypervisor> {
     let handle = try_with!(openpid(pid), "cannot open handle in proc");
 
-    let (vm_fds, vcpus) = try_with!(find_vm_fd(&handle), "failed to access kvm fds");
+    let (vm_fds, vcpus) = try_with!(
+        timings::measure("find vm fd", || find_vm_fd(&handle)),
+        "failed to access kvm fds"
+    );
     if vm_fds.is_empty() {
         bail!("no KVM-VMs found. If this is qemu, does it enable KVM?");
     }
@@ -704,10 +1150,13 @@ pub fn get_hypervisor(pid: Pid) -> Result<Hypervisor> {
     if vcpu_maps.is_empty() {
         bail!("found VCPUs but no mappings of their fds");
     }
+    let vcpu_maps = pair_vcpu_maps(pid, &vcpus, vcpu_maps)?;
 
+    let tracee = Arc::new(RwLock::new(tracee));
     Ok(Hypervisor {
         pid,
-        tracee: Arc::new(RwLock::new(tracee)),
+        arena: Arc::new(Mutex::new(HvArena::new(tracee.clone()))),
+        tracee,
         vm_fd: vm_fds[0],
         vcpus,
         vcpu_maps,
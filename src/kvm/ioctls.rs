@@ -215,6 +215,34 @@ ioctl_iow_nr!(
 
 ioctl_io_nr!(KVM_RUN, KVMIO, 0x80);
 
+/// kvmb::kvm_dirty_log without the union around the bitmap pointer
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct kvm_dirty_log {
+    pub slot: u32,
+    pub padding1: u32,
+    /// address of the bitmap in the hypervisor
+    pub dirty_bitmap: u64,
+}
+ioctl_iow_nr!(KVM_GET_DIRTY_LOG, KVMIO, 0x42, kvmb::kvm_dirty_log);
+
+/// With this capability enabled by the hypervisor, KVM_GET_DIRTY_LOG no longer clears the bitmap
+/// and write protects pages again, KVM_CLEAR_DIRTY_LOG does.
+pub const KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2: std::os::raw::c_int = 168;
+
+/// struct kvm_clear_dirty_log without the union around the bitmap pointer
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct kvm_clear_dirty_log {
+    pub slot: u32,
+    pub num_pages: u32,
+    /// must be a multiple of 64
+    pub first_page: u64,
+    /// address of the bitmap in the hypervisor
+    pub dirty_bitmap: u64,
+}
+ioctl_iowr_nr!(KVM_CLEAR_DIRTY_LOG, KVMIO, 0xc0, kvm_clear_dirty_log);
+
 // Ioctls for VM fds.
 /* Available with KVM_CAP_USER_MEMORY */
 //ioctl_iow_nr!(
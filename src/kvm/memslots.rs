@@ -1,18 +1,25 @@
-use bcc::perf_event::PerfMapBuilder;
+use bcc::perf_event::{PerfMap, PerfMapBuilder};
 use bcc::{BPFBuilder, Kprobe, BPF};
 use core::slice::from_raw_parts as make_slice;
+use kvm_bindings as kvmb;
 use libc::{c_ulong, size_t};
-use log::warn;
+use log::{debug, warn};
 use nix::unistd::Pid;
 use simple_error::bail;
 use simple_error::require_with;
 use simple_error::try_with;
-use std::sync::mpsc::channel;
+use std::cmp::min;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{channel, Receiver};
 use std::time::Duration;
 use std::{fmt, ptr};
 
 use crate::kvm::hypervisor;
 use crate::result::Result;
+use crate::timings;
 use crate::tracer::proc::openpid;
 use crate::tracer::proc::{self, Mapping};
 use crate::{kvm::tracee::Tracee, page_math::page_size};
@@ -23,9 +30,22 @@ pub struct MemSlot {
     base_gfn: u64,
     npages: c_ulong,
     userspace_addr: c_ulong,
+    flags: u32,
+    id: u32,
 }
 
 impl MemSlot {
+    /// The slot as set by KVM_SET_USER_MEMORY_REGION with `region`.
+    pub fn from_region(region: &kvmb::kvm_userspace_memory_region) -> MemSlot {
+        MemSlot {
+            base_gfn: region.guest_phys_addr / page_size() as u64,
+            npages: (region.memory_size / page_size() as u64) as c_ulong,
+            userspace_addr: region.userspace_addr as c_ulong,
+            flags: region.flags,
+            id: region.slot,
+        }
+    }
+
     pub fn start(&self) -> usize {
         self.userspace_addr as usize
     }
@@ -41,6 +61,24 @@ impl MemSlot {
     pub fn physical_start(&self) -> usize {
         (self.base_gfn as usize) * page_size()
     }
+
+    /// KVM_MEM_* flags
+    pub fn flags(&self) -> u32 {
+        self.flags
+    }
+
+    /// slot number for KVM_SET_USER_MEMORY_REGION
+    pub fn id(&self) -> u32 {
+        self.id
+    }
+
+    /// Whether both describe the same memory, regardless of their flags.
+    pub fn same_region(&self, other: &MemSlot) -> bool {
+        self.id == other.id
+            && self.base_gfn == other.base_gfn
+            && self.npages == other.npages
+            && self.userspace_addr == other.userspace_addr
+    }
 }
 
 impl fmt::Display for MemSlot {
@@ -63,17 +101,23 @@ struct memslot {
     gfn_t base_gfn;
     unsigned long npages;
     unsigned long userspace_addr;
+    u32 flags;
+    u32 id;
 };
 
-// KVM_MEM_SLOTS_NUM became to big to handle it in ebpf
+// KVM_MEM_SLOTS_NUM became to big to handle it in ebpf at once, so userspace asks for
+// MAX_SLOTS slots from index `start` on per ioctl
 #define MAX_SLOTS 1024
 
 typedef struct {
   size_t used_slots;
+  size_t pid;
+  size_t first;
   struct memslot memslots[MAX_SLOTS];
 } out_t;
 
 BPF_PERCPU_ARRAY(slots, out_t, 1);
+BPF_ARRAY(start, u32, 1);
 
 BPF_PERF_OUTPUT(memslots);
 
@@ -81,34 +125,48 @@ void kvm_vm_ioctl(struct pt_regs *ctx, struct file *filp) {
     struct kvm *kvm = (struct kvm *)filp->private_data;
 
     u32 pid = bpf_get_current_pid_tgid() >> 32;
+#ifdef TARGET_PID
     if (pid != TARGET_PID) {
         return;
     }
+#endif
 
     u32 idx = 0;
     out_t *out = slots.lookup(&idx);
-    if (!out) {
+    u32 *first = start.lookup(&idx);
+    if (!out || !first) {
       return;
     }
 
     // On x86 there is also a second address space for system management mode in memslots[1]
     // however we dont care about about this one
     out->used_slots = kvm->memslots[0]->used_slots;
-    for (size_t i = 0; i < MAX_SLOTS && i < out->used_slots; i++) {
-      struct kvm_memory_slot *in_slot = &kvm->memslots[0]->memslots[i];
+    out->pid = pid;
+    out->first = *first;
+    for (size_t i = 0; i < MAX_SLOTS && out->first + i < out->used_slots; i++) {
+      struct kvm_memory_slot *in_slot = &kvm->memslots[0]->memslots[out->first + i];
       struct memslot *out_slot = &out->memslots[i];
 
       out_slot->base_gfn = in_slot->base_gfn;
       out_slot->npages = in_slot->npages;
       out_slot->userspace_addr = in_slot->userspace_addr;
+      out_slot->flags = in_slot->flags;
+      out_slot->id = in_slot->id;
     }
     memslots.perf_submit(ctx, out, sizeof(*out));
 }"#;
 
-fn bpf_prog(pid: Pid) -> Result<BPF> {
+/// Slots reported per kvm_vm_ioctl, MAX_SLOTS in `BPF_TEXT`
+const MAX_SLOTS: usize = 1024;
+
+/// Without `pid` the program reports the memslots of every process calling kvm_vm_ioctl.
+fn bpf_prog(pid: Option<Pid>) -> Result<BPF> {
     let builder = try_with!(BPFBuilder::new(BPF_TEXT), "cannot compile bpf program");
-    let cflags = &[format!("-DTARGET_PID={}", pid)];
-    let builder_with_cflags = try_with!(builder.cflags(cflags), "could not pass cflags");
+    let cflags = pid
+        .iter()
+        .map(|pid| format!("-DTARGET_PID={}", pid))
+        .collect::<Vec<_>>();
+    let builder_with_cflags = try_with!(builder.cflags(cflags.as_slice()), "could not pass cflags");
     Ok(try_with!(
         builder_with_cflags.build(),
         "build failed. This might happen if vmsh was started without root (or cap_sys_admin)"
@@ -121,42 +179,239 @@ pub fn fetch_mappings(pid: Pid) -> Result<Vec<Mapping>> {
     Ok(mappings)
 }
 
-pub fn get_maps(tracee: &Tracee) -> Result<Vec<Mapping>> {
-    let mut module = bpf_prog(tracee.pid())?;
-    try_with!(
-        Kprobe::new()
-            .handler("kvm_vm_ioctl")
-            .function("kvm_vm_ioctl")
-            .attach(&mut module),
-        "failed to install kprobe"
-    );
-    let table = try_with!(module.table("memslots"), "failed to get perf event table");
-
-    let (sender, receiver) = channel();
-    let builder = PerfMapBuilder::new(table, move || {
-        let sender = sender.clone();
-        Box::new(move |x| {
-            let head = x.as_ptr() as *const size_t;
-            let size = unsafe { ptr::read(head) };
-            let memslots_slice = unsafe { make_slice(head.add(1) as *const MemSlot, size) };
-            sender.send(memslots_slice.to_vec()).unwrap();
+/// Memslots of each hypervisor process are cached here between vmsh invocations.
+const CACHE_DIR: &str = "/run/vmsh";
+
+/// Makes the names of partially written caches unique within the process.
+static TMP_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+fn cache_path(pid: Pid) -> PathBuf {
+    Path::new(CACHE_DIR).join(format!("memslots-{}", pid))
+}
+
+fn dirty_log_path(pid: Pid) -> PathBuf {
+    Path::new(CACHE_DIR).join(format!("dirty-log-{}", pid))
+}
+
+/// Cache format: the start time of the process, then one memslot per line.
+fn load_cache(pid: Pid, start_time: u64) -> Option<Vec<MemSlot>> {
+    load_slots(&cache_path(pid), start_time)
+}
+
+fn load_slots(path: &Path, start_time: u64) -> Option<Vec<MemSlot>> {
+    let content = fs::read_to_string(path).ok()?;
+    let mut lines = content.lines();
+    if lines.next()?.parse::<u64>().ok()? != start_time {
+        return None;
+    }
+    lines
+        .map(|line| {
+            let fields = line
+                .split_whitespace()
+                .map(|f| f.parse::<u64>().ok())
+                .collect::<Option<Vec<_>>>()?;
+            match fields.as_slice() {
+                [base_gfn, npages, userspace_addr, flags, id] => Some(MemSlot {
+                    base_gfn: *base_gfn,
+                    npages: *npages as c_ulong,
+                    userspace_addr: *userspace_addr as c_ulong,
+                    flags: *flags as u32,
+                    id: *id as u32,
+                }),
+                _ => None,
+            }
         })
-    });
-    let mut perf_map = try_with!(builder.build(), "could not install perf event handler");
-    try_with!(tracee.check_extension(0), "cannot query kvm extensions");
+        .collect()
+}
 
-    perf_map.poll(0);
-    let memslots = try_with!(
-        receiver.recv_timeout(Duration::from_secs(0)),
-        "could not receive memslots from kernel"
+fn store_cache(pid: Pid, start_time: u64, memslots: &[MemSlot]) -> io::Result<()> {
+    store_slots(&cache_path(pid), start_time, memslots)
+}
+
+fn store_slots(path: &Path, start_time: u64, memslots: &[MemSlot]) -> io::Result<()> {
+    let mut content = format!("{}\n", start_time);
+    for slot in memslots {
+        content.push_str(&format!(
+            "{} {} {} {} {}\n",
+            slot.base_gfn, slot.npages, slot.userspace_addr, slot.flags, slot.id
+        ));
+    }
+    fs::create_dir_all(CACHE_DIR)?;
+    let name = path.file_name().and_then(|n| n.to_str()).unwrap_or("slots");
+    let tmp = Path::new(CACHE_DIR).join(format!(
+        ".{}.{}.{}",
+        name,
+        std::process::id(),
+        TMP_COUNTER.fetch_add(1, Ordering::Relaxed)
+    ));
+    let res = fs::write(&tmp, content).and_then(|_| fs::rename(&tmp, path));
+    if res.is_err() {
+        let _ = fs::remove_file(&tmp);
+    }
+    res
+}
+
+/// Memslots of `pid` that vmsh switched to dirty logging, kept between vmsh invocations. Slots
+/// that log dirty pages without being listed here do so for the hypervisor itself (i.e. for a
+/// migration), and vmsh must not fetch or clear their log.
+pub fn dirty_log_slots(pid: Pid) -> Result<Vec<MemSlot>> {
+    let start_time = try_with!(openpid(pid), "cannot open handle in proc").start_time()?;
+    Ok(load_slots(&dirty_log_path(pid), start_time).unwrap_or_default())
+}
+
+pub fn set_dirty_log_slots(pid: Pid, memslots: &[MemSlot]) -> Result<()> {
+    let start_time = try_with!(openpid(pid), "cannot open handle in proc").start_time()?;
+    try_with!(
+        store_slots(&dirty_log_path(pid), start_time, memslots),
+        "cannot record dirty logging memslots in {}",
+        CACHE_DIR
     );
-    if memslots.len() == 1024 {
-        warn!(
-            "Reached capacity of kvm memslots we can extract from the kernel.
-We might miss physical memory allocations."
+    Ok(())
+}
+
+/// Must be called after changing the memslots of `pid`.
+pub fn invalidate_cache(pid: Pid) {
+    if let Err(e) = fs::remove_file(cache_path(pid)) {
+        if e.kind() != io::ErrorKind::NotFound {
+            warn!("cannot remove memslot cache: {}", e);
+        }
+    }
+}
+
+/// Memslots of the vm. Probing them needs a bpf program that bcc compiles first. With
+/// `use_cache` a cached result is used while a mapping of the hypervisor still backs each slot.
+/// That does not notice slots the hypervisor moved in guest-physical space, so `batch` only
+/// reads slots it probed itself just before, and vmsh drops the cache whenever it changes
+/// memslots.
+pub fn get_memslots(tracee: &Tracee, use_cache: bool) -> Result<Vec<MemSlot>> {
+    let pid = tracee.pid();
+    if !use_cache {
+        return probe_memslots(tracee);
+    }
+    let start_time = try_with!(openpid(pid), "cannot open handle in proc").start_time()?;
+    if let Some(memslots) = load_cache(pid, start_time) {
+        if memslot_mappings(pid, &memslots).is_ok() {
+            debug!("use cached memslots of {}", pid);
+            return Ok(memslots);
+        }
+        debug!("cached memslots of {} are stale", pid);
+    }
+    let memslots = probe_memslots(tracee)?;
+    if let Err(e) = store_cache(pid, start_time, &memslots) {
+        debug!("cannot cache memslots in {}: {}", CACHE_DIR, e);
+    }
+    Ok(memslots)
+}
+
+/// Compiles and installs the bpf program once to probe the memslots of any number of
+/// hypervisors, see `cache_memslots`.
+pub struct MemslotProbe {
+    perf_map: PerfMap,
+    /// pid, number of slots of the vm, index of the first received slot, received slots
+    receiver: Receiver<(Pid, usize, usize, Vec<MemSlot>)>,
+    // dropped last, detaches the kprobe
+    module: BPF,
+}
+
+impl MemslotProbe {
+    /// A probe for `pid` only or, if None, for every hypervisor.
+    pub fn new(pid: Option<Pid>) -> Result<MemslotProbe> {
+        let mut module = bpf_prog(pid)?;
+        try_with!(
+            Kprobe::new()
+                .handler("kvm_vm_ioctl")
+                .function("kvm_vm_ioctl")
+                .attach(&mut module),
+            "failed to install kprobe"
         );
+        let table = try_with!(module.table("memslots"), "failed to get perf event table");
+
+        let (sender, receiver) = channel();
+        let builder = PerfMapBuilder::new(table, move || {
+            let sender = sender.clone();
+            Box::new(move |x| {
+                let head = x.as_ptr() as *const size_t;
+                let used = unsafe { ptr::read(head) };
+                let pid = unsafe { ptr::read(head.add(1)) };
+                let first = unsafe { ptr::read(head.add(2)) };
+                let size = min(MAX_SLOTS, used.saturating_sub(first));
+                let memslots_slice = unsafe { make_slice(head.add(3) as *const MemSlot, size) };
+                let msg = (
+                    Pid::from_raw(pid as i32),
+                    used,
+                    first,
+                    memslots_slice.to_vec(),
+                );
+                let _ = sender.send(msg);
+            })
+        });
+        let perf_map = try_with!(builder.build(), "could not install perf event handler");
+        Ok(MemslotProbe {
+            perf_map,
+            receiver,
+            module,
+        })
+    }
+
+    /// Make the next kvm_vm_ioctl report the slots from index `first` on.
+    fn set_start(&mut self, first: usize) -> Result<()> {
+        let mut table = try_with!(self.module.table("start"), "failed to get start table");
+        let mut key = 0u32.to_ne_bytes();
+        let mut leaf = (first as u32).to_ne_bytes();
+        try_with!(table.set(&mut key, &mut leaf), "cannot set first memslot");
+        Ok(())
+    }
+
+    /// All slots of the vm, with a kvm_vm_ioctl per MAX_SLOTS of them.
+    pub fn probe(&mut self, tracee: &Tracee) -> Result<Vec<MemSlot>> {
+        let mut memslots = vec![];
+        loop {
+            let first = memslots.len();
+            self.set_start(first)?;
+            try_with!(tracee.check_extension(0), "cannot query kvm extensions");
+
+            self.perf_map.poll(0);
+            // other hypervisors may have called kvm_vm_ioctl meanwhile
+            let mut received = None;
+            while let Ok((pid, used, from, slots)) =
+                self.receiver.recv_timeout(Duration::from_secs(0))
+            {
+                if pid == tracee.pid() && from == first {
+                    received = Some((used, slots));
+                }
+            }
+            let (used, slots) = require_with!(received, "could not receive memslots from kernel");
+            if slots.is_empty() && first < used {
+                bail!("received no memslots from index {} of {}", first, used);
+            }
+            memslots.extend(slots);
+            if memslots.len() >= used {
+                return Ok(memslots);
+            }
+        }
     }
-    let mappings = fetch_mappings(tracee.pid())?;
+}
+
+fn probe_memslots(tracee: &Tracee) -> Result<Vec<MemSlot>> {
+    MemslotProbe::new(Some(tracee.pid()))?.probe(tracee)
+}
+
+/// Probe the memslots of `tracee` with a shared `probe` and cache them for `get_memslots`.
+pub fn cache_memslots(tracee: &Tracee, probe: &mut MemslotProbe) -> Result<()> {
+    let pid = tracee.pid();
+    let start_time = try_with!(openpid(pid), "cannot open handle in proc").start_time()?;
+    let memslots = probe.probe(tracee)?;
+    try_with!(
+        store_cache(pid, start_time, &memslots),
+        "cannot cache memslots in {}",
+        CACHE_DIR
+    );
+    Ok(())
+}
+
+/// Hypervisor mappings of `memslots`, in the same order.
+pub fn memslot_mappings(pid: Pid, memslots: &[MemSlot]) -> Result<Vec<Mapping>> {
+    let mappings = fetch_mappings(pid)?;
     memslots
         .iter()
         .map(|slot| match proc::find_mapping(&mappings, slot.start()) {
@@ -169,12 +424,18 @@ We might miss physical memory allocations."
             None => bail!(
                 "No mapping of memslot {} found in hypervisor (/proc/{}/maps)",
                 slot,
-                tracee.pid()
+                pid
             ),
         })
         .collect()
 }
 
+pub fn get_maps(tracee: &Tracee) -> Result<Vec<Mapping>> {
+    timings::measure("memslots", || {
+        memslot_mappings(tracee.pid(), &tracee.get_memslots()?)
+    })
+}
+
 /// ordered list of the hypervisor memory mapped to [vcpu0fd, vcpu1fd, ...]
 pub fn get_vcpu_maps(pid: Pid) -> Result<Vec<Mapping>> {
     let mappings = fetch_mappings(pid)?;
@@ -5,15 +5,16 @@ use simple_error::{bail, try_with};
 use std::mem::MaybeUninit;
 use std::os::unix::prelude::RawFd;
 use std::ptr;
+use std::sync::Mutex;
 
 use super::ioctls;
 use crate::cpu;
 use crate::kvm::hypervisor::{HvMem, VCPU};
 use crate::kvm::ioctls::KVM_CHECK_EXTENSION;
-use crate::kvm::memslots::{get_maps, get_vcpu_maps};
+use crate::kvm::memslots::{self, get_maps, get_memslots, get_vcpu_maps, MemSlot};
 use crate::result::Result;
 use crate::tracer::inject_syscall;
-use crate::tracer::inject_syscall::Process as Injectee;
+use crate::tracer::inject_syscall::{Process as Injectee, SyscallArgs};
 use crate::tracer::proc::Mapping;
 
 /// In theory this is dynamic however for for simplicity we limit it to 1 entry to not have to rewrite our vm allocation stack
@@ -39,6 +40,12 @@ pub struct Tracee {
     /// other functions.
     /// This hold especially true for the destructor of for example `VmMem`.
     proc: Option<Injectee>,
+    /// Set by `defer_cleanup`: syscalls of destructors queued for `run_deferred`.
+    deferred: Mutex<Option<Vec<SyscallArgs>>>,
+    /// Memslots as probed by this vmsh process and changed by it since.
+    memslots: Mutex<Option<Vec<MemSlot>>>,
+    /// Set by `use_memslot_cache`.
+    memslot_cache: bool,
 }
 
 #[allow(non_camel_case_types)]
@@ -51,7 +58,81 @@ pub type socklen_t = libc::socklen_t;
 
 impl Tracee {
     pub fn new(pid: Pid, vm_fd: RawFd, proc: Option<Injectee>) -> Tracee {
-        Tracee { pid, vm_fd, proc }
+        Tracee {
+            pid,
+            vm_fd,
+            proc,
+            deferred: Mutex::new(None),
+            memslots: Mutex::new(None),
+            memslot_cache: false,
+        }
+    }
+
+    /// Take memslots from the cache on disk, see `memslots::get_memslots`. The cache is only
+    /// checked against the mappings of the hypervisor, not against KVM, so this is only for
+    /// memslots probed just before by the same vmsh run. Memslots can not be changed afterwards.
+    pub fn use_memslot_cache(&mut self) {
+        self.memslot_cache = true;
+    }
+
+    /// Memslots are passed to KVM_SET_USER_MEMORY_REGION, which must never see a cached layout:
+    /// with a stale slot it would move or create memory behind the back of the hypervisor.
+    pub fn require_probed_memslots(&self) -> Result<()> {
+        if self.memslot_cache {
+            bail!("cannot change memslots taken from the memslot cache");
+        }
+        Ok(())
+    }
+
+    /// From now on `munmap`, `close` and `vm_ioctl_with_ref` only queue their syscall and
+    /// return 0, so destructors can remove memory, memslots and file descriptors of vmsh without
+    /// stopping the process. `run_deferred` runs the queue.
+    pub fn defer_cleanup(&self) -> Result<()> {
+        let mut deferred = try_with!(self.deferred.lock(), "cannot lock deferred syscalls");
+        deferred.get_or_insert_with(Vec::new);
+        Ok(())
+    }
+
+    /// Queue `call` if cleanup is deferred, false if it has to run now.
+    fn defer(&self, call: SyscallArgs) -> bool {
+        match self.deferred.lock() {
+            Ok(mut deferred) => match deferred.as_mut() {
+                Some(calls) => {
+                    calls.push(call);
+                    true
+                }
+                None => false,
+            },
+            Err(_) => false,
+        }
+    }
+
+    /// Whether syscalls were queued since `defer_cleanup` and did not run yet.
+    pub fn has_deferred(&self) -> bool {
+        match self.deferred.lock() {
+            Ok(deferred) => deferred.as_ref().map_or(false, |calls| !calls.is_empty()),
+            Err(_) => false,
+        }
+    }
+
+    /// Run the syscalls queued since `defer_cleanup` in order, with one stop of the process,
+    /// and stop deferring.
+    pub fn run_deferred(&self) -> Result<()> {
+        let calls = {
+            let mut deferred = try_with!(self.deferred.lock(), "cannot lock deferred syscalls");
+            deferred.take().unwrap_or_default()
+        };
+        if calls.is_empty() {
+            return Ok(());
+        }
+        let proc = self.try_get_proc()?;
+        let res = proc.syscalls(&calls)?;
+        // errors are returned as -errno
+        let failed = res.iter().filter(|r| (-4095..0).contains(*r)).count();
+        if failed != 0 {
+            bail!("{} of {} cleanup syscalls failed", failed, calls.len());
+        }
+        Ok(())
     }
 
     /// see Process#adopt
@@ -138,9 +219,32 @@ impl Tracee {
         request: c_ulong,
         arg: &HvMem<T>,
     ) -> Result<c_int> {
+        let call = [
+            libc::SYS_ioctl as c_ulong,
+            self.vm_fd as c_ulong,
+            request,
+            arg.ptr as c_ulong,
+            0,
+            0,
+            0,
+        ];
+        if self.defer(call) {
+            return Ok(0);
+        }
         self.vm_ioctl(request, arg.ptr as c_ulong)
     }
 
+    /// Run the ioctls `(request, arg)` on the vm fd with one stop of the process, see
+    /// `Process::syscalls`.
+    pub fn vm_ioctls(&self, calls: &[(c_ulong, c_ulong)]) -> Result<Vec<c_int>> {
+        let proc = self.try_get_proc()?;
+        let calls = calls
+            .iter()
+            .map(|(request, arg)| (self.vm_fd, *request, *arg))
+            .collect::<Vec<_>>();
+        proc.ioctls(&calls)
+    }
+
     fn vcpu_ioctl(&self, vcpu: &VCPU, request: c_ulong, arg: c_ulong) -> Result<c_int> {
         let proc = self.try_get_proc()?;
         proc.ioctl(vcpu.fd_num, request, arg)
@@ -166,6 +270,12 @@ impl Tracee {
         proc.mmap(addr, length, prot, flags, fd, offset)
     }
 
+    /// Like `mmap` for each of `lengths`, with one stop of the process.
+    pub fn mmaps(&self, lengths: &[libc::size_t]) -> Result<Vec<*mut c_void>> {
+        let proc = self.try_get_proc()?;
+        proc.mmaps(lengths)
+    }
+
     /// Guarantees not to allocate or follow pointers. Pure pointer calculus.
     /// You are free to try to convince the compiler that this is constant. In theory it is.
     ///
@@ -339,11 +449,26 @@ impl Tracee {
     ///
     /// length in bytes.
     pub fn munmap(&self, addr: *mut c_void, length: libc::size_t) -> Result<()> {
+        let call = [
+            libc::SYS_munmap as c_ulong,
+            addr as c_ulong,
+            length as c_ulong,
+            0,
+            0,
+            0,
+            0,
+        ];
+        if self.defer(call) {
+            return Ok(());
+        }
         let proc = self.try_get_proc()?;
         proc.munmap(addr, length)
     }
 
     pub fn close(&self, fd: RawFd) -> Result<i32> {
+        if self.defer([libc::SYS_close as c_ulong, fd as c_ulong, 0, 0, 0, 0, 0]) {
+            return Ok(0);
+        }
         let proc = self.try_get_proc()?;
         proc.close(fd)
     }
@@ -363,4 +488,29 @@ impl Tracee {
     pub fn get_vcpu_maps(&self) -> Result<Vec<Mapping>> {
         get_vcpu_maps(self.pid)
     }
+
+    /// Probed once per vmsh process, vmsh keeps them up to date with `update_memslot`.
+    pub fn get_memslots(&self) -> Result<Vec<MemSlot>> {
+        let mut probed = try_with!(self.memslots.lock(), "cannot lock memslots");
+        if let Some(memslots) = &*probed {
+            return Ok(memslots.clone());
+        }
+        let memslots = get_memslots(self, self.memslot_cache)?;
+        *probed = Some(memslots.clone());
+        Ok(memslots)
+    }
+
+    /// Record that vmsh set `slot`, which replaces the slot with the same id or, with a size of
+    /// 0, deletes it.
+    pub fn update_memslot(&self, slot: MemSlot) {
+        memslots::invalidate_cache(self.pid);
+        if let Ok(mut probed) = self.memslots.lock() {
+            if let Some(memslots) = probed.as_mut() {
+                memslots.retain(|s| s.id() != slot.id());
+                if slot.size() != 0 {
+                    memslots.push(slot);
+                }
+            }
+        }
+    }
 }
@@ -1,17 +1,22 @@
 pub mod attach;
+pub mod batch;
 pub mod coredump;
 pub mod cpu;
 pub mod devices;
 pub mod elf;
+pub mod fstype;
 pub mod gdb_break;
 pub mod guest_mem;
 pub mod inspect;
 pub mod interrutable_thread;
 pub mod kvm;
 pub mod loader;
+pub mod metrics;
 pub mod page_math;
 pub mod page_table;
 pub mod result;
+pub mod sessions;
 pub mod signal_handler;
 pub mod stage1;
+pub mod timings;
 pub mod tracer;
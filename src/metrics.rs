@@ -0,0 +1,224 @@
+//! Lock-free counters and histograms of a running attach, served in the Prometheus text format
+//! on a unix socket.
+
+use lazy_static::lazy_static;
+use log::info;
+use std::fmt::Write;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+const BUCKETS: usize = 65;
+
+/// Counts values in power-of-two buckets: bucket `i` holds values below `2^i` that do not fit
+/// into bucket `i - 1`.
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS],
+    sum: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        const ZERO: AtomicU64 = AtomicU64::new(0);
+        Histogram {
+            buckets: [ZERO; BUCKETS],
+            sum: AtomicU64::new(0),
+        }
+    }
+}
+
+impl Histogram {
+    pub fn record(&self, value: u64) {
+        let bucket = (64 - value.leading_zeros()) as usize;
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+    }
+
+    pub fn record_duration(&self, duration: Duration) {
+        self.record(duration.as_nanos() as u64);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.buckets.iter().map(|b| b.load(Ordering::Relaxed)).sum()
+    }
+
+    /// Upper bound of the bucket the `q`th quantile falls into.
+    pub fn quantile(&self, q: f64) -> u64 {
+        let rank = (self.count() as f64 * q).ceil() as u64;
+        let mut seen = 0;
+        for (i, b) in self.buckets.iter().enumerate() {
+            seen += b.load(Ordering::Relaxed);
+            if seen >= rank.max(1) {
+                return if i == 64 { u64::MAX } else { 1 << i };
+            }
+        }
+        0
+    }
+}
+
+/// Latency of mmio exits of one vcpu, from the return of ioctl(KVM_RUN) until the thread is
+/// resumed, in nanoseconds.
+#[derive(Default)]
+pub struct VcpuExits {
+    /// exits to our devices
+    pub intercepted: Histogram,
+    /// exits to devices of the hypervisor we passed on
+    pub ignored: Histogram,
+}
+
+lazy_static! {
+    static ref VCPU_EXITS: Mutex<Vec<Arc<VcpuExits>>> = Mutex::new(vec![]);
+}
+
+/// The exit histograms of vcpus `0..vcpus`. They live as long as vmsh, so attaching the exit
+/// handler again keeps counting.
+pub fn vcpu_exits(vcpus: usize) -> Vec<Arc<VcpuExits>> {
+    let mut all = VCPU_EXITS.lock().unwrap();
+    while all.len() < vcpus {
+        all.push(Arc::new(VcpuExits::default()));
+    }
+    all[..vcpus].to_vec()
+}
+
+/// Summarize the exit latencies of vcpus `0..vcpus`.
+pub fn log_vcpu_exits(vcpus: usize) {
+    for (vcpu, e) in vcpu_exits(vcpus).iter().enumerate() {
+        info!(
+            "vcpu {} mmio exits: {} intercepted (p50 < {}ns, p99 < {}ns), {} ignored (p50 < {}ns, p99 < {}ns)",
+            vcpu,
+            e.intercepted.count(),
+            e.intercepted.quantile(0.5),
+            e.intercepted.quantile(0.99),
+            e.ignored.count(),
+            e.ignored.quantile(0.5),
+            e.ignored.quantile(0.99),
+        );
+    }
+}
+
+/// Builds a scrape in the Prometheus text format.
+#[derive(Default)]
+pub struct Exposition {
+    /// name, type and samples of each metric, in the order they were first written. The format
+    /// wants all samples of a metric in one group after its `# TYPE` line.
+    metrics: Vec<(String, &'static str, String)>,
+}
+
+impl Exposition {
+    /// The samples of metric `name` of type `kind`.
+    fn samples(&mut self, name: &str, kind: &'static str) -> &mut String {
+        let idx = match self.metrics.iter().position(|(n, _, _)| n == name) {
+            Some(idx) => idx,
+            None => {
+                self.metrics.push((name.to_string(), kind, String::new()));
+                self.metrics.len() - 1
+            }
+        };
+        &mut self.metrics[idx].2
+    }
+
+    pub fn counter(&mut self, name: &str, labels: &str, value: u64) {
+        let out = self.samples(name, "counter");
+        let _ = writeln!(out, "{}{{{}}} {}", name, labels, value);
+    }
+
+    /// Writes the buckets `first..=last` of `hist`; `scale` converts values to the unit of the
+    /// metric.
+    pub fn histogram(
+        &mut self,
+        name: &str,
+        labels: &str,
+        hist: &Histogram,
+        first: usize,
+        last: usize,
+        scale: f64,
+    ) {
+        let out = self.samples(name, "histogram");
+        let mut cumulative: u64 = hist.buckets[..first]
+            .iter()
+            .map(|b| b.load(Ordering::Relaxed))
+            .sum();
+        for i in first..=last {
+            cumulative += hist.buckets[i].load(Ordering::Relaxed);
+            let le = (1u64 << i) as f64 * scale;
+            let _ = writeln!(
+                out,
+                "{}_bucket{{{},le=\"{}\"}} {}",
+                name, labels, le, cumulative
+            );
+        }
+        let _ = writeln!(
+            out,
+            "{}_bucket{{{},le=\"+Inf\"}} {}",
+            name,
+            labels,
+            hist.count()
+        );
+        let _ = writeln!(
+            out,
+            "{}_sum{{{}}} {}",
+            name,
+            labels,
+            hist.sum.load(Ordering::Relaxed) as f64 * scale
+        );
+        let _ = writeln!(out, "{}_count{{{}}} {}", name, labels, hist.count());
+    }
+
+    pub fn vcpu_exits(&mut self, exits: &[Arc<VcpuExits>]) {
+        for (vcpu, e) in exits.iter().enumerate() {
+            for (kind, hist) in &[("intercepted", &e.intercepted), ("ignored", &e.ignored)] {
+                // 256ns .. 17s
+                self.histogram(
+                    "vmsh_mmio_exit_seconds",
+                    &format!("vcpu=\"{}\",kind=\"{}\"", vcpu, kind),
+                    hist,
+                    8,
+                    34,
+                    1e-9,
+                );
+            }
+        }
+    }
+
+    pub fn finish(self) -> String {
+        let mut out = String::new();
+        for (name, kind, samples) in self.metrics {
+            let _ = writeln!(out, "# TYPE {} {}", name, kind);
+            out.push_str(&samples);
+        }
+        out
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_histogram() {
+        let hist = Histogram::default();
+        for v in &[0, 1, 3, 4, 1000] {
+            hist.record(*v);
+        }
+        assert_eq!(hist.count(), 5);
+        assert_eq!(hist.quantile(0.5), 4);
+        assert_eq!(hist.quantile(1.0), 1024);
+
+        let mut exp = Exposition::default();
+        exp.counter("y_total", "a=\"b\"", 1);
+        exp.histogram("x", "a=\"b\"", &hist, 2, 3, 1.0);
+        exp.counter("y_total", "a=\"c\"", 2);
+        assert_eq!(
+            exp.finish(),
+            "# TYPE y_total counter\n\
+             y_total{a=\"b\"} 1\n\
+             y_total{a=\"c\"} 2\n\
+             # TYPE x histogram\n\
+             x_bucket{a=\"b\",le=\"4\"} 3\n\
+             x_bucket{a=\"b\",le=\"8\"} 4\n\
+             x_bucket{a=\"b\",le=\"+Inf\"} 5\n\
+             x_sum{a=\"b\"} 1008\n\
+             x_count{a=\"b\"} 5\n"
+        );
+    }
+}
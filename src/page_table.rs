@@ -1,15 +1,17 @@
-use std::cmp::max;
+use std::collections::HashMap;
 use std::mem::{size_of, size_of_val};
+use std::slice::from_raw_parts_mut;
 use std::sync::Arc;
 
 use crate::guest_mem::MappedMemory;
 use crate::kvm::hypervisor::{process_read, Hypervisor, PhysMem};
 use crate::page_math::{is_page_aligned, page_align, page_size};
 use crate::result::Result;
+use crate::timings;
 use bitflags::bitflags;
 use log::error;
 use nix::sys::mman::ProtFlags;
-use nix::sys::uio::{process_vm_writev, IoVec, RemoteIoVec};
+use nix::sys::uio::{process_vm_readv, process_vm_writev, IoVec, RemoteIoVec};
 use simple_error::{bail, try_with};
 use vm_memory::remote_mem::any_as_bytes;
 
@@ -127,13 +129,14 @@ pub struct PageTable {
     level: u8,
 }
 
+/// Iterates over the mapped pages in a virtual address range in ascending order. All tables are
+/// read on the first call to `next`, see `walk`.
 pub struct PageTableIterator<'a> {
     hv: &'a Hypervisor,
     page_table: PageTable,
     start: usize,
     end: usize,
-    count: usize,
-    inner: Option<Box<Self>>,
+    entries: Option<std::vec::IntoIter<PageTableIteratorValue>>,
 }
 
 impl PageTable {
@@ -172,8 +175,7 @@ impl PageTable {
             start,
             end,
             page_table: self,
-            count: 0,
-            inner: None,
+            entries: None,
         }
     }
 }
@@ -333,6 +335,7 @@ fn commit_page_tables(hv: &Hypervisor, tables: &[PageTable]) -> Result<()> {
         process_vm_writev(hv.pid, local_iovec.as_slice(), remote_iovec.as_slice()),
         "cannot write to process"
     );
+    timings::count_copied(written);
     let expected = remote_iovec.len() * page_size();
     if written != expected {
         bail!("short write, expected {}, written: {}", expected, written);
@@ -465,57 +468,149 @@ pub struct PageTableIteratorValue {
     pub entry: PageTableEntry,
 }
 
-impl<'a> Iterator for PageTableIterator<'a> {
-    type Item = Result<PageTableIteratorValue>;
-    fn next(&mut self) -> Option<Self::Item> {
-        if let Some(inner) = &mut self.inner {
-            let item = inner.next();
-            if item.is_some() {
-                return item;
-            } else {
-                self.inner.take();
-            }
+type Entries = [PageTableEntry; ENTRY_COUNT];
+
+/// Maximum number of iovecs per process_vm_readv call
+const IOV_MAX: usize = 1024;
+
+/// Read the tables at `addrs` with one process_vm_readv per `IOV_MAX` tables.
+fn read_tables(hv: &Hypervisor, addrs: &[PhysAddr]) -> Result<Vec<Entries>> {
+    let mut tables = vec![[PageTableEntry::default(); ENTRY_COUNT]; addrs.len()];
+    for (tables, addrs) in tables.chunks_mut(IOV_MAX).zip(addrs.chunks(IOV_MAX)) {
+        let local_iovec = tables
+            .iter_mut()
+            .map(|table| {
+                let len = size_of_val(table);
+                let bytes = unsafe { from_raw_parts_mut(table.as_mut_ptr() as *mut u8, len) };
+                IoVec::from_mut_slice(bytes)
+            })
+            .collect::<Vec<_>>();
+        let remote_iovec = addrs
+            .iter()
+            .map(|addr| RemoteIoVec {
+                base: addr.host_addr(),
+                len: size_of::<Entries>(),
+            })
+            .collect::<Vec<_>>();
+        let read = try_with!(
+            process_vm_readv(hv.pid, local_iovec.as_slice(), remote_iovec.as_slice()),
+            "cannot read page tables"
+        );
+        timings::count_copied(read);
+        let expected = remote_iovec.len() * size_of::<Entries>();
+        if read != expected {
+            bail!("short read, expected {}, read: {}", expected, read);
         }
-        let pt = &self.page_table;
-        let start = get_index(self.start as u64, pt.level) as usize;
-        self.count = max(self.count, start);
-        let end = get_index(self.end as u64, pt.level) as usize + 1;
-        for entry in pt.entries[self.count..end].iter() {
-            let idx = self.count as u64;
-            self.count += 1;
-            let mut virt_addr = pt.virt_addr + (idx << get_shift(pt.level));
-            // sign extend most significant bit
-            if virt_addr >> 47 != 0 {
-                virt_addr |= 0xFFFF << 48
-            }
-            if !entry.flags().contains(PageTableFlags::PRESENT) {
-                continue;
+    }
+    Ok(tables)
+}
+
+/// A table to visit, limited to the entries covering `start..=end`.
+struct Visit {
+    table: PageTable,
+    start: usize,
+    end: usize,
+}
+
+/// Collect the mapped pages of `root` in `start..=end`. Tables are walked one level at a time:
+/// all child tables of a level are fetched with a single call to `read` and tables referenced
+/// more than once are read only once.
+fn walk<F>(
+    root: PageTable,
+    start: usize,
+    end: usize,
+    mut read: F,
+) -> Result<Vec<PageTableIteratorValue>>
+where
+    F: FnMut(&[PhysAddr]) -> Result<Vec<Entries>>,
+{
+    let mut pages = vec![];
+    let mut cache: HashMap<usize, Entries> = HashMap::new();
+    let mut visits = vec![Visit {
+        table: root,
+        start,
+        end,
+    }];
+    while !visits.is_empty() {
+        // (address, virtual address, start, end) of the next level's tables
+        let mut children = vec![];
+        for visit in &visits {
+            let pt = &visit.table;
+            let start = get_index(visit.start as u64, pt.level) as usize;
+            let end = get_index(visit.end as u64, pt.level) as usize;
+            for (idx, entry) in pt.entries.iter().enumerate().take(end + 1).skip(start) {
+                let mut virt_addr = pt.virt_addr + ((idx as u64) << get_shift(pt.level));
+                // sign extend most significant bit
+                if virt_addr >> 47 != 0 {
+                    virt_addr |= 0xFFFF << 48
+                }
+                if !entry.flags().contains(PageTableFlags::PRESENT) {
+                    continue;
+                }
+                if pt.level == 3 || entry.flags().contains(PageTableFlags::HUGE_PAGE) {
+                    pages.push(PageTableIteratorValue {
+                        virt_addr,
+                        level: pt.level,
+                        entry: *entry,
+                    });
+                    continue;
+                }
+                let child_start = if idx > start { 0 } else { visit.start };
+                let child_end = if idx < end { usize::MAX } else { visit.end };
+                children.push((pt.phys_addr(*entry), virt_addr, child_start, child_end));
             }
+        }
 
-            if pt.level == 3 || entry.flags().contains(PageTableFlags::HUGE_PAGE) {
-                return Some(Ok(PageTableIteratorValue {
+        let mut missing = children
+            .iter()
+            .map(|(addr, ..)| addr.clone())
+            .filter(|addr| !cache.contains_key(&addr.value))
+            .collect::<Vec<_>>();
+        missing.sort_by_key(|addr| addr.value);
+        missing.dedup();
+        if !missing.is_empty() {
+            let tables = read(&missing)?;
+            cache.extend(missing.iter().map(|addr| addr.value).zip(tables));
+        }
+
+        let level = visits[0].table.level + 1;
+        visits = children
+            .into_iter()
+            .map(|(phys_addr, virt_addr, start, end)| Visit {
+                table: PageTable {
+                    entries: cache[&phys_addr.value],
                     virt_addr,
-                    level: pt.level,
-                    entry: *entry,
-                }));
-            }
-            let next_pt =
-                PageTable::read(self.hv, &pt.phys_addr(*entry), virt_addr, pt.level + 1).ok()?;
-
-            let start = if idx as usize > start { 0 } else { self.start };
-            let end = if (idx as usize) < end - 1 {
-                usize::MAX
-            } else {
-                self.end
-            };
-
-            let mut inner = next_pt.iter(self.hv, start, end);
-            if let Some(next) = &inner.next() {
-                self.inner = Some(Box::new(inner));
-                return Some(next.clone());
+                    phys_addr,
+                    level,
+                },
+                start,
+                end,
+            })
+            .collect();
+    }
+    // the sign extension keeps the order of the table indices
+    pages.sort_by_key(|page| page.virt_addr);
+    Ok(pages)
+}
+
+impl<'a> Iterator for PageTableIterator<'a> {
+    type Item = Result<PageTableIteratorValue>;
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.entries.is_none() {
+            let hv = self.hv;
+            let res = walk(self.page_table.clone(), self.start, self.end, |addrs| {
+                read_tables(hv, addrs)
+            });
+            match res {
+                Ok(pages) => self.entries = Some(pages.into_iter()),
+                Err(e) => {
+                    // report the error only once
+                    self.entries = Some(vec![].into_iter());
+                    return Some(Err(e));
+                }
             }
         }
-        None
+        self.entries.as_mut()?.next().map(Ok)
     }
 }
 
@@ -523,7 +618,7 @@ impl<'a> Iterator for PageTableIterator<'a> {
 mod tests {
     use crate::page_math::page_size;
 
-    use super::{estimate_page_table_size, ENTRY_COUNT, LEVEL_COUNT};
+    use super::*;
     #[test]
     fn test_page_table_size() {
         assert_eq!(estimate_page_table_size(1), page_size() * LEVEL_COUNT);
@@ -533,4 +628,74 @@ mod tests {
             page_size() + page_size() * LEVEL_COUNT
         );
     }
+
+    #[test]
+    fn test_walk() {
+        let entry = |addr: u64, flags: PageTableFlags| PageTableEntry {
+            entry: addr | (flags | PageTableFlags::PRESENT).bits(),
+        };
+        let phys = |value| PhysAddr {
+            value,
+            host_offset: 0,
+        };
+        let mut memory: HashMap<usize, Entries> = HashMap::new();
+        let mut pml4 = PageTable::empty(phys(0x1000));
+        // two pml4 entries share the same pdpt
+        pml4.entries[1] = entry(0x2000, PageTableFlags::empty());
+        pml4.entries[511] = entry(0x2000, PageTableFlags::empty());
+        let mut pdpt = [PageTableEntry::default(); ENTRY_COUNT];
+        pdpt[2] = entry(0x4000_0000, PageTableFlags::HUGE_PAGE);
+        pdpt[3] = entry(0x3000, PageTableFlags::empty());
+        memory.insert(0x2000, pdpt);
+        let mut pd = [PageTableEntry::default(); ENTRY_COUNT];
+        pd[0] = entry(0x4000, PageTableFlags::empty());
+        memory.insert(0x3000, pd);
+        let mut pt = [PageTableEntry::default(); ENTRY_COUNT];
+        pt[0] = entry(0x10000, PageTableFlags::empty());
+        pt[5] = entry(0x11000, PageTableFlags::empty());
+        memory.insert(0x4000, pt);
+
+        let mut reads = vec![];
+        let pages = walk(pml4, 0, usize::MAX, |addrs| {
+            reads.push(addrs.len());
+            Ok(addrs.iter().map(|a| memory[&a.value]).collect())
+        })
+        .unwrap();
+        // one read per level, the shared pdpt is read once
+        assert_eq!(reads, vec![1, 1, 1]);
+        let pages = pages
+            .iter()
+            .map(|p| (p.virt_addr, p.level, p.entry.addr()))
+            .collect::<Vec<_>>();
+        let pml4_1 = 1 << 39;
+        let pml4_511 = 0xFFFF_0000_0000_0000 | 511 << 39;
+        assert_eq!(
+            pages,
+            vec![
+                (pml4_1 + (2 << 30), 1, 0x4000_0000),
+                (pml4_1 + (3 << 30), 3, 0x10000),
+                (pml4_1 + (3 << 30) + 0x5000, 3, 0x11000),
+                (pml4_511 + (2 << 30), 1, 0x4000_0000),
+                (pml4_511 + (3 << 30), 3, 0x10000),
+                (pml4_511 + (3 << 30) + 0x5000, 3, 0x11000),
+            ]
+        );
+
+        // the range limits the walk
+        let mut pml4 = PageTable::empty(phys(0x1000));
+        pml4.entries[1] = entry(0x2000, PageTableFlags::empty());
+        let start = pml4_1 as usize + (3 << 30) + 0x1000;
+        let pages = walk(pml4, start, usize::MAX, |addrs| {
+            Ok(addrs.iter().map(|a| memory[&a.value]).collect())
+        })
+        .unwrap();
+        assert_eq!(pages.len(), 1);
+        assert_eq!(pages[0].entry.addr(), 0x11000);
+
+        // errors are not swallowed
+        let pml4 = PageTable::empty(phys(0x1000));
+        let mut pml4_err = pml4.clone();
+        pml4_err.entries[0] = entry(0x5000, PageTableFlags::empty());
+        assert!(walk(pml4_err, 0, usize::MAX, |_| bail!("cannot read")).is_err());
+    }
 }
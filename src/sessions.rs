@@ -0,0 +1,193 @@
+//! Shells that stay available while vmsh is attached.
+//!
+//! Each session is an extra console backed by a host pty. stage2 keeps a login shell running on
+//! it and restarts it on exit, so opening a further shell in the VM just means connecting to the
+//! pty instead of attaching again. The ptys are published as symlinks in `session_dir`.
+
+use log::{info, warn};
+use nix::fcntl::{fcntl, FcntlArg, OFlag};
+use nix::poll::{poll, PollFd, PollFlags};
+use nix::pty::openpty;
+use nix::sys::termios::{self, SetArg};
+use nix::unistd::{self, Pid};
+use simple_error::{bail, try_with};
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Read, Write};
+use std::os::unix::fs::symlink;
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::path::{Path, PathBuf};
+
+use crate::result::Result;
+
+/// Environment variable telling stage2 for how many consoles it has to serve shells.
+pub const SESSIONS_ENV: &str = "VMSH_SESSIONS";
+
+/// Detaches `connect` from a session, like telnet.
+const ESCAPE: u8 = 0x1d; // ^]
+
+pub fn session_dir(pid: Pid) -> PathBuf {
+    Path::new("/run/vmsh").join(format!("sessions-{}", pid))
+}
+
+fn session_path(pid: Pid, idx: usize) -> PathBuf {
+    session_dir(pid).join(idx.to_string())
+}
+
+struct Session {
+    master: File,
+    // Without an open slave reads from the master fail while no client is connected.
+    _slave: File,
+}
+
+pub struct Sessions {
+    dir: PathBuf,
+    sessions: Vec<Session>,
+}
+
+impl Sessions {
+    pub fn new(pid: Pid, count: usize) -> Result<Sessions> {
+        let dir = session_dir(pid);
+        if count == 0 {
+            return Ok(Sessions {
+                dir,
+                sessions: vec![],
+            });
+        }
+        // left over from a vmsh that did not exit cleanly
+        let _ = fs::remove_dir_all(&dir);
+        try_with!(fs::create_dir_all(&dir), "cannot create {}", dir.display());
+
+        let mut sessions = Sessions {
+            dir,
+            sessions: vec![],
+        };
+        for idx in 0..count {
+            let pty = try_with!(openpty(None, None), "cannot allocate pty");
+            let master = unsafe { File::from_raw_fd(pty.master) };
+            let slave = unsafe { File::from_raw_fd(pty.slave) };
+            // Output nobody reads must not stall the device thread once the pty buffer is full.
+            try_with!(
+                fcntl(master.as_raw_fd(), FcntlArg::F_SETFL(OFlag::O_NONBLOCK)),
+                "cannot make pty non-blocking"
+            );
+            // The guest's tty already echos and translates, the host pty must pass bytes as is.
+            let mut attrs = try_with!(termios::tcgetattr(slave.as_raw_fd()), "tcgetattr failed");
+            termios::cfmakeraw(&mut attrs);
+            try_with!(
+                termios::tcsetattr(slave.as_raw_fd(), SetArg::TCSANOW, &attrs),
+                "tcsetattr failed"
+            );
+            let tty = try_with!(unistd::ttyname(slave.as_raw_fd()), "cannot get pty name");
+            let link = session_path(pid, idx);
+            try_with!(symlink(&tty, &link), "cannot create {}", link.display());
+            info!("session {}: {}", idx, tty.display());
+            sessions.sessions.push(Session {
+                master,
+                _slave: slave,
+            });
+        }
+        Ok(sessions)
+    }
+
+    /// The host side of each session, to be connected to a console device.
+    pub fn consoles(&self) -> Result<Vec<File>> {
+        let mut files = vec![];
+        for session in &self.sessions {
+            files.push(try_with!(
+                session.master.try_clone(),
+                "cannot duplicate pty"
+            ));
+        }
+        Ok(files)
+    }
+
+    pub fn len(&self) -> usize {
+        self.sessions.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.sessions.is_empty()
+    }
+}
+
+impl Drop for Sessions {
+    fn drop(&mut self) {
+        if self.sessions.is_empty() {
+            return;
+        }
+        if let Err(e) = fs::remove_dir_all(&self.dir) {
+            warn!("cannot remove {}: {}", self.dir.display(), e);
+        }
+    }
+}
+
+/// Copies what is available on `from` to `to`. Returns false on end of file.
+fn forward(from: &mut File, to: &mut dyn Write, buf: &mut [u8]) -> io::Result<bool> {
+    let n = from.read(buf)?;
+    if n == 0 {
+        return Ok(false);
+    }
+    to.write_all(&buf[..n])?;
+    to.flush()?;
+    Ok(true)
+}
+
+/// Connect the terminal to session `idx` of the vmsh attached to `pid` until ^] is pressed.
+pub fn connect(pid: Pid, idx: usize) -> Result<()> {
+    let path = session_path(pid, idx);
+    let mut pty = try_with!(
+        OpenOptions::new().read(true).write(true).open(&path),
+        "cannot open session {}",
+        path.display()
+    );
+    let mut stdin = unsafe { File::from_raw_fd(libc::STDIN_FILENO) };
+    let saved = termios::tcgetattr(libc::STDIN_FILENO).ok();
+    if let Some(saved) = &saved {
+        let mut raw = saved.clone();
+        termios::cfmakeraw(&mut raw);
+        try_with!(
+            termios::tcsetattr(libc::STDIN_FILENO, SetArg::TCSANOW, &raw),
+            "cannot switch terminal to raw mode"
+        );
+        eprint!("connected to session {}, press ^] to detach\r\n", idx);
+    }
+
+    let res = (|| -> Result<()> {
+        let mut buf = [0u8; 4096];
+        let mut stdout = io::stdout();
+        loop {
+            let mut fds = [
+                PollFd::new(libc::STDIN_FILENO, PollFlags::POLLIN),
+                PollFd::new(pty.as_raw_fd(), PollFlags::POLLIN),
+            ];
+            try_with!(poll(&mut fds, -1), "poll failed");
+            let ready = |fd: &PollFd| fd.revents().map_or(false, |r| !r.is_empty());
+            if ready(&fds[0]) {
+                let n = try_with!(stdin.read(&mut buf), "cannot read stdin");
+                let input = match buf[..n].iter().position(|&b| b == ESCAPE) {
+                    Some(end) => &buf[..end],
+                    None => &buf[..n],
+                };
+                try_with!(pty.write_all(input), "cannot write to session");
+                if n == 0 || input.len() < n {
+                    return Ok(());
+                }
+            }
+            if ready(&fds[1])
+                && !try_with!(
+                    forward(&mut pty, &mut stdout, &mut buf),
+                    "cannot read session"
+                )
+            {
+                bail!("session {} was closed", idx);
+            }
+        }
+    })();
+
+    if let Some(saved) = saved {
+        let _ = termios::tcsetattr(libc::STDIN_FILENO, SetArg::TCSANOW, &saved);
+    }
+    // stdin is not ours to close
+    std::mem::forget(stdin);
+    res
+}
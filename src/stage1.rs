@@ -20,6 +20,7 @@ use crate::kvm::allocator::VirtAlloc;
 use crate::loader::Loader;
 use crate::page_table::VirtMem;
 use crate::result::Result;
+use crate::timings;
 
 const STAGE1_EXE: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/stage1.ko"));
 const STAGE1_LIB: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/libstage1_freestanding.so"));
@@ -82,6 +83,7 @@ fn write_padded(f: &mut dyn Write, bytes: &[u8], padded_size: usize) -> Result<(
 fn stage1_thread(
     ssh_args: String,
     command: &[String],
+    env: &[String],
     mmio_addrs: Vec<u64>,
     virt_mem: VirtMem,
     should_stop: Arc<AtomicBool>,
@@ -101,6 +103,13 @@ fn stage1_thread(
         .collect::<Vec<_>>()
         .join(",");
 
+    // an empty array parameter would still pass one empty variable
+    let env_param = if env.is_empty() {
+        String::new()
+    } else {
+        format!(r#"stage2_env="{}""#, env.join(","))
+    };
+
     let virt_addr = virt_mem.mappings[0].virt_start;
     info!("virt: 0x{:x}", virt_addr);
     let mut child = ssh_command(&ssh_args, move |cmd| -> &mut Command {
@@ -112,12 +121,13 @@ trap "rm -rf '$tmpdir'" EXIT
 dd if=/proc/self/fd/0 of="$tmpdir/stage1.ko" count={} bs=512
 # cleanup old driver if still loaded
 rmmod stage1 2>/dev/null || true
-insmod "$tmpdir/stage1.ko" devices="{}" stage2_argv="{}" virt_mem="{}"
+insmod "$tmpdir/stage1.ko" devices="{}" stage2_argv="{}" {} virt_mem="{}"
 "#,
             debug_stage1,
             stage1_size / 512,
             mmio_addrs,
             command.join(","),
+            env_param,
             virt_addr
         );
         cmd.stdin(Stdio::piped()).arg(script)
@@ -164,8 +174,6 @@ insmod "$tmpdir/stage1.ko" devices="{}" stage2_argv="{}" virt_mem="{}"
         };
     }
 
-    info!("block device driver started");
-
     Ok(Stage1 {
         ssh_args,
         virt_mem: Some(virt_mem),
@@ -175,12 +183,14 @@ insmod "$tmpdir/stage1.ko" devices="{}" stage2_argv="{}" virt_mem="{}"
 pub fn spawn_stage1(
     ssh_args: &str,
     command: &[String],
+    env: &[String],
     mmio_ranges: Vec<u64>,
     mut allocator: kvm::PhysMemAllocator,
     result_sender: &SyncSender<()>,
 ) -> Result<InterrutableThread<Stage1>> {
     let ssh_args = ssh_args.to_string();
     let command = command.to_vec();
+    let env = env.to_vec();
     let kernel_sections = try_with!(
         allocator.find_kernel(),
         "could not find Linux kernel in VM memory"
@@ -206,7 +216,12 @@ pub fn spawn_stage1(
         result_sender,
         move |should_stop: Arc<AtomicBool>| {
             // wait until vmsh can process block device requests
-            stage1_thread(ssh_args, &command, mmio_ranges, virt_mem, should_stop)
+            let stage1 = timings::measure("stage1", || {
+                stage1_thread(ssh_args, &command, &env, mmio_ranges, virt_mem, should_stop)
+            })?;
+            timings::report();
+            info!("block device driver started");
+            Ok(stage1)
         },
     );
     Ok(try_with!(res, "failed to create stage1 thread"))
@@ -8,15 +8,20 @@
 static int stage2_argc;
 static char *stage2_argv[MAX_STAGE2_ARGS];
 
+#define MAX_STAGE2_ENV 254
+static int stage2_envc;
+static char *stage2_env[MAX_STAGE2_ENV];
+
 #define MAX_DEVICES 254
 static int devices_num;
-static char *devices[3];
+static char *devices[MAX_DEVICES];
+// too large for the kernel stack
+static unsigned long long devs[MAX_DEVICES];
 static char *phys_mem, *virt_mem;
 
 // FIXME: Right now this is a kernel module in future, this should be replaced
 // something to be injectable into VMs.
 int init_module(void) {
-  unsigned long long devs[3];
   size_t i;
   unsigned long mem = 0;
   void __iomem *baseptr;
@@ -55,7 +60,7 @@ int init_module(void) {
     memset((void*)mem, 'A', 0x2000);
   }
 
-  return init_vmsh_stage1(devices_num, devs, stage2_argc, stage2_argv);
+  return init_vmsh_stage1(devices_num, devs, stage2_argc, stage2_argv, stage2_envc, stage2_env);
 }
 
 void cleanup_module(void) {
@@ -66,6 +71,7 @@ module_param(phys_mem, charp, 0);
 module_param(virt_mem, charp, 0);
 module_param_array(devices, charp, &devices_num, 0);
 module_param_array(stage2_argv, charp, &stage2_argc, 0);
+module_param_array(stage2_env, charp, &stage2_envc, 0);
 
 MODULE_AUTHOR("joerg@thalheim.io");
 MODULE_DESCRIPTION("Mount block device and launch intial vmsh process");
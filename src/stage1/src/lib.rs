@@ -194,8 +194,10 @@ unsafe fn register_virtio_mmio(
 }
 
 /// Holds the device we create by this code, so we can unregister it later
-const MAX_DEVICES: usize = 3;
-static mut DEVICES: [Option<PlatformDevice>; MAX_DEVICES] = [None, None, None];
+// same limit as in module.c
+const MAX_DEVICES: usize = 254;
+const NO_DEVICE: Option<PlatformDevice> = None;
+static mut DEVICES: [Option<PlatformDevice>; MAX_DEVICES] = [NO_DEVICE; MAX_DEVICES];
 static mut DEVICE_ADDRS: [libc::c_ulonglong; MAX_DEVICES] = [0; MAX_DEVICES];
 static mut STAGE2_SPAWNER: Option<*mut task_struct> = None;
 
@@ -272,6 +274,7 @@ impl Drop for KFile {
 
 static STAGE2_PATH: &str = c_str!("/dev/.vmsh");
 static mut STAGE2_ARGV: [*mut libc::c_char; 256] = [ptr::null_mut(); 256];
+static mut STAGE2_ENVP: [*mut libc::c_char; 256] = [ptr::null_mut(); 256];
 
 unsafe extern "C" fn spawn_stage2(_arg: *mut libc::c_void) -> libc::c_int {
     for (i, addr) in DEVICE_ADDRS.iter().enumerate() {
@@ -294,7 +297,7 @@ unsafe extern "C" fn spawn_stage2(_arg: *mut libc::c_void) -> libc::c_int {
                 }
             }
             Err(res) => {
-                printkln!("stage1: failed to register block mmio device: %d", res);
+                printkln!("stage1: failed to register mmio device: %d", res);
                 return res;
             }
         };
@@ -328,12 +331,10 @@ unsafe extern "C" fn spawn_stage2(_arg: *mut libc::c_void) -> libc::c_int {
     drop(file);
     flush_delayed_fput();
 
-    let mut envp: [*mut libc::c_char; 1] = [ptr::null_mut()];
-
     let res = call_usermodehelper(
         STAGE2_PATH.as_ptr() as *mut libc::c_char,
         STAGE2_ARGV.as_mut_ptr(),
-        envp.as_mut_ptr(),
+        STAGE2_ENVP.as_mut_ptr(),
         UMH_WAIT_EXEC,
     );
     if res != 0 {
@@ -351,6 +352,8 @@ unsafe fn init_vmsh_stage1(
     devices: *mut libc::c_ulonglong,
     argc: libc::c_int,
     argv: *mut *mut libc::c_char,
+    envc: libc::c_int,
+    envp: *mut *mut libc::c_char,
 ) -> libc::c_int {
     printkln!("stage1: init with %d arguments", argc);
     for i in 0..(devices_num as usize) {
@@ -358,7 +361,8 @@ unsafe fn init_vmsh_stage1(
             *addr = *devices.add(i);
         } else {
             printkln!(
-                "stage1: received too many devices, expect 1-3, got: %d",
+                "stage1: received too many devices, expect at most %zu, got: %d",
+                MAX_DEVICES,
                 devices_num
             );
             return -libc::EINVAL;
@@ -379,6 +383,18 @@ unsafe fn init_vmsh_stage1(
         (argc as usize) * size_of::<*mut libc::c_char>(),
     );
 
+    // envp = [ vars..., NULL ];
+    if (envc + 1) as usize > STAGE2_ENVP.len() {
+        printkln!("stage1: too many environment variables passed to stage2");
+        return -libc::E2BIG;
+    }
+
+    memcpy(
+        STAGE2_ENVP.as_ptr() as *mut libc::c_void,
+        envp as *mut libc::c_void,
+        (envc as usize) * size_of::<*mut libc::c_char>(),
+    );
+
     // We cannot close a file synchronusly outside of a kthread
     // Within a kthread we can use `flush_delayed_fput`
     let thread = kthread_create_on_node(
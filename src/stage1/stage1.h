@@ -1,4 +1,4 @@
 #pragma once
 
-int init_vmsh_stage1(int devices_num, unsigned long long* devices, int stage2_argc, char** stage2_argv);
+int init_vmsh_stage1(int devices_num, unsigned long long* devices, int stage2_argc, char** stage2_argv, int stage2_envc, char** stage2_env);
 void cleanup_vmsh_stage1(void);
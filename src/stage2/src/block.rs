@@ -13,8 +13,14 @@ use crate::procfs;
 use crate::result::Result;
 use crate::sys_ext::mknodat;
 
+// Platform device of the root block device: stage1 registers it first, as
+// virtio-mmio.<MMIO_DEVICE_ID>.
+const ROOT_PLATFORM_DEVICE: &str = "/sys/bus/platform/devices/virtio-mmio.1863406883";
+
 pub struct BlockDevice {
     dev_type: libc::dev_t,
+    // filesystem detected by vmsh, all supported ones are tried if None
+    fstype: Option<String>,
 }
 
 pub struct DeviceFile {
@@ -124,35 +130,48 @@ impl BlockDevice {
             DeviceFile::new(mountpoint, self),
             "cannot create block device file"
         );
-        let filesystems = try_with!(get_filesystems(), "could not read supported filesystems");
-        for fs in &filesystems {
-            let mount_flags = selinux_context
-                .as_ref()
-                .map(|ctx| PathBuf::from(format!("context=\"{}\"", ctx)));
-            let ref_mount_flags = mount_flags.as_deref();
-
-            let res = nix::mount::mount(
+        let mount_flags = selinux_context
+            .as_ref()
+            .map(|ctx| PathBuf::from(format!("context=\"{}\"", ctx)));
+        let mount_as = |fs: &str| {
+            nix::mount::mount(
                 Some(&dev_file.path),
                 mountpoint,
-                Some(fs.as_str()),
+                Some(fs),
                 nix::mount::MsFlags::empty(),
-                ref_mount_flags,
+                mount_flags.as_deref(),
+            )
+        };
+        let failed = |e: Errno| -> Result<()> {
+            if let Err(e) = dump_dmesg() {
+                eprintln!("dmesg failed {}", e);
+            }
+
+            bail!(
+                "mount(\"{}\", \"{}\") failed with {}",
+                dev_file.path.display(),
+                mountpoint.display(),
+                e
             );
-            match res {
+        };
+
+        if let Some(fs) = &self.fstype {
+            match mount_as(fs) {
                 Ok(()) => return Ok(()),
-                Err(Errno::EINVAL) => {}
-                Err(e) => {
-                    if let Err(e) = dump_dmesg() {
-                        eprintln!("dmesg failed {}", e);
-                    }
-
-                    bail!(
-                        "mount(\"{}\", \"{}\") failed with {}",
-                        dev_file.path.display(),
-                        mountpoint.display(),
-                        e
-                    );
+                // not supported by this kernel or not what vmsh thought it is
+                Err(Errno::ENODEV) | Err(Errno::EINVAL) => {
+                    eprintln!("cannot mount image as {}, trying all filesystems", fs)
                 }
+                Err(e) => return failed(e),
+            }
+        }
+
+        let filesystems = try_with!(get_filesystems(), "could not read supported filesystems");
+        for fs in &filesystems {
+            match mount_as(fs) {
+                Ok(()) => return Ok(()),
+                Err(Errno::EINVAL) => {}
+                Err(e) => return failed(e),
             };
         }
         bail!(
@@ -162,7 +181,26 @@ impl BlockDevice {
     }
 }
 
-pub fn find_vmsh_blockdev() -> Result<BlockDevice> {
+/// The sysfs directory of the root block device without asking every block device for its
+/// serial.
+fn find_by_platform_device() -> Option<PathBuf> {
+    for entry in fs::read_dir(ROOT_PLATFORM_DEVICE).ok()? {
+        let path = entry.ok()?.path();
+        if !path
+            .file_name()
+            .and_then(|n| n.to_str())
+            .map_or(false, |n| n.starts_with("virtio"))
+        {
+            continue;
+        }
+        if let Some(disk) = fs::read_dir(path.join("block")).ok()?.next() {
+            return Some(disk.ok()?.path());
+        }
+    }
+    None
+}
+
+fn find_by_serial() -> Result<PathBuf> {
     let dir = try_with!(
         fs::read_dir("/sys/block"),
         "failed to read /sys/block directory"
@@ -173,33 +211,51 @@ pub fn find_vmsh_blockdev() -> Result<BlockDevice> {
         let serial_path = entry.path().join("serial");
         match fs::read_to_string(&serial_path) {
             // not all block devices implement serial
-            Ok(s) if s == "vmsh0" => s,
+            Ok(s) if s == "vmsh0" => return Ok(entry.path()),
             _ => continue,
         };
-        let dev_path = entry.path().join("dev");
-        let major_minor = try_with!(
-            fs::read_to_string(&dev_path),
-            "cannot read device number from {}",
-            dev_path.display()
-        );
-        let splits = major_minor.trim_end().splitn(2, ':').collect::<Vec<_>>();
-        if splits.len() != 2 {
-            bail!("could not parse major/minor number: {}", major_minor);
-        }
-
-        let major = try_with!(
-            splits[0].parse(),
-            "could not parse major number: {}",
-            splits[0]
-        );
-        let minor = try_with!(
-            splits[1].parse(),
-            "could not parse minor number: {}",
-            splits[1]
-        );
-        let dev_type = unsafe { libc::makedev(major, minor) };
-        return Ok(BlockDevice { dev_type });
     }
 
     bail!("no vmsh block device found");
 }
+
+pub fn find_vmsh_blockdev(
+    fstype: Option<String>,
+    read_ahead_kb: Option<u32>,
+) -> Result<BlockDevice> {
+    let sysfs_path = match find_by_platform_device() {
+        Some(path) => path,
+        None => find_by_serial()?,
+    };
+    let dev_path = sysfs_path.join("dev");
+    let major_minor = try_with!(
+        fs::read_to_string(&dev_path),
+        "cannot read device number from {}",
+        dev_path.display()
+    );
+    let splits = major_minor.trim_end().splitn(2, ':').collect::<Vec<_>>();
+    if splits.len() != 2 {
+        bail!("could not parse major/minor number: {}", major_minor);
+    }
+
+    let major = try_with!(
+        splits[0].parse(),
+        "could not parse major number: {}",
+        splits[0]
+    );
+    let minor = try_with!(
+        splits[1].parse(),
+        "could not parse minor number: {}",
+        splits[1]
+    );
+    let dev_type = unsafe { libc::makedev(major, minor) };
+
+    if let Some(kb) = read_ahead_kb {
+        let path = sysfs_path.join("queue/read_ahead_kb");
+        if let Err(e) = fs::write(&path, kb.to_string()) {
+            eprintln!("cannot set {}: {}", path.display(), e);
+        }
+    }
+
+    Ok(BlockDevice { dev_type, fstype })
+}
@@ -4,8 +4,9 @@ use std::collections::HashMap;
 use std::env;
 use std::ffi::OsString;
 use std::fs::File;
-use std::io::{BufRead, BufReader};
+use std::io::{self, BufRead, BufReader};
 use std::os::unix::ffi::OsStringExt;
+use std::os::unix::process::CommandExt;
 use std::process::Child;
 use std::process::Command;
 
@@ -70,7 +71,33 @@ impl Cmd {
             environment: variables,
         })
     }
-    pub fn spawn(mut self) -> Result<Child> {
+    pub fn spawn(self) -> Result<Child> {
+        self.spawn_with(|_| {})
+    }
+
+    /// Spawns the command in a new session with `console` as its controlling terminal and stdio.
+    pub fn spawn_on(self, console: &File) -> Result<Child> {
+        let mut stdio = vec![];
+        for _ in 0..3 {
+            stdio.push(try_with!(console.try_clone(), "cannot duplicate console"));
+        }
+        self.spawn_with(move |cmd| {
+            cmd.stdin(stdio.pop().unwrap())
+                .stdout(stdio.pop().unwrap())
+                .stderr(stdio.pop().unwrap());
+            unsafe {
+                cmd.pre_exec(|| {
+                    unistd::setsid().map_err(|e| io::Error::from_raw_os_error(e as i32))?;
+                    if libc::ioctl(libc::STDIN_FILENO, libc::TIOCSCTTY, 0) < 0 {
+                        return Err(io::Error::last_os_error());
+                    }
+                    Ok(())
+                });
+            }
+        })
+    }
+
+    fn spawn_with<F: FnOnce(&mut Command)>(mut self, configure: F) -> Result<Child> {
         let default_path =
             OsString::from("/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin");
         self.environment.insert(
@@ -82,10 +109,10 @@ impl Cmd {
             self.environment.insert(OsString::from("HOME"), path);
         }
 
-        let child = Command::new(&self.command)
-            .args(&self.arguments)
-            .envs(self.environment)
-            .spawn();
+        let mut cmd = Command::new(&self.command);
+        cmd.args(&self.arguments).envs(self.environment);
+        configure(&mut cmd);
+        let child = cmd.spawn();
         Ok(try_with!(
             child,
             "failed to spawn {} {}",
@@ -14,7 +14,8 @@ use simple_error::{bail, try_with};
 // Linux assigns consoles linear so later added devices get a higher number.
 // In theory just assuming vmsh is the last console added is racy however
 // in practice it seems unlikely to have consoles added at runtime (famous last words).
-pub fn find_vmsh_consoles() -> Result<File> {
+// Returns up to `count` consoles, the one of vmsh first.
+pub fn find_vmsh_consoles(count: usize) -> Result<Vec<File>> {
     let entries = try_with!(
         fs::read_dir(PathBuf::from("/dev/")),
         "failed to open directory /dev"
@@ -31,21 +32,39 @@ pub fn find_vmsh_consoles() -> Result<File> {
             }
         }
     }
-    for num in heap {
+    let mut consoles = vec![];
+    // highest number first, iterating the heap itself yields arbitrary order
+    for num in heap.into_sorted_vec().into_iter().rev() {
+        if consoles.len() == count {
+            break;
+        }
         let name = format!("/dev/hvc{}", num);
         match fcntl::open(name.as_str(), OFlag::O_RDWR, stat::Mode::empty()) {
-            Ok(fd) => return Ok(unsafe { File::from_raw_fd(fd) }),
+            Ok(fd) => consoles.push(unsafe { File::from_raw_fd(fd) }),
             Err(Errno::ENODEV) => {}
             e => {
                 try_with!(e, "failed to open {}", &name);
             }
         };
     }
-    bail!("cannot find vmsh console device in /dev");
+    if consoles.is_empty() {
+        bail!("cannot find vmsh console device in /dev");
+    }
+    Ok(consoles)
 }
 
-pub fn setup() -> Result<()> {
-    let monitor_console = find_vmsh_consoles()?;
+/// Redirects stdout and stderr to the vmsh console and returns the consoles of the
+/// `sessions` shells.
+pub fn setup(sessions: usize) -> Result<Vec<File>> {
+    let mut consoles = find_vmsh_consoles(sessions + 1)?;
+    if consoles.len() != sessions + 1 {
+        bail!(
+            "expected {} consoles for sessions, found {}",
+            sessions,
+            consoles.len() - 1
+        );
+    }
+    let monitor_console = consoles.remove(0);
     try_with!(
         unistd::dup2(monitor_console.as_raw_fd(), libc::STDOUT_FILENO),
         "cannot replace stdout with monitor connection"
@@ -55,5 +74,5 @@ pub fn setup() -> Result<()> {
         "cannot replace stderr with monitor connection"
     );
 
-    Ok(())
+    Ok(consoles)
 }
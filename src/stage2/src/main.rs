@@ -13,6 +13,7 @@ use user_namespace::IdMap;
 use crate::block::find_vmsh_blockdev;
 use crate::cmd::Cmd;
 use crate::result::Result;
+use crate::session::Session;
 
 mod block;
 mod capabilities;
@@ -24,6 +25,7 @@ mod mountns;
 mod namespace;
 mod procfs;
 mod result;
+mod session;
 mod sys_ext;
 mod user_namespace;
 
@@ -32,13 +34,21 @@ struct Options {
     command: Option<String>,
     args: Vec<String>,
     home: Option<OsString>,
+    // number of consoles to serve shells on next to the one of `command`
+    sessions: usize,
+    // filesystem of the root device if vmsh knows it
+    fstype: Option<String>,
+    read_ahead_kb: Option<u32>,
 }
 
 fn run_stage2(opts: &Options) -> Result<()> {
     // get a console to report errors as quick as possible
-    try_with!(console::setup(), "failed to setup console");
+    let session_consoles = try_with!(console::setup(opts.sessions), "failed to setup console");
 
-    let dev = try_with!(find_vmsh_blockdev(), "cannot find block_device");
+    let dev = try_with!(
+        find_vmsh_blockdev(opts.fstype.clone(), opts.read_ahead_kb),
+        "cannot find block_device"
+    );
 
     let (uid_map, gid_map) = try_with!(
         IdMap::new_from_pid(opts.target_pid),
@@ -155,8 +165,18 @@ fn run_stage2(opts: &Options) -> Result<()> {
     // now that we have our child, we can drop temporary mount points
 
     drop(mount_ns);
+
+    let sessions = session_consoles
+        .into_iter()
+        .map(|console| Session::start(console, opts.target_pid, opts.home.clone()))
+        .collect::<Vec<_>>();
+
+    // vmsh detaching hangs up the console of the command as well
     let status = try_with!(child.wait(), "failed to wait for child process");
     eprintln!("process finished with {}", status);
+    for session in sessions {
+        session.stop();
+    }
     Ok(())
 }
 
@@ -182,6 +202,14 @@ fn main() {
         target_pid: Pid::from_raw(1),
         args: (&args[2..]).to_vec(),
         home: None,
+        sessions: env::var("VMSH_SESSIONS")
+            .ok()
+            .and_then(|n| n.parse().ok())
+            .unwrap_or(0),
+        fstype: env::var("VMSH_FSTYPE").ok(),
+        read_ahead_kb: env::var("VMSH_READ_AHEAD_KB")
+            .ok()
+            .and_then(|kb| kb.parse().ok()),
     };
     if let Err(e) = run_stage2(&opts) {
         // print to both allocated pty and kmsg
@@ -0,0 +1,103 @@
+use nix::poll::{poll, PollFd, PollFlags};
+use nix::sys::signal::{kill, Signal};
+use nix::unistd::Pid;
+use std::ffi::OsString;
+use std::fs::File;
+use std::os::unix::io::AsRawFd;
+use std::sync::{Arc, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use crate::cmd::Cmd;
+
+/// Shells that exit sooner than this were probably not used, so the next one is delayed.
+const MIN_RUNTIME: Duration = Duration::from_secs(1);
+const MAX_BACKOFF: Duration = Duration::from_secs(30);
+
+#[derive(Default)]
+struct State {
+    stopped: bool,
+    shell: Option<Pid>,
+}
+
+/// A login shell on a console that is restarted whenever it exits.
+pub struct Session {
+    state: Arc<Mutex<State>>,
+    thread: JoinHandle<()>,
+}
+
+impl Session {
+    pub fn start(console: File, target_pid: Pid, home: Option<OsString>) -> Session {
+        let state = Arc::new(Mutex::new(State::default()));
+        let thread_state = state.clone();
+        let thread = thread::spawn(move || serve(&console, target_pid, home, &thread_state));
+        Session { state, thread }
+    }
+
+    /// Hang up the current shell and do not start new ones.
+    pub fn stop(self) {
+        let mut state = self.state.lock().unwrap();
+        state.stopped = true;
+        if let Some(shell) = state.shell {
+            // the shell leads its own session, so this reaches its jobs as well
+            let _ = kill(Pid::from_raw(-shell.as_raw()), Signal::SIGHUP);
+        }
+        drop(state);
+        // the shell might ignore SIGHUP, so do not wait for it
+        drop(self.thread);
+    }
+}
+
+/// True once nobody can use the console anymore: a hung up tty polls as POLLHUP or POLLERR and
+/// fails reads with EIO or EOF.
+fn hung_up(console: &File) -> bool {
+    let mut fds = [PollFd::new(console.as_raw_fd(), PollFlags::empty())];
+    match poll(&mut fds, 0) {
+        Ok(_) => fds[0].revents().map_or(false, |r| {
+            r.intersects(PollFlags::POLLHUP | PollFlags::POLLERR | PollFlags::POLLNVAL)
+        }),
+        Err(_) => true,
+    }
+}
+
+fn serve(console: &File, target_pid: Pid, home: Option<OsString>, state: &Mutex<State>) {
+    let mut backoff = Duration::from_millis(100);
+    loop {
+        if hung_up(console) {
+            eprintln!("session console hung up");
+            return;
+        }
+        let started = Instant::now();
+        let res = {
+            let mut state = state.lock().unwrap();
+            if state.stopped {
+                return;
+            }
+            let res = Cmd::new(None, vec![], target_pid, home.clone())
+                .and_then(|cmd| cmd.spawn_on(console));
+            if let Ok(child) = &res {
+                state.shell = Some(Pid::from_raw(child.id() as i32));
+            }
+            res
+        };
+        match res {
+            Ok(mut child) => {
+                if let Err(e) = child.wait() {
+                    eprintln!("failed to wait for session shell: {}", e);
+                }
+                let mut state = state.lock().unwrap();
+                state.shell = None;
+                if state.stopped {
+                    return;
+                }
+            }
+            Err(e) => eprintln!("cannot start session shell: {}", e),
+        }
+        if started.elapsed() >= MIN_RUNTIME {
+            backoff = Duration::from_millis(100);
+            continue;
+        }
+        thread::sleep(backoff);
+        backoff = std::cmp::min(backoff * 2, MAX_BACKOFF);
+    }
+}
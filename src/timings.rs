@@ -0,0 +1,156 @@
+//! Wall time, injected syscalls and bytes copied from/to the hypervisor per phase of an attach.
+
+use lazy_static::lazy_static;
+use log::warn;
+use simple_error::try_with;
+use std::fmt;
+use std::fs;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use crate::result::Result;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static INJECTED_SYSCALLS: AtomicU64 = AtomicU64::new(0);
+static COPIED_BYTES: AtomicU64 = AtomicU64::new(0);
+
+lazy_static! {
+    static ref PHASES: Mutex<Vec<Phase>> = Mutex::new(vec![]);
+    static ref JSON_PATH: Mutex<Option<PathBuf>> = Mutex::new(None);
+}
+
+/// Counters are inclusive: a phase contains its nested phases and phases of other threads
+/// running at the same time.
+#[derive(Clone, Debug)]
+pub struct Phase {
+    pub name: &'static str,
+    pub wall: Duration,
+    pub syscalls: u64,
+    pub bytes: u64,
+}
+
+/// Record phases from now on. `json` receives them once `report` is called.
+pub fn enable(json: Option<PathBuf>) {
+    *JSON_PATH.lock().unwrap() = json;
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+/// Count syscalls injected into the hypervisor.
+pub fn count_syscalls(n: usize) {
+    INJECTED_SYSCALLS.fetch_add(n as u64, Ordering::Relaxed);
+}
+
+/// Count bytes copied from or to hypervisor memory.
+pub fn count_copied(bytes: usize) {
+    COPIED_BYTES.fetch_add(bytes as u64, Ordering::Relaxed);
+}
+
+/// Run `f` as phase `name`.
+pub fn measure<T, F: FnOnce() -> T>(name: &'static str, f: F) -> T {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return f();
+    }
+    let syscalls = INJECTED_SYSCALLS.load(Ordering::Relaxed);
+    let bytes = COPIED_BYTES.load(Ordering::Relaxed);
+    let start = Instant::now();
+    let res = f();
+    let phase = Phase {
+        name,
+        wall: start.elapsed(),
+        syscalls: INJECTED_SYSCALLS.load(Ordering::Relaxed) - syscalls,
+        bytes: COPIED_BYTES.load(Ordering::Relaxed) - bytes,
+    };
+    PHASES.lock().unwrap().push(phase);
+    res
+}
+
+struct Table<'a>(&'a [Phase]);
+
+impl<'a> fmt::Display for Table<'a> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(
+            f,
+            "{:<20} {:>12} {:>10} {:>12}",
+            "phase", "wall (ms)", "syscalls", "bytes"
+        )?;
+        for p in self.0 {
+            writeln!(
+                f,
+                "{:<20} {:>12.3} {:>10} {:>12}",
+                p.name,
+                p.wall.as_secs_f64() * 1000.0,
+                p.syscalls,
+                p.bytes
+            )?;
+        }
+        Ok(())
+    }
+}
+
+fn to_json(phases: &[Phase]) -> String {
+    let entries = phases
+        .iter()
+        .map(|p| {
+            format!(
+                r#"{{"phase":"{}","wall_us":{},"syscalls":{},"bytes":{}}}"#,
+                p.name,
+                p.wall.as_micros(),
+                p.syscalls,
+                p.bytes
+            )
+        })
+        .collect::<Vec<_>>();
+    format!("[{}]\n", entries.join(","))
+}
+
+fn write_json(path: &PathBuf, phases: &[Phase]) -> Result<()> {
+    // the file only shows up once complete
+    let tmp = path.with_extension("tmp");
+    try_with!(fs::write(&tmp, to_json(phases)), "cannot write {:?}", tmp);
+    try_with!(fs::rename(&tmp, path), "cannot rename {:?}", tmp);
+    Ok(())
+}
+
+/// Print the recorded phases to stderr and write them as json if requested.
+pub fn report() {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return;
+    }
+    let phases = PHASES.lock().unwrap().clone();
+    eprint!("{}", Table(&phases));
+    if let Some(path) = JSON_PATH.lock().unwrap().as_ref() {
+        if let Err(e) = write_json(path, &phases) {
+            warn!("{}", e);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_to_json() {
+        let phases = [
+            Phase {
+                name: "stop",
+                wall: Duration::from_micros(1500),
+                syscalls: 3,
+                bytes: 0,
+            },
+            Phase {
+                name: "devices",
+                wall: Duration::from_millis(2),
+                syscalls: 10,
+                bytes: 4096,
+            },
+        ];
+        assert_eq!(
+            to_json(&phases),
+            "[{\"phase\":\"stop\",\"wall_us\":1500,\"syscalls\":3,\"bytes\":0},\
+             {\"phase\":\"devices\",\"wall_us\":2000,\"syscalls\":10,\"bytes\":4096}]\n"
+        );
+    }
+}
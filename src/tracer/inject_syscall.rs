@@ -1,16 +1,25 @@
 use libc::{c_int, c_long, c_ulong, c_void, off_t, pid_t, size_t, ssize_t, SYS_munmap};
 use libc::{SYS_getpid, SYS_ioctl, SYS_mmap};
 use log::debug;
+use nix::sys::mman::{MapFlags, ProtFlags};
+use nix::sys::signal::Signal;
+use nix::sys::uio::{process_vm_readv, process_vm_writev, IoVec, RemoteIoVec};
 use nix::sys::wait::{waitpid, WaitStatus};
 use nix::unistd::Pid;
 use simple_error::{bail, try_with};
+use std::mem::size_of;
 use std::os::unix::prelude::RawFd;
+use std::slice::{from_raw_parts, from_raw_parts_mut};
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::thread::{current, ThreadId};
 
 use super::ptrace::attach_seize;
 use crate::cpu::{self, Regs};
+use crate::page_math::page_size;
 use crate::result::Result;
-use crate::tracer::proc::Mapping;
+use crate::timings;
+use crate::tracer::proc::{openpid, Mapping};
+use crate::tracer::wrap_syscall::VcpuMap;
 use crate::tracer::{ptrace, Tracer};
 
 #[derive(Debug)]
@@ -21,8 +30,24 @@ pub struct Process {
     /// Must never be None during operation. Only deinit() (called by drop) may take() this.
     threads: Option<Vec<ptrace::Thread>>,
     owner: Option<ThreadId>,
+    /// `cpu::SYSCALL_BATCH_TEXT` followed by a page for its entries, 0 until the first batch,
+    /// `NO_BATCH_PAGE` if it cannot be mapped
+    batch_page: AtomicU64,
 }
 
+/// Syscall number and arguments as passed to `Process::syscalls`
+pub type SyscallArgs = [c_ulong; 7];
+
+/// Syscall number, arguments and return value as read by `cpu::SYSCALL_BATCH_TEXT`.
+type BatchEntry = [c_ulong; 8];
+
+/// The batch trampoline maps a read-only executable page for its code and a writable one for
+/// the entries.
+const BATCH_PAGES: usize = 2;
+/// `Process::batch_page` when the process does not allow the trampoline, e.g. with
+/// PR_SET_MDWE or a policy against executable mappings.
+const NO_BATCH_PAGE: u64 = u64::MAX;
+
 /// save and overwrite main thread state
 fn init(threads: &[ptrace::Thread], process_idx: usize) -> Result<(Regs, c_long)> {
     let saved_regs = try_with!(
@@ -47,9 +72,17 @@ fn init(threads: &[ptrace::Thread], process_idx: usize) -> Result<(Regs, c_long)
 /// First call: return Some(_). From now on no further operations must be done on this object.
 /// Second call: return None
 fn deinit(p: &mut Process) -> Option<Vec<ptrace::Thread>> {
-    match &mut p.threads {
+    match &p.threads {
         // may have been take()en already
-        Some(threads) => {
+        Some(_) => {
+            let page = p.batch_page.swap(0, Ordering::Relaxed);
+            if page != 0 && page != NO_BATCH_PAGE {
+                // fails if we are not the owner, in which case the page is leaked
+                if let Err(e) = p.munmap(page as *mut c_void, BATCH_PAGES * page_size()) {
+                    debug!("cannot unmap syscall batch page: {}", e);
+                }
+            }
+            let threads = p.threads.as_ref().unwrap();
             let main_thread = &threads[p.process_idx];
             let _ = unsafe {
                 main_thread.write(
@@ -73,16 +106,17 @@ pub fn from_tracer(t: Tracer) -> Result<Process> {
         saved_text,
         threads: Some(t.threads),
         owner: t.owner,
+        batch_page: AtomicU64::new(0),
     })
 }
 
-pub fn into_tracer(mut p: Process, vcpu_map: Mapping) -> Result<Tracer> {
+pub fn into_tracer(mut p: Process, vcpu_maps: Vec<VcpuMap>) -> Result<Tracer> {
     let process_idx = p.process_idx;
     let threads = deinit(&mut p).expect("Process was deinited before it was dropped!");
     Ok(Tracer {
         process_idx,
         threads,
-        vcpu_map,
+        vcpu_maps,
         owner: p.owner,
     })
 }
@@ -97,6 +131,7 @@ pub fn attach(pid: Pid) -> Result<Process> {
         saved_text,
         threads: Some(threads),
         owner: Some(current().id()),
+        batch_page: AtomicU64::new(0),
     })
 }
 
@@ -321,12 +356,264 @@ impl Process {
         self.syscall(&args).map(|v| v as ssize_t)
     }
 
+    pub fn mprotect(&self, addr: *mut c_void, length: size_t, prot: c_int) -> Result<c_int> {
+        let args = syscall_args!(
+            self.saved_regs,
+            libc::SYS_mprotect as c_ulong,
+            addr,
+            length,
+            prot
+        );
+
+        self.syscall(&args).map(|v| v as c_int)
+    }
+
     pub fn userfaultfd(&self, flags: c_int) -> Result<c_int> {
         let args = syscall_args!(self.saved_regs, libc::SYS_userfaultfd as c_ulong, flags);
 
         self.syscall(&args).map(|v| v as c_int)
     }
 
+    /// Run the ioctls `(fd, request, arg)`, see `syscalls`.
+    pub fn ioctls(&self, calls: &[(RawFd, c_ulong, c_ulong)]) -> Result<Vec<c_int>> {
+        let calls = calls
+            .iter()
+            .map(|(fd, request, arg)| {
+                [
+                    SYS_ioctl as c_ulong,
+                    *fd as c_ulong,
+                    *request,
+                    *arg,
+                    0,
+                    0,
+                    0,
+                ]
+            })
+            .collect::<Vec<_>>();
+        let res = self.syscalls(&calls)?;
+        Ok(res.into_iter().map(|v| v as c_int).collect())
+    }
+
+    /// Map anonymous shared memory of each of `lengths`, see `syscalls`.
+    pub fn mmaps(&self, lengths: &[size_t]) -> Result<Vec<*mut c_void>> {
+        let calls = lengths
+            .iter()
+            .map(|len| {
+                let flags = libc::MAP_SHARED | libc::MAP_ANONYMOUS;
+                let prot = libc::PROT_READ | libc::PROT_WRITE;
+                [
+                    SYS_mmap as c_ulong,
+                    0,
+                    *len as c_ulong,
+                    prot as c_ulong,
+                    flags as c_ulong,
+                    -1i64 as c_ulong,
+                    0,
+                ]
+            })
+            .collect::<Vec<_>>();
+        let res = self.syscalls(&calls)?;
+        Ok(res.into_iter().map(|v| v as *mut c_void).collect())
+    }
+
+    /// Run independent syscalls and return their results. Unlike one `syscall` after the
+    /// other, which stops the process twice per syscall, a trampoline in the process runs up to
+    /// a page of them between two stops. Processes that refuse the trampoline get one syscall
+    /// after the other.
+    #[cfg(target_arch = "x86_64")]
+    pub fn syscalls(&self, calls: &[SyscallArgs]) -> Result<Vec<isize>> {
+        if calls.len() < 2 {
+            return self.syscalls_one_by_one(calls);
+        }
+        self.check_owner()?;
+        let page = match self.batch_page()? {
+            Some(page) => page,
+            None => return self.syscalls_one_by_one(calls),
+        };
+        let entries_addr = page + page_size() as u64;
+        let max_entries = page_size() / size_of::<BatchEntry>();
+
+        let mut results = Vec::with_capacity(calls.len());
+        for batch in calls.chunks(max_entries) {
+            let mut entries = batch
+                .iter()
+                .map(|c| [c[0], c[1], c[2], c[3], c[4], c[5], c[6], 0])
+                .collect::<Vec<BatchEntry>>();
+            let len = entries.len() * size_of::<BatchEntry>();
+            let remote = [RemoteIoVec {
+                base: entries_addr as usize,
+                len,
+            }];
+            let bytes = unsafe { from_raw_parts(entries.as_ptr() as *const u8, len) };
+            let written = try_with!(
+                process_vm_writev(self.pid(), &[IoVec::from_slice(bytes)], &remote),
+                "cannot write syscall batch"
+            );
+            if written != len {
+                bail!("short write of syscall batch: {}/{}b", written, len);
+            }
+
+            let regs =
+                self.saved_regs
+                    .prepare_syscall_batch(page, entries_addr, entries.len() as u64);
+            try_with!(
+                self.main_thread().setregs(&regs),
+                "cannot set registers for syscall batch"
+            );
+            try_with!(self.wait_for_trap(), "failed to run syscall batch");
+            let result_regs = try_with!(self.main_thread().getregs(), "cannot get batch results");
+            if result_regs.ip() != page + cpu::SYSCALL_BATCH_TEXT.len() as u64 {
+                bail!("syscall batch stopped at 0x{:x}", result_regs.ip());
+            }
+            timings::count_syscalls(batch.len());
+
+            let bytes = unsafe { from_raw_parts_mut(entries.as_mut_ptr() as *mut u8, len) };
+            let read = try_with!(
+                process_vm_readv(self.pid(), &[IoVec::from_mut_slice(bytes)], &remote),
+                "cannot read syscall batch results"
+            );
+            if read != len {
+                bail!("short read of syscall batch results: {}/{}b", read, len);
+            }
+            results.extend(entries.iter().map(|e| e[7] as isize));
+        }
+        Ok(results)
+    }
+
+    #[cfg(not(target_arch = "x86_64"))]
+    pub fn syscalls(&self, calls: &[SyscallArgs]) -> Result<Vec<isize>> {
+        self.syscalls_one_by_one(calls)
+    }
+
+    fn syscalls_one_by_one(&self, calls: &[SyscallArgs]) -> Result<Vec<isize>> {
+        calls
+            .iter()
+            .map(|c| self.syscall(&self.saved_regs.prepare_syscall(c)))
+            .collect()
+    }
+
+    /// Leave the batch page mapped when the process is released, so that releasing it does not
+    /// inject another syscall. The next attach finds and reuses it, see `kept_batch_page`.
+    pub fn keep_batch_page(&self) {
+        self.batch_page.store(0, Ordering::Relaxed);
+    }
+
+    /// Map the batch trampoline on first use, None if the process does not allow it. The code
+    /// is written while the page is writable and only then made executable.
+    #[cfg(target_arch = "x86_64")]
+    fn batch_page(&self) -> Result<Option<u64>> {
+        match self.batch_page.load(Ordering::Relaxed) {
+            0 => {}
+            NO_BATCH_PAGE => return Ok(None),
+            page => return Ok(Some(page)),
+        }
+        if let Some(page) = self.kept_batch_page() {
+            self.batch_page.store(page, Ordering::Relaxed);
+            return Ok(Some(page));
+        }
+        let addr = self.mmap(
+            std::ptr::null_mut(),
+            BATCH_PAGES * page_size(),
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+            -1,
+            0,
+        )? as isize;
+        // errors are returned as -errno
+        if (-4095..0).contains(&addr) {
+            debug!("cannot map syscall batch page: errno {}", -addr);
+            self.batch_page.store(NO_BATCH_PAGE, Ordering::Relaxed);
+            return Ok(None);
+        }
+        let page = addr as u64;
+        let remote = [RemoteIoVec {
+            base: page as usize,
+            len: cpu::SYSCALL_BATCH_TEXT.len(),
+        }];
+        let written = try_with!(
+            process_vm_writev(
+                self.pid(),
+                &[IoVec::from_slice(cpu::SYSCALL_BATCH_TEXT)],
+                &remote
+            ),
+            "cannot write syscall batch trampoline"
+        );
+        if written != cpu::SYSCALL_BATCH_TEXT.len() {
+            bail!("short write of syscall batch trampoline");
+        }
+        let prot = libc::PROT_READ | libc::PROT_EXEC;
+        let ret = self.mprotect(page as *mut c_void, page_size(), prot)?;
+        if ret != 0 {
+            debug!("cannot make syscall batch page executable: errno {}", -ret);
+            if let Err(e) = self.munmap(page as *mut c_void, BATCH_PAGES * page_size()) {
+                debug!("cannot unmap syscall batch page: {}", e);
+            }
+            self.batch_page.store(NO_BATCH_PAGE, Ordering::Relaxed);
+            return Ok(None);
+        }
+        self.batch_page.store(page, Ordering::Relaxed);
+        Ok(Some(page))
+    }
+
+    /// The batch page an earlier attach left mapped with `keep_batch_page`: an anonymous
+    /// executable page holding the trampoline, followed by a writable one.
+    #[cfg(target_arch = "x86_64")]
+    fn kept_batch_page(&self) -> Option<u64> {
+        let maps = match openpid(self.pid()).and_then(|p| p.maps()) {
+            Ok(maps) => maps,
+            Err(e) => {
+                debug!("cannot look for a kept syscall batch page: {}", e);
+                return None;
+            }
+        };
+        let anonymous = |m: &Mapping, prot: ProtFlags| {
+            m.prot_flags == prot
+                && m.map_flags == MapFlags::MAP_PRIVATE
+                && m.inode == 0
+                && m.pathname.is_empty()
+                && m.size() == page_size()
+        };
+        let (text, _) = maps
+            .windows(2)
+            .map(|w| (&w[0], &w[1]))
+            .find(|(text, entries)| {
+                anonymous(text, ProtFlags::PROT_READ | ProtFlags::PROT_EXEC)
+                    && anonymous(entries, ProtFlags::PROT_READ | ProtFlags::PROT_WRITE)
+                    && entries.start == text.end
+                    && self.holds_trampoline(text.start)
+            })?;
+        debug!("reuse syscall batch page at 0x{:x}", text.start);
+        Some(text.start as u64)
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    fn holds_trampoline(&self, addr: usize) -> bool {
+        let mut text = vec![0u8; cpu::SYSCALL_BATCH_TEXT.len()];
+        let remote = [RemoteIoVec {
+            base: addr,
+            len: text.len(),
+        }];
+        match process_vm_readv(self.pid(), &[IoVec::from_mut_slice(&mut text)], &remote) {
+            Ok(read) => read == text.len() && text == cpu::SYSCALL_BATCH_TEXT,
+            Err(_) => false,
+        }
+    }
+
+    /// Continue until the int3 at the end of the batch trampoline.
+    fn wait_for_trap(&self) -> Result<()> {
+        loop {
+            try_with!(self.main_thread().cont(None), "ptrace_cont() failed");
+            let status = try_with!(waitpid(self.main_thread().tid, None), "waitpid failed");
+
+            match status {
+                WaitStatus::Stopped(_, Signal::SIGTRAP) => return Ok(()),
+                WaitStatus::Exited(_, status) => bail!("process exited with: {}", status),
+                WaitStatus::Signaled(_, signal, _) => bail!("process killed by: {}", signal),
+                _ => {}
+            }
+        }
+    }
+
     fn wait_for_syscall(&self) -> Result<()> {
         loop {
             try_with!(self.main_thread().syscall(), "ptrace_syscall() failed");
@@ -342,6 +629,7 @@ impl Process {
 
     fn syscall(&self, regs: &Regs) -> Result<isize> {
         self.check_owner()?;
+        timings::count_syscalls(1);
         try_with!(
             self.main_thread().setregs(regs),
             "cannot set system call args"
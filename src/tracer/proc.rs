@@ -1,9 +1,10 @@
 use libc::c_int;
+use nix::errno::Errno;
 use nix::fcntl::{self, OFlag};
 use nix::sys::mman::{MapFlags, ProtFlags};
 use nix::sys::stat;
 use nix::unistd::{getpid, Pid};
-use simple_error::try_with;
+use simple_error::{require_with, try_with};
 use std::fs::{read_dir, read_link, File};
 use std::io::{BufRead, BufReader};
 use std::os::unix::io::{AsRawFd, FromRawFd};
@@ -48,6 +49,17 @@ pub fn find_mapping(mappings: &[Mapping], ip: usize) -> Option<Mapping> {
         .cloned()
 }
 
+/// Duplicate the file descriptor `fd` of process `pid` into our process, see pidfd_getfd(2).
+/// Needs linux 5.6 or newer and the same permissions as ptrace.
+pub fn pidfd_getfd(pid: Pid, fd: RawFd) -> Result<File> {
+    let res = unsafe { libc::syscall(libc::SYS_pidfd_open, pid.as_raw(), 0) };
+    let pidfd = try_with!(Errno::result(res), "pidfd_open({}) failed", pid);
+    let pidfd = unsafe { File::from_raw_fd(pidfd as RawFd) };
+    let res = unsafe { libc::syscall(libc::SYS_pidfd_getfd, pidfd.as_raw_fd(), fd, 0) };
+    let fd = try_with!(Errno::result(res), "pidfd_getfd({}, {}) failed", pid, fd);
+    Ok(unsafe { File::from_raw_fd(fd as RawFd) })
+}
+
 pub struct PidHandle {
     pub pid: Pid,
     file: File,
@@ -189,6 +201,30 @@ impl PidHandle {
         Ok(fds)
     }
 
+    /// Start time of the process in clock ticks after boot, which tells apart processes that
+    /// got the same pid.
+    pub fn start_time(&self) -> Result<u64> {
+        let path = self.entry("stat");
+        let stat = try_with!(
+            std::fs::read_to_string(&path),
+            "cannot read {}",
+            path.display()
+        );
+        // the command name in field 2 may contain spaces and parentheses
+        let fields = require_with!(stat.rsplit_once(')'), "cannot parse {}", path.display()).1;
+        // field 22, counted from the state in field 3
+        let start_time = require_with!(
+            fields.split_whitespace().nth(19),
+            "no start time in {}",
+            path.display()
+        );
+        Ok(try_with!(
+            start_time.parse::<u64>(),
+            "invalid start time in {}",
+            path.display()
+        ))
+    }
+
     pub fn maps(&self) -> Result<Vec<Mapping>> {
         let path = self.entry("maps");
         let f = try_with!(File::open(&path), "cannot open {}", path.display());
@@ -7,23 +7,124 @@ use nix::{
     errno::Errno,
     sys::wait::{waitpid, WaitStatus},
 };
-use nix::{sys::signal::Signal, unistd::getpgrp};
+use nix::{
+    sys::mman::{self, MapFlags, ProtFlags},
+    sys::signal::Signal,
+    unistd::getpgrp,
+};
 use simple_error::bail;
 use simple_error::try_with;
 use std::{
     fmt,
+    fs::File,
+    mem::size_of,
+    os::unix::prelude::{AsRawFd, RawFd},
+    ptr,
+    sync::Arc,
     thread::{current, ThreadId},
+    time::Instant,
 };
 
 use crate::kvm::hypervisor;
 use crate::kvm::ioctls;
+use crate::metrics::{self, VcpuExits};
 use crate::result::Result;
-use crate::tracer::proc::Mapping;
+use crate::tracer::proc::{self, Mapping};
 use crate::tracer::ptrace;
 
 type MmioRwRaw = kvmb::kvm_run__bindgen_ty_1__bindgen_ty_6;
 pub const MMIO_RW_DATA_MAX: usize = 8;
 
+/// A vcpu of the hypervisor and the memory where its `kvm_run` structure is mapped to.
+#[derive(Clone, Debug)]
+pub struct VcpuMap {
+    /// vcpu number as found in anon_inode:kvm-vcpu:<idx>
+    pub idx: usize,
+    /// vcpu file descriptor in the hypervisor
+    pub fd_num: RawFd,
+    /// hypervisor memory where fd_num is mapped to.
+    pub mapping: Mapping,
+    /// The same `kvm_run` structure mapped into vmsh. If None, exits are copied from `mapping`
+    /// with process_vm_readv instead.
+    pub kvm_run: Option<Arc<SharedKvmRun>>,
+}
+
+/// The `kvm_run` structure of a vcpu mapped into our process. Allows to read and answer mmio
+/// exits in place instead of copying kvm_run between processes on every exit.
+#[derive(Debug)]
+pub struct SharedKvmRun {
+    ptr: *mut kvmb::kvm_run,
+    len: usize,
+    /// our duplicate of the vcpu fd
+    _vcpu_fd: File,
+}
+
+// The mapping is only accessed while the thread running the vcpu is stopped in ioctl(KVM_RUN).
+unsafe impl Send for SharedKvmRun {}
+unsafe impl Sync for SharedKvmRun {}
+
+impl SharedKvmRun {
+    pub fn new(pid: Pid, vcpu: &VcpuMap) -> Result<SharedKvmRun> {
+        let len = vcpu.mapping.size();
+        if len < size_of::<kvmb::kvm_run>() {
+            bail!(
+                "mapping of vcpu {} is smaller than kvm_run ({}b)",
+                vcpu.idx,
+                len
+            );
+        }
+        let vcpu_fd = proc::pidfd_getfd(pid, vcpu.fd_num)?;
+        let ptr = try_with!(
+            unsafe {
+                mman::mmap(
+                    ptr::null_mut(),
+                    len,
+                    ProtFlags::PROT_READ | ProtFlags::PROT_WRITE,
+                    MapFlags::MAP_SHARED,
+                    vcpu_fd.as_raw_fd(),
+                    0,
+                )
+            },
+            "cannot mmap kvm_run of vcpu {}",
+            vcpu.idx
+        );
+        Ok(SharedKvmRun {
+            ptr: ptr as *mut kvmb::kvm_run,
+            len,
+            _vcpu_fd: vcpu_fd,
+        })
+    }
+
+    /// Returns the mmio union of kvm_run if the vcpu exited with KVM_EXIT_MMIO.
+    fn mmio_exit(&self) -> Option<MmioRwRaw> {
+        // safe because the mapping is at least size_of::<kvm_run>() big and the exit_reason
+        // (which comes from the kernel) told us which union field to use.
+        unsafe {
+            if ptr::read_volatile(&(*self.ptr).exit_reason) != kvmb::KVM_EXIT_MMIO {
+                return None;
+            }
+            Some(ptr::read_volatile(&(*self.ptr).__bindgen_anon_1.mmio))
+        }
+    }
+
+    fn answer_mmio_read(&self, data: &[u8; MMIO_RW_DATA_MAX]) {
+        unsafe {
+            let mmio: *mut MmioRwRaw = &mut (*self.ptr).__bindgen_anon_1.mmio;
+            ptr::write_volatile(&mut (*mmio).data, *data);
+            // guess who will never know that this was a mmio read
+            ptr::write_volatile(&mut (*mmio).is_write, 1);
+        }
+    }
+}
+
+impl Drop for SharedKvmRun {
+    fn drop(&mut self) {
+        if let Err(e) = unsafe { mman::munmap(self.ptr as *mut libc::c_void, self.len) } {
+            warn!("cannot unmap kvm_run: {}", e);
+        }
+    }
+}
+
 pub struct MmioRw {
     /// address in the guest physical memory
     pub addr: u64,
@@ -31,12 +132,15 @@ pub struct MmioRw {
     pub is_write: bool,
     data: [u8; MMIO_RW_DATA_MAX],
     len: usize,
+    /// thread that is stopped in ioctl(KVM_RUN)
     pid: Pid,
-    vcpu_map: Mapping,
+    /// position of the exited vcpu in the `VcpuMap`s given to the KvmRunWrapper
+    pub vcpu: usize,
+    vcpu_map: VcpuMap,
 }
 
 impl MmioRw {
-    pub fn new(raw: &MmioRwRaw, pid: Pid, vcpu_map: Mapping) -> MmioRw {
+    pub fn new(raw: &MmioRwRaw, pid: Pid, vcpu: usize, vcpu_map: VcpuMap) -> MmioRw {
         // should we sanity check len here in order to not crash on out of bounds?
         // should we check that vcpu_map is big enough for kvm_run?
         MmioRw {
@@ -45,22 +149,33 @@ impl MmioRw {
             data: raw.data,
             len: raw.len as usize,
             pid,
+            vcpu,
             vcpu_map,
         }
     }
 
-    pub fn from(kvm_run: &kvmb::kvm_run, pid: Pid, vcpu_map: Mapping) -> Option<MmioRw> {
+    pub fn from(
+        kvm_run: &kvmb::kvm_run,
+        pid: Pid,
+        vcpu: usize,
+        vcpu_map: VcpuMap,
+    ) -> Option<MmioRw> {
         match kvm_run.exit_reason {
             kvmb::KVM_EXIT_MMIO => {
                 // Safe because the exit_reason (which comes from the kernel) told us which
                 // union field to use.
                 let mmio: &MmioRwRaw = unsafe { &kvm_run.__bindgen_anon_1.mmio };
-                Some(MmioRw::new(mmio, pid, vcpu_map))
+                Some(MmioRw::new(mmio, pid, vcpu, vcpu_map))
             }
             _ => None,
         }
     }
 
+    /// Thread of the hypervisor that waits for this mmio access to be answered.
+    pub fn tid(&self) -> Pid {
+        self.pid
+    }
+
     pub fn data(&self) -> &[u8] {
         &self.data[..self.len]
     }
@@ -89,7 +204,12 @@ impl MmioRw {
         }
         self.data_mut().clone_from_slice(data);
 
-        let kvm_run_ptr = self.vcpu_map.start as *mut kvm_bindings::kvm_run;
+        if let Some(kvm_run) = &self.vcpu_map.kvm_run {
+            kvm_run.answer_mmio_read(&self.data);
+            return Ok(());
+        }
+
+        let kvm_run_ptr = self.vcpu_map.mapping.start as *mut kvm_bindings::kvm_run;
         // safe because those pointers will not be used in our process :) and additionally Self::new
         // may or may not perform vcpu_map size assertions.
         let mmio_ptr: *mut MmioRwRaw = unsafe { &mut ((*kvm_run_ptr).__bindgen_anon_1.mmio) };
@@ -128,23 +248,47 @@ impl fmt::Display for MmioRw {
     }
 }
 
+/// Number of syscall stops after which a thread that never called ioctl(KVM_RUN) is no longer
+/// stopped at syscalls. This only happens once every vcpu was seen running on some other thread,
+/// so the thread is an io or main loop thread of the hypervisor and not a vcpu thread that is
+/// still setting up.
+const MAX_FOREIGN_SYSCALL_STOPS: usize = 64;
+
 /// Contains the state of the thread running a vcpu.
-/// TODO in theory vcpus could change threads which they are run on
 #[derive(Debug)]
 struct Thread {
     ptthread: ptrace::Thread,
-    vcpu_map: Mapping,
+    /// Index into `KvmRunWrapper.vcpus` of the vcpu the thread runs with its current
+    /// ioctl(KVM_RUN). Looked up on every KVM_RUN entry since vcpus can change threads.
+    vcpu: Option<usize>,
     is_running: bool,
     in_syscall: bool,
+    /// Not resumed by `KvmRunWrapper::wait_for_ioctl()` until `KvmRunWrapper::release()` is
+    /// called. Used while its mmio exit is answered by a different thread.
+    held: bool,
+    /// Resume with PTRACE_SYSCALL if true, otherwise with PTRACE_CONT, so that the thread runs at
+    /// full speed and only stops for signals.
+    trace_syscalls: bool,
+    /// ioctl(KVM_RUN) was observed on this thread
+    runs_vcpu: bool,
+    /// syscall stops observed before `runs_vcpu` was set
+    foreign_syscall_stops: usize,
+    /// mmio exit the thread is stopped in: since when, the vcpu and whether it was intercepted
+    exit: Option<(Instant, usize, bool)>,
 }
 
 impl Thread {
-    pub fn new(ptthread: ptrace::Thread, vcpu_map: Mapping) -> Thread {
+    pub fn new(ptthread: ptrace::Thread) -> Thread {
         Thread {
             ptthread,
+            vcpu: None,
             is_running: false,
             in_syscall: false, // ptrace (in practice) never attaches to a process while it is in a syscall
-            vcpu_map,
+            held: false,
+            trace_syscalls: true,
+            runs_vcpu: false,
+            foreign_syscall_stops: 0,
+            exit: None,
         }
     }
 
@@ -152,6 +296,34 @@ impl Thread {
         self.in_syscall = !self.in_syscall;
     }
 
+    /// Continue the thread until its next syscall or, if it does not run a vcpu, until the next
+    /// signal.
+    fn resume(&mut self) -> Result<()> {
+        if self.trace_syscalls {
+            try_with!(self.ptthread.syscall(), "ptrace.thread.syscall() failed");
+        } else {
+            try_with!(self.ptthread.cont(None), "ptrace.thread.cont() failed");
+        }
+        self.is_running = true;
+        Ok(())
+    }
+
+    /// Account a syscall stop that was not caused by ioctl(KVM_RUN). `vcpus_placed` tells whether
+    /// every vcpu was seen in ioctl(KVM_RUN) already.
+    fn foreign_syscall_stop(&mut self, vcpus_placed: bool) {
+        if self.runs_vcpu || !self.trace_syscalls {
+            return;
+        }
+        self.foreign_syscall_stops += 1;
+        if vcpus_placed && self.foreign_syscall_stops >= MAX_FOREIGN_SYSCALL_STOPS {
+            debug!(
+                "thread {} does not run a vcpu, stop tracing its syscalls",
+                self.ptthread.tid
+            );
+            self.trace_syscalls = false;
+        }
+    }
+
     /// Should be called before or during dropping a Thread
     pub fn prepare_detach(&self) -> Result<()> {
         if !self.is_running {
@@ -166,8 +338,10 @@ impl Thread {
                 "failed to waitpid on thread {}",
                 self.ptthread.tid
             );
+            // threads resumed with PTRACE_CONT report the interrupt as PTRACE_EVENT_STOP
             if let WaitStatus::PtraceSyscall(pid)
-            | WaitStatus::PtraceEvent(pid, Signal::SIGSTOP, _) = status
+            | WaitStatus::PtraceEvent(pid, Signal::SIGSTOP, _)
+            | WaitStatus::PtraceEvent(pid, Signal::SIGTRAP, libc::PTRACE_EVENT_STOP) = status
             {
                 if pid == self.ptthread.tid {
                     break;
@@ -182,8 +356,12 @@ impl Thread {
 pub struct KvmRunWrapper {
     process_idx: usize,
     threads: Vec<Thread>,
+    vcpus: Vec<VcpuMap>,
     process_group: Pid,
     owner: Option<ThreadId>,
+    exit_metrics: Vec<Arc<VcpuExits>>,
+    /// per vcpu, whether a thread was seen running it
+    vcpus_seen: Vec<bool>,
 }
 
 impl Drop for KvmRunWrapper {
@@ -206,25 +384,22 @@ fn get_process_group(pid: Pid) -> Result<Pid> {
 }
 
 impl KvmRunWrapper {
-    pub fn attach(pid: Pid, vcpu_maps: &[Mapping]) -> Result<KvmRunWrapper> {
+    pub fn attach(pid: Pid, vcpu_maps: &[VcpuMap]) -> Result<KvmRunWrapper> {
         let (threads, process_idx) = try_with!(
             ptrace::attach_all_threads(pid),
             "cannot attach KvmRunWrapper to all threads of {} via ptrace",
             pid
         );
-        let threads: Vec<Thread> = threads
-            .into_iter()
-            .map(|t| {
-                let vcpu_map = vcpu_maps[0].clone(); // TODO support more than 1 cpu and respect remaps
-                Thread::new(t, vcpu_map)
-            })
-            .collect();
+        let threads: Vec<Thread> = threads.into_iter().map(Thread::new).collect();
 
         Ok(KvmRunWrapper {
             process_idx,
             threads,
+            vcpus: vcpu_maps.to_vec(),
             process_group: get_process_group(pid)?,
             owner: Some(current().id()),
+            exit_metrics: metrics::vcpu_exits(vcpu_maps.len()),
+            vcpus_seen: vec![false; vcpu_maps.len()],
         })
     }
 
@@ -242,7 +417,7 @@ impl KvmRunWrapper {
 
     /// resume all threads and convert self into tracer.
     pub fn into_tracer(mut self) -> Result<Tracer> {
-        let vcpu_map = self.threads[0].vcpu_map.clone();
+        let vcpu_maps = self.vcpus.clone();
         // Because we run the drop routine here,
         self.prepare_detach()?;
         // we may take all here, despite making KvmRunWrapper::drop ineffective.
@@ -251,24 +426,22 @@ impl KvmRunWrapper {
         Ok(Tracer {
             process_idx: self.process_idx,
             threads,
-            vcpu_map,
+            vcpu_maps,
             owner: self.owner,
         })
     }
 
     pub fn from_tracer(tracer: Tracer) -> Result<Self> {
         let pid = tracer.main_thread().tid;
-        let vcpu_map = tracer.vcpu_map;
-        let threads: Vec<Thread> = tracer
-            .threads
-            .into_iter()
-            .map(|t| Thread::new(t, vcpu_map.clone()))
-            .collect();
+        let threads: Vec<Thread> = tracer.threads.into_iter().map(Thread::new).collect();
 
         Ok(KvmRunWrapper {
             process_idx: tracer.process_idx,
             process_group: get_process_group(pid)?,
             threads,
+            exit_metrics: metrics::vcpu_exits(tracer.vcpu_maps.len()),
+            vcpus_seen: vec![false; tracer.vcpu_maps.len()],
+            vcpus: tracer.vcpu_maps,
             owner: tracer.owner,
         })
     }
@@ -305,39 +478,94 @@ impl KvmRunWrapper {
         Ok(())
     }
 
+    /// Keep the thread stopped in its ioctl(KVM_RUN) exit until `release()` is called, so that
+    /// its mmio exit can be answered from a different thread.
+    pub fn hold(&mut self, tid: Pid) -> Result<()> {
+        match self.threads.iter_mut().find(|t| t.ptthread.tid == tid) {
+            Some(thread) => thread.held = true,
+            None => bail!("cannot hold unknown thread {}", tid),
+        }
+        Ok(())
+    }
+
+    /// Account the mmio exit `tid` is stopped in as one to our devices.
+    pub fn intercepted(&mut self, tid: Pid) {
+        if let Some(thread) = self.threads.iter_mut().find(|t| t.ptthread.tid == tid) {
+            if let Some(exit) = &mut thread.exit {
+                exit.2 = true;
+            }
+        }
+    }
+
+    /// Let the next `wait_for_ioctl()` resume a thread previously stopped by `hold()`.
+    /// Threads that were never held or do no longer exist are ignored.
+    pub fn release(&mut self, tid: Pid) {
+        if let Some(thread) = self.threads.iter_mut().find(|t| t.ptthread.tid == tid) {
+            thread.held = false;
+        }
+    }
+
     // TODO Err if third qemu thread terminates?
     pub fn wait_for_ioctl(&mut self) -> Result<Option<MmioRw>> {
+        self.wait_for_ioctl_(true)
+    }
+
+    /// Like `wait_for_ioctl()` but returns immediately if no thread has stopped yet.
+    pub fn try_wait_for_ioctl(&mut self) -> Result<Option<MmioRw>> {
+        self.wait_for_ioctl_(false)
+    }
+
+    fn wait_for_ioctl_(&mut self, block: bool) -> Result<Option<MmioRw>> {
         self.check_owner()?;
         for thread in &mut self.threads {
-            if !thread.is_running {
-                try_with!(thread.ptthread.syscall(), "ptrace.thread.syscall() failed");
-                thread.is_running = true;
+            if !thread.is_running && !thread.held {
+                if let Some((since, vcpu, intercepted)) = thread.exit.take() {
+                    let exits = &self.exit_metrics[vcpu];
+                    let hist = if intercepted {
+                        &exits.intercepted
+                    } else {
+                        &exits.ignored
+                    };
+                    hist.record_duration(since.elapsed());
+                }
+                thread.resume()?;
             }
         }
-        let status = try_with!(self.waitpid(), "cannot waitpid");
+        let status = match try_with!(self.waitpid(block), "cannot waitpid") {
+            Some(status) => status,
+            None => return Ok(None),
+        };
         let mmio = try_with!(self.process_status(status), "cannot process status");
 
         Ok(mmio)
     }
 
-    fn waitpid(&mut self) -> Result<WaitStatus> {
+    fn waitpid(&mut self, block: bool) -> Result<Option<WaitStatus>> {
+        let mut flags = nix::sys::wait::WaitPidFlag::__WALL;
+        if !block {
+            flags |= nix::sys::wait::WaitPidFlag::WNOHANG;
+        }
         loop {
             let status = try_with!(
                 waitpid(
                     Some(Pid::from_raw(-self.process_group.as_raw())),
-                    Some(nix::sys::wait::WaitPidFlag::__WALL)
+                    Some(flags)
                 ),
                 "cannot wait for ioctl syscall"
             );
-            if let Some(pid) = status.pid() {
-                let res = self
-                    .threads
-                    .iter_mut()
-                    .find(|thread| thread.ptthread.tid == pid);
-                if let Some(mut thread) = res {
-                    thread.is_running = false;
-                    return Ok(status);
+            match status.pid() {
+                Some(pid) => {
+                    let res = self
+                        .threads
+                        .iter_mut()
+                        .find(|thread| thread.ptthread.tid == pid);
+                    if let Some(mut thread) = res {
+                        thread.is_running = false;
+                        return Ok(Some(status));
+                    }
                 }
+                // WaitStatus::StillAlive
+                None => return Ok(None),
             }
         }
     }
@@ -376,6 +604,8 @@ impl KvmRunWrapper {
     }
 
     fn stopped(&mut self, pid: Pid) -> Result<Option<MmioRw>> {
+        let vcpus = &self.vcpus;
+        let vcpus_placed = self.vcpus_seen.iter().all(|seen| *seen);
         let thread: &mut Thread = match self
             .threads
             .iter_mut()
@@ -386,23 +616,29 @@ impl KvmRunWrapper {
         };
 
         let regs = try_with!(thread.ptthread.getregs(), "cannot syscall results");
-        // TODO check for matching ioctlfd
-        let (syscall_nr, _ioctl_fd, ioctl_request, _, _, _, _) = regs.get_syscall_params();
+        let (syscall_nr, ioctl_fd, ioctl_request, _, _, _, _) = regs.get_syscall_params();
         // SYS_ioctl = 16
         if syscall_nr != libc::SYS_ioctl as u64 {
+            thread.foreign_syscall_stop(vcpus_placed);
             return Ok(None);
         }
 
-        // TODO check vcpufd and save a mapping for active syscalls from thread to cpu to
-        // support multiple cpus
         thread.toggle_in_syscall();
         // KVM_RUN = 0xae80 = ioctl_io_nr!(KVM_RUN, KVMIO, 0x80)
         if ioctl_request != ioctls::KVM_RUN() {
+            thread.foreign_syscall_stop(vcpus_placed);
             return Ok(None);
         }
+        thread.runs_vcpu = true;
 
         if thread.in_syscall {
-            trace!("kvm-run enter {}", pid);
+            // remember which vcpu the thread runs until the ioctl returns
+            thread.vcpu = vcpus.iter().position(|v| v.fd_num as u64 == ioctl_fd);
+            match thread.vcpu {
+                Some(idx) => self.vcpus_seen[idx] = true,
+                None => warn!("thread {} runs unknown vcpu fd {}", pid, ioctl_fd),
+            }
+            trace!("kvm-run enter {} (vcpu {:?})", pid, thread.vcpu);
             return Ok(None);
         } else {
             trace!("kvm-run exit {}", pid);
@@ -417,11 +653,26 @@ impl KvmRunWrapper {
             }
         }
 
+        let exited = Instant::now();
+        let (vcpu_idx, vcpu) = match thread.vcpu.take() {
+            Some(idx) => (idx, &vcpus[idx]),
+            None => return Ok(None),
+        };
+
         // fulfilled precondition: ioctl(KVM_RUN) just returned
-        let map_ptr = thread.vcpu_map.start as *const kvm_bindings::kvm_run;
-        let kvm_run: kvm_bindings::kvm_run =
-            hypervisor::process_read(pid, map_ptr as *const libc::c_void)?;
-        let mmio = MmioRw::from(&kvm_run, thread.ptthread.tid, thread.vcpu_map.clone());
+        let mmio = if let Some(kvm_run) = &vcpu.kvm_run {
+            kvm_run
+                .mmio_exit()
+                .map(|raw| MmioRw::new(&raw, thread.ptthread.tid, vcpu_idx, vcpu.clone()))
+        } else {
+            let map_ptr = vcpu.mapping.start as *const kvm_bindings::kvm_run;
+            let kvm_run: kvm_bindings::kvm_run =
+                hypervisor::process_read(pid, map_ptr as *const libc::c_void)?;
+            MmioRw::from(&kvm_run, thread.ptthread.tid, vcpu_idx, vcpu.clone())
+        };
+        if mmio.is_some() {
+            thread.exit = Some((exited, vcpu_idx, false));
+        }
 
         Ok(mmio)
     }
@@ -0,0 +1,85 @@
+"""
+Results of the benchmarks in this directory, stored as json per commit so that
+changes to the device backends can be compared:
+
+$ python3 tests/bench.py <old revision> <new revision>
+
+Revisions are named by `git describe --always --dirty`.
+
+VMSH_BENCH_DIR overrides where results are stored (default: .git/bench-results).
+"""
+
+import json
+import os
+import subprocess
+import sys
+from pathlib import Path
+from typing import Any, Dict, List
+
+from root import PROJECT_ROOT
+
+
+def results_dir() -> Path:
+    default = PROJECT_ROOT.joinpath(".git", "bench-results")
+    return Path(os.environ.get("VMSH_BENCH_DIR", default))
+
+
+def revision() -> str:
+    rev = subprocess.run(
+        ["git", "describe", "--always", "--dirty"],
+        cwd=PROJECT_ROOT,
+        text=True,
+        stdout=subprocess.PIPE,
+        check=True,
+    )
+    return rev.stdout.strip()
+
+
+def record(name: str, results: List[Dict[str, Any]]) -> Path:
+    """
+    Store `results` of benchmark `name` for the checked out revision.
+    """
+    rev = revision()
+    path = results_dir().joinpath(rev, f"{name}.json")
+    path.parent.mkdir(parents=True, exist_ok=True)
+    with open(path, "w") as f:
+        json.dump(dict(revision=rev, benchmark=name, results=results), f, indent=2)
+    print(f"results written to {path}")
+    return path
+
+
+def load(rev: str) -> Dict[str, Dict[str, Any]]:
+    """
+    All results of `rev`, keyed by benchmark and the id of each result.
+    """
+    results: Dict[str, Dict[str, Any]] = {}
+    for path in sorted(results_dir().joinpath(rev).glob("*.json")):
+        with open(path) as f:
+            data = json.load(f)
+        for r in data["results"]:
+            results[f"{data['benchmark']}/{r['id']}"] = r
+    return results
+
+
+def compare(old: str, new: str) -> None:
+    a = load(old)
+    b = load(new)
+    print(f"{'benchmark':<50} {'metric':<12} {old:>14} {new:>14} {'change':>8}")
+    for key in sorted(a.keys() & b.keys()):
+        for metric, value in a[key].items():
+            if metric == "id" or not isinstance(value, (int, float)):
+                continue
+            new_value = b[key].get(metric)
+            if new_value is None:
+                continue
+            change = f"{(new_value / value - 1) * 100:+.1f}%" if value else "-"
+            print(
+                f"{key:<50} {metric:<12} {value:>14.1f} {new_value:>14.1f} {change:>8}"
+            )
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print(f"USAGE: {sys.argv[0]} OLD_REV NEW_REV", file=sys.stderr)
+        sys.exit(1)
+    compare(sys.argv[1], sys.argv[2])
@@ -0,0 +1,88 @@
+"""
+Attach to the same VM several times and report p50/p99 wall time per attach phase:
+
+$ pytest -s tests/bench_attach.py
+
+VMSH_ATTACH_RUNS sets the number of attaches (default: 10). Results are stored with
+bench.record.
+"""
+
+import json
+import os
+import tempfile
+from collections import defaultdict
+from pathlib import Path
+from typing import Dict, List
+
+import bench
+import conftest
+from root import PROJECT_ROOT
+
+
+def percentile(values: List[float], p: float) -> float:
+    values = sorted(values)
+    idx = min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))
+    return values[idx]
+
+
+def attach_once(
+    helpers: conftest.Helpers, img: Path, pid: int, ssh_args: str, timings: Path
+) -> List[Dict[str, int]]:
+    vmsh = helpers.spawn_vmsh_command(
+        [
+            "attach",
+            "--backing-file",
+            str(img),
+            "--timings-json",
+            str(timings),
+            str(pid),
+            "--ssh-args",
+            ssh_args,
+            "--",
+            "/bin/sh",
+            "-c",
+            "echo works",
+        ]
+    )
+    with vmsh:
+        vmsh.wait_until_line(
+            "block device driver started",
+            lambda l: "block device driver started" in l,
+        )
+    with open(timings) as f:
+        return json.load(f)
+
+
+def test_bench_attach(helpers: conftest.Helpers) -> None:
+    runs = int(os.environ.get("VMSH_ATTACH_RUNS", "10"))
+    wall: Dict[str, List[float]] = defaultdict(list)
+    syscalls: Dict[str, List[int]] = defaultdict(list)
+    with helpers.busybox_image() as img, helpers.spawn_qemu(
+        helpers.notos_image()
+    ) as vm, tempfile.TemporaryDirectory() as tmp:
+        vm.wait_for_ssh()
+        ssh_key = PROJECT_ROOT.joinpath("nix", "ssh_key")
+        ssh_args = f" -i {ssh_key} -p {vm.ssh_port} root@127.0.0.1"
+        for i in range(runs):
+            timings = Path(tmp).joinpath(f"timings-{i}.json")
+            for phase in attach_once(helpers, img, vm.pid, ssh_args, timings):
+                wall[phase["phase"]].append(phase["wall_us"] / 1000)
+                syscalls[phase["phase"]].append(phase["syscalls"])
+        # the VM must survive all attaches
+        res = vm.ssh_cmd(["echo", "ping"], check=False)
+        assert res.stdout == "ping\n"
+
+    print(f"\n{'phase':<20} {'p50 (ms)':>10} {'p99 (ms)':>10} {'syscalls':>10}")
+    results = []
+    for name, values in wall.items():
+        r = dict(
+            id=name,
+            p50_ms=percentile(values, 50),
+            p99_ms=percentile(values, 99),
+            syscalls=percentile(syscalls[name], 50),
+        )
+        print(
+            f"{name:<20} {r['p50_ms']:>10.3f} {r['p99_ms']:>10.3f} {r['syscalls']:>10}"
+        )
+        results.append(r)
+    bench.record("attach", results)
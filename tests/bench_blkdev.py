@@ -0,0 +1,134 @@
+"""
+Run fio in the VM against a disk attached by vmsh and against the same kind of disk
+attached natively by qemu (virtio-blk-pci):
+
+$ pytest -s tests/bench_blkdev.py
+
+Every combination of sequential/random, read/write, block size and queue depth is
+run. VMSH_FIO_BS (default: 4k,64k,1m), VMSH_FIO_QD (default: 1,16,64) and
+VMSH_FIO_RUNTIME (seconds per job, default: 5) narrow it down. Results are stored
+with bench.record.
+"""
+
+import json
+import os
+import tempfile
+from pathlib import Path
+from typing import Any, Dict, List
+
+import bench
+import conftest
+from qemu import QemuVm
+from root import PROJECT_ROOT
+
+DISK_SIZE = 1024 * 1024 * 1024
+NATIVE_SERIAL = "native"
+# the root filesystem is vmsh0, our --disk comes next
+VMSH_SERIAL = "vmsh1"
+
+
+def env_list(name: str, default: str) -> List[str]:
+    return os.environ.get(name, default).split(",")
+
+
+def find_disk(vm: QemuVm, serial: str) -> str:
+    script = f"""
+for dev in /sys/block/*; do
+  if [ "$(cat $dev/serial 2>/dev/null)" = "{serial}" ]; then
+    echo /dev/${{dev##*/}}
+  fi
+done
+"""
+    res = vm.ssh_cmd(["sh", "-c", script])
+    dev = res.stdout.strip()
+    assert dev != "", f"no block device with serial {serial} in the VM"
+    return dev
+
+
+def fio(
+    vm: QemuVm, dev: str, rw: str, bs: str, iodepth: str, runtime: str
+) -> Dict[str, Any]:
+    res = vm.ssh_cmd(
+        [
+            "fio",
+            "--name=bench",
+            f"--filename={dev}",
+            f"--rw={rw}",
+            f"--bs={bs}",
+            f"--iodepth={iodepth}",
+            "--ioengine=libaio",
+            "--direct=1",
+            "--time_based",
+            f"--runtime={runtime}",
+            "--output-format=json",
+        ]
+    )
+    job = json.loads(res.stdout)["jobs"][0]
+    stats = job["write" if "write" in rw else "read"]
+    percentiles = stats["clat_ns"].get("percentile", {})
+    return dict(
+        iops=stats["iops"],
+        bw_mib=stats["bw_bytes"] / 1024 / 1024,
+        lat_p50_us=percentiles.get("50.000000", 0) / 1000,
+        lat_p99_us=percentiles.get("99.000000", 0) / 1000,
+    )
+
+
+def test_bench_blkdev(helpers: conftest.Helpers) -> None:
+    runtime = os.environ.get("VMSH_FIO_RUNTIME", "5")
+    results = []
+    with tempfile.TemporaryDirectory() as tmp, helpers.busybox_image() as img:
+        native = Path(tmp).joinpath("native.img")
+        vmsh_disk = Path(tmp).joinpath("vmsh.img")
+        for path in (native, vmsh_disk):
+            with open(path, "wb") as f:
+                f.truncate(DISK_SIZE)
+        qemu_args = [
+            "-drive",
+            f"id=bench,file={native},format=raw,if=none",
+            "-device",
+            f"virtio-blk-pci,drive=bench,serial={NATIVE_SERIAL}",
+        ]
+        with helpers.spawn_qemu(helpers.notos_image(), qemu_args) as vm:
+            vm.wait_for_ssh()
+            ssh_key = PROJECT_ROOT.joinpath("nix", "ssh_key")
+            ssh_args = f" -i {ssh_key} -p {vm.ssh_port} root@127.0.0.1"
+            vmsh = helpers.spawn_vmsh_command(
+                [
+                    "attach",
+                    "--backing-file",
+                    str(img),
+                    "--disk",
+                    str(vmsh_disk),
+                    str(vm.pid),
+                    "--ssh-args",
+                    ssh_args,
+                    "--",
+                    "/bin/sh",
+                    "-c",
+                    "echo works",
+                ]
+            )
+            with vmsh:
+                vmsh.wait_until_line(
+                    "block device driver started",
+                    lambda l: "block device driver started" in l,
+                )
+                disks = dict(
+                    native=find_disk(vm, NATIVE_SERIAL),
+                    vmsh=find_disk(vm, VMSH_SERIAL),
+                )
+                for rw in ("read", "write", "randread", "randwrite"):
+                    for bs in env_list("VMSH_FIO_BS", "4k,64k,1m"):
+                        for qd in env_list("VMSH_FIO_QD", "1,16,64"):
+                            for name, dev in disks.items():
+                                r = fio(vm, dev, rw, bs, qd, runtime)
+                                r["id"] = f"{name}/{rw}/{bs}/qd{qd}"
+                                print(
+                                    f"{r['id']:<28} {r['iops']:>10.0f} IOPS "
+                                    f"{r['bw_mib']:>9.1f} MiB/s "
+                                    f"p50 {r['lat_p50_us']:>8.1f}us "
+                                    f"p99 {r['lat_p99_us']:>8.1f}us"
+                                )
+                                results.append(r)
+    bench.record("blkdev", results)
@@ -0,0 +1,59 @@
+"""
+Measure how fast output of a command in the VM reaches the host through the vmsh
+console:
+
+$ pytest -s tests/bench_console.py
+
+VMSH_CONSOLE_MIB sets the amount of output (default: 16). Results are stored with
+bench.record.
+"""
+
+import os
+import tempfile
+import time
+from pathlib import Path
+
+import bench
+import conftest
+from root import PROJECT_ROOT
+
+
+def test_bench_console(helpers: conftest.Helpers) -> None:
+    size = int(os.environ.get("VMSH_CONSOLE_MIB", "16")) * 1024 * 1024
+    with helpers.busybox_image() as img, helpers.spawn_qemu(
+        helpers.notos_image()
+    ) as vm, tempfile.TemporaryDirectory() as tmp:
+        vm.wait_for_ssh()
+        ssh_key = PROJECT_ROOT.joinpath("nix", "ssh_key")
+        ssh_args = f" -i {ssh_key} -p {vm.ssh_port} root@127.0.0.1"
+        out = Path(tmp).joinpath("console.out")
+        with open(out, "w") as f:
+            vmsh = helpers.spawn_vmsh_command(
+                [
+                    "attach",
+                    "--backing-file",
+                    str(img),
+                    str(vm.pid),
+                    "--ssh-args",
+                    ssh_args,
+                    "--",
+                    "/bin/sh",
+                    "-c",
+                    f"head -c {size} /dev/zero | tr '\\0' x",
+                ],
+                stdout=f,
+            )
+            with vmsh:
+                # the clock starts with the first byte, so the attach is not part of it
+                while out.stat().st_size == 0:
+                    assert vmsh.poll() is None, "vmsh exited before any output"
+                    time.sleep(0.001)
+                start = time.monotonic()
+                while out.stat().st_size < size:
+                    assert vmsh.poll() is None, "vmsh exited before all output arrived"
+                    time.sleep(0.001)
+                elapsed = time.monotonic() - start
+
+    mib_s = size / elapsed / 1024 / 1024
+    print(f"\nconsole: {size} bytes in {elapsed:.3f}s, {mib_s:.1f} MiB/s")
+    bench.record("console", [dict(id="stdout", bw_mib=mib_s, seconds=elapsed)])
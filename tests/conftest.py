@@ -8,7 +8,7 @@ import threading
 from pathlib import Path
 from queue import Queue
 from shlex import quote
-from typing import Any, List, Type, Union, Callable, Optional
+from typing import IO, Any, List, Type, Union, Callable, Optional
 
 import pytest
 from qemu import QemuVm, VmImage, spawn_qemu
@@ -44,7 +44,8 @@ EOF = 1
 class VmshPopen(subprocess.Popen):
     def process_stdout(self) -> None:
         self.lines: Queue[Union[str, int]] = Queue()
-        threading.Thread(target=self.print_stdout).start()
+        if self.stdout is not None:
+            threading.Thread(target=self.print_stdout).start()
         threading.Thread(target=self.print_stderr).start()
 
     def terminate(self) -> None:
@@ -97,7 +98,13 @@ class VmshPopen(subprocess.Popen):
                 return
 
 
-def spawn_vmsh_command(args: List[str], cargo_executable: str = "vmsh") -> VmshPopen:
+def spawn_vmsh_command(
+    args: List[str], cargo_executable: str = "vmsh", stdout: Optional[IO] = None
+) -> VmshPopen:
+    """
+    @stdout receives the output of vmsh instead of the line queue, which is too slow
+    to measure console throughput with. wait_until_line then only sees stderr.
+    """
     if not os.path.isdir("/sys/module/kheaders"):
         subprocess.run(["sudo", "modprobe", "kheaders"])
     uid = os.getuid()
@@ -125,7 +132,12 @@ def spawn_vmsh_command(args: List[str], cargo_executable: str = "vmsh") -> VmshP
         cmd_quoted,
     ]
     print("$ " + " ".join(map(quote, cmd)))
-    p = VmshPopen(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    p = VmshPopen(
+        cmd,
+        stdout=subprocess.PIPE if stdout is None else stdout,
+        stderr=subprocess.PIPE,
+        text=True,
+    )
     p.process_stdout()
     return p
 
@@ -145,9 +157,9 @@ class Helpers:
 
     @staticmethod
     def spawn_vmsh_command(
-        args: List[str], cargo_executable: str = "vmsh"
+        args: List[str], cargo_executable: str = "vmsh", stdout: Optional[IO] = None
     ) -> VmshPopen:
-        return spawn_vmsh_command(args, cargo_executable)
+        return spawn_vmsh_command(args, cargo_executable, stdout)
 
     @staticmethod
     def run_vmsh_command(args: List[str], cargo_executable: str = "vmsh") -> VmshPopen:
@@ -61,3 +61,46 @@ def test_attach(helpers: conftest.Helpers) -> None:
         res = vm.ssh_cmd(["echo", "ping"], check=False)
         assert res.stdout == "ping\n"
         assert res.returncode == 0
+
+
+def test_attach_after_fast_detach(helpers: conftest.Helpers) -> None:
+    """
+    A fast detach removes the memslots and ioeventfds of vmsh, so attaching again
+    does not run into them.
+    """
+    with helpers.busybox_image() as img, helpers.spawn_qemu(
+        helpers.notos_image()
+    ) as vm:
+        vm.wait_for_ssh()
+        ssh_key = PROJECT_ROOT.joinpath("nix", "ssh_key")
+        ssh_args = f" -i {ssh_key} -p {vm.ssh_port} root@127.0.0.1"
+        for _ in range(2):
+            vmsh = helpers.spawn_vmsh_command(
+                [
+                    "attach",
+                    "--fast-detach",
+                    "--backing-file",
+                    str(img),
+                    str(vm.pid),
+                    "--ssh-args",
+                    ssh_args,
+                    "--",
+                    "/bin/sh",
+                    "-c",
+                    "echo works",
+                ]
+            )
+            with vmsh:
+                vmsh.wait_until_line(
+                    "block device driver started",
+                    lambda l: "block device driver started" in l,
+                )
+                vmsh.terminate()
+                vmsh.wait_until_line(
+                    "released hypervisor",
+                    lambda l: "released hypervisor" in l,
+                )
+
+        res = vm.ssh_cmd(["echo", "ping"], check=False)
+        assert res.stdout == "ping\n"
+        assert res.returncode == 0